@@ -0,0 +1,951 @@
+/*
+ * Stand-in FTP server for benchmarking ftpup against a local directory.
+ *
+ * Every reply is held back until a fixed time after the input that caused
+ * it arrived, so commands sent one at a time cost one latency each while
+ * pipelined ones share it.  Data connections share one pipe of limited
+ * bandwidth.  The feature set can be cut down to look like a poorer server.
+ *
+ * On SIGUSR1 the counters are written to the stats file as a fragment of a
+ * JSON object and then reset; on SIGTERM or SIGINT they are written and the
+ * server exits.
+ * */
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "md5.h"
+#include "memory.h"
+
+#define F_PASV  (1<<0)
+#define F_PORT  (1<<1)
+#define F_MLSD  (1<<2)
+#define F_MODEB (1<<3)
+#define F_REST  (1<<4)
+#define F_SIZE  (1<<5)
+#define F_XMD5  (1<<6)
+#define F_TRUNC (1<<7)  /* STOR after REST truncates the file first */
+#define F_COPY  (1<<8)  /* SITE CPFR and CPTO, as in ProFTPD's mod_copy */
+
+static const struct {/*{{{*/
+  const char *name;
+  int flag;
+} feature_names[] = {
+  { "pasv",  F_PASV  },
+  { "port",  F_PORT  },
+  { "mlsd",  F_MLSD  },
+  { "modeb", F_MODEB },
+  { "rest",  F_REST  },
+  { "size",  F_SIZE  },
+  { "xmd5",  F_XMD5  },
+  { "trunc", F_TRUNC },
+  { "copy",  F_COPY  },
+  { NULL, 0 }
+};
+/*}}}*/
+
+static char *root;
+static int features = F_PASV | F_PORT | F_MLSD | F_MODEB | F_REST | F_SIZE | F_XMD5 | F_COPY;
+static double latency = 0.0;     /* seconds from a client's input to our reply */
+static double bandwidth = 0.0;   /* bytes per second over all data connections, 0 for no limit */
+
+static pthread_mutex_t pipe_lock = PTHREAD_MUTEX_INITIALIZER;
+static double pipe_free_at = 0.0;
+
+struct counters {/*{{{*/
+  long sessions;
+  long commands;
+  long round_trips;       /* times the server had to wait for the client */
+  long data_connections;
+  long ctrl_bytes_in;
+  long ctrl_bytes_out;
+  long data_bytes_in;
+  long data_bytes_out;
+};
+/*}}}*/
+static struct counters stats;
+
+struct session {/*{{{*/
+  int fd;
+  char buf[4096];
+  int len;
+  int answered;           /* a reply has gone out since we last waited */
+  double input_at;        /* when the input being answered arrived */
+  char *cwd;              /* always starts with '/', never ends with one unless it is "/" */
+  int pasv_fd;
+  struct sockaddr_in port_addr;
+  int have_port;
+  int mode_b;
+  size_t rest;
+  char *rename_from;
+  char *copy_from;
+};
+/*}}}*/
+
+static double now(void)/*{{{*/
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + 1.0e-6 * tv.tv_usec;
+}
+/*}}}*/
+static void sleep_until(double t)/*{{{*/
+{
+  double dt = t - now();
+  struct timespec ts;
+  if (dt <= 0.0) return;
+  ts.tv_sec = (time_t) dt;
+  ts.tv_nsec = (long) ((dt - ts.tv_sec) * 1.0e9);
+  while (nanosleep(&ts, &ts) < 0 && errno == EINTR) ;
+}
+/*}}}*/
+static void use_pipe(size_t n)/*{{{*/
+{
+  /* Book n bytes' worth of time on the shared pipe and wait for it. */
+  double start, t;
+  if (bandwidth <= 0.0) return;
+  pthread_mutex_lock(&pipe_lock);
+  t = now();
+  start = (pipe_free_at > t) ? pipe_free_at : t;
+  pipe_free_at = start + n / bandwidth;
+  t = pipe_free_at;
+  pthread_mutex_unlock(&pipe_lock);
+  sleep_until(t);
+}
+/*}}}*/
+static int write_all(int fd, const char *data, size_t n)/*{{{*/
+{
+  ssize_t k;
+  while (n > 0) {
+    k = write(fd, data, n);
+    if (k < 0) {
+      if (errno == EINTR) continue;
+      return 0;
+    }
+    data += k;
+    n -= k;
+  }
+  return 1;
+}
+/*}}}*/
+
+static void reply(struct session *s, const char *fmt, ...)/*{{{*/
+{
+  char line[1200];
+  va_list ap;
+  int n;
+  va_start(ap, fmt);
+  n = vsnprintf(line, sizeof(line) - 2, fmt, ap);
+  va_end(ap);
+  if (n > (int) sizeof(line) - 3) n = sizeof(line) - 3;
+  line[n++] = '\r';
+  line[n++] = '\n';
+  sleep_until(s->input_at + latency);
+  write_all(s->fd, line, n);
+  __sync_fetch_and_add(&stats.ctrl_bytes_out, n);
+  s->answered = 1;
+}
+/*}}}*/
+static void reply_more(struct session *s, const char *text)/*{{{*/
+{
+  /* A continuation line of a multi-line reply. */
+  size_t n = strlen(text);
+  sleep_until(s->input_at + latency);
+  write_all(s->fd, text, n);
+  write_all(s->fd, "\r\n", 2);
+  __sync_fetch_and_add(&stats.ctrl_bytes_out, n + 2);
+}
+/*}}}*/
+static char *read_command(struct session *s)/*{{{*/
+{
+  /* Return the next command line, or NULL at the end of the session. */
+  struct pollfd pfd;
+  char *eol, *line;
+  int n, len, waited;
+
+  for (;;) {
+    eol = memchr(s->buf, '\n', s->len);
+    if (eol) {
+      len = eol - s->buf;
+      line = new_array(char, len + 1);
+      memcpy(line, s->buf, len);
+      line[len] = '\0';
+      if (len && (line[len-1] == '\r')) line[len-1] = '\0';
+      s->len -= len + 1;
+      memmove(s->buf, eol + 1, s->len);
+      __sync_fetch_and_add(&stats.commands, 1);
+      return line;
+    }
+    if (s->len == sizeof(s->buf)) return NULL;
+    /* If nothing is waiting after we have replied, the client has stopped
+     * to hear from us, and what it sends next costs a round trip. */
+    pfd.fd = s->fd;
+    pfd.events = POLLIN;
+    waited = s->answered && (poll(&pfd, 1, 0) == 0);
+    n = read(s->fd, s->buf + s->len, sizeof(s->buf) - s->len);
+    if (n <= 0) return NULL;
+    if (waited) {
+      __sync_fetch_and_add(&stats.round_trips, 1);
+      s->answered = 0;
+    }
+    s->input_at = now();
+    s->len += n;
+    __sync_fetch_and_add(&stats.ctrl_bytes_in, n);
+  }
+}
+/*}}}*/
+
+static char *virtual_path(struct session *s, const char *arg)/*{{{*/
+{
+  /* Resolve arg against the working directory, without escaping the root. */
+  char *joined, *out, *p, *q, *seg;
+  int len;
+
+  if (!arg || !*arg) arg = ".";
+  joined = new_array(char, strlen(s->cwd) + strlen(arg) + 2);
+  if (arg[0] == '/') strcpy(joined, arg);
+  else sprintf(joined, "%s/%s", s->cwd, arg);
+
+  out = new_array(char, strlen(joined) + 2);
+  out[0] = '\0';
+  len = 0;
+  for (p = joined; *p; p = q) {
+    while (*p == '/') p++;
+    for (q = p; *q && (*q != '/'); q++) ;
+    seg = p;
+    if (q == p) break;
+    if ((q - p == 1) && (seg[0] == '.')) continue;
+    if ((q - p == 2) && (seg[0] == '.') && (seg[1] == '.')) {
+      while (len > 0 && out[len] != '/') len--;
+      out[len] = '\0';
+      continue;
+    }
+    out[len++] = '/';
+    memcpy(out + len, seg, q - p);
+    len += q - p;
+    out[len] = '\0';
+  }
+  if (!len) strcpy(out, "/");
+  free(joined);
+  return out;
+}
+/*}}}*/
+static char *real_path(struct session *s, const char *arg)/*{{{*/
+{
+  char *v = virtual_path(s, arg);
+  char *r = new_array(char, strlen(root) + strlen(v) + 1);
+  sprintf(r, "%s%s", root, v);
+  free(v);
+  return r;
+}
+/*}}}*/
+
+static int open_data(struct session *s)/*{{{*/
+{
+  /* Return the data connection set up by PASV or PORT, or -1. */
+  int fd = -1;
+  if (s->pasv_fd >= 0) {
+    fd = accept(s->pasv_fd, NULL, NULL);
+    close(s->pasv_fd);
+    s->pasv_fd = -1;
+  } else if (s->have_port) {
+    fd = socket(PF_INET, SOCK_STREAM, 0);
+    if ((fd >= 0) && (connect(fd, (struct sockaddr *) &s->port_addr, sizeof(s->port_addr)) < 0)) {
+      close(fd);
+      fd = -1;
+    }
+    s->have_port = 0;
+  }
+  if (fd >= 0) __sync_fetch_and_add(&stats.data_connections, 1);
+  return fd;
+}
+/*}}}*/
+static int send_data(struct session *s, int fd, const char *data, size_t n)/*{{{*/
+{
+  unsigned char header[3];
+  size_t chunk;
+  while (n > 0) {
+    chunk = (n > 65535) ? 65535 : n;
+    use_pipe(chunk);
+    if (s->mode_b) {
+      header[0] = 0;
+      header[1] = chunk >> 8;
+      header[2] = chunk & 0xff;
+      if (!write_all(fd, (char *) header, 3)) return 0;
+      __sync_fetch_and_add(&stats.data_bytes_out, 3);
+    }
+    if (!write_all(fd, data, chunk)) return 0;
+    __sync_fetch_and_add(&stats.data_bytes_out, chunk);
+    data += chunk;
+    n -= chunk;
+  }
+  return 1;
+}
+/*}}}*/
+static int end_data(struct session *s, int fd)/*{{{*/
+{
+  /* In block mode the end of file is marked, not just the connection closed. */
+  static const unsigned char eof_block[3] = { 64, 0, 0 };
+  int ok = 1;
+  if (s->mode_b) {
+    ok = write_all(fd, (const char *) eof_block, 3);
+    __sync_fetch_and_add(&stats.data_bytes_out, 3);
+  }
+  close(fd);
+  return ok;
+}
+/*}}}*/
+static int read_all(int fd, unsigned char *buf, size_t n)/*{{{*/
+{
+  ssize_t k;
+  while (n > 0) {
+    k = read(fd, buf, n);
+    if (k <= 0) return 0;
+    buf += k;
+    n -= k;
+  }
+  return 1;
+}
+/*}}}*/
+static int receive_data(struct session *s, int fd, int out)/*{{{*/
+{
+  /* Copy the data connection into out; return 1 if it ended properly. */
+  static const int chunk = 65536;
+  unsigned char header[3];
+  char *buf = new_array(char, chunk);
+  int last = 0, ok = 1;
+  ssize_t n;
+  size_t want;
+
+  while (!last) {
+    if (s->mode_b) {
+      if (!read_all(fd, header, 3)) {
+        ok = 0;
+        break;
+      }
+      __sync_fetch_and_add(&stats.data_bytes_in, 3);
+      last = (header[0] & 64) ? 1 : 0;
+      want = (header[1] << 8) | header[2];
+      if (!read_all(fd, (unsigned char *) buf, want)) {
+        ok = 0;
+        break;
+      }
+      n = want;
+    } else {
+      n = read(fd, buf, chunk);
+      if (n < 0) {
+        ok = 0;
+        break;
+      }
+      if (n == 0) break;
+    }
+    __sync_fetch_and_add(&stats.data_bytes_in, n);
+    use_pipe(n);
+    if (!write_all(out, buf, n)) {
+      ok = 0;
+      break;
+    }
+  }
+  free(buf);
+  close(fd);
+  s->input_at = now();
+  return ok;
+}
+/*}}}*/
+
+static void append_text(char **text, size_t *len, size_t *max, const char *line)/*{{{*/
+{
+  size_t n = strlen(line);
+  if (*len + n + 3 > *max) {
+    *max = 2 * (*len + n + 3);
+    *text = grow_array(char, *max, *text);
+  }
+  memcpy(*text + *len, line, n);
+  *len += n;
+  (*text)[(*len)++] = '\r';
+  (*text)[(*len)++] = '\n';
+}
+/*}}}*/
+static int compare_names(const void *a, const void *b)/*{{{*/
+{
+  return strcmp(*(char **) a, *(char **) b);
+}
+/*}}}*/
+static char *listing(const char *dir, const char *verb, size_t *len)/*{{{*/
+{
+  /* Build the LIST, NLST or MLSD reply for dir; NULL if it isn't one. */
+  DIR *d;
+  struct dirent *de;
+  struct stat sb;
+  char **names = NULL;
+  int n = 0, max = 0, i;
+  char *text = NULL, *path, line[1200], stamp[16];
+  size_t tmax = 0;
+
+  d = opendir(dir);
+  if (!d) return NULL;
+  while ((de = readdir(d))) {
+    if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) continue;
+    if (n == max) {
+      max = max ? 2 * max : 64;
+      names = grow_array(char *, max, names);
+    }
+    names[n++] = new_string(de->d_name);
+  }
+  closedir(d);
+  qsort(names, n, sizeof(char *), compare_names);
+
+  *len = 0;
+  text = grow_array(char, (tmax = 256), text);
+  path = new_array(char, strlen(dir) + 1024);
+  for (i=0; i<n; i++) {
+    sprintf(path, "%s/%.1000s", dir, names[i]);
+    if (stat(path, &sb) < 0) continue;
+    if (!strcmp(verb, "NLST")) {
+      snprintf(line, sizeof(line), "%s", names[i]);
+    } else if (!strcmp(verb, "MLSD")) {
+      strftime(stamp, sizeof(stamp), "%Y%m%d%H%M%S", gmtime(&sb.st_mtime));
+      snprintf(line, sizeof(line), "type=%s;size=%lu;modify=%s; %s",
+               S_ISDIR(sb.st_mode) ? "dir" : "file", (unsigned long) sb.st_size, stamp, names[i]);
+    } else {
+      snprintf(line, sizeof(line), "%crw-r--r-- 1 ftp ftp %lu Jan 01 00:00 %s",
+               S_ISDIR(sb.st_mode) ? 'd' : '-', (unsigned long) sb.st_size, names[i]);
+    }
+    append_text(&text, len, &tmax, line);
+    free(names[i]);
+  }
+  free(names);
+  free(path);
+  return text;
+}
+/*}}}*/
+
+static void do_list(struct session *s, const char *verb, const char *arg)/*{{{*/
+{
+  char *path, *text;
+  size_t len;
+  int fd;
+
+  /* Skip options such as "-a" */
+  while (arg && (arg[0] == '-')) {
+    while (*arg && !isspace(*arg)) arg++;
+    while (isspace(*arg)) arg++;
+  }
+  path = real_path(s, arg);
+  text = listing(path, verb, &len);
+  free(path);
+  if (!text) {
+    reply(s, "550 No such directory");
+    return;
+  }
+  fd = open_data(s);
+  if (fd < 0) {
+    reply(s, "425 No data connection");
+  } else {
+    reply(s, "150 Here comes the listing");
+    if (send_data(s, fd, text, len) && end_data(s, fd)) reply(s, "226 Done");
+    else reply(s, "426 Transfer aborted");
+  }
+  free(text);
+}
+/*}}}*/
+static void do_store(struct session *s, const char *verb, const char *arg)/*{{{*/
+{
+  char *path = real_path(s, arg);
+  int out, fd, flags;
+
+  flags = O_WRONLY | O_CREAT;
+  if (!strcmp(verb, "APPE")) flags |= O_APPEND;
+  else if (!s->rest) flags |= O_TRUNC;
+  out = open(path, flags, 0644);
+  free(path);
+  if (out < 0) {
+    reply(s, "553 Cannot open file");
+    s->rest = 0;
+    return;
+  }
+  if (s->rest) {
+    if ((features & F_TRUNC) && (ftruncate(out, s->rest) < 0)) {
+      reply(s, "553 Cannot truncate file");
+      close(out);
+      s->rest = 0;
+      return;
+    }
+    lseek(out, s->rest, SEEK_SET);
+    s->rest = 0;
+  }
+  fd = open_data(s);
+  if (fd < 0) {
+    reply(s, "425 No data connection");
+  } else {
+    reply(s, "150 Ready to receive");
+    if (receive_data(s, fd, out)) reply(s, "226 Done");
+    else reply(s, "426 Transfer aborted");
+  }
+  close(out);
+}
+/*}}}*/
+static void do_retrieve(struct session *s, const char *arg)/*{{{*/
+{
+  char *path = real_path(s, arg);
+  char buf[65536];
+  int in, fd, ok = 1;
+  ssize_t n;
+
+  in = open(path, O_RDONLY);
+  free(path);
+  if (in < 0) {
+    reply(s, "550 No such file");
+    return;
+  }
+  if (s->rest) lseek(in, s->rest, SEEK_SET);
+  s->rest = 0;
+  fd = open_data(s);
+  if (fd < 0) {
+    reply(s, "425 No data connection");
+  } else {
+    reply(s, "150 Sending");
+    while (ok && ((n = read(in, buf, sizeof(buf))) > 0)) {
+      ok = send_data(s, fd, buf, n);
+    }
+    if (ok && end_data(s, fd)) reply(s, "226 Done");
+    else reply(s, "426 Transfer aborted");
+  }
+  close(in);
+}
+/*}}}*/
+static void do_xmd5(struct session *s, const char *arg)/*{{{*/
+{
+  char *path = real_path(s, arg);
+  struct md5_ctx ctx;
+  unsigned char digest[16], buf[65536];
+  char hex[33];
+  ssize_t n;
+  int in;
+
+  in = open(path, O_RDONLY);
+  free(path);
+  if (in < 0) {
+    reply(s, "550 No such file");
+    return;
+  }
+  md5_init(&ctx);
+  while ((n = read(in, buf, sizeof(buf))) > 0) md5_update(&ctx, buf, n);
+  close(in);
+  md5_final(&ctx, digest);
+  md5_to_hex(digest, hex);
+  reply(s, "250 %s", hex);
+}
+/*}}}*/
+static void do_site(struct session *s, char *arg)/*{{{*/
+{
+  /* Only what's needed for server-side copies. */
+  char *p, *path, buf[65536];
+  struct stat sb;
+  ssize_t n;
+  int in, out, ok;
+
+  for (p = arg; p && *p && (*p != ' '); p++) *p = toupper(*p);
+  if (p && *p) *p++ = '\0';
+  if (!arg || !(features & F_COPY)) {
+    reply(s, "500 SITE not understood");
+  } else if (!strcmp(arg, "HELP")) {
+    reply_more(s, "214-The following SITE commands are recognized");
+    reply_more(s, " CPFR CPTO HELP");
+    reply(s, "214 Direct comments to root");
+  } else if (!strcmp(arg, "CPFR")) {
+    path = real_path(s, p);
+    if ((stat(path, &sb) == 0) && S_ISREG(sb.st_mode)) {
+      free(s->copy_from);
+      s->copy_from = path;
+      reply(s, "350 File or directory exists, ready for destination name");
+    } else {
+      free(path);
+      reply(s, "550 No such file");
+    }
+  } else if (!strcmp(arg, "CPTO")) {
+    if (!s->copy_from) {
+      reply(s, "503 Bad sequence of commands");
+      return;
+    }
+    path = real_path(s, p);
+    in = open(s->copy_from, O_RDONLY);
+    out = (in < 0) ? -1 : open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ok = (out >= 0);
+    while (ok && ((n = read(in, buf, sizeof(buf))) > 0)) {
+      ok = (write(out, buf, n) == n);
+    }
+    if (in >= 0) close(in);
+    if (out >= 0) close(out);
+    if (ok) reply(s, "250 Copy successful");
+    else reply(s, "550 Cannot copy");
+    free(path);
+    free(s->copy_from);
+    s->copy_from = NULL;
+  } else {
+    reply(s, "500 SITE %s not understood", arg);
+  }
+}
+/*}}}*/
+static void do_pasv(struct session *s)/*{{{*/
+{
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  unsigned long ip;
+  int port;
+
+  if (s->pasv_fd >= 0) close(s->pasv_fd);
+  s->pasv_fd = socket(PF_INET, SOCK_STREAM, 0);
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0;
+  if ((s->pasv_fd < 0) ||
+      (bind(s->pasv_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) ||
+      (listen(s->pasv_fd, 1) < 0) ||
+      (getsockname(s->pasv_fd, (struct sockaddr *) &addr, &len) < 0)) {
+    reply(s, "425 Cannot open passive connection");
+    return;
+  }
+  ip = ntohl(addr.sin_addr.s_addr);
+  port = ntohs(addr.sin_port);
+  reply(s, "227 Entering Passive Mode (%lu,%lu,%lu,%lu,%d,%d)",
+        (ip >> 24) & 0xff, (ip >> 16) & 0xff, (ip >> 8) & 0xff, ip & 0xff,
+        (port >> 8) & 0xff, port & 0xff);
+}
+/*}}}*/
+static void do_port(struct session *s, const char *arg)/*{{{*/
+{
+  unsigned int h0, h1, h2, h3, p0, p1;
+  if (!arg || (sscanf(arg, "%u,%u,%u,%u,%u,%u", &h0, &h1, &h2, &h3, &p0, &p1) != 6)) {
+    reply(s, "501 Bad PORT argument");
+    return;
+  }
+  memset(&s->port_addr, 0, sizeof(s->port_addr));
+  s->port_addr.sin_family = AF_INET;
+  s->port_addr.sin_addr.s_addr = htonl((h0 << 24) | (h1 << 16) | (h2 << 8) | h3);
+  s->port_addr.sin_port = htons((p0 << 8) | p1);
+  s->have_port = 1;
+  reply(s, "200 PORT command successful");
+}
+/*}}}*/
+static void do_feat(struct session *s)/*{{{*/
+{
+  reply_more(s, "211-Features:");
+  if (features & F_MLSD) reply_more(s, " MLST type*;size*;modify*;");
+  if (features & F_REST) reply_more(s, " REST STREAM");
+  if (features & F_SIZE) reply_more(s, " SIZE");
+  if (features & F_XMD5) reply_more(s, " XMD5");
+  reply(s, "211 End");
+}
+/*}}}*/
+static int handle(struct session *s, char *line)/*{{{*/
+{
+  /* Act on one command; return 0 to end the session. */
+  char *verb = line, *arg, *p, *path;
+  struct stat sb;
+
+  for (p = line; *p && (*p != ' '); p++) *p = toupper(*p);
+  arg = NULL;
+  if (*p) {
+    *p++ = '\0';
+    arg = p;
+  }
+
+  if (!strcmp(verb, "USER")) reply(s, "331 Send password");
+  else if (!strcmp(verb, "PASS")) reply(s, "230 Logged in");
+  else if (!strcmp(verb, "SYST")) reply(s, "215 UNIX Type: L8");
+  else if (!strcmp(verb, "NOOP")) reply(s, "200 OK");
+  else if (!strcmp(verb, "TYPE")) reply(s, "200 Type set");
+  else if (!strcmp(verb, "FEAT")) do_feat(s);
+  else if (!strcmp(verb, "QUIT")) {
+    reply(s, "221 Goodbye");
+    return 0;
+  } else if (!strcmp(verb, "MODE")) {
+    if (arg && (toupper(arg[0]) == 'S')) {
+      s->mode_b = 0;
+      reply(s, "200 Mode S");
+    } else if (arg && (toupper(arg[0]) == 'B') && (features & F_MODEB)) {
+      s->mode_b = 1;
+      reply(s, "200 Mode B");
+    } else {
+      reply(s, "504 Mode not supported");
+    }
+  } else if (!strcmp(verb, "PWD")) reply(s, "257 \"%s\"", s->cwd);
+  else if (!strcmp(verb, "CWD") || !strcmp(verb, "CDUP")) {
+    p = virtual_path(s, strcmp(verb, "CDUP") ? arg : "..");
+    path = real_path(s, p);
+    if ((stat(path, &sb) == 0) && S_ISDIR(sb.st_mode)) {
+      free(s->cwd);
+      s->cwd = p;
+      reply(s, "250 Directory changed");
+    } else {
+      free(p);
+      reply(s, "550 No such directory");
+    }
+    free(path);
+  }
+  else if (!strcmp(verb, "PASV") && (features & F_PASV)) do_pasv(s);
+  else if (!strcmp(verb, "PORT") && (features & F_PORT)) do_port(s, arg);
+  else if (!strcmp(verb, "LIST") || !strcmp(verb, "NLST")) do_list(s, verb, arg);
+  else if (!strcmp(verb, "MLSD") && (features & F_MLSD)) do_list(s, verb, arg);
+  else if (!strcmp(verb, "STOR") || !strcmp(verb, "APPE")) do_store(s, verb, arg);
+  else if (!strcmp(verb, "RETR")) do_retrieve(s, arg);
+  else if (!strcmp(verb, "REST") && (features & F_REST)) {
+    s->rest = arg ? strtoul(arg, NULL, 10) : 0;
+    reply(s, "350 Restarting at %lu", (unsigned long) s->rest);
+  } else if (!strcmp(verb, "SIZE") && (features & F_SIZE)) {
+    path = real_path(s, arg);
+    if ((stat(path, &sb) == 0) && S_ISREG(sb.st_mode)) reply(s, "213 %lu", (unsigned long) sb.st_size);
+    else reply(s, "550 No such file");
+    free(path);
+  } else if (!strcmp(verb, "XMD5") && (features & F_XMD5)) do_xmd5(s, arg);
+  else if (!strcmp(verb, "DELE")) {
+    path = real_path(s, arg);
+    if (unlink(path) == 0) reply(s, "250 Deleted");
+    else reply(s, "550 Cannot delete");
+    free(path);
+  } else if (!strcmp(verb, "RMD")) {
+    path = real_path(s, arg);
+    if (rmdir(path) == 0) reply(s, "250 Removed");
+    else reply(s, "550 Cannot remove");
+    free(path);
+  } else if (!strcmp(verb, "MKD")) {
+    path = real_path(s, arg);
+    if (mkdir(path, 0755) == 0) reply(s, "257 \"%s\" created", arg);
+    else reply(s, "550 Cannot create");
+    free(path);
+  } else if (!strcmp(verb, "RNFR")) {
+    path = real_path(s, arg);
+    if (stat(path, &sb) == 0) {
+      free(s->rename_from);
+      s->rename_from = path;
+      reply(s, "350 Ready for RNTO");
+    } else {
+      free(path);
+      reply(s, "550 No such file");
+    }
+  } else if (!strcmp(verb, "RNTO")) {
+    if (!s->rename_from) {
+      reply(s, "503 RNFR first");
+    } else {
+      path = real_path(s, arg);
+      if (rename(s->rename_from, path) == 0) reply(s, "250 Renamed");
+      else reply(s, "550 Cannot rename");
+      free(path);
+      free(s->rename_from);
+      s->rename_from = NULL;
+    }
+  } else if (!strcmp(verb, "SITE")) {
+    do_site(s, arg);
+  } else {
+    reply(s, "502 Command not implemented");
+  }
+  return 1;
+}
+/*}}}*/
+static void *session(void *arg)/*{{{*/
+{
+  struct session *s = arg;
+  char *line;
+  int more = 1;
+
+  __sync_fetch_and_add(&stats.sessions, 1);
+  s->input_at = now();
+  reply(s, "220 ftpup bench server");
+  while (more && (line = read_command(s))) {
+    more = handle(s, line);
+    free(line);
+  }
+  close(s->fd);
+  if (s->pasv_fd >= 0) close(s->pasv_fd);
+  free(s->cwd);
+  free(s->rename_from);
+  free(s->copy_from);
+  free(s);
+  return NULL;
+}
+/*}}}*/
+static void *acceptor(void *arg)/*{{{*/
+{
+  int listen_fd = *(int *) arg;
+  struct session *s;
+  pthread_t thread;
+  int fd;
+
+  for (;;) {
+    fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0) continue;
+    s = new(struct session);
+    memset(s, 0, sizeof(struct session));
+    s->fd = fd;
+    s->cwd = new_string("/");
+    s->pasv_fd = -1;
+    if (pthread_create(&thread, NULL, session, s) != 0) {
+      close(fd);
+      continue;
+    }
+    pthread_detach(thread);
+  }
+  return NULL;
+}
+/*}}}*/
+static void write_stats(const char *filename)/*{{{*/
+{
+  /* Written under another name and renamed, so that whoever is waiting for
+   * the file never sees half of it. */
+  char *temp;
+  FILE *out;
+
+  if (filename) {
+    temp = new_array(char, strlen(filename) + 5);
+    sprintf(temp, "%s.new", filename);
+    out = fopen(temp, "w");
+    if (!out) {
+      perror(temp);
+      exit(1);
+    }
+  } else {
+    temp = NULL;
+    out = stdout;
+  }
+  fprintf(out, "\"sessions\":%ld,\"commands\":%ld,\"round_trips\":%ld,\"data_connections\":%ld,"
+               "\"ctrl_bytes\":%ld,\"data_bytes_up\":%ld,\"data_bytes_down\":%ld,\"wire_bytes\":%ld\n",
+          stats.sessions, stats.commands, stats.round_trips, stats.data_connections,
+          stats.ctrl_bytes_in + stats.ctrl_bytes_out, stats.data_bytes_in, stats.data_bytes_out,
+          stats.ctrl_bytes_in + stats.ctrl_bytes_out + stats.data_bytes_in + stats.data_bytes_out);
+  if (temp) {
+    fclose(out);
+    rename(temp, filename);
+    free(temp);
+  } else {
+    fflush(out);
+  }
+}
+/*}}}*/
+static int parse_features(const char *list)/*{{{*/
+{
+  char *copy = new_string(list), *word;
+  int result = 0, i;
+  for (word = strtok(copy, ","); word; word = strtok(NULL, ",")) {
+    for (i = 0; feature_names[i].name && strcasecmp(word, feature_names[i].name); i++) ;
+    if (!feature_names[i].name) {
+      fprintf(stderr, "Unknown feature %s\n", word);
+      exit(1);
+    }
+    result |= feature_names[i].flag;
+  }
+  free(copy);
+  return result;
+}
+/*}}}*/
+static void usage(void)/*{{{*/
+{
+  fprintf(stderr, "Usage: ftpd [-p port] [-l latency_ms] [-b bytes_per_sec] [-F features] [-s stats_file] root\n"
+                  "  -p : port to listen on; 0 picks one (default), which is printed on stdout\n"
+                  "  -l : delay from a client's input to the reply it causes\n"
+                  "  -b : bandwidth shared by all data connections (default: unlimited)\n"
+                  "  -F : comma-separated list from pasv,port,mlsd,modeb,rest,size,xmd5,trunc,copy\n"
+                  "       (default: all but trunc)\n"
+                  "  -s : where to write the counters on SIGUSR1 or SIGTERM (default: stdout)\n");
+}
+/*}}}*/
+int main(int argc, char **argv)/*{{{*/
+{
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  const char *stats_file = NULL;
+  int port = 0, listen_fd, one = 1, sig;
+  sigset_t signals;
+  pthread_t thread;
+
+  while (++argv, --argc) {
+    if (!strcmp(*argv, "-p") && (argc > 1)) {
+      --argc, ++argv;
+      port = atoi(*argv);
+    } else if (!strcmp(*argv, "-l") && (argc > 1)) {
+      --argc, ++argv;
+      latency = atof(*argv) / 1000.0;
+    } else if (!strcmp(*argv, "-b") && (argc > 1)) {
+      --argc, ++argv;
+      bandwidth = atof(*argv);
+    } else if (!strcmp(*argv, "-F") && (argc > 1)) {
+      --argc, ++argv;
+      features = parse_features(*argv);
+    } else if (!strcmp(*argv, "-s") && (argc > 1)) {
+      --argc, ++argv;
+      stats_file = *argv;
+    } else if ((*argv)[0] == '-') {
+      usage();
+      exit(2);
+    } else {
+      root = *argv;
+    }
+  }
+  if (!root) {
+    usage();
+    exit(2);
+  }
+  root = realpath(root, NULL);
+  if (!root) {
+    perror("realpath");
+    exit(1);
+  }
+
+  listen_fd = socket(PF_INET, SOCK_STREAM, 0);
+  if (listen_fd < 0) {
+    perror("socket");
+    exit(1);
+  }
+  setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+  if ((bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) ||
+      (listen(listen_fd, 16) < 0) ||
+      (getsockname(listen_fd, (struct sockaddr *) &addr, &len) < 0)) {
+    perror("bind");
+    exit(1);
+  }
+  printf("%d\n", ntohs(addr.sin_port));
+  fflush(stdout);
+
+  /* Let only this thread see the signals, and wait for them here. */
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGTERM);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+  signal(SIGPIPE, SIG_IGN);
+  if (pthread_create(&thread, NULL, acceptor, &listen_fd) != 0) {
+    fprintf(stderr, "Cannot start acceptor thread\n");
+    exit(1);
+  }
+  for (;;) {
+    sigwait(&signals, &sig);
+    write_stats(stats_file);
+    if (sig != SIGUSR1) break;
+    /* Only asked for between runs, when no sessions are active. */
+    memset(&stats, 0, sizeof(stats));
+  }
+  return 0;
+}
+/*}}}*/
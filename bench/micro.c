@@ -0,0 +1,585 @@
+/*
+ * Microbenchmarks for the inventory, listing and reconcile code, with no
+ * network involved.
+ *
+ * For each size, a synthetic listing is written (with some journal records
+ * appended, as a real one would have), and a matching local tree is built
+ * on disk when it is small enough.  Each phase is timed on its own and the
+ * fastest of a few repetitions (in CPU time) is reported, along with the heap
+ * allocations it made per node.  malloc, calloc and realloc are wrapped at
+ * link time (see the Makefile) so that only ftpup's own calls are counted.
+ *
+ * Phases that use several threads (loading the listing) can be timed by the
+ * wall clock instead, and the phases run can be narrowed down, so that a
+ * listing of ten million lines or more can be loaded without the rest.
+ *
+ * Given a baseline file (in the same format as the output), the exit status
+ * is 1 if any phase is slower by more than the tolerance, or allocates more
+ * per node, than the baseline row with the same phase and tree shape.
+ * */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "invent.h"
+#include "memory.h"
+#include "namecheck.h"
+
+int verbose = 0;
+
+/*{{{ Allocation counting */
+static long n_allocs;
+static long n_alloc_bytes;
+
+void *__real_malloc(size_t);
+void *__real_calloc(size_t, size_t);
+void *__real_realloc(void *, size_t);
+
+void *__wrap_malloc(size_t size)/*{{{*/
+{
+  __sync_fetch_and_add(&n_allocs, 1);
+  __sync_fetch_and_add(&n_alloc_bytes, size);
+  return __real_malloc(size);
+}
+/*}}}*/
+void *__wrap_calloc(size_t n, size_t size)/*{{{*/
+{
+  __sync_fetch_and_add(&n_allocs, 1);
+  __sync_fetch_and_add(&n_alloc_bytes, n * size);
+  return __real_calloc(n, size);
+}
+/*}}}*/
+void *__wrap_realloc(void *old, size_t size)/*{{{*/
+{
+  __sync_fetch_and_add(&n_allocs, 1);
+  __sync_fetch_and_add(&n_alloc_bytes, size);
+  return __real_realloc(old, size);
+}
+/*}}}*/
+/*}}}*/
+
+struct shape {/*{{{*/
+  long nodes;
+  int fanout;   /* entries per directory */
+  int subdirs;  /* how many of those are directories */
+  int depth;    /* no directories below this depth; 0 for no limit */
+};
+/*}}}*/
+struct result {/*{{{*/
+  char phase[32];
+  struct shape shape;
+  double ns_per_node;
+  double allocs_per_node;
+  double bytes_per_node;
+};
+/*}}}*/
+
+#define BASE_MTIME 1000000000L
+
+static int wall_clock = 0;
+static const char *phases = NULL;
+
+static double now(void)/*{{{*/
+{
+  /* CPU time rather than wall time unless asked, so that other work on the
+   * machine disturbs the figures less. */
+  struct timespec ts;
+  clock_gettime(wall_clock ? CLOCK_MONOTONIC : CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec + 1.0e-9 * ts.tv_nsec;
+}
+/*}}}*/
+static int wanted(const char *phase)/*{{{*/
+{
+  /* 1 if phase is in the comma-separated list given with -p, or there
+   * wasn't one. */
+  const char *p;
+  int len = strlen(phase);
+  if (!phases) return 1;
+  for (p = phases; p; p = strchr(p, ',')) {
+    if (*p == ',') p++;
+    if (!strncmp(p, phase, len) && ((p[len] == ',') || !p[len])) return 1;
+  }
+  return 0;
+}
+/*}}}*/
+static size_t file_size(long serial)/*{{{*/
+{
+  return (serial * 2654435761UL) % 100000;
+}
+/*}}}*/
+static long write_listing(const char *filename, const struct shape *sh, const char *tree)/*{{{*/
+{
+  /* Lay the tree out breadth first, so that every directory is listed
+   * before what is in it.  One file in ten is then recorded again, as
+   * uploads append to the journal.  If tree is non-null the
+   * tree is made on disk there too, with the final sizes and mtimes.
+   * Return the number of nodes. */
+  FILE *out;
+  char **queue, *path;
+  int *depth, *filled;
+  long head = 0, tail = 1, n = 0, serial = 0, max = 1024;
+  int i, fd;
+  struct timeval times[2];
+
+  out = fopen(filename, "w");
+  if (!out) {
+    perror(filename);
+    exit(1);
+  }
+  fprintf(out, "H bench\nU bench\nP 21\n");
+  queue = new_array(char *, max);
+  depth = new_array(int, max);
+  filled = new_array(int, max);
+  queue[0] = new_string("");
+  depth[0] = 0;
+  filled[0] = 0;
+  path = new_array(char, 4096);
+
+  while ((head < tail) && (n < sh->nodes)) {
+    for (i = 0; (i < sh->fanout) && (n < sh->nodes); i++, n++) {
+      if ((i < sh->subdirs) && (!sh->depth || (depth[head] < sh->depth))) {
+        sprintf(path, "%s%sd%02d", queue[head], queue[head][0] ? "/" : "", i);
+        fprintf(out, "D %s\n", path);
+        if (tree) {
+          sprintf(path, "%s/%s%sd%02d", tree, queue[head], queue[head][0] ? "/" : "", i);
+          mkdir(path, 0755);
+          sprintf(path, "%s%sd%02d", queue[head], queue[head][0] ? "/" : "", i);
+        }
+        if (tail == max) {
+          max *= 2;
+          queue = grow_array(char *, max, queue);
+          depth = grow_array(int, max, depth);
+          filled = grow_array(int, max, filled);
+        }
+        queue[tail] = new_string(path);
+        filled[tail] = 0;
+        depth[tail++] = depth[head] + 1;
+      } else {
+        serial++;
+        sprintf(path, "%s%sfile%04d.dat", queue[head], queue[head][0] ? "/" : "", i);
+        fprintf(out, "F %8lu %lx %s\n", (unsigned long) file_size(serial), BASE_MTIME + serial, path);
+        if (tree) {
+          sprintf(path, "%s/%s%sfile%04d.dat", tree, queue[head], queue[head][0] ? "/" : "", i);
+          fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+          if ((fd < 0) || (ftruncate(fd, file_size(serial)) < 0)) {
+            perror(path);
+            exit(1);
+          }
+          close(fd);
+          /* Every seventh file has changed locally since it was sent. */
+          times[0].tv_sec = times[1].tv_sec = BASE_MTIME + serial + ((serial % 7) ? 0 : 100);
+          times[0].tv_usec = times[1].tv_usec = 0;
+          utimes(path, times);
+        }
+      }
+    }
+    filled[head++] = i;
+  }
+
+  /* The journal */
+  serial = 0;
+  for (head = 0; head < tail; head++) {
+    for (i = 0; i < filled[head]; i++) {
+      if ((i < sh->subdirs) && (!sh->depth || (depth[head] < sh->depth))) continue;
+      serial++;
+      if (serial % 10) continue;
+      fprintf(out, "F %8lu %lx %s%sfile%04d.dat\n", (unsigned long) file_size(serial),
+              BASE_MTIME + serial, queue[head], queue[head][0] ? "/" : "", i);
+    }
+  }
+  for (head = 0; head < tail; head++) free(queue[head]);
+  free(queue);
+  free(depth);
+  free(filled);
+  free(path);
+  fclose(out);
+  return n;
+}
+/*}}}*/
+static void age_files(struct fnode *a, long *serial)/*{{{*/
+{
+  /* Make a copy of the listing look like the local tree write_listing
+   * would have made. */
+  struct fnode *e;
+  for (e = a->next; e != a; e = e->next) {
+    if (e->is_dir) {
+      age_files((struct fnode *) &e->x.dir.next, serial);
+    } else if ((++*serial % 7) == 0) {
+      e->x.file.mtime += 100;
+    }
+  }
+}
+/*}}}*/
+static void lookup_all(struct fnode *a, const struct namecheck *nc, long *n_pass)/*{{{*/
+{
+  struct fnode *e;
+  for (e = a->next; e != a; e = e->next) {
+    if (lookup_namecheck(nc, e->path) == NC_PASS) ++*n_pass;
+    if (e->is_dir) lookup_all((struct fnode *) &e->x.dir.next, nc, n_pass);
+  }
+}
+/*}}}*/
+static void write_rules(const char *filename)/*{{{*/
+{
+  /* Something like a typical @@GLOBAL_UPLOAD@@. */
+  static const char *rules[] = {
+    "!@@*", "!*.o", "!*.a", "!*~", "!.*.swp", "!*.tmp", "!core", "!.git",
+    "!build/**", "!**/cache/*", "!file00[0-3]?.dat", "*.html", "*.css",
+    "*.js", "*.png", "*.jpg", "d[0-9][0-9]", "*.dat", NULL
+  };
+  FILE *out = fopen(filename, "w");
+  int i;
+  if (!out) {
+    perror(filename);
+    exit(1);
+  }
+  for (i = 0; rules[i]; i++) fprintf(out, "%s\n", rules[i]);
+  fclose(out);
+}
+/*}}}*/
+static void remove_tree(const char *path)/*{{{*/
+{
+  char *command = new_array(char, strlen(path) + 16);
+  sprintf(command, "rm -rf '%s'", path);
+  if (system(command) != 0) {
+    fprintf(stderr, "Could not remove %s\n", path);
+  }
+  free(command);
+}
+/*}}}*/
+
+/*{{{ Timing one phase */
+/* Small trees are run over and over until this much time has been spent,
+ * so that their fastest run is a fair one. */
+#define MIN_SECONDS 0.5
+#define MAX_RUNS 100
+
+struct timing {
+  double best;
+  double total;
+  long allocs;
+  long bytes;
+  int runs;
+};
+
+static int more_runs(const struct timing *t, int reps)/*{{{*/
+{
+  if (t->runs < reps) return 1;
+  return (t->total < MIN_SECONDS) && (t->runs < MAX_RUNS);
+}
+/*}}}*/
+
+static void start_run(struct timing *t, double *start, long *allocs, long *bytes)/*{{{*/
+{
+  *allocs = n_allocs;
+  *bytes = n_alloc_bytes;
+  *start = now();
+}
+/*}}}*/
+static void end_run(struct timing *t, double start, long allocs, long bytes)/*{{{*/
+{
+  double elapsed = now() - start;
+  if (!t->runs || (elapsed < t->best)) t->best = elapsed;
+  t->total += elapsed;
+  /* Allocation counts don't vary, so the first run's will do. */
+  if (!t->runs) {
+    t->allocs = n_allocs - allocs;
+    t->bytes = n_alloc_bytes - bytes;
+  }
+  t->runs++;
+}
+/*}}}*/
+/*}}}*/
+
+static struct result *results = NULL;
+static int n_results = 0, max_results = 0;
+
+static void report(const char *phase, const struct shape *sh, long nodes, const struct timing *t)/*{{{*/
+{
+  struct result *r;
+  if (n_results == max_results) {
+    max_results = max_results ? 2 * max_results : 16;
+    results = grow_array(struct result, max_results, results);
+  }
+  r = &results[n_results++];
+  strncpy(r->phase, phase, sizeof(r->phase) - 1);
+  r->phase[sizeof(r->phase) - 1] = '\0';
+  r->shape = *sh;
+  r->ns_per_node = 1.0e9 * t->best / nodes;
+  r->allocs_per_node = (double) t->allocs / nodes;
+  r->bytes_per_node = (double) t->bytes / nodes;
+  printf("%-16s %9ld %6d %7d %5d %10.1f %12.2f %11.1f\n",
+         r->phase, sh->nodes, sh->fanout, sh->subdirs, sh->depth,
+         r->ns_per_node, r->allocs_per_node, r->bytes_per_node);
+  fflush(stdout);
+}
+/*}}}*/
+static void run_shape(const struct shape *sh, const char *work, long local_limit, int reps)/*{{{*/
+{
+  char *listing, *tree, *rules, *cwd;
+  struct fnode *fileinv, *localinv;
+  struct remote_params rp;
+  struct namecheck *nc;
+  struct timing t;
+  double start;
+  long allocs, bytes, nodes, serial, n_pass;
+  int on_disk;
+
+  listing = new_array(char, strlen(work) + 32);
+  tree = new_array(char, strlen(work) + 32);
+  rules = new_array(char, strlen(work) + 32);
+  sprintf(listing, "%s/@@LISTING@@", work);
+  sprintf(tree, "%s/tree", work);
+  sprintf(rules, "%s/rules", work);
+  cwd = getcwd(NULL, 0);
+
+  on_disk = (sh->nodes <= local_limit);
+  if (on_disk) {
+    remove_tree(tree);
+    mkdir(tree, 0755);
+  }
+  nodes = write_listing(listing, sh, on_disk ? tree : NULL);
+
+  /*{{{ make_fileinv */
+  if (wanted("make_fileinv")) {
+    memset(&t, 0, sizeof(t));
+    fileinv = NULL;
+    while (more_runs(&t, reps)) {
+      if (fileinv) free_inventory(fileinv);
+      init_remote_params(&rp);
+      start_run(&t, &start, &allocs, &bytes);
+      fileinv = make_fileinv(listing, &rp);
+      end_run(&t, start, allocs, bytes);
+    }
+    report("make_fileinv", sh, nodes, &t);
+  } else {
+    init_remote_params(&rp);
+    fileinv = make_fileinv(listing, &rp);
+  }
+  /*}}}*/
+  /*{{{ print_inventory */
+  if (wanted("print_inventory")) {
+    memset(&t, 0, sizeof(t));
+    while (more_runs(&t, reps)) {
+      start_run(&t, &start, &allocs, &bytes);
+      print_inventory(fileinv, listing, "bench", 21, "bench", NULL);
+      end_run(&t, start, allocs, bytes);
+    }
+    report("print_inventory", sh, nodes, &t);
+  }
+  /*}}}*/
+  /*{{{ preen_listing */
+  if (wanted("preen_listing")) {
+    memset(&t, 0, sizeof(t));
+    while (more_runs(&t, reps)) {
+      write_listing(listing, sh, NULL);
+      start_run(&t, &start, &allocs, &bytes);
+      preen_listing(listing);
+      end_run(&t, start, allocs, bytes);
+    }
+    report("preen_listing", sh, nodes, &t);
+  }
+  /*}}}*/
+  /*{{{ make_localinv, or a stand-in for it */
+  localinv = NULL;
+  if (on_disk && (wanted("make_localinv") || wanted("reconcile"))) {
+    memset(&t, 0, sizeof(t));
+    if (chdir(tree) < 0) {
+      perror(tree);
+      exit(1);
+    }
+    while (more_runs(&t, reps)) {
+      if (localinv) free_inventory(localinv);
+      start_run(&t, &start, &allocs, &bytes);
+      localinv = make_localinv(NULL, NULL, 1, NULL, NULL);
+      end_run(&t, start, allocs, bytes);
+    }
+    if (chdir(cwd) < 0) {
+      perror(cwd);
+      exit(1);
+    }
+    if (wanted("make_localinv")) report("make_localinv", sh, nodes, &t);
+  } else if (!on_disk && wanted("reconcile")) {
+    init_remote_params(&rp);
+    localinv = make_fileinv(listing, &rp);
+    serial = 0;
+    age_files(localinv, &serial);
+  }
+  /*}}}*/
+  /*{{{ reconcile */
+  if (wanted("reconcile")) {
+    memset(&t, 0, sizeof(t));
+    while (more_runs(&t, reps)) {
+      start_run(&t, &start, &allocs, &bytes);
+      reconcile(fileinv, localinv);
+      end_run(&t, start, allocs, bytes);
+    }
+    report("reconcile", sh, nodes, &t);
+  }
+  /*}}}*/
+  /*{{{ lookup_namecheck */
+  if (wanted("lookup_namecheck")) {
+    write_rules(rules);
+    nc = make_namecheck(rules);
+    memset(&t, 0, sizeof(t));
+    while (more_runs(&t, reps)) {
+      n_pass = 0;
+      start_run(&t, &start, &allocs, &bytes);
+      lookup_all(fileinv, nc, &n_pass);
+      end_run(&t, start, allocs, bytes);
+    }
+    report("lookup_namecheck", sh, nodes, &t);
+    free_namecheck(nc);
+  }
+  /*}}}*/
+
+  free_inventory(fileinv);
+  free(fileinv);
+  if (localinv) {
+    free_inventory(localinv);
+    free(localinv);
+  }
+  if (on_disk) remove_tree(tree);
+  unlink(listing);
+  unlink(rules);
+  free(listing);
+  free(tree);
+  free(rules);
+  free(cwd);
+}
+/*}}}*/
+static int check_baseline(const char *filename, double tolerance)/*{{{*/
+{
+  /* Return the number of phases that have regressed. */
+  FILE *in;
+  char line[256];
+  struct result b;
+  int i, n_bad = 0, n_matched = 0;
+
+  in = fopen(filename, "r");
+  if (!in) {
+    fprintf(stderr, "Cannot open baseline %s\n", filename);
+    exit(1);
+  }
+  while (fgets(line, sizeof(line), in)) {
+    if (line[0] == '#') continue;
+    if (sscanf(line, "%31s %ld %d %d %d %lf %lf %lf", b.phase, &b.shape.nodes, &b.shape.fanout,
+               &b.shape.subdirs, &b.shape.depth, &b.ns_per_node, &b.allocs_per_node,
+               &b.bytes_per_node) != 8) continue;
+    for (i = 0; i < n_results; i++) {
+      struct result *r = &results[i];
+      if (strcmp(r->phase, b.phase) || (r->shape.nodes != b.shape.nodes) ||
+          (r->shape.fanout != b.shape.fanout) || (r->shape.subdirs != b.shape.subdirs) ||
+          (r->shape.depth != b.shape.depth)) continue;
+      n_matched++;
+      if (r->ns_per_node > b.ns_per_node * (1.0 + tolerance)) {
+        printf("REGRESSION %s at %ld nodes : %.1f ns/node, baseline %.1f\n",
+               r->phase, r->shape.nodes, r->ns_per_node, b.ns_per_node);
+        n_bad++;
+      }
+      /* Small slack for the allocations libc makes on our behalf varying. */
+      if (r->allocs_per_node > b.allocs_per_node * 1.01 + 0.01) {
+        printf("REGRESSION %s at %ld nodes : %.2f allocs/node, baseline %.2f\n",
+               r->phase, r->shape.nodes, r->allocs_per_node, b.allocs_per_node);
+        n_bad++;
+      }
+    }
+  }
+  fclose(in);
+  printf("Checked %d phases against %s : %d regression%s\n",
+         n_matched, filename, n_bad, (n_bad == 1) ? "" : "s");
+  return n_bad;
+}
+/*}}}*/
+static void usage(void)/*{{{*/
+{
+  fprintf(stderr, "Usage: micro [options]\n"
+                  "  -n <n>[,<n>...] : tree sizes in nodes (default: 10000,100000,1000000)\n"
+                  "  -f <n>          : entries per directory (default: 32)\n"
+                  "  -w <n>          : of which subdirectories (default: 4)\n"
+                  "  -d <n>          : no directories below this depth (default: no limit)\n"
+                  "  -l <n>          : largest tree to make on disk for make_localinv (default: 100000)\n"
+                  "  -r <n>          : least repetitions of each phase, fastest reported (default: 3)\n"
+                  "  -b <file>       : fail if slower or allocating more than this baseline\n"
+                  "  -t <pct>        : slowdown allowed against the baseline (default: 50)\n"
+                  "  -T <dir>        : where to make the trees (default: $TMPDIR or /tmp)\n"
+                  "  -p <phase>[,<phase>...] : only run these phases (default: all)\n"
+                  "  -W              : time by the wall clock rather than CPU time\n");
+}
+/*}}}*/
+int main(int argc, char **argv)/*{{{*/
+{
+  char *sizes = "10000,100000,1000000", *baseline = NULL, *p, *work;
+  const char *tmp;
+  struct shape sh;
+  long local_limit = 100000;
+  int reps = 3;
+  double tolerance = 0.5;
+
+  sh.fanout = 32;
+  sh.subdirs = 4;
+  sh.depth = 0;
+  tmp = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+
+  while (++argv, --argc) {
+    if (!strcmp(*argv, "-W")) {
+      wall_clock = 1;
+      continue;
+    }
+    if ((*argv)[0] != '-' || (argc < 2)) {
+      usage();
+      exit(2);
+    }
+    switch ((*argv)[1]) {
+      case 'n': sizes = argv[1]; break;
+      case 'f': sh.fanout = atoi(argv[1]); break;
+      case 'w': sh.subdirs = atoi(argv[1]); break;
+      case 'd': sh.depth = atoi(argv[1]); break;
+      case 'l': local_limit = atol(argv[1]); break;
+      case 'r': reps = atoi(argv[1]); break;
+      case 'b': baseline = argv[1]; break;
+      case 't': tolerance = atof(argv[1]) / 100.0; break;
+      case 'T': tmp = argv[1]; break;
+      case 'p': phases = argv[1]; break;
+      default:
+        usage();
+        exit(2);
+    }
+    --argc, ++argv;
+  }
+  if ((sh.fanout < 1) || (sh.subdirs < 0) || (sh.subdirs > sh.fanout) || (reps < 1)) {
+    usage();
+    exit(2);
+  }
+  if ((sh.subdirs == 0) || (sh.subdirs == sh.fanout)) {
+    fprintf(stderr, "Need some files and some subdirectories in each directory\n");
+    exit(2);
+  }
+
+  work = new_array(char, strlen(tmp) + 32);
+  sprintf(work, "%s/ftpup-micro.XXXXXX", tmp);
+  if (!mkdtemp(work)) {
+    perror(work);
+    exit(1);
+  }
+
+  printf("# %-14s %9s %6s %7s %5s %10s %12s %11s\n",
+         "phase", "nodes", "fanout", "subdirs", "depth", "ns/node", "allocs/node", "bytes/node");
+  for (p = sizes; *p; ) {
+    sh.nodes = strtol(p, &p, 10);
+    if (sh.nodes > 0) run_shape(&sh, work, local_limit, reps);
+    while (*p && (*p < '0' || *p > '9')) p++;
+  }
+  rmdir(work);
+  free(work);
+
+  if (baseline && check_baseline(baseline, tolerance)) return 1;
+  return 0;
+}
+/*}}}*/
@@ -0,0 +1,184 @@
+/*
+ * Make synthetic trees for the benchmarks, and change them in repeatable ways.
+ *
+ *   mktree [-s seed] create <dir> <depth> <width> <files_per_dir> <mean_size>
+ *   mktree [-s seed] mutate <dir> <percent>
+ *
+ * create makes width subdirectories at each level down to depth, and
+ * files_per_dir files in every directory, sized between half and one and a
+ * half times mean_size.  mutate rewrites, grows or deletes about percent of
+ * the files, and adds about as many new ones.  The same seed always gives
+ * the same tree.
+ * */
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/stat.h>
+
+#include "memory.h"
+
+/* Files are dated well in the past, and changes a little less so, so that
+ * ftpup's check for files still being written doesn't hold them back. */
+#define CREATE_AGE 3600
+#define MUTATE_AGE 10
+
+static unsigned long long rng_state = 88172645463325252ULL;
+
+static unsigned long long next_random(void)/*{{{*/
+{
+  /* xorshift64 */
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state;
+}
+/*}}}*/
+static int chance(int percent)/*{{{*/
+{
+  return (int) (next_random() % 100) < percent;
+}
+/*}}}*/
+static void set_age(const char *path, int age)/*{{{*/
+{
+  struct utimbuf times;
+  times.actime = times.modtime = time(NULL) - age;
+  utime(path, &times);
+}
+/*}}}*/
+static void write_file(const char *path, size_t size, const char *mode, int age)/*{{{*/
+{
+  unsigned long long word;
+  FILE *out;
+  size_t i;
+
+  out = fopen(path, mode);
+  if (!out) {
+    perror(path);
+    exit(1);
+  }
+  for (i = 0; i < size; i += sizeof(word)) {
+    word = next_random();
+    fwrite(&word, 1, (size - i < sizeof(word)) ? size - i : sizeof(word), out);
+  }
+  fclose(out);
+  set_age(path, age);
+}
+/*}}}*/
+static size_t pick_size(size_t mean)/*{{{*/
+{
+  if (mean < 2) return mean;
+  return mean / 2 + next_random() % (mean + 1);
+}
+/*}}}*/
+static void create(const char *dir, int depth, int width, int n_files, size_t mean)/*{{{*/
+{
+  char *path = new_array(char, strlen(dir) + 16);
+  struct stat sb;
+  int i;
+
+  if ((mkdir(dir, 0755) < 0) && ((stat(dir, &sb) < 0) || !S_ISDIR(sb.st_mode))) {
+    perror(dir);
+    exit(1);
+  }
+  for (i=0; i<n_files; i++) {
+    sprintf(path, "%s/f%03d.dat", dir, i);
+    write_file(path, pick_size(mean), "wb", CREATE_AGE);
+  }
+  if (depth > 0) {
+    for (i=0; i<width; i++) {
+      sprintf(path, "%s/d%02d", dir, i);
+      create(path, depth - 1, width, n_files, mean);
+    }
+  }
+  set_age(dir, CREATE_AGE);
+  free(path);
+}
+/*}}}*/
+static int compare_names(const void *a, const void *b)/*{{{*/
+{
+  return strcmp(*(char **) a, *(char **) b);
+}
+/*}}}*/
+static void mutate(const char *dir, int percent)/*{{{*/
+{
+  /* Entries are visited in sorted order so that the result doesn't depend
+   * on the order the filesystem lists them in. */
+  DIR *d;
+  struct dirent *de;
+  struct stat sb;
+  char **names = NULL, *path;
+  int n = 0, max = 0, i, n_added = 0;
+  unsigned long long roll;
+
+  d = opendir(dir);
+  if (!d) {
+    perror(dir);
+    exit(1);
+  }
+  while ((de = readdir(d))) {
+    if ((de->d_name[0] == '.') || !strncmp(de->d_name, "@@", 2)) continue;
+    if (n == max) {
+      max = max ? 2 * max : 64;
+      names = grow_array(char *, max, names);
+    }
+    names[n++] = new_string(de->d_name);
+  }
+  closedir(d);
+  qsort(names, n, sizeof(char *), compare_names);
+
+  path = new_array(char, strlen(dir) + 1024);
+  for (i=0; i<n; i++) {
+    sprintf(path, "%s/%.1000s", dir, names[i]);
+    if (stat(path, &sb) < 0) continue;
+    if (S_ISDIR(sb.st_mode)) {
+      mutate(path, percent);
+    } else if (chance(percent)) {
+      roll = next_random() % 4;
+      if (roll < 2) {
+        write_file(path, sb.st_size, "r+b", MUTATE_AGE);
+      } else if (roll == 2) {
+        write_file(path, pick_size(sb.st_size / 4 + 1), "ab", MUTATE_AGE);
+      } else {
+        unlink(path);
+      }
+      /* Keep the number of files about the same. */
+      sprintf(path, "%s/n%03d.dat", dir, n_added++);
+      write_file(path, pick_size(sb.st_size + 1), "wb", MUTATE_AGE);
+    }
+    free(names[i]);
+  }
+  free(names);
+  free(path);
+}
+/*}}}*/
+static void usage(void)/*{{{*/
+{
+  fprintf(stderr, "Usage:\n"
+                  "  mktree [-s seed] create <dir> <depth> <width> <files_per_dir> <mean_size>\n"
+                  "  mktree [-s seed] mutate <dir> <percent>\n");
+}
+/*}}}*/
+int main(int argc, char **argv)/*{{{*/
+{
+  if ((argc > 2) && !strcmp(argv[1], "-s")) {
+    rng_state ^= strtoull(argv[2], NULL, 10) * 0x9e3779b97f4a7c15ULL;
+    if (!rng_state) rng_state = 1;
+    argc -= 2;
+    argv += 2;
+  }
+  if ((argc == 7) && !strcmp(argv[1], "create")) {
+    create(argv[2], atoi(argv[3]), atoi(argv[4]), atoi(argv[5]), strtoul(argv[6], NULL, 10));
+  } else if ((argc == 4) && !strcmp(argv[1], "mutate")) {
+    mutate(argv[2], atoi(argv[3]));
+  } else {
+    usage();
+    exit(2);
+  }
+  return 0;
+}
+/*}}}*/
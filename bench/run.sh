@@ -0,0 +1,114 @@
+#!/bin/sh
+# Run ftpup against the stand-in server over a set of network profiles and
+# tree shapes, printing one JSON object per run on stdout.
+#
+# Environment:
+#   BENCH_PROFILES  which of the profiles below to use  (default: "lan wan")
+#   BENCH_SHAPES    which of the shapes below to use    (default: "flat deep big")
+#   BENCH_FEATURES  server features, as for ftpd -F     (default: all but trunc)
+#   BENCH_JOBS      connections for ftpup -U            (default: 1)
+#   BENCH_ACTIVE    set to 1 to use active FTP
+#   BENCH_KEEP      set to 1 to leave the work directory behind
+
+set -e
+
+top=$(cd "$(dirname "$0")/.." && pwd)
+ftpup=$top/ftpup
+bench=$top/bench
+
+# name : latency in ms, bandwidth in bytes/s (0 for no limit)
+profile_lan="0 0"
+profile_wan="20 2000000"
+
+# name : depth, width, files per directory, mean file size
+shape_flat="0 0 200 4096"
+shape_deep="6 2 3 2048"
+shape_big="0 0 4 2000000"
+
+profiles=${BENCH_PROFILES:-"lan wan"}
+shapes=${BENCH_SHAPES:-"flat deep big"}
+features=${BENCH_FEATURES:-"pasv,port,mlsd,modeb,rest,size,xmd5,copy"}
+jobs=${BENCH_JOBS:-1}
+active=
+[ "${BENCH_ACTIVE:-0}" = 1 ] && active=-a
+
+work=$(mktemp -d "${TMPDIR:-/tmp}/ftpup-bench.XXXXXX")
+server_pid=
+cleanup() {
+  [ -n "$server_pid" ] && kill "$server_pid" 2>/dev/null || true
+  [ "${BENCH_KEEP:-0}" = 1 ] || rm -rf "$work"
+}
+trap cleanup EXIT INT TERM
+
+start_server() {
+  # $1 latency_ms, $2 bandwidth
+  rm -f "$work/port" "$work/server.stats"
+  "$bench/ftpd" -l "$1" -b "$2" -F "$features" -s "$work/server.stats" "$work/remote" > "$work/port" &
+  server_pid=$!
+  while [ ! -s "$work/port" ]; do sleep 0.05; done
+  port=$(cat "$work/port")
+}
+
+stop_server() {
+  kill "$server_pid"
+  wait "$server_pid" 2>/dev/null || true
+  server_pid=
+}
+
+server_stats() {
+  # Have the server write out and reset its counters.
+  rm -f "$work/server.stats"
+  kill -USR1 "$server_pid"
+  while [ ! -s "$work/server.stats" ]; do sleep 0.05; done
+  cat "$work/server.stats"
+}
+
+count_files() {
+  find "$work/local" -type f ! -name '@@*' | wc -l | tr -d ' '
+}
+
+run() {
+  # $1 scenario name, then the ftpup arguments
+  scenario=$1
+  shift
+  n_files=$(count_files)
+  status=0
+  (cd "$work/local" && "$bench/runstat" "$work/client.stats" "$ftpup" "$@" >> "$work/ftpup.log" 2>&1) || status=$?
+  client=$(cat "$work/client.stats")
+  server=$(server_stats)
+  printf '{"profile":"%s","shape":"%s","scenario":"%s","args":"%s","local_files":%s,%s,%s}\n' \
+         "$profile" "$shape" "$scenario" "$*" "$n_files" "$client" "$server"
+  if [ "$status" != 0 ]; then
+    echo "ftpup $* failed in $scenario (exit $status); see $work/ftpup.log" >&2
+    BENCH_KEEP=1
+    exit 1
+  fi
+}
+
+for profile in $profiles; do
+  eval "set -- \$profile_$profile"
+  [ $# = 2 ] || { echo "Unknown profile $profile" >&2; exit 2; }
+  latency=$1 bandwidth=$2
+  for shape in $shapes; do
+    eval "set -- \$shape_$shape"
+    [ $# = 4 ] || { echo "Unknown shape $shape" >&2; exit 2; }
+    echo "Running $shape on $profile" >&2
+    rm -rf "$work/local" "$work/remote"
+    mkdir -p "$work/remote"
+    "$bench/mktree" -s 1 create "$work/local" "$@"
+    printf '!@@*\n*\n' > "$work/local/@@GLOBAL_UPLOAD@@"
+    start_server "$latency" "$bandwidth"
+
+    run inventory-empty -R -u bench -p bench -P "$port" $active 127.0.0.1
+    run dry-run -N
+    run upload-full -U -p bench -j "$jobs" $active
+    "$bench/mktree" -s 2 mutate "$work/local" 10
+    run dry-run-changed -N
+    run upload-changed -U -p bench -j "$jobs" $active
+    rm -f "$work/local/@@LISTING@@"
+    run inventory-full -R -u bench -p bench -P "$port" $active 127.0.0.1
+    run lint -L -p bench $active
+
+    stop_server
+  done
+done
@@ -0,0 +1,62 @@
+/*
+ * Run a command and report its wall time, peak resident set size and exit
+ * status, as a fragment of a JSON object.
+ *
+ *   runstat <stats_file> <command> [args...]
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+static double now(void)/*{{{*/
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + 1.0e-6 * tv.tv_usec;
+}
+/*}}}*/
+int main(int argc, char **argv)/*{{{*/
+{
+  struct rusage usage;
+  double start, elapsed;
+  pid_t pid;
+  int status, code;
+  FILE *out;
+
+  if (argc < 3) {
+    fprintf(stderr, "Usage: runstat <stats_file> <command> [args...]\n");
+    exit(2);
+  }
+  start = now();
+  pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    exit(1);
+  }
+  if (pid == 0) {
+    execvp(argv[2], argv + 2);
+    perror(argv[2]);
+    _exit(127);
+  }
+  if (wait4(pid, &status, 0, &usage) < 0) {
+    perror("wait4");
+    exit(1);
+  }
+  elapsed = now() - start;
+  code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+
+  out = fopen(argv[1], "w");
+  if (!out) {
+    perror(argv[1]);
+    exit(1);
+  }
+  /* ru_maxrss is in kilobytes on Linux. */
+  fprintf(out, "\"wall_s\":%.3f,\"peak_rss_kb\":%ld,\"exit\":%d\n", elapsed, usage.ru_maxrss, code);
+  fclose(out);
+  return code;
+}
+/*}}}*/
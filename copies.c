@@ -0,0 +1,289 @@
+/*
+ * Server-side copies : when several files about to be sent have the same
+ * contents, send one of them and have the server copy it to the others.
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "copies.h"
+#include "ftp.h"
+#include "invent.h"
+#include "journal.h"
+#include "memory.h"
+#include "progress.h"
+#include "schedule.h"
+
+/* Number of CPFR/CPTO pairs to send before waiting for replies. */
+#define BATCH 32
+
+/* Below this size, sending a file costs little more than the round trips
+ * to copy it. */
+#define MIN_COPY_SIZE 4096
+
+/* Targets are local files that are new, or the local peers of stale remote
+ * files, grouped by size and digest.  If a remote file that is staying as it
+ * is already has a group's contents, every member is copied from that;
+ * otherwise the first member (by path) is sent as usual, and the rest are
+ * copied from it once everything else has been sent.  The copies go
+ * through SITE CPFR and SITE CPTO, as in ProFTPD's mod_copy. */
+
+struct source {/*{{{*/
+  struct source *next; /* hash chain */
+  struct fnode *node;  /* whose size and digest are the key */
+  const char *path;    /* where the server has, or will have, the contents */
+};
+/*}}}*/
+struct target {/*{{{*/
+  struct fnode *local;  /* from localinv */
+  struct fnode *remote; /* stale entry in fileinv, or NULL if new */
+};
+/*}}}*/
+struct copy {/*{{{*/
+  struct target t;
+  const char *from;
+};
+/*}}}*/
+struct copy_plan {/*{{{*/
+  struct copy *copies;
+  int n;
+};
+/*}}}*/
+
+#define N_BUCKETS 4096
+
+static unsigned int key_hash(const struct fnode *f)/*{{{*/
+{
+  unsigned int h;
+  memcpy(&h, f->x.file.md5, sizeof(h));
+  return (h ^ (unsigned int) f->x.file.size) % N_BUCKETS;
+}
+/*}}}*/
+static struct source *find_source(struct source **table, const struct fnode *f)/*{{{*/
+{
+  struct source *s;
+  for (s = table[key_hash(f)]; s; s = s->next) {
+    if ((s->node->x.file.size == f->x.file.size) && !memcmp(s->node->x.file.md5, f->x.file.md5, 16)) {
+      return s;
+    }
+  }
+  return NULL;
+}
+/*}}}*/
+static void add_source(struct source **table, struct fnode *f, const char *path)/*{{{*/
+{
+  unsigned int b = key_hash(f);
+  struct source *s = new(struct source);
+  s->node = f;
+  s->path = path;
+  s->next = table[b];
+  table[b] = s;
+}
+/*}}}*/
+static void free_sources(struct source **table)/*{{{*/
+{
+  int i;
+  struct source *s, *ns;
+  for (i=0; i<N_BUCKETS; i++) {
+    for (s = table[i]; s; s = ns) {
+      ns = s->next;
+      free(s);
+    }
+  }
+  free(table);
+}
+/*}}}*/
+
+static int is_candidate(const struct fnode *f)/*{{{*/
+{
+  return f->x.file.has_md5 && (f->x.file.size >= MIN_COPY_SIZE);
+}
+/*}}}*/
+static void add_target(struct target **v, int *n, int *max, struct fnode *local, struct fnode *remote)/*{{{*/
+{
+  if (*n == *max) {
+    *max = *max ? 2 * *max : 64;
+    *v = grow_array(struct target, *max, *v);
+  }
+  (*v)[*n].local = local;
+  (*v)[(*n)++].remote = remote;
+}
+/*}}}*/
+static void find_new_targets(struct fnode *x, struct target **v, int *n, int *max)/*{{{*/
+{
+  /* x is from 'localinv' */
+  struct fnode *e;
+  for (e = x->next; e != x; e = e->next) {
+    if (e->is_dir) {
+      find_new_targets((struct fnode *) &e->x.dir.next, v, n, max);
+    } else if (e->is_unique && is_candidate(e)) {
+      add_target(v, n, max, e, NULL);
+    }
+  }
+}
+/*}}}*/
+static void find_stale_targets(struct fnode *x, struct target **v, int *n, int *max)/*{{{*/
+{
+  /* x is from 'fileinv' */
+  struct fnode *e;
+  for (e = x->next; e != x; e = e->next) {
+    if (e->is_dir) {
+      find_stale_targets((struct fnode *) &e->x.dir.next, v, n, max);
+    } else if (!e->is_unique && e->x.file.is_stale && is_candidate(e->x.file.peer)) {
+      add_target(v, n, max, e->x.file.peer, e);
+    }
+  }
+}
+/*}}}*/
+static int compare_sizes(const void *a, const void *b)/*{{{*/
+{
+  size_t sa = *(const size_t *) a, sb = *(const size_t *) b;
+  return (sa < sb) ? -1 : (sa > sb) ? 1 : 0;
+}
+/*}}}*/
+static void find_unchanged(struct fnode *x, struct source **table, const size_t *sizes, int n_sizes)/*{{{*/
+{
+  /* x is from 'fileinv'.  Only files with a digest in the listing will do,
+   * and only at sizes some target has. */
+  struct fnode *e;
+  for (e = x->next; e != x; e = e->next) {
+    if (e->is_dir) {
+      find_unchanged((struct fnode *) &e->x.dir.next, table, sizes, n_sizes);
+    } else if (!e->is_unique && !e->x.file.is_stale && e->x.file.has_md5 &&
+               bsearch(&e->x.file.size, sizes, n_sizes, sizeof(size_t), compare_sizes) &&
+               !find_source(table, e)) {
+      add_source(table, e, e->path);
+    }
+  }
+}
+/*}}}*/
+static int compare_targets(const void *a, const void *b)/*{{{*/
+{
+  return strcmp(((const struct target *) a)->local->path, ((const struct target *) b)->local->path);
+}
+/*}}}*/
+static void hold_back(struct target *t, int to_what)/*{{{*/
+{
+  /* Take the target out of the files to send (to_what 0), or put it back
+   * (to_what 1). */
+  if (t->remote) {
+    t->remote->x.file.is_stale = t->local->x.file.is_stale = to_what;
+  } else {
+    t->local->is_unique = to_what;
+  }
+}
+/*}}}*/
+struct copy_plan *plan_copies(struct fnode *fileinv, struct fnode *localinv)/*{{{*/
+{
+  struct target *targets = NULL;
+  struct source **table;
+  struct copy_plan *plan;
+  size_t *sizes;
+  int n_targets = 0, max_targets = 0;
+  int i;
+
+  find_new_targets(localinv, &targets, &n_targets, &max_targets);
+  find_stale_targets(fileinv, &targets, &n_targets, &max_targets);
+  if (!n_targets) return NULL;
+
+  sizes = new_array(size_t, n_targets);
+  for (i=0; i<n_targets; i++) sizes[i] = targets[i].local->x.file.size;
+  qsort(sizes, n_targets, sizeof(size_t), compare_sizes);
+  table = new_array(struct source *, N_BUCKETS);
+  memset(table, 0, N_BUCKETS * sizeof(struct source *));
+  find_unchanged(fileinv, table, sizes, n_targets);
+  free(sizes);
+
+  /* By path, so the same file is sent each time for a given tree. */
+  qsort(targets, n_targets, sizeof(struct target), compare_targets);
+  plan = new(struct copy_plan);
+  plan->copies = new_array(struct copy, n_targets);
+  plan->n = 0;
+  for (i=0; i<n_targets; i++) {
+    struct target *t = &targets[i];
+    struct source *s = find_source(table, t->local);
+    if (s) {
+      struct copy *c = &plan->copies[plan->n++];
+      c->t = *t;
+      c->from = s->path;
+      hold_back(t, 0);
+    } else {
+      add_source(table, t->local, t->local->path);
+    }
+  }
+  free(targets);
+  free_sources(table);
+
+  if (!plan->n) {
+    free_copy_plan(plan);
+    return NULL;
+  }
+  return plan;
+}
+/*}}}*/
+void perform_copies(struct FTP *ctrl_con, struct copy_plan *plan, FILE *journal,/*{{{*/
+                    const struct connect_info *ci)
+{
+  const char *from[BATCH], *to[BATCH];
+  int ok[BATCH];
+  struct transfer *resend;
+  int i, j, n, n_copied, n_resend;
+  size_t saved, resend_bytes;
+  char buf[16];
+
+  resend = new_array(struct transfer, plan->n);
+  n_copied = n_resend = 0;
+  saved = resend_bytes = 0;
+  for (i=0; i<plan->n; i += n) {
+    n = plan->n - i;
+    if (n > BATCH) n = BATCH;
+    for (j=0; j<n; j++) {
+      struct copy *c = &plan->copies[i+j];
+      from[j] = c->from;
+      to[j] = c->t.local->path;
+      journal_file_intent(journal, "CPTO", c->t.local, to[j]);
+    }
+    ftp_copy_batch(ctrl_con, n, from, to, ok);
+
+    for (j=0; j<n; j++) {
+      struct copy *c = &plan->copies[i+j];
+      if (ok[j]) {
+        journal_file(journal, c->t.local, to[j]);
+        progress_message("Copied remote file %s to %s\n", from[j], to[j]);
+        n_copied++;
+        saved += c->t.local->x.file.size;
+      } else {
+        /* A failed copy may have left anything at the target, so don't
+         * trust the listing's digest of what was there before. */
+        progress_message("Could not copy remote file %s to %s, sending it instead\n", from[j], to[j]);
+        journal_settled(journal, to[j]);
+        hold_back(&c->t, 1);
+        if (c->t.remote) c->t.remote->x.file.has_md5 = 0;
+        resend[n_resend].node = c->t.remote ? c->t.remote : c->t.local;
+        resend[n_resend++].size = c->t.local->x.file.size;
+        resend_bytes += c->t.local->x.file.size;
+      }
+    }
+    fflush(stdout);
+  }
+
+  if (n_resend) {
+    progress_begin(n_resend, resend_bytes);
+    send_batch(ctrl_con, resend, n_resend, journal, ci);
+    progress_end();
+  }
+  free(resend);
+  if (n_copied) {
+    progress_message("Copied %d file%s on the server instead of sending %s (saved %s)\n",
+                     n_copied, (n_copied == 1) ? "" : "s", (n_copied == 1) ? "it" : "them",
+                     format_bytes(saved, buf));
+  }
+}
+/*}}}*/
+void free_copy_plan(struct copy_plan *plan)/*{{{*/
+{
+  free(plan->copies);
+  free(plan);
+}
+/*}}}*/
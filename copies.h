@@ -0,0 +1,26 @@
+#ifndef COPIES_H
+#define COPIES_H
+
+#include <stdio.h>
+
+struct fnode;
+struct FTP;
+struct connect_info;
+struct copy_plan;
+
+/* Work out which of the files about to be sent have the same contents as
+ * another one, or as a remote file that is staying as it is, so that the
+ * server can copy them instead.  Must be called after reconcile and once
+ * the files to be sent have their digests.  The files to be copied are
+ * taken out of the ones to send.  Return NULL if there is nothing to
+ * copy. */
+extern struct copy_plan *plan_copies(struct fnode *fileinv, struct fnode *localinv);
+
+/* Carry out the copies, journalling each one, once everything else has been
+ * sent.  Any the server won't do are sent after all. */
+extern void perform_copies(struct FTP *ctrl_con, struct copy_plan *, FILE *journal,
+                           const struct connect_info *ci);
+
+extern void free_copy_plan(struct copy_plan *);
+
+#endif /* COPIES_H */
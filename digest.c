@@ -0,0 +1,433 @@
+/*
+ * Content digests of local files.
+ * */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "digest.h"
+#include "invent.h"
+#include "md5.h"
+#include "memory.h"
+
+/* Notes on the hash cache file format.
+
+   One line per file:
+
+   <device> <inode> <size> <mtime> <md5> [<block size> <block digests>]
+
+   all in hex, the block digests run together.  An entry is only used if the file found at (device, inode)
+   still has the same size and mtime.  As with the scan cache, files whose
+   mtime is no earlier than the second in which they were hashed could be
+   rewritten without the mtime moving, so they are not saved.  */
+
+#define MAX_THREADS 8
+
+struct hash_entry {/*{{{*/
+  struct hash_entry *next;
+  dev_t dev;
+  ino_t ino;
+  size_t size;
+  time_t mtime;
+  time_t hashed_at;
+  unsigned char md5[16];
+  size_t block_size;
+  unsigned char *blocks;
+};
+/*}}}*/
+
+#define N_BUCKETS 65536
+static struct hash_entry **table = NULL;
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int bucket(dev_t dev, ino_t ino)/*{{{*/
+{
+  unsigned long long k = ((unsigned long long) dev << 32) ^ (unsigned long long) ino;
+  k ^= k >> 29;
+  k *= 0xbf58476d1ce4e5b9ULL;
+  k ^= k >> 32;
+  return (unsigned int) (k % N_BUCKETS);
+}
+/*}}}*/
+size_t choose_block_size(size_t size)/*{{{*/
+{
+  /* A power of two, so that modest changes in size don't change it. */
+  size_t block_size;
+  if (size < BLOCK_THRESHOLD) return 0;
+  for (block_size = MIN_BLOCK_SIZE; size > block_size * TARGET_BLOCKS; block_size <<= 1) ;
+  return block_size;
+}
+/*}}}*/
+int count_blocks(size_t size, size_t block_size)/*{{{*/
+{
+  return (size + block_size - 1) / block_size;
+}
+/*}}}*/
+static struct hash_entry *find_entry(dev_t dev, ino_t ino)/*{{{*/
+{
+  struct hash_entry *he;
+  if (!table) return NULL;
+  for (he = table[bucket(dev, ino)]; he; he = he->next) {
+    if ((he->dev == dev) && (he->ino == ino)) return he;
+  }
+  return NULL;
+}
+/*}}}*/
+static void store_entry(dev_t dev, ino_t ino, size_t size, time_t mtime, time_t hashed_at, const unsigned char *md5,/*{{{*/
+                        size_t block_size, const unsigned char *blocks)
+{
+  struct hash_entry *he;
+  if (!table) {
+    table = new_array(struct hash_entry *, N_BUCKETS);
+    memset(table, 0, N_BUCKETS * sizeof(struct hash_entry *));
+  }
+  he = find_entry(dev, ino);
+  if (!he) {
+    unsigned int b = bucket(dev, ino);
+    he = new(struct hash_entry);
+    he->dev = dev;
+    he->ino = ino;
+    he->blocks = NULL;
+    he->next = table[b];
+    table[b] = he;
+  }
+  he->size = size;
+  he->mtime = mtime;
+  he->hashed_at = hashed_at;
+  memcpy(he->md5, md5, 16);
+  if (he->blocks) free(he->blocks);
+  he->blocks = NULL;
+  he->block_size = 0;
+  if (blocks) {
+    int len = count_blocks(size, block_size) * BLOCK_DIGEST_LEN;
+    he->blocks = new_array(unsigned char, len);
+    memcpy(he->blocks, blocks, len);
+    he->block_size = block_size;
+  }
+}
+/*}}}*/
+unsigned char *blocks_from_hex(const char *hex, size_t size, size_t block_size)/*{{{*/
+{
+  /* Return NULL if the digests don't match the size. */
+  int n, len, i;
+  unsigned char md5[16];
+  unsigned char *blocks;
+  if (!block_size) return NULL;
+  n = count_blocks(size, block_size);
+  if ((n > MAX_BLOCKS) || (strspn(hex, "0123456789abcdefABCDEF") != 2 * n * BLOCK_DIGEST_LEN)) return NULL;
+  len = n * BLOCK_DIGEST_LEN;
+  blocks = new_array(unsigned char, len);
+  for (i=0; i<n; i++) {
+    /* md5_from_hex wants 32 digits; pad out a copy of each one. */
+    char one[33];
+    memset(one, '0', 32);
+    one[32] = '\0';
+    memcpy(one, hex + 2 * BLOCK_DIGEST_LEN * i, 2 * BLOCK_DIGEST_LEN);
+    md5_from_hex(one, md5);
+    memcpy(blocks + BLOCK_DIGEST_LEN * i, md5, BLOCK_DIGEST_LEN);
+  }
+  return blocks;
+}
+/*}}}*/
+void blocks_to_hex(const unsigned char *blocks, size_t size, size_t block_size, char *out)/*{{{*/
+{
+  /* out needs room for BLOCKS_HEX_LEN + 1 characters. */
+  static const char hex[] = "0123456789abcdef";
+  int i, len;
+  len = count_blocks(size, block_size) * BLOCK_DIGEST_LEN;
+  for (i=0; i<len; i++) {
+    out[2*i]   = hex[blocks[i] >> 4];
+    out[2*i+1] = hex[blocks[i] & 15];
+  }
+  out[2*len] = '\0';
+}
+/*}}}*/
+void load_hashcache(const char *filename)/*{{{*/
+{
+  FILE *in;
+  char line[128 + BLOCKS_HEX_LEN];
+  unsigned long long dev, ino, size, block_size;
+  unsigned long mtime;
+  char hex[40];
+  unsigned char md5[16];
+  unsigned char *blocks;
+  const char *rest;
+  int used;
+
+  in = fopen(filename, "r");
+  if (!in) return;
+  while (fgets(line, sizeof(line), in)) {
+    if ((sscanf(line, "%llx %llx %llx %lx %39s%n", &dev, &ino, &size, &mtime, hex, &used) == 5) &&
+        md5_from_hex(hex, md5)) {
+      blocks = NULL;
+      block_size = 0;
+      rest = line + used;
+      if (sscanf(rest, " %llx %n", &block_size, &used) == 1) {
+        blocks = blocks_from_hex(rest + used, size, block_size);
+      }
+      /* Anything loaded was hashed in an earlier second than its mtime. */
+      store_entry(dev, ino, size, mtime, mtime + 1, md5, block_size, blocks);
+      if (blocks) free(blocks);
+    }
+  }
+  fclose(in);
+}
+/*}}}*/
+static void save_entries(FILE *out, struct fnode *x)/*{{{*/
+{
+  struct fnode *e;
+  struct hash_entry *he;
+  char hex[33];
+  char block_hex[BLOCKS_HEX_LEN + 1];
+  for (e = x->next; e != x; e = e->next) {
+    if (e->is_dir) {
+      save_entries(out, (struct fnode *) &e->x.dir.next);
+    } else {
+      he = find_entry(e->x.file.dev, e->x.file.ino);
+      if (he && (he->size == e->x.file.size) && (he->mtime == e->x.file.mtime) &&
+          (he->mtime < he->hashed_at)) {
+        md5_to_hex(he->md5, hex);
+        fprintf(out, "%llx %llx %llx %lx %s",
+                (unsigned long long) he->dev, (unsigned long long) he->ino,
+                (unsigned long long) he->size, (unsigned long) he->mtime, hex);
+        if (he->blocks) {
+          blocks_to_hex(he->blocks, he->size, he->block_size, block_hex);
+          fprintf(out, " %llx %s", (unsigned long long) he->block_size, block_hex);
+        }
+        fputc('\n', out);
+      }
+    }
+  }
+}
+/*}}}*/
+void save_hashcache(const char *filename, struct fnode *localinv)/*{{{*/
+{
+  /* Only entries for files still in the local tree are kept. */
+  char *nf;
+  FILE *out;
+
+  if (!table) return;
+  nf = new_array(char, strlen(filename) + 5);
+  strcpy(nf, filename);
+  strcat(nf, ".new");
+  out = fopen(nf, "w");
+  if (!out) {
+    free(nf);
+    return;
+  }
+  save_entries(out, localinv);
+  if ((fclose(out) != 0) || (rename(nf, filename) < 0)) {
+    fprintf(stderr, "Could not write hash cache %s\n", filename);
+    unlink(nf);
+  }
+  free(nf);
+}
+/*}}}*/
+void forget_hashcache(void)/*{{{*/
+{
+  struct hash_entry *he, *next;
+  int i;
+  if (!table) return;
+  pthread_mutex_lock(&table_lock);
+  for (i=0; i<N_BUCKETS; i++) {
+    for (he = table[i]; he; he = next) {
+      next = he->next;
+      if (he->blocks) free(he->blocks);
+      free(he);
+    }
+  }
+  free(table);
+  table = NULL;
+  pthread_mutex_unlock(&table_lock);
+}
+/*}}}*/
+int digest_file(const char *path, size_t size, time_t mtime, unsigned char md5[16],/*{{{*/
+                size_t block_size, unsigned char *blocks)
+{
+  /* Both kinds of digest are worked out in the same pass over the file. */
+  int fd;
+  struct stat sb;
+  struct md5_ctx ctx, block_ctx;
+  char buffer[65536];
+  unsigned char block_md5[16];
+  ssize_t n, k;
+  size_t block_left;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0) return 0;
+  if ((fstat(fd, &sb) < 0) || (sb.st_size != size) || (sb.st_mtime != mtime)) {
+    close(fd);
+    return 0;
+  }
+  md5_init(&ctx);
+  md5_init(&block_ctx);
+  block_left = block_size;
+  while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+    md5_update(&ctx, buffer, n);
+    for (k = 0; block_size && (k < n); ) {
+      size_t chunk = n - k;
+      if (chunk > block_left) chunk = block_left;
+      md5_update(&block_ctx, buffer + k, chunk);
+      k += chunk;
+      block_left -= chunk;
+      if (!block_left) {
+        md5_final(&block_ctx, block_md5);
+        memcpy(blocks, block_md5, BLOCK_DIGEST_LEN);
+        blocks += BLOCK_DIGEST_LEN;
+        md5_init(&block_ctx);
+        block_left = block_size;
+      }
+    }
+  }
+  close(fd);
+  if (n < 0) return 0;
+  md5_final(&ctx, md5);
+  if (block_size && (block_left < block_size)) {
+    /* The last, short, block. */
+    md5_final(&block_ctx, block_md5);
+    memcpy(blocks, block_md5, BLOCK_DIGEST_LEN);
+  }
+  return 1;
+}
+/*}}}*/
+int digest_prefix(const char *path, size_t length, unsigned char md5[16])/*{{{*/
+{
+  int fd;
+  struct md5_ctx ctx;
+  char buffer[65536];
+  ssize_t n;
+  size_t want;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0) return 0;
+  md5_init(&ctx);
+  while (length > 0) {
+    want = (length < sizeof(buffer)) ? length : sizeof(buffer);
+    n = read(fd, buffer, want);
+    if (n <= 0) break;
+    md5_update(&ctx, buffer, n);
+    length -= n;
+  }
+  close(fd);
+  if (length > 0) return 0;
+  md5_final(&ctx, md5);
+  return 1;
+}
+/*}}}*/
+
+struct digest_job {/*{{{*/
+  struct fnode **files;
+  int n;
+  int next; /* next file to be claimed by a worker */
+  time_t started;
+};
+/*}}}*/
+static size_t wanted_block_size(const struct fnode *f)/*{{{*/
+{
+  return f->x.file.block_size ? f->x.file.block_size : choose_block_size(f->x.file.size);
+}
+/*}}}*/
+static int is_digested(const struct fnode *f)/*{{{*/
+{
+  size_t block_size = wanted_block_size(f);
+  return f->x.file.has_md5 &&
+    (!block_size || (f->x.file.blocks && (f->x.file.block_size == block_size)));
+}
+/*}}}*/
+static void set_blocks(struct fnode *f, size_t block_size, unsigned char *blocks)/*{{{*/
+{
+  /* f takes ownership of blocks. */
+  if (f->x.file.blocks) free(f->x.file.blocks);
+  f->x.file.blocks = blocks;
+  f->x.file.block_size = block_size;
+}
+/*}}}*/
+static void *digest_worker(void *arg)/*{{{*/
+{
+  struct digest_job *job = arg;
+  int i;
+  while ((i = __sync_fetch_and_add(&job->next, 1)) < job->n) {
+    struct fnode *f = job->files[i];
+    size_t block_size = wanted_block_size(f);
+    unsigned char *blocks = NULL;
+    if (block_size) {
+      blocks = new_array(unsigned char, count_blocks(f->x.file.size, block_size) * BLOCK_DIGEST_LEN);
+    }
+    f->x.file.has_md5 = digest_file(f->path, f->x.file.size, f->x.file.mtime, f->x.file.md5,
+                                    block_size, blocks);
+    if (f->x.file.has_md5 && blocks) {
+      set_blocks(f, block_size, blocks);
+    } else if (blocks) {
+      free(blocks);
+    }
+  }
+  return NULL;
+}
+/*}}}*/
+void digest_files(struct fnode **files, int n)/*{{{*/
+{
+  struct digest_job job;
+  pthread_t threads[MAX_THREADS];
+  int n_threads, i, j;
+
+  /* Take what we can from the cache, and compact the rest to the front. */
+  pthread_mutex_lock(&table_lock);
+  for (i=j=0; i<n; i++) {
+    struct fnode *f = files[i];
+    struct hash_entry *he;
+    size_t block_size;
+    if (is_digested(f)) continue;
+    block_size = wanted_block_size(f);
+    he = find_entry(f->x.file.dev, f->x.file.ino);
+    if (he && (he->size == f->x.file.size) && (he->mtime == f->x.file.mtime) &&
+        (!block_size || (he->blocks && (he->block_size == block_size)))) {
+      memcpy(f->x.file.md5, he->md5, 16);
+      f->x.file.has_md5 = 1;
+      if (block_size) {
+        int len = count_blocks(he->size, block_size) * BLOCK_DIGEST_LEN;
+        unsigned char *blocks = new_array(unsigned char, len);
+        memcpy(blocks, he->blocks, len);
+        set_blocks(f, block_size, blocks);
+      }
+    } else {
+      files[j++] = f;
+    }
+  }
+  pthread_mutex_unlock(&table_lock);
+  if (!j) return;
+
+  job.files = files;
+  job.n = j;
+  job.next = 0;
+  job.started = time(NULL);
+
+  n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n_threads > MAX_THREADS) n_threads = MAX_THREADS;
+  if (n_threads > job.n) n_threads = job.n;
+  if (n_threads <= 1) {
+    digest_worker(&job);
+  } else {
+    for (i=0; i<n_threads; i++) {
+      if (pthread_create(&threads[i], NULL, digest_worker, &job) != 0) break;
+    }
+    /* If no threads could be started at all, do the work here. */
+    if (i == 0) digest_worker(&job);
+    while (i > 0) pthread_join(threads[--i], NULL);
+  }
+
+  pthread_mutex_lock(&table_lock);
+  for (i=0; i<job.n; i++) {
+    struct fnode *f = files[i];
+    if (f->x.file.has_md5) {
+      store_entry(f->x.file.dev, f->x.file.ino, f->x.file.size, f->x.file.mtime, job.started, f->x.file.md5,
+                  f->x.file.block_size, f->x.file.blocks);
+    }
+  }
+  pthread_mutex_unlock(&table_lock);
+}
+/*}}}*/
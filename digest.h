@@ -0,0 +1,52 @@
+#ifndef DIGEST_H
+#define DIGEST_H
+
+#include <sys/types.h>
+#include <time.h>
+
+struct fnode;
+
+/* Large files also get a digest for each block, so that a changed file can
+ * be patched on the server by resending just the blocks that differ.  Each
+ * block digest is the start of the block's MD5; the whole-file digest is
+ * what confirms the result. */
+#define BLOCK_DIGEST_LEN 8
+#define BLOCK_THRESHOLD (16UL << 20) /* files smaller than this have none */
+#define MIN_BLOCK_SIZE  (1UL << 20)
+#define TARGET_BLOCKS   64
+#define MAX_BLOCKS      128
+
+/* The block size to use for a file of the given size, or 0 for none. */
+extern size_t choose_block_size(size_t size);
+extern int count_blocks(size_t size, size_t block_size);
+
+/* Convert block digests to and from hex, run together.  blocks_from_hex
+ * returns a new array, or NULL if the digits don't fit the file size. */
+#define BLOCKS_HEX_LEN (2 * BLOCK_DIGEST_LEN * MAX_BLOCKS)
+extern void blocks_to_hex(const unsigned char *blocks, size_t size, size_t block_size, char *out);
+extern unsigned char *blocks_from_hex(const char *hex, size_t size, size_t block_size);
+
+/* Cache of local file digests, keyed by (device, inode) and only trusted
+ * while the file's size and mtime are unchanged. */
+extern void load_hashcache(const char *filename);
+extern void save_hashcache(const char *filename, struct fnode *localinv);
+/* Drop everything in the cache, to give the memory back. */
+extern void forget_hashcache(void);
+
+/* Compute the digest of a local file, checking it still has the given size
+ * and mtime.  If block_size is non-zero, also fill in the block digests.
+ * Return 1 on success, 0 if the file couldn't be read or has changed. */
+extern int digest_file(const char *path, size_t size, time_t mtime, unsigned char md5[16],
+                       size_t block_size, unsigned char *blocks);
+
+/* Compute the digest of the first 'length' bytes of a local file.  Return 0
+ * if the file is shorter than that or couldn't be read. */
+extern int digest_prefix(const char *path, size_t length, unsigned char md5[16]);
+
+/* Fill in x.file.md5 for each of the n local files, from the cache where
+ * possible and otherwise by reading them on several threads.  Large files
+ * get block digests too, at x.file.block_size if that is already set.  The
+ * array is reordered in the process. */
+extern void digest_files(struct fnode **files, int n);
+
+#endif /* DIGEST_H */
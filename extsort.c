@@ -0,0 +1,293 @@
+/*
+ * Sorting with temporary files, for when there's too much to sort in memory.
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "extsort.h"
+#include "memory.h"
+
+/* Runs on disk are the records in order, each followed by a NUL.  No more
+ * than MAX_FANIN runs are read at once; if there are more than that, groups
+ * of them are merged into longer runs first.  The same is done while records
+ * are still being added if the runs pile up, to keep down the number of open
+ * files.  Runs are always merged in groups of neighbours and ties go to the
+ * earlier run, which keeps the sort stable. */
+
+#define MAX_FANIN 64
+/* Allowance for the pointer to each record and the allocator's overhead. */
+#define RECORD_OVERHEAD (sizeof(char *) + 16)
+
+struct merge {/*{{{*/
+  FILE **files;
+  int n;
+  char **heads;   /* the next record from each file */
+  size_t *caps;
+  int *live;      /* 0 once a file is used up */
+  int last;       /* the file whose head was returned last, or -1 */
+};
+/*}}}*/
+struct sorter {/*{{{*/
+  size_t mem_limit;
+  int (*compare)(const char *, const char *);
+
+  /* Records held in memory */
+  char **recs;
+  int n;
+  int max;
+  size_t used;
+
+  /* Sorted runs written out so far */
+  FILE **runs;
+  int n_runs;
+  int max_runs;
+
+  /* Reading back : either straight from recs, or by merging the runs. */
+  int finished;
+  int next;
+  char *returned; /* last record handed out from memory */
+  struct merge merge;
+};
+/*}}}*/
+
+int compare_paths(const char *a, const char *b)/*{{{*/
+{
+  int ca, cb;
+  while (1) {
+    ca = (*a == '\n') ? 0 : (unsigned char) *a;
+    cb = (*b == '\n') ? 0 : (unsigned char) *b;
+    if ((ca != cb) || !ca) return ca - cb;
+    a++, b++;
+  }
+}
+/*}}}*/
+static void merge_sort(char **a, char **tmp, int n, int (*compare)(const char *, const char *))/*{{{*/
+{
+  /* Stable, unlike qsort. */
+  int h, i, j, k;
+  if (n < 2) return;
+  h = n / 2;
+  merge_sort(a, tmp, h, compare);
+  merge_sort(a + h, tmp, n - h, compare);
+  i = k = 0, j = h;
+  while ((i < h) && (j < n)) {
+    tmp[k++] = ((*compare)(a[j], a[i]) < 0) ? a[j++] : a[i++];
+  }
+  while (i < h) tmp[k++] = a[i++];
+  while (j < n) tmp[k++] = a[j++];
+  memcpy(a, tmp, n * sizeof(char *));
+}
+/*}}}*/
+static void sort_in_memory(struct sorter *s)/*{{{*/
+{
+  char **tmp;
+  if (s->n < 2) return;
+  tmp = new_array(char *, s->n);
+  merge_sort(s->recs, tmp, s->n, s->compare);
+  free(tmp);
+}
+/*}}}*/
+static FILE *new_run(void)/*{{{*/
+{
+  FILE *f = tmpfile();
+  if (!f) {
+    fprintf(stderr, "Could not create a temporary file for sorting\n");
+    exit(1);
+  }
+  return f;
+}
+/*}}}*/
+static void add_run(struct sorter *s, FILE *f)/*{{{*/
+{
+  if (s->n_runs == s->max_runs) {
+    s->max_runs = s->max_runs ? 2 * s->max_runs : 16;
+    s->runs = grow_array(FILE *, s->max_runs, s->runs);
+  }
+  s->runs[s->n_runs++] = f;
+}
+/*}}}*/
+static void write_record(FILE *f, const char *record)/*{{{*/
+{
+  if ((fputs(record, f) == EOF) || (putc('\0', f) == EOF)) {
+    fprintf(stderr, "Could not write to a temporary file for sorting\n");
+    exit(1);
+  }
+}
+/*}}}*/
+static void merge_pass(struct sorter *s);
+static void spill(struct sorter *s)/*{{{*/
+{
+  FILE *f;
+  int i;
+  sort_in_memory(s);
+  f = new_run();
+  for (i=0; i<s->n; i++) {
+    write_record(f, s->recs[i]);
+    free(s->recs[i]);
+  }
+  if (fflush(f) == EOF) {
+    fprintf(stderr, "Could not write to a temporary file for sorting\n");
+    exit(1);
+  }
+  add_run(s, f);
+  s->n = 0;
+  s->used = 0;
+  if (s->n_runs == 2 * MAX_FANIN) merge_pass(s);
+}
+/*}}}*/
+
+static int read_head(struct merge *m, int i)/*{{{*/
+{
+  m->live[i] = (getdelim(&m->heads[i], &m->caps[i], '\0', m->files[i]) > 0);
+  return m->live[i];
+}
+/*}}}*/
+static void start_merge(struct merge *m, FILE **files, int n)/*{{{*/
+{
+  int i;
+  m->files = files;
+  m->n = n;
+  m->heads = new_array(char *, n);
+  m->caps = new_array(size_t, n);
+  m->live = new_array(int, n);
+  m->last = -1;
+  for (i=0; i<n; i++) {
+    rewind(files[i]);
+    m->heads[i] = NULL;
+    m->caps[i] = 0;
+    read_head(m, i);
+  }
+}
+/*}}}*/
+static const char *merge_next(struct merge *m, int (*compare)(const char *, const char *))/*{{{*/
+{
+  int i, best;
+  if (m->last >= 0) read_head(m, m->last);
+  best = -1;
+  for (i=0; i<m->n; i++) {
+    if (m->live[i] && ((best < 0) || ((*compare)(m->heads[i], m->heads[best]) < 0))) {
+      best = i;
+    }
+  }
+  m->last = best;
+  return (best < 0) ? NULL : m->heads[best];
+}
+/*}}}*/
+static void end_merge(struct merge *m)/*{{{*/
+{
+  int i;
+  for (i=0; i<m->n; i++) {
+    fclose(m->files[i]);
+    free(m->heads[i]);
+  }
+  free(m->heads);
+  free(m->caps);
+  free(m->live);
+  m->n = 0;
+}
+/*}}}*/
+static void merge_pass(struct sorter *s)/*{{{*/
+{
+  /* Merge groups of MAX_FANIN runs, cutting the number of runs by that
+   * factor. */
+  struct merge m;
+  const char *record;
+  FILE *f;
+  int i, n, n_new;
+
+  for (i = n_new = 0; i < s->n_runs; i += n) {
+    n = s->n_runs - i;
+    if (n > MAX_FANIN) n = MAX_FANIN;
+    f = new_run();
+    start_merge(&m, s->runs + i, n);
+    while ((record = merge_next(&m, s->compare))) write_record(f, record);
+    end_merge(&m);
+    if (fflush(f) == EOF) {
+      fprintf(stderr, "Could not write to a temporary file for sorting\n");
+      exit(1);
+    }
+    s->runs[n_new++] = f;
+  }
+  s->n_runs = n_new;
+}
+/*}}}*/
+
+struct sorter *new_sorter(size_t mem_limit, int (*compare)(const char *, const char *))/*{{{*/
+{
+  struct sorter *s;
+  s = new(struct sorter);
+  s->mem_limit = mem_limit;
+  s->compare = compare;
+  s->recs = NULL;
+  s->n = s->max = 0;
+  s->used = 0;
+  s->runs = NULL;
+  s->n_runs = s->max_runs = 0;
+  s->finished = 0;
+  s->next = 0;
+  s->returned = NULL;
+  s->merge.n = 0;
+  return s;
+}
+/*}}}*/
+void sorter_add(struct sorter *s, const char *record)/*{{{*/
+{
+  if (s->n == s->max) {
+    s->max = s->max ? 2 * s->max : 1024;
+    s->recs = grow_array(char *, s->max, s->recs);
+  }
+  s->recs[s->n++] = new_string(record);
+  s->used += strlen(record) + 1 + RECORD_OVERHEAD;
+  if (s->used >= s->mem_limit) spill(s);
+}
+/*}}}*/
+void sorter_finish(struct sorter *s)/*{{{*/
+{
+  s->finished = 1;
+  if (!s->n_runs) {
+    /* It all fitted. */
+    sort_in_memory(s);
+    return;
+  }
+  if (s->n) spill(s);
+  free(s->recs);
+  s->recs = NULL;
+  s->max = 0;
+  while (s->n_runs > MAX_FANIN) merge_pass(s);
+  start_merge(&s->merge, s->runs, s->n_runs);
+}
+/*}}}*/
+const char *sorter_next(struct sorter *s)/*{{{*/
+{
+  if (!s->finished) {
+    fprintf(stderr, "Internal error : sorter read before it was finished\n");
+    exit(1);
+  }
+  if (s->n_runs) return merge_next(&s->merge, s->compare);
+
+  /* Let go of each record as soon as the caller is done with it. */
+  if (s->returned) free(s->returned);
+  s->returned = NULL;
+  if (s->next == s->n) return NULL;
+  s->returned = s->recs[s->next];
+  s->recs[s->next++] = NULL;
+  return s->returned;
+}
+/*}}}*/
+void free_sorter(struct sorter *s)/*{{{*/
+{
+  int i;
+  if (s->merge.n) {
+    end_merge(&s->merge);
+  } else {
+    for (i=0; i<s->n_runs; i++) fclose(s->runs[i]);
+  }
+  for (i=s->next; i<s->n; i++) free(s->recs[i]);
+  if (s->recs) free(s->recs);
+  if (s->returned) free(s->returned);
+  if (s->runs) free(s->runs);
+  free(s);
+}
+/*}}}*/
@@ -0,0 +1,29 @@
+#ifndef EXTSORT_H
+#define EXTSORT_H
+
+#include <sys/types.h>
+
+/* Sort more records than fit in memory.  Records are strings, which may
+ * contain newlines but not NULs.  They are held in memory until about
+ * mem_limit bytes are in use, then written out as a sorted run to a
+ * temporary file; the runs are merged as they are read back.  The sort is
+ * stable : records that compare equal come back in the order they were
+ * added. */
+
+struct sorter;
+
+extern struct sorter *new_sorter(size_t mem_limit, int (*compare)(const char *, const char *));
+extern void sorter_add(struct sorter *, const char *record);
+/* No more records will be added. */
+extern void sorter_finish(struct sorter *);
+/* The next record in order, or NULL when there are no more.  The record is
+ * only good until the next call. */
+extern const char *sorter_next(struct sorter *);
+extern void free_sorter(struct sorter *);
+
+/* Compare records that start with a path, ended by a newline or the end of
+ * the record, in the order strcmp would put the paths.  A directory comes
+ * before everything in it. */
+extern int compare_paths(const char *a, const char *b);
+
+#endif /* EXTSORT_H */
@@ -0,0 +1,47 @@
+/*
+ * Giving up after an error, for the whole program or just one job.
+ * */
+
+#include <stdlib.h>
+
+#include "fail.h"
+
+static __thread struct fail_scope *scope = NULL;
+
+void fail_begin_scope(struct fail_scope *s)/*{{{*/
+{
+  s->owner = pthread_self();
+  s->failed = 0;
+  scope = s;
+}
+/*}}}*/
+void fail_set_scope(struct fail_scope *s)/*{{{*/
+{
+  scope = s;
+}
+/*}}}*/
+struct fail_scope *fail_get_scope(void)/*{{{*/
+{
+  return scope;
+}
+/*}}}*/
+void give_up(void)/*{{{*/
+{
+  if (!scope) exit(1);
+  scope->failed = 1;
+  if (pthread_equal(pthread_self(), scope->owner)) {
+    longjmp(scope->jump, 1);
+  }
+  pthread_exit(NULL);
+}
+/*}}}*/
+int fail_pending(void)/*{{{*/
+{
+  return scope && scope->failed;
+}
+/*}}}*/
+void fail_check(void)/*{{{*/
+{
+  if (fail_pending()) give_up();
+}
+/*}}}*/
@@ -0,0 +1,41 @@
+#ifndef FAIL_H
+#define FAIL_H
+
+#include <pthread.h>
+#include <setjmp.h>
+
+/* Giving up after an error.  Normally that ends the program, but a thread
+ * doing one of several independent jobs side by side (such as bringing one
+ * of several mirrors up to date) can set up a scope to catch it, so that
+ * only that job stops.  The thread that set up the scope jumps back to it;
+ * a helper thread working for it just stops, and the owner gives up in turn
+ * at its next fail_check.  So while an owner has helpers running, it must
+ * leave to them any work that could give up, since jumping back would pull
+ * its stack out from under them. */
+
+struct fail_scope {/*{{{*/
+  jmp_buf jump;     /* where the owner goes back to; set with setjmp */
+  pthread_t owner;
+  volatile int failed;
+};
+/*}}}*/
+
+/* Make this thread the owner of a new scope s, before the setjmp. */
+extern void fail_begin_scope(struct fail_scope *s);
+/* Put a helper thread in its owner's scope, as got from fail_get_scope (as
+ * with the progress label), or in none with NULL. */
+extern void fail_set_scope(struct fail_scope *s);
+extern struct fail_scope *fail_get_scope(void);
+
+/* Stop, once the error has been reported. */
+extern void give_up(void) __attribute__ ((noreturn));
+
+/* 1 if some thread in this thread's scope has given up, so helpers can stop
+ * taking on more work. */
+extern int fail_pending(void);
+
+/* For the owner, once its helpers have finished : give up if any of them
+ * did. */
+extern void fail_check(void);
+
+#endif /* FAIL_H */
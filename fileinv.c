@@ -3,19 +3,30 @@
  * */
 
 #include <ctype.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
+#include "digest.h"
 #include "invent.h"
+#include "md5.h"
 #include "memory.h"
 
 /* Notes on listing file format.
  
    1st column indicates file type:
    F - ordinary file
+   M - ordinary file with digest
+   B - block digests for the file just given
    D - directory
    Z - deleted
+   I - intent : a remote operation about to be started
+   X - an intent that changed nothing
+   S - the start of a shard, when the listing is split up (see shards.c)
 
    or the 3 special entries that only occur once:
    H <hostname>
@@ -34,12 +45,43 @@
    <size> in bytes
    <mtime> as an integer.
 
+   M <size> <mtime> <md5> <name>
+
+   is the same as 'F', but also gives the MD5 digest of the contents (32 hex
+   digits).
+
+   B <block size> <digests> <name>
+
+   follows the 'M' line for a large file, and gives the first 8 bytes of the
+   MD5 digest of each <block size> bytes (in hex) of it, all run together.
+
    D <name>
 
    Z <name>
 
+   I <command> <record>
+
+   is written just before the FTP <command> is sent, with the record that
+   will be written for its path once it has worked : 'Z' for DELE, RMD and
+   RNFR, 'D' for MKD, 'F' or 'M' for STOR, RNTO and CPTO.  Any later record for the
+   path settles the intent, including
+
+   X <name>
+
+   which says that the operation left <name> as the listing already had it.
+   An intent that nothing settles was cut short; see resume.c.
+
    */
 
+/* The listing is loaded in chunks of about this many bytes, split at line
+ * boundaries.  Worker threads parse the chunks into records while the
+ * records of earlier chunks are applied to the tree, in the order they
+ * were written, so the last record for a path still wins. */
+#define CHUNK_SIZE (1UL << 20)
+#define MAX_THREADS 8
+/* How far parsing may get ahead of applying, in chunks. */
+#define MAX_AHEAD (4 * MAX_THREADS)
+
 static void lookup_dir(struct fnode *top, const char *full_path, const char *path, struct fnode **dir, const char **tail)/*{{{*/
 {
   const char *slash;
@@ -73,33 +115,160 @@ static void lookup_dir(struct fnode *top, const char *full_path, const char *pat
   }
 }
 /*}}}*/
-static void add_file(struct fnode *a, const char *line)/*{{{*/
+static const char *skip_field(const char *p)/*{{{*/
+{
+  while (*p && !isspace(*p)) p++;
+  while (isspace(*p)) p++;
+  return p;
+}
+/*}}}*/
+const char *record_path(const char *line)/*{{{*/
+{
+  const char *p;
+  int n_fields;
+  if (line[0] == 'I') {
+    /* Skip the command to the record. */
+    p = line+1;
+    while (isspace(*p)) p++;
+    return record_path(skip_field(p));
+  }
+  switch (line[0]) {
+    case 'F': n_fields = 2; break;
+    case 'M': n_fields = 3; break;
+    case 'B': n_fields = 2; break;
+    default:  n_fields = 0; break;
+  }
+  p = line+1;
+  while (isspace(*p)) p++;
+  while (n_fields--) p = skip_field(p);
+  return p;
+}
+/*}}}*/
+static const char *scan_number(const char *p, int base, unsigned long *value)/*{{{*/
+{
+  /* As strtoul for the unsigned decimal and hex fields of the listing, but
+   * without the locale and overflow handling. */
+  unsigned long v = 0;
+  int d;
+  while (1) {
+    if ((*p >= '0') && (*p <= '9')) {
+      d = *p - '0';
+    } else if ((base == 16) && ((*p | 0x20) >= 'a') && ((*p | 0x20) <= 'f')) {
+      d = (*p | 0x20) - 'a' + 10;
+    } else {
+      break;
+    }
+    v = v * base + d;
+    p++;
+  }
+  *value = v;
+  return p;
+}
+/*}}}*/
+const char *parse_file_record(const char *line, struct fnode *f)/*{{{*/
 {
+  const char *p;
+  unsigned long value;
+
+  p = line+1;
+  while (isspace(*p)) p++;
+  p = scan_number(p, 10, &value);
+  f->x.file.size = value;
+  p = skip_field(p);
+  p = scan_number(p, 16, &value);
+  f->x.file.mtime = value;
+  p = skip_field(p);
+  f->x.file.has_md5 = 0;
+  if (line[0] == 'M') {
+    f->x.file.has_md5 = md5_from_hex(p, f->x.file.md5);
+    p = skip_field(p);
+  }
+  return p;
+}
+/*}}}*/
+const char *parse_blocks_record(const char *line, struct fnode *f)/*{{{*/
+{
+  unsigned long block_size;
+  const char *p, *hex;
+
+  p = line+1;
+  while (isspace(*p)) p++;
+  sscanf(p, "%lx", &block_size);
+  p = skip_field(p);
+  hex = p;
+  p = skip_field(p);
+  /* Ignored if it doesn't fit the file's size. */
+  if (f->x.file.blocks) free(f->x.file.blocks);
+  f->x.file.blocks = blocks_from_hex(hex, f->x.file.size, block_size);
+  f->x.file.block_size = f->x.file.blocks ? block_size : 0;
+  return p;
+}
+/*}}}*/
+struct record {/*{{{*/
+  /* One line of the listing, as parsed by a worker. */
+  const char *line;   /* trailing space removed */
+  const char *path;   /* for F, M, D and Z */
+  /* for F and M */
   size_t size;
   time_t mtime;
-  const char *p;
+  int has_md5;
+  unsigned char md5[16];
+};
+/*}}}*/
+struct loader {/*{{{*/
+  struct fnode *top;
+  /* The directory last looked up : the records for a directory mostly come
+   * together. */
+  struct fnode *dir;
+  char *dir_path;
+  int dir_len;
+  int max_dir_len;
+};
+/*}}}*/
+static void find_parent(struct loader *ld, const char *path, struct fnode **dir, const char **tail)/*{{{*/
+{
+  /* As lookup_dir, from the top of the tree being loaded. */
+  const char *slash;
+  int len;
+
+  slash = strrchr(path, '/');
+  len = slash ? slash - path : 0;
+  if (ld->dir && (len == ld->dir_len) && !memcmp(path, ld->dir_path, len)) {
+    *dir = ld->dir;
+    *tail = slash ? slash + 1 : path;
+    return;
+  }
+  lookup_dir(ld->top, path, path, dir, tail);
+  if (len >= ld->max_dir_len) {
+    ld->max_dir_len = 2 * len + 64;
+    ld->dir_path = grow_array(char, ld->max_dir_len, ld->dir_path);
+  }
+  memcpy(ld->dir_path, path, len);
+  ld->dir_len = len;
+  ld->dir = *dir;
+}
+/*}}}*/
+static void add_file(struct loader *ld, const struct record *r)/*{{{*/
+{
+  const char *p = r->path;
   struct fnode *d;
   const char *tail;
   struct fnode *e;
   struct fnode *nfn;
 
-  p = line+1;
-  while (isspace(*p)) p++;
-  size = atol(p);
-  while (!isspace(*p)) p++;
-  while (isspace(*p)) p++;
-  sscanf(p, "%lx", &mtime);
-  while (!isspace(*p)) p++;
-  while (isspace(*p)) p++;
-  /* p now pointing to path */
-  lookup_dir(a, p, p, &d, &tail);
+  find_parent(ld, p, &d, &tail);
 
   /* lookup */
   for (e = d->next; e != d; e = e->next) {
     if (!strcmp(e->name, tail)) {
       /* Update parameters */
-      e->x.file.size = size;
-      e->x.file.mtime = mtime;
+      e->x.file.size = r->size;
+      e->x.file.mtime = r->mtime;
+      e->x.file.has_md5 = r->has_md5;
+      if (r->has_md5) memcpy(e->x.file.md5, r->md5, 16);
+      if (e->x.file.blocks) free(e->x.file.blocks);
+      e->x.file.blocks = NULL;
+      e->x.file.block_size = 0;
       return;
     }
   }
@@ -109,24 +278,45 @@ static void add_file(struct fnode *a, const char *line)/*{{{*/
   nfn->name = new_string(tail);
   nfn->path = new_string(p);
   nfn->is_dir = 0;
-  nfn->x.file.size = size;
-  nfn->x.file.mtime = mtime;
+  nfn->x.file.size = r->size;
+  nfn->x.file.mtime = r->mtime;
+  nfn->x.file.has_md5 = r->has_md5;
+  if (r->has_md5) memcpy(nfn->x.file.md5, r->md5, 16);
+  nfn->x.file.block_size = 0;
+  nfn->x.file.blocks = NULL;
   nfn->x.file.peer = NULL;
+  nfn->x.file.is_retouched = 0;
   add_fnode_at_end(d, nfn);
 }
 /*}}}*/
-static void add_directory(struct fnode *a, const char *line)/*{{{*/
+static void add_blocks(struct loader *ld, const char *line)/*{{{*/
 {
   const char *p;
   struct fnode *d;
   const char *tail;
   struct fnode *e;
+
+  p = record_path(line);
+  find_parent(ld, p, &d, &tail);
+
+  for (e = d->next; e != d; e = e->next) {
+    if (!strcmp(e->name, tail) && !e->is_dir) {
+      parse_blocks_record(line, e);
+      return;
+    }
+  }
+  fprintf(stderr, "In add_blocks for %s, it doesn't exist in the database\n", p);
+  exit(1);
+}
+/*}}}*/
+static void add_directory(struct loader *ld, const char *p)/*{{{*/
+{
+  struct fnode *d;
+  const char *tail;
+  struct fnode *e;
   struct fnode *nfn;
 
-  p = line+1;
-  while (isspace(*p)) p++;
-  /* p now pointing to path */
-  lookup_dir(a, p, p, &d, &tail);
+  find_parent(ld, p, &d, &tail);
 
   /* lookup */
   for (e = d->next; e != d; e = e->next) {
@@ -146,17 +336,13 @@ static void add_directory(struct fnode *a, const char *line)/*{{{*/
   add_fnode_at_start(d, nfn);
 }
 /*}}}*/
-static void delete_entry(struct fnode *a, const char *line)/*{{{*/
+static void delete_entry(struct loader *ld, const char *p)/*{{{*/
 {
-  const char *p;
   struct fnode *d;
   const char *tail;
   struct fnode *e;
 
-  p = line+1;
-  while (isspace(*p)) p++;
-  /* p now pointing to path */
-  lookup_dir(a, p, p, &d, &tail);
+  find_parent(ld, p, &d, &tail);
 
   /* lookup */
   for (e = d->next; e != d; e = e->next) {
@@ -174,6 +360,7 @@ do_delete:
       fprintf(stderr, "In delete_entry for %s, it's a non-empty directory\n", p);
       exit(1);
     } else {
+      if (ld->dir == (struct fnode *) &e->x.dir.next) ld->dir = NULL;
       free(e->name);
       free(e->path);
       e->next->prev = e->prev;
@@ -182,6 +369,7 @@ do_delete:
     }
   } else {
     /* file */
+    if (e->x.file.blocks) free(e->x.file.blocks);
     free(e->name);
     free(e->path);
     e->next->prev = e->prev;
@@ -196,61 +384,379 @@ static char *copy_data(const char *in)/*{{{*/
   return new_string(in + 2);
 }
 /*}}}*/
-struct fnode *make_fileinv(const char *listing, struct remote_params *rp)/*{{{*/
+struct chunk {/*{{{*/
+  char *start;        /* whole lines, the last ending at 'end' */
+  char *end;
+  struct record *records;
+  int n;
+  char *last_line;    /* a copy of a last line with no newline after it */
+  int is_parsed;
+};
+/*}}}*/
+struct load_job {/*{{{*/
+  struct chunk *chunks;
+  int n_chunks;
+  int next;           /* the next chunk to parse */
+  int applied;        /* the chunks applied to the tree so far */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+/*}}}*/
+static char *read_whole(FILE *in, size_t *len, int *is_mapped)/*{{{*/
+{
+  /* Map a plain listing straight in, privately so that the parse can
+   * terminate lines in place.  A split one comes through a stream, so is
+   * read into memory. */
+  struct stat sb;
+  char *data;
+  size_t max, n;
+
+  if ((fileno(in) >= 0) && (fstat(fileno(in), &sb) == 0) && S_ISREG(sb.st_mode) && (sb.st_size > 0)) {
+    data = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(in), 0);
+    if (data != MAP_FAILED) {
+      madvise(data, sb.st_size, MADV_SEQUENTIAL);
+      *len = sb.st_size;
+      *is_mapped = 1;
+      return data;
+    }
+  }
+  *is_mapped = 0;
+  *len = 0;
+  max = CHUNK_SIZE;
+  data = new_array(char, max);
+  while ((n = fread(data + *len, 1, max - *len, in)) > 0) {
+    *len += n;
+    if (*len == max) {
+      max *= 2;
+      data = grow_array(char, max, data);
+    }
+  }
+  return data;
+}
+/*}}}*/
+static void split_chunks(struct load_job *job, char *data, size_t len)/*{{{*/
+{
+  char *p, *end, *nl;
+  int max;
+
+  job->n_chunks = 0;
+  max = len / CHUNK_SIZE + 1;
+  job->chunks = new_array(struct chunk, max);
+  end = data + len;
+  for (p = data; p < end; p = nl) {
+    struct chunk *c = &job->chunks[job->n_chunks++];
+    nl = ((end - p) > CHUNK_SIZE) ? memchr(p + CHUNK_SIZE - 1, '\n', end - p - CHUNK_SIZE + 1) : NULL;
+    nl = nl ? nl + 1 : end;
+    c->start = p;
+    c->end = nl;
+    c->records = NULL;
+    c->n = 0;
+    c->last_line = NULL;
+    c->is_parsed = 0;
+  }
+}
+/*}}}*/
+static void parse_chunk(struct chunk *c)/*{{{*/
+{
+  char *p, *nl, *q;
+  struct fnode f;
+  int max;
+
+  max = (c->end - c->start) / 48 + 16;
+  c->records = new_array(struct record, max);
+  for (p = c->start; p < c->end; p = nl + 1) {
+    struct record *r;
+    nl = memchr(p, '\n', c->end - p);
+    if (nl) {
+      *nl = '\0';
+    } else {
+      /* The last line of the listing wasn't finished, and there's no room
+       * in the map to terminate it. */
+      c->last_line = new_array(char, c->end - p + 1);
+      memcpy(c->last_line, p, c->end - p);
+      c->last_line[c->end - p] = '\0';
+      nl = c->end - 1;
+      p = c->last_line;
+    }
+    for (q = p + strlen(p); (q > p) && isspace(q[-1]); ) *--q = '\0';
+
+    if (c->n == max) {
+      max *= 2;
+      c->records = grow_array(struct record, max, c->records);
+    }
+    r = &c->records[c->n++];
+    r->line = p;
+    switch (p[0]) {
+      case 'F':
+      case 'M':
+        r->path = parse_file_record(p, &f);
+        r->size = f.x.file.size;
+        r->mtime = f.x.file.mtime;
+        r->has_md5 = f.x.file.has_md5;
+        memcpy(r->md5, f.x.file.md5, 16);
+        break;
+      case 'D':
+      case 'Z':
+        for (q = p + 1; isspace(*q); q++) ;
+        r->path = q;
+        break;
+      default:
+        r->path = NULL;
+        break;
+    }
+  }
+}
+/*}}}*/
+static void *load_worker(void *arg)/*{{{*/
+{
+  struct load_job *job = arg;
+  int i;
+
+  pthread_mutex_lock(&job->lock);
+  while (job->next < job->n_chunks) {
+    if (job->next >= job->applied + MAX_AHEAD) {
+      pthread_cond_wait(&job->cond, &job->lock);
+      continue;
+    }
+    i = job->next++;
+    pthread_mutex_unlock(&job->lock);
+    parse_chunk(&job->chunks[i]);
+    pthread_mutex_lock(&job->lock);
+    job->chunks[i].is_parsed = 1;
+    pthread_cond_broadcast(&job->cond);
+  }
+  pthread_mutex_unlock(&job->lock);
+  return NULL;
+}
+/*}}}*/
+struct fnode *make_fileinv_within(const char *listing, struct remote_params *rp, const char *only)/*{{{*/
 {
   /* listing is the path to the file containing the cache of what's on the
    * remote site. */
 
   FILE *in;
-  char line[4096];
-  int number;
+  char *data;
+  size_t len;
+  int is_mapped, number, skipping, n_threads, i, j;
+  struct load_job job;
+  struct loader ld;
+  pthread_t threads[MAX_THREADS];
   struct fnode *result;
 
-  in = fopen(listing, "r");
+  in = open_listing(listing, only);
   if (!in) {
     fprintf(stderr, "Couldn't open listing file %s\n", listing);
     exit(1);
   }
+  data = read_whole(in, &len, &is_mapped);
+  split_chunks(&job, data, len);
+  job.next = job.applied = 0;
+  pthread_mutex_init(&job.lock, NULL);
+  pthread_cond_init(&job.cond, NULL);
+
+  n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n_threads > MAX_THREADS) n_threads = MAX_THREADS;
+  if (n_threads > job.n_chunks) n_threads = job.n_chunks;
+  i = 0;
+  if (n_threads > 1) {
+    for (i=0; i<n_threads; i++) {
+      if (pthread_create(&threads[i], NULL, load_worker, &job) != 0) break;
+    }
+  }
+  n_threads = i;
 
   number = 1;
+  skipping = 0;
   result = new(struct fnode);
   result->next = result->prev = result;
+  ld.top = result;
+  ld.dir = NULL;
+  ld.dir_path = NULL;
+  ld.dir_len = ld.max_dir_len = 0;
+
+  for (i=0; i<job.n_chunks; i++) {
+    struct chunk *c = &job.chunks[i];
+    if (n_threads) {
+      pthread_mutex_lock(&job.lock);
+      while (!c->is_parsed) pthread_cond_wait(&job.cond, &job.lock);
+      pthread_mutex_unlock(&job.lock);
+    } else {
+      parse_chunk(c);
+    }
+
+    for (j=0; j<c->n; j++) {
+      struct record *r = &c->records[j];
+      const char *line = r->line;
+      if (skipping && (line[0] != 'S')) continue;
+      switch (line[0]) {
+        case 'H':
+          rp->hostname = copy_data(line);
+          break;
+        case 'U':
+          rp->username = copy_data(line);
+          break;
+        case 'P':
+          rp->port_number = atoi(line+2);
+          break;
+        case 'R':
+          rp->remote_root = copy_data(line);
+          break;
+        case 'F':
+        case 'M':
+          add_file(&ld, r);
+          break;
+        case 'B':
+          add_blocks(&ld, line);
+          break;
+        case 'D':
+          add_directory(&ld, r->path);
+          break;
+        case 'Z':
+          delete_entry(&ld, r->path);
+          break;
+        case 'I':
+        case 'X':
+          /* See pending_intents */
+          break;
+        case 'S':
+          /* The start of a shard.  Once its directory has been removed (or
+           * replaced by a file), what's left in it is only the records of
+           * removing its contents. */
+          skipping = !lookup_dir_list(result, line + 2);
+          break;
+        default:
+          fprintf(stderr, "Line %d in listing file %s corrupted\n", number, listing);
+          break;
+      }
+      number++;
+    }
+
+    free(c->records);
+    if (c->last_line) free(c->last_line);
+    pthread_mutex_lock(&job.lock);
+    job.applied++;
+    pthread_cond_broadcast(&job.cond);
+    pthread_mutex_unlock(&job.lock);
+  }
+        
+  while (n_threads > 0) pthread_join(threads[--n_threads], NULL);
+  pthread_mutex_destroy(&job.lock);
+  pthread_cond_destroy(&job.cond);
+  free(job.chunks);
+  if (ld.dir_path) free(ld.dir_path);
+  if (is_mapped) {
+    munmap(data, len);
+  } else {
+    free(data);
+  }
+  fclose(in);
+  return result;
+}
+/*}}}*/
+struct fnode *make_fileinv(const char *listing, struct remote_params *rp)/*{{{*/
+{
+  return make_fileinv_within(listing, rp, NULL);
+}
+/*}}}*/
+struct pending {/*{{{*/
+  struct intent intent;
+  int settled; /* 1 once a later record for the path has been seen */
+  int next;    /* next unsettled intent in the same bucket, or -1 */
+};
+/*}}}*/
+
+#define N_PENDING_BUCKETS 4096
 
-  while (fgets(line, sizeof(line), in)) {
-    char *p;
-    for (p=line; *p; p++) ;
-    while (isspace(*--p)) {
-      *p = '\0';
+static unsigned int path_bucket(const char *path)/*{{{*/
+{
+  unsigned int h = 5381;
+  while (*path) h = h * 33 + (unsigned char) *path++;
+  return h % N_PENDING_BUCKETS;
+}
+/*}}}*/
+static void settle(struct pending *p, int *table, const char *path)/*{{{*/
+{
+  /* Settled intents leave their chain, so the chains only ever hold the
+   * intents still in doubt, and each record costs one short walk. */
+  int *link = &table[path_bucket(path)];
+  while (*link >= 0) {
+    struct pending *q = &p[*link];
+    if (!strcmp(q->intent.path, path)) {
+      q->settled = 1;
+      *link = q->next;
+    } else {
+      link = &q->next;
+    }
+  }
+}
+/*}}}*/
+struct intent *pending_intents(const char *listing, struct remote_params *rp, int *n_pending)/*{{{*/
+{
+  FILE *in;
+  char *line = NULL;
+  size_t linesize = 0;
+  struct pending *p = NULL;
+  struct intent *result;
+  int table[N_PENDING_BUCKETS];
+  int n, max, i;
+  unsigned int b;
+  const char *record;
+
+  in = open_listing_intents(listing);
+  if (!in) {
+    fprintf(stderr, "Couldn't open listing file %s\n", listing);
+    exit(1);
+  }
+  n = max = 0;
+  for (i=0; i<N_PENDING_BUCKETS; i++) table[i] = -1;
+  while (getline(&line, &linesize, in) > 0) {
+    char *q;
+    for (q=line; *q; q++) ;
+    while ((q > line) && isspace(*--q)) {
+      *q = '\0';
     }
     switch (line[0]) {
-      case 'H':
-        rp->hostname = copy_data(line);
-        break;
-      case 'U':
-        rp->username = copy_data(line);
-        break;
-      case 'P':
-        rp->port_number = atoi(line+2);
-      case 'R':
-        rp->remote_root = copy_data(line);
+      case 'H': rp->hostname = copy_data(line); break;
+      case 'U': rp->username = copy_data(line); break;
+      case 'P': rp->port_number = atoi(line+2); break;
+      case 'R': rp->remote_root = copy_data(line); break;
+      case 'I':
+        if (n == max) {
+          max = max ? 2 * max : 64;
+          p = grow_array(struct pending, max, p);
+        }
+        sscanf(line + 2, "%7s", p[n].intent.command);
+        record = skip_field(line + 2);
+        p[n].intent.record = new_string(record);
+        p[n].intent.path = p[n].intent.record + (record_path(record) - record);
+        p[n].settled = 0;
+        b = path_bucket(p[n].intent.path);
+        p[n].next = table[b];
+        table[b] = n;
+        n++;
         break;
       case 'F':
-        add_file(result, line);
-        break;
+      case 'M':
       case 'D':
-        add_directory(result, line);
-        break;
       case 'Z':
-        delete_entry(result, line);
-        break;
-      default:
-        fprintf(stderr, "Line %d in listing file %s corrupted\n", number, listing);
+      case 'X':
+        if (n) settle(p, table, record_path(line));
         break;
     }
-    number++;
   }
-        
+  if (line) free(line);
   fclose(in);
+
+  result = new_array(struct intent, n ? n : 1);
+  *n_pending = 0;
+  for (i=0; i<n; i++) {
+    if (p[i].settled) {
+      free(p[i].intent.record);
+    } else {
+      result[(*n_pending)++] = p[i].intent;
+    }
+  }
+  if (p) free(p);
   return result;
 }
 /*}}}*/
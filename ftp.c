@@ -3,6 +3,7 @@
 
 #include <stdio.h>
 #include <ctype.h>
+#include <strings.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -10,6 +11,7 @@
 #include <netdb.h>
 #include <netinet/in.h>
 
+#include "fail.h"
 #include "ftp.h"
 #include "memory.h"
 
@@ -20,6 +22,13 @@ struct FTP {/*{{{*/
   int fd;        /* fd of the control socket */
   int active;    /* 1 if use active on the data connection, 0 for passive */
   int listen_fd; /* listening fd for active mode */
+  int rest_overwrites; /* 1 if REST+STOR is known to patch in place, -1 if
+                          known not to, 0 if not found out yet */
+  int can_copy;  /* likewise for SITE CPFR and CPTO */
+  char *root;    /* absolute path of the directory remote paths are relative
+                    to, or NULL to send paths as they are (see in_dir) */
+  char *dir;     /* the working directory, relative to root */
+  char *full;    /* scratch space for from_root */
   
   char readbuf[4096];
   char *bufptr;
@@ -67,8 +76,9 @@ static char *read_line(struct FTP *con)/*{{{*/
     } else {
       n = read(con->fd, con->bufptr, con->readbuf + sizeof(con->readbuf) - con->bufptr);
       if (n < 0) {
+        /* Treat a reset connection like a closed one; callers decide. */
         perror("read");
-        exit(1);
+        return NULL;
       }
       if (n == 0) {
         return NULL;
@@ -81,6 +91,7 @@ static char *read_line(struct FTP *con)/*{{{*/
 static int get_status(const char *x)/*{{{*/
 {
   int val;
+  if (!x) return 0;
   if (isdigit(x[0]) && isdigit(x[1]) && isdigit(x[2]) && (x[3] == ' ')) {
     val = 100*(x[0] - '0') + 10*(x[1] - '0') + (x[2] - '0');
   } else {
@@ -95,12 +106,35 @@ static int read_status(struct FTP *con)/*{{{*/
   int status;
   do {
     line = read_line(con);
+    if (!line) {
+      /* Server has closed the control connection. */
+      return 421;
+    }
     status = get_status(line);
     free(line);
   } while (status == 0);
   return status;
 }
 /*}}}*/
+static int read_reply(struct FTP *con, char **text)/*{{{*/
+{
+  /* As read_status, but also return the final line of the reply (to be
+   * freed by the caller), or NULL if the connection was lost. */
+  char *line;
+  int status;
+  do {
+    line = read_line(con);
+    if (!line) {
+      *text = NULL;
+      return 421;
+    }
+    status = get_status(line);
+    if (status == 0) free(line);
+  } while (status == 0);
+  *text = line;
+  return status;
+}
+/*}}}*/
 static void put_cmd(struct FTP *con, const char *cmd, const char *arg)/*{{{*/
 {
   char *xcmd;
@@ -131,6 +165,9 @@ struct FTP *ftp_open(const char *hostname, const int port_number, const char *us
 
   result = new(struct FTP);
   result->bufptr = result->readbuf;
+  result->rest_overwrites = 0;
+  result->can_copy = 0;
+  result->root = result->dir = result->full = NULL;
   
   host = gethostbyname(hostname);
   if (!host) return NULL;
@@ -174,7 +211,7 @@ struct FTP *ftp_open(const char *hostname, const int port_number, const char *us
   }
   if (status >= 500) {
     fprintf(stderr, "Password authentication failed\n");
-    exit(1);
+    give_up();
   }
 
   result->active = active_ftp;
@@ -185,6 +222,9 @@ struct FTP *ftp_open(const char *hostname, const int port_number, const char *us
 int ftp_close(struct FTP *con)/*{{{*/
 {
   close(con->fd);
+  if (con->root) free(con->root);
+  if (con->dir) free(con->dir);
+  if (con->full) free(con->full);
   free(con);
   return 0;
 }
@@ -210,7 +250,7 @@ int open_passive_data_con(struct FTP *ctrl_con)/*{{{*/
   }
   if (status != 227) {
     fprintf(stderr, "Could not configure passive\n");
-    exit(1);
+    give_up();
   }
 
   /* parse host and port */
@@ -233,17 +273,17 @@ int open_passive_data_con(struct FTP *ctrl_con)/*{{{*/
     data_fd = socket(PF_INET, SOCK_STREAM, 0);
     if (data_fd < 0) {
       perror("socket(data_fd)");
-      exit(1);
+      give_up();
     }
     if (connect(data_fd, (struct sockaddr *) &data_addr, addrlen) < 0) {
       perror("connect(data_fd)");
-      exit(1);
+      give_up();
     }
     return data_fd;
 
   } else {
     fprintf(stderr, "Could not read host and port\n");
-    exit(1);
+    give_up();
   }
 }
 /*}}}*/
@@ -262,7 +302,7 @@ static void setup_active_data_con(struct FTP *ctrl_con)/*{{{*/
   status = getsockname(ctrl_con->fd, (struct sockaddr *) &ctrl_sock_addr, &ctrl_sock_addr_len);
   if (status < 0) {
     perror("getsocknamd(ctrl_con)");
-    exit(1);
+    give_up();
   }
   ip_addr = ntohl(ctrl_sock_addr.sin_addr.s_addr);
   port = ntohs(ctrl_sock_addr.sin_port);
@@ -275,24 +315,24 @@ static void setup_active_data_con(struct FTP *ctrl_con)/*{{{*/
   listen_fd = socket(PF_INET, SOCK_STREAM, 0);
   if (listen_fd < 0) {
     perror("socket(listen_fd)");
-    exit(1);
+    give_up();
   }
 
   if (bind(listen_fd, (struct sockaddr *) &data_sock_addr, data_sock_addr_len) < 0) {
     perror("bind(listen_fd)");
-    exit(1);
+    give_up();
   }
 
   if (listen(listen_fd, 1) < 0) {
     perror("listen(listen_fd)");
-    exit(1);
+    give_up();
   }
 
   /* Get actual port number */
   status = getsockname(listen_fd, (struct sockaddr *) &data_sock_addr, &data_sock_addr_len);
   if (status < 0) {
     perror("getsockname(listen_fd)");
-    exit(1);
+    give_up();
   }
 
   ip_addr = htonl(data_sock_addr.sin_addr.s_addr);
@@ -311,7 +351,7 @@ static void setup_active_data_con(struct FTP *ctrl_con)/*{{{*/
   }
   if (status >= 400) {
     fprintf(stderr, "Failed to set port number\n");
-    exit(1);
+    give_up();
   }
 
   ctrl_con->listen_fd = listen_fd;
@@ -347,12 +387,110 @@ int ftp_cwd(struct FTP *con, const char *new_root_dir)/*{{{*/
   return 0;
 }
 /*}}}*/
+int ftp_relative_paths(struct FTP *con)/*{{{*/
+{
+  /* Find out where the session is with PWD, so that in_dir knows the way
+   * back.  The name comes in double quotes, with any quote in it doubled. */
+  char *text, *p, *q, *name;
+  int status;
+
+  put_cmd(con, "PWD", NULL);
+  status = read_reply(con, &text);
+  if (verbose) {
+    printf("Got %d from PWD command\n", status);
+  }
+  if ((status != 257) || !(p = strchr(text + 4, '"')) || (p[1] != '/')) {
+    if (text) free(text);
+    return 0;
+  }
+  name = q = ++p;
+  for (; *p; p++) {
+    if (*p == '"') {
+      if (p[1] != '"') break;
+      p++;
+    }
+    *q++ = *p;
+  }
+  if (!*p) {
+    free(text);
+    return 0;
+  }
+  /* So that joining on a path never gives "//". */
+  if ((q > name + 1) && (q[-1] == '/')) q--;
+  *q = '\0';
+  con->root = new_string((q == name + 1) ? "" : name);
+  con->dir = new_string("");
+  free(text);
+  return 1;
+}
+/*}}}*/
+static char *root_path(struct FTP *con, const char *path, int len)/*{{{*/
+{
+  /* The first len characters of path, anchored at the root, in con->full. */
+  if (con->full) free(con->full);
+  con->full = new_array(char, strlen(con->root) + len + 3);
+  sprintf(con->full, "%s/%.*s", con->root, len, path);
+  return con->full;
+}
+/*}}}*/
+static const char *in_dir(struct FTP *con, const char *path)/*{{{*/
+{
+  /* Change to the directory path is in, unless the session is there
+   * already, and return the name to use for it from there.  Operations on
+   * the entries of one directory are grouped together, so this costs one
+   * CWD per group rather than sending the full path every time.  If the CWD
+   * fails, go back to the root and use the full path, so the command fails
+   * (or not) just as it would have. */
+  const char *slash;
+  int len, status;
+
+  if (!con->root) return path;
+  slash = strrchr(path, '/');
+  len = slash ? slash - path : 0;
+  if ((strlen(con->dir) == len) && !strncmp(con->dir, path, len)) {
+    return slash ? slash + 1 : path;
+  }
+  put_cmd(con, "CWD", len ? root_path(con, path, len) : (*con->root ? con->root : "/"));
+  status = read_status(con);
+  if (verbose) {
+    printf("Got %d from CWD to %.*s\n", status, len, path);
+  }
+  free(con->dir);
+  if ((status >= 200) && (status < 300)) {
+    con->dir = new_array(char, len + 1);
+    memcpy(con->dir, path, len);
+    con->dir[len] = '\0';
+    return slash ? slash + 1 : path;
+  }
+  con->dir = new_string("");
+  if (len) {
+    put_cmd(con, "CWD", *con->root ? con->root : "/");
+    status = read_status(con);
+    if ((status < 200) || (status >= 300)) {
+      /* Lost : just send paths as they are from now on. */
+      free(con->root);
+      con->root = NULL;
+    }
+  }
+  return path;
+}
+/*}}}*/
+static const char *from_root(struct FTP *con, const char *path)/*{{{*/
+{
+  /* The name to use for path without changing directory : as it is at the
+   * root, otherwise anchored there.  The result is good until the next
+   * call. */
+  if (!con->root || !*con->dir) return path;
+  if (!strcmp(path, ".")) return *con->root ? con->root : "/";
+  return root_path(con, path, strlen(path));
+}
+/*}}}*/
 
 struct file_list {/*{{{*/
   struct file_list *next;
   struct file_list *prev;
   char *name;
-  int size;
+  size_t size;
   int perms;
   int is_dir;
 };
@@ -399,7 +537,7 @@ static void parse_perms(const char *field, int *perms, int *is_dir)/*{{{*/
             ((field[9] == 'x') ? (1<<0) : 0);
 }
 /*}}}*/
-static void append_file(struct file_list *fl, const char *name, int size, int perms, int is_dir)/*{{{*/
+static void append_file(struct file_list *fl, const char *name, size_t size, int perms, int is_dir)/*{{{*/
 {
   struct file_list *new_fl;
 
@@ -420,11 +558,10 @@ static void append_file(struct file_list *fl, const char *name, int size, int pe
 int ftp_names(struct FTP *ctrl_con, const char *dir_path,/*{{{*/
               char ***names, int *n_names)
 {
-  /* hack. */
-  char *tnames[1024];
-  int N;
+  /* Return 1 and the names in the directory, as given by NLST; 0 if it
+   * can't be listed (e.g. it isn't there). */
+  int N, max;
   int data_fd = -1;
-  int i;
   int status;
   FILE *in;
   char line[4096];
@@ -435,50 +572,43 @@ int ftp_names(struct FTP *ctrl_con, const char *dir_path,/*{{{*/
     data_fd = open_passive_data_con(ctrl_con);
   }
 
-  put_cmd(ctrl_con, "NLST", dir_path);
+  put_cmd(ctrl_con, "NLST", from_root(ctrl_con, dir_path));
   status = read_status(ctrl_con);
   if (verbose) {
     printf("Got status %d after NLST %s\n", status, dir_path);
   }
 
-  N = 0;
-
-  if (status == 150) {
-    if (ctrl_con->active) {
-      data_fd = open_active_data_con(ctrl_con);
-    }
+  N = max = 0;
+  *names = NULL;
+  if (status != 150) {
+    if (data_fd >= 0) close(data_fd);
+    *n_names = 0;
+    return 0;
+  }
 
-    in = fdopen(data_fd, "rb");
-    while (fgets(line, sizeof(line), in)) {
-      int len;
-      len = strlen(line);
-      line[len-1] = '\0';
-      if (N >= 1024) {
-        fprintf(stderr, "Array bounds exceeded in ftp_names, dir=%s\n", dir_path);
-        exit(1);
-      }
-      tnames[N++] = new_string(line);
-    }
+  if (ctrl_con->active) {
+    data_fd = open_active_data_con(ctrl_con);
+  }
 
-    fclose(in);
-    /* might need more actions to close an active connection? */
-    status = read_status(ctrl_con);
-    if (verbose) {
-      printf("Got status %d after NLST %s data transfer\n", status, dir_path);
+  in = fdopen(data_fd, "rb");
+  while (fgets(line, sizeof(line), in)) {
+    strip_termination(line);
+    if (N == max) {
+      max = max ? 2 * max : 64;
+      *names = grow_array(char *, max, *names);
     }
+    (*names)[N++] = new_string(line);
   }
 
-  if (N > 0) {
-    *names = new_array(char *, N);
-    for (i = 0; i < N; i++) {
-      (*names)[i] = tnames[i];
-    }
-  } else {
-    *names = NULL;
+  fclose(in);
+  /* might need more actions to close an active connection? */
+  status = read_status(ctrl_con);
+  if (verbose) {
+    printf("Got status %d after NLST %s data transfer\n", status, dir_path);
   }
   *n_names = N;
 
-  return 0;
+  return (status >= 200) && (status < 300);
 }
 /*}}}*/
 
@@ -503,11 +633,11 @@ int ftp_lsdir(struct FTP *ctrl_con, const char *dir_path,/*{{{*/
     data_fd = open_passive_data_con(ctrl_con);
   }
 
-  if (!strcmp(dir_path, ".")) {
+  if (!strcmp(from_root(ctrl_con, dir_path), ".")) {
     /* Otherwise SuperH's FTP server, for one, gets confused */
     put_cmd(ctrl_con, "LIST -a", NULL);
   } else {
-    put_cmd(ctrl_con, "LIST -a", dir_path);
+    put_cmd(ctrl_con, "LIST -a", from_root(ctrl_con, dir_path));
   }
 
   status = read_status(ctrl_con);
@@ -522,7 +652,7 @@ int ftp_lsdir(struct FTP *ctrl_con, const char *dir_path,/*{{{*/
   N = 0;
   in = fdopen(data_fd, "rb");
   while (fgets(line, sizeof(line), in)) {
-    int size;
+    size_t size;
     int perms, is_dir;
     char *name;
     strip_termination(line);
@@ -532,10 +662,10 @@ int ftp_lsdir(struct FTP *ctrl_con, const char *dir_path,/*{{{*/
     split_into_fields(line, fields, &n_fields);
     if (n_fields < 8) {
       fprintf(stderr, "Didn't see expected number of fields\n");
-      exit(1);
+      give_up();
     }
     name = fields[n_fields - 1];
-    size = atoi(fields[n_fields - 5]);
+    size = strtoul(fields[n_fields - 5], NULL, 10);
     parse_perms(fields[0], &perms, &is_dir);
     if (strcmp(name, ".") && strcmp(name, "..")) {
       /* Don't add . or .. entries to the list else it will recurse infinitely.
@@ -578,7 +708,7 @@ static int status_map(int status) {/*{{{*/
 int ftp_delete(struct FTP *ctrl_con, const char *path)/*{{{*/
 {
   int status;
-  put_cmd(ctrl_con, "DELE", path);
+  put_cmd(ctrl_con, "DELE", in_dir(ctrl_con, path));
   status = read_status(ctrl_con);
   if (verbose) {
     printf("Got %d from DELE comamnd\n", status);
@@ -589,19 +719,175 @@ int ftp_delete(struct FTP *ctrl_con, const char *path)/*{{{*/
 int ftp_rmdir(struct FTP *ctrl_con, const char *dir_path)/*{{{*/
 {
   int status;
-  put_cmd(ctrl_con, "RMD", dir_path);
+  put_cmd(ctrl_con, "RMD", in_dir(ctrl_con, dir_path));
   status = read_status(ctrl_con);
   return status_map(status);
 }
 /*}}}*/
+int ftp_remove_batch(struct FTP *ctrl_con, int n, const char **paths, const int *is_dir, int *ok)/*{{{*/
+{
+  /* As ftp_rename_batch : every DELE or RMD goes out before any reply is
+   * read, except that the batch is split where the directory changes, for
+   * in_dir to move to the next one. */
+  int i, j, k, len, skip, status, n_ok;
+  const char *slash;
+
+  n_ok = 0;
+  for (i=0; i<n; i=j) {
+    slash = strrchr(paths[i], '/');
+    len = slash ? slash - paths[i] : -1;
+    for (j = i + 1; j < n; j++) {
+      slash = strrchr(paths[j], '/');
+      if ((slash ? slash - paths[j] : -1) != len) break;
+      if ((len > 0) && strncmp(paths[i], paths[j], len)) break;
+    }
+    /* The whole run has the same prefix to drop, if any. */
+    skip = in_dir(ctrl_con, paths[i]) - paths[i];
+    for (k=i; k<j; k++) {
+      put_cmd(ctrl_con, is_dir[k] ? "RMD" : "DELE", paths[k] + skip);
+    }
+    for (k=i; k<j; k++) {
+      status = read_status(ctrl_con);
+      if (verbose) {
+        printf("Got %d from %s %s\n", status, is_dir[k] ? "RMD" : "DELE", paths[k]);
+      }
+      ok[k] = status_map(status);
+      n_ok += ok[k];
+    }
+  }
+  return n_ok;
+}
+/*}}}*/
 int ftp_mkdir(struct FTP *ctrl_con, const char *dir_path)/*{{{*/
 {
   int status;
-  put_cmd(ctrl_con, "MKD", dir_path);
+  put_cmd(ctrl_con, "MKD", in_dir(ctrl_con, dir_path));
   status = read_status(ctrl_con);
   return status_map(status);
 }
 /*}}}*/
+int ftp_rename_batch(struct FTP *ctrl_con, int n, const char **old_paths, const char **new_paths, int *ok)/*{{{*/
+{
+  /* Send all n RNFR/RNTO pairs before reading any of the replies, so the
+   * whole batch costs one round trip.  The server still carries them out in
+   * order.  ok[i] is set to 1 for each rename that succeeded; the number of
+   * successes is returned. */
+  int i, status, n_ok;
+
+  for (i=0; i<n; i++) {
+    put_cmd(ctrl_con, "RNFR", from_root(ctrl_con, old_paths[i]));
+    put_cmd(ctrl_con, "RNTO", from_root(ctrl_con, new_paths[i]));
+  }
+  n_ok = 0;
+  for (i=0; i<n; i++) {
+    status = read_status(ctrl_con);
+    if (verbose) {
+      printf("Got %d from RNFR %s\n", status, old_paths[i]);
+    }
+    ok[i] = (status == 350);
+    status = read_status(ctrl_con);
+    if (verbose) {
+      printf("Got %d from RNTO %s\n", status, new_paths[i]);
+    }
+    ok[i] = ok[i] && status_map(status);
+    n_ok += ok[i];
+  }
+  return n_ok;
+}
+/*}}}*/
+static int has_word(const char *line, const char *word)/*{{{*/
+{
+  /* 1 if word appears in line on its own, in any case. */
+  const char *p;
+  int len = strlen(word);
+  for (p = line; *p; p++) {
+    if (((p == line) || !isalnum(p[-1])) && !strncasecmp(p, word, len) && !isalnum(p[len])) return 1;
+  }
+  return 0;
+}
+/*}}}*/
+int ftp_can_copy(struct FTP *ctrl_con)/*{{{*/
+{
+  /* Servers with copying (such as ProFTPD with mod_copy) don't put it in
+   * the FEAT reply, but list CPFR and CPTO in the reply to SITE HELP.  The
+   * answer is remembered for the connection. */
+  char *line;
+  int has_cpfr = 0, has_cpto = 0;
+
+  if (!ctrl_con->can_copy) {
+    put_cmd(ctrl_con, "SITE HELP", NULL);
+    while ((line = read_line(ctrl_con))) {
+      if (has_word(line, "CPFR")) has_cpfr = 1;
+      if (has_word(line, "CPTO")) has_cpto = 1;
+      if (get_status(line)) {
+        if (get_status(line) >= 300) has_cpfr = has_cpto = 0;
+        free(line);
+        break;
+      }
+      free(line);
+    }
+    ctrl_con->can_copy = (has_cpfr && has_cpto) ? 1 : -1;
+    if (verbose) {
+      printf("Server %s copy files\n", (ctrl_con->can_copy > 0) ? "can" : "cannot");
+    }
+  }
+  return (ctrl_con->can_copy > 0);
+}
+/*}}}*/
+int ftp_copy_batch(struct FTP *ctrl_con, int n, const char **from_paths, const char **to_paths, int *ok)/*{{{*/
+{
+  /* As ftp_rename_batch, but with SITE CPFR and SITE CPTO, leaving the
+   * source where it is. */
+  int i, status, n_ok;
+  char *arg;
+
+  for (i=0; i<n; i++) {
+    arg = new_array(char, strlen(from_root(ctrl_con, from_paths[i])) + 6);
+    sprintf(arg, "CPFR %s", from_root(ctrl_con, from_paths[i]));
+    put_cmd(ctrl_con, "SITE", arg);
+    free(arg);
+    arg = new_array(char, strlen(from_root(ctrl_con, to_paths[i])) + 6);
+    sprintf(arg, "CPTO %s", from_root(ctrl_con, to_paths[i]));
+    put_cmd(ctrl_con, "SITE", arg);
+    free(arg);
+  }
+  n_ok = 0;
+  for (i=0; i<n; i++) {
+    status = read_status(ctrl_con);
+    if (verbose) {
+      printf("Got %d from SITE CPFR %s\n", status, from_paths[i]);
+    }
+    ok[i] = (status == 350);
+    status = read_status(ctrl_con);
+    if (verbose) {
+      printf("Got %d from SITE CPTO %s\n", status, to_paths[i]);
+    }
+    ok[i] = ok[i] && status_map(status);
+    n_ok += ok[i];
+  }
+  return n_ok;
+}
+/*}}}*/
+int ftp_rename(struct FTP *ctrl_con, const char *old_path, const char *new_path)/*{{{*/
+{
+  int ok;
+  ftp_rename_batch(ctrl_con, 1, &old_path, &new_path, &ok);
+  return ok;
+}
+/*}}}*/
+int ftp_noop(struct FTP *ctrl_con)/*{{{*/
+{
+  /* Keep an idle control connection from being timed out by the server.
+   * Return 1 if the connection is still usable, 0 if not. */
+  int status;
+  put_cmd(ctrl_con, "NOOP", NULL);
+  status = read_status(ctrl_con);
+  if (verbose) {
+    printf("Got %d from NOOP command\n", status);
+  }
+  return status_map(status);
+}
+/*}}}*/
 int ftp_binary(struct FTP *ctrl_con)/*{{{*/
 {
   /* switch connection to binary. */
@@ -615,41 +901,56 @@ int ftp_binary(struct FTP *ctrl_con)/*{{{*/
 
   if (status >= 400) {
     fprintf(stderr, "Couldn't set TYPE to I\n");
-    exit(1);
+    give_up();
   }
 
   return 0;
 }
 /*}}}*/
-int ftp_write(struct FTP *ctrl_con, const char *local_path, const char *remote_path, void (*callback)(void*,int), void *cb_arg)/*{{{*/
+static int send_stream(struct FTP *ctrl_con, const char *cmd, FILE *local, const char *remote_path, size_t rest, size_t length, void (*callback)(void*,size_t), void *cb_arg)/*{{{*/
 {
+  /* Send up to 'length' bytes from the current position of 'local' with
+   * STOR or APPE, preceded by REST if 'rest' is non-zero.  The callback is
+   * told the number of bytes sent so far after each chunk. */
 
 #define CHUNKSIZE 512
 
   int data_fd = -1;
-  FILE *local, *remote;
+  FILE *remote;
   int status;
   char buffer[CHUNKSIZE];
-  int n, bytes_done;
-  struct stat sb;
-
-  local = fopen(local_path, "rb");
-  if (!local) {
-    fprintf(stderr, "Could not open local file %s\n", local_path);
-    return 0;
-  }
+  int n;
+  size_t bytes_done, want;
+  const char *name;
 
+  name = in_dir(ctrl_con, remote_path);
   if (ctrl_con->active) {
     setup_active_data_con(ctrl_con);
   } else {
     data_fd = open_passive_data_con(ctrl_con);
   }
-  put_cmd(ctrl_con, "STOR", remote_path);
+  if (rest) {
+    char arg[32];
+    sprintf(arg, "%llu", (unsigned long long) rest);
+    put_cmd(ctrl_con, "REST", arg);
+    status = read_status(ctrl_con);
+    if (verbose) {
+      printf("Got status %d after REST %s\n", status, arg);
+    }
+    if (status != 350) {
+      if (data_fd >= 0) close(data_fd);
+      return 0;
+    }
+  }
+  put_cmd(ctrl_con, cmd, name);
   status = read_status(ctrl_con);
   if (verbose) {
-    printf("Got status %d after STOR %s->%s\n", status, local_path, remote_path);
+    printf("Got status %d after %s %s\n", status, cmd, remote_path);
+  }
+  if (status >= 400) {
+    if (data_fd >= 0) close(data_fd);
+    return 0;
   }
-  if (status >= 400) return 0;
 
   if (ctrl_con->active) {
     data_fd = open_active_data_con(ctrl_con);
@@ -657,33 +958,211 @@ int ftp_write(struct FTP *ctrl_con, const char *local_path, const char *remote_p
 
   remote = fdopen(data_fd, "w");
 
-  if (fstat(fileno(local), &sb) < 0) {
-    perror("ftp_write, stat");
-    exit(1);
-  }
-  
   bytes_done = 0;
-  while (1) {
-    n = fread(buffer, 1, CHUNKSIZE, local);
+  while (bytes_done < length) {
+    want = length - bytes_done;
+    if (want > CHUNKSIZE) want = CHUNKSIZE;
+    n = fread(buffer, 1, want, local);
     if (!n) break;
     fwrite(buffer, 1, n, remote);
     bytes_done += n;
-    if (callback) {
-      double percent;
-      percent = 100.0 * (double) bytes_done / (double) sb.st_size;
-      (*callback)(cb_arg, (int) percent);
-    }
+    if (callback) (*callback)(cb_arg, bytes_done);
   }
 
   fclose(remote);
-  fclose(local);
 
   status = read_status(ctrl_con);
   if (verbose) {
-    printf("Got status %d after STOR %s->%s\n", status, local_path, remote_path);
+    printf("Got status %d after %s %s\n", status, cmd, remote_path);
   }
 
   return status_map(status);
 }
 /*}}}*/
+static int store_data(struct FTP *ctrl_con, const char *cmd, const char *local_path, const char *remote_path, size_t offset, size_t length, size_t rest, void (*callback)(void*,size_t), void *cb_arg)/*{{{*/
+{
+  /* Send 'length' bytes of the local file from 'offset' onwards, or the
+   * rest of the file if length is 0. */
+  FILE *local;
+  struct stat sb;
+  int status;
 
+  local = fopen(local_path, "rb");
+  if (!local) {
+    fprintf(stderr, "Could not open local file %s\n", local_path);
+    return 0;
+  }
+  if (fstat(fileno(local), &sb) < 0) {
+    perror("ftp_write, stat");
+    give_up();
+  }
+  if ((offset > sb.st_size) || (fseeko(local, (off_t) offset, SEEK_SET) < 0)) {
+    fclose(local);
+    return 0;
+  }
+  if (!length) length = sb.st_size - offset;
+  status = send_stream(ctrl_con, cmd, local, remote_path, rest, length, callback, cb_arg);
+  fclose(local);
+  return status;
+}
+/*}}}*/
+int ftp_write(struct FTP *ctrl_con, const char *local_path, const char *remote_path, void (*callback)(void*,size_t), void *cb_arg)/*{{{*/
+{
+  return store_data(ctrl_con, "STOR", local_path, remote_path, 0, 0, 0, callback, cb_arg);
+}
+/*}}}*/
+int ftp_append(struct FTP *ctrl_con, const char *local_path, const char *remote_path, size_t offset, void (*callback)(void*,size_t), void *cb_arg)/*{{{*/
+{
+  return store_data(ctrl_con, "APPE", local_path, remote_path, offset, 0, 0, callback, cb_arg);
+}
+/*}}}*/
+int ftp_patch(struct FTP *ctrl_con, const char *local_path, const char *remote_path, size_t offset, size_t length, void (*callback)(void*,size_t), void *cb_arg)/*{{{*/
+{
+  return store_data(ctrl_con, "STOR", local_path, remote_path, offset, length, offset, callback, cb_arg);
+}
+/*}}}*/
+int ftp_size_batch(struct FTP *ctrl_con, int n, const char **remote_paths, size_t *sizes, int *ok)/*{{{*/
+{
+  /* As ftp_rename_batch : all the SIZE commands go before any reply is read. */
+  int i, status, n_ok;
+  char *text;
+  unsigned long long val;
+
+  for (i=0; i<n; i++) {
+    put_cmd(ctrl_con, "SIZE", from_root(ctrl_con, remote_paths[i]));
+  }
+  n_ok = 0;
+  for (i=0; i<n; i++) {
+    status = read_reply(ctrl_con, &text);
+    if (verbose) {
+      printf("Got %d from SIZE %s\n", status, remote_paths[i]);
+    }
+    ok[i] = (status == 213) && (sscanf(text + 4, "%llu", &val) == 1);
+    if (ok[i]) sizes[i] = val;
+    n_ok += ok[i];
+    free(text);
+  }
+  return n_ok;
+}
+/*}}}*/
+int ftp_size(struct FTP *ctrl_con, const char *remote_path, size_t *size)/*{{{*/
+{
+  int ok;
+  ftp_size_batch(ctrl_con, 1, &remote_path, size, &ok);
+  return ok;
+}
+/*}}}*/
+static int lists_rest_stream(struct FTP *ctrl_con)/*{{{*/
+{
+  /* Return 1 if the FEAT reply includes REST STREAM (RFC 3659). */
+  char *line;
+  const char *p;
+  int found = 0;
+
+  put_cmd(ctrl_con, "FEAT", NULL);
+  while ((line = read_line(ctrl_con))) {
+    if (get_status(line)) {
+      free(line);
+      break;
+    }
+    for (p = line; isspace(*p); p++) ;
+    if (!strncasecmp(p, "REST STREAM", 11)) found = 1;
+    free(line);
+  }
+  return found;
+}
+/*}}}*/
+static int store_buffer(struct FTP *ctrl_con, const char *remote_path, const char *data, size_t rest)/*{{{*/
+{
+  FILE *in;
+  int status;
+  in = fmemopen((void *) data, strlen(data), "r");
+  if (!in) return 0;
+  status = send_stream(ctrl_con, "STOR", in, remote_path, rest, strlen(data), NULL, NULL);
+  fclose(in);
+  return status;
+}
+/*}}}*/
+int ftp_rest_overwrites(struct FTP *ctrl_con)/*{{{*/
+{
+  /* Servers differ in what STOR does after REST : some overwrite in place
+   * from the offset, others truncate the file there first.  Find out by
+   * patching the middle of a scratch file and checking that its size hasn't
+   * changed.  The answer is remembered for the connection.  Several
+   * connections may be finding out at once, so each probes a file of its
+   * own, named after the process and the control socket. */
+  char probe[64];
+  size_t size;
+
+  if (!ctrl_con->rest_overwrites) {
+    sprintf(probe, "@@FTPUP_PROBE@@.%d.%d", (int) getpid(), ctrl_con->fd);
+    ctrl_con->rest_overwrites = -1;
+    if (lists_rest_stream(ctrl_con) &&
+        store_buffer(ctrl_con, probe, "0123456789abcdef", 0) &&
+        store_buffer(ctrl_con, probe, "XY", 4) &&
+        ftp_size(ctrl_con, probe, &size) && (size == 16)) {
+      ctrl_con->rest_overwrites = 1;
+    }
+    ftp_delete(ctrl_con, probe);
+    if (verbose) {
+      printf("Server %s patch files in place\n",
+             (ctrl_con->rest_overwrites > 0) ? "can" : "cannot");
+    }
+  }
+  return (ctrl_con->rest_overwrites > 0);
+}
+/*}}}*/
+static int hex_digit(int c)/*{{{*/
+{
+  if ((c >= '0') && (c <= '9')) return c - '0';
+  c = tolower(c);
+  if ((c >= 'a') && (c <= 'f')) return c - 'a' + 10;
+  return -1;
+}
+/*}}}*/
+static int parse_xmd5(const char *text, unsigned char md5[16])/*{{{*/
+{
+  /* Servers vary in the reply code and in what surrounds the digest, so
+   * take the first run of exactly 32 hex digits after the code. */
+  const char *p;
+  int i, n;
+  for (p = text + 4; *p; p += n ? n : 1) {
+    for (n = 0; hex_digit(p[n]) >= 0; n++) ;
+    if ((n == 32) && ((p == text + 4) || isspace(p[-1]) || (p[-1] == '"'))) {
+      for (i=0; i<16; i++) {
+        md5[i] = (hex_digit(p[2*i]) << 4) | hex_digit(p[2*i+1]);
+      }
+      return 1;
+    }
+  }
+  return 0;
+}
+/*}}}*/
+int ftp_xmd5_batch(struct FTP *ctrl_con, int n, const char **remote_paths, unsigned char (*md5s)[16], int *ok)/*{{{*/
+{
+  int i, status, n_ok;
+  char *text;
+
+  for (i=0; i<n; i++) {
+    put_cmd(ctrl_con, "XMD5", from_root(ctrl_con, remote_paths[i]));
+  }
+  n_ok = 0;
+  for (i=0; i<n; i++) {
+    status = read_reply(ctrl_con, &text);
+    if (verbose) {
+      printf("Got %d from XMD5 %s\n", status, remote_paths[i]);
+    }
+    ok[i] = status_map(status) && parse_xmd5(text, md5s[i]);
+    n_ok += ok[i];
+    free(text);
+  }
+  return n_ok;
+}
+/*}}}*/
+int ftp_xmd5(struct FTP *ctrl_con, const char *remote_path, unsigned char md5[16])/*{{{*/
+{
+  int ok;
+  ftp_xmd5_batch(ctrl_con, 1, &remote_path, (unsigned char (*)[16]) md5, &ok);
+  return ok;
+}
+/*}}}*/
@@ -21,26 +21,83 @@ extern int ftp_close(struct FTP *);
 
 extern int ftp_cwd(struct FTP *, const char *new_root_dir);
 
+/* From now on, send commands on single entries (STOR, APPE, DELE, RMD, MKD)
+ * from within the entry's directory, changing to it only when the last one
+ * was elsewhere, and take all remote paths as relative to the current
+ * directory.  Return 1 if that's possible, 0 if the server won't say where
+ * the session is, in which case paths are sent as they are. */
+extern int ftp_relative_paths(struct FTP *);
+
 extern int ftp_write(struct FTP *,
                      const char *local_path, /* local path */
                      const char *remote_path, /* path on remote server */
-                     void (*callback)(void*,int),
+                     void (*callback)(void*,size_t),
+                     void *cb_arg);
+
+/* Send the local file from byte 'offset' onwards, appending it to the
+ * remote file with APPE. */
+extern int ftp_append(struct FTP *,
+                      const char *local_path,
+                      const char *remote_path,
+                      size_t offset,
+                      void (*callback)(void*,size_t),
+                      void *cb_arg);
+
+/* Overwrite 'length' bytes of the remote file, starting at 'offset', with
+ * the same range of the local file (or the rest of it if length is 0),
+ * using REST and STOR.  Only use this if ftp_rest_overwrites says it's
+ * safe. */
+extern int ftp_patch(struct FTP *,
+                     const char *local_path,
+                     const char *remote_path,
+                     size_t offset,
+                     size_t length,
+                     void (*callback)(void*,size_t),
                      void *cb_arg);
 
+/* Return 1 if the server is known to leave the rest of the file alone when
+ * STOR follows REST, 0 if it may truncate. */
+extern int ftp_rest_overwrites(struct FTP *);
+
 extern int ftp_read(struct FTP *,
                     const char *remote_path,
                     const char *filename); /* local path to write data to */
 
+/* Return 1 for success, 0 for failure */
 extern int ftp_rename(struct FTP *,
                       const char *old_path, /* old remote path */
                       const char *new_path); /* new remote path */
 
+/* Pipelined renames : set ok[i] for each that worked, return number that
+ * did. */
+extern int ftp_rename_batch(struct FTP *, int n,
+                            const char **old_paths,
+                            const char **new_paths,
+                            int *ok);
+
+/* Return 1 if the server can copy files itself (SITE CPFR and CPTO). */
+extern int ftp_can_copy(struct FTP *);
+
+/* Pipelined server-side copies : set ok[i] for each that worked, return
+ * number that did. */
+extern int ftp_copy_batch(struct FTP *, int n,
+                          const char **from_paths,
+                          const char **to_paths,
+                          int *ok);
+
 /* Return 1 for success, 0 for failure */
 extern int ftp_delete(struct FTP *,
                       const char *remote_path);
 extern int ftp_rmdir(struct FTP *,
                      const char *remote_path);
 
+/* Pipelined DELE (or RMD where is_dir[i] is set) : set ok[i] for each that
+ * worked, return number that did. */
+extern int ftp_remove_batch(struct FTP *, int n,
+                            const char **remote_paths,
+                            const int *is_dir,
+                            int *ok);
+
 extern int ftp_mkdir(struct FTP *,
                      const char *remote_path);
 
@@ -53,8 +110,25 @@ extern int ftp_lsdir(struct FTP *,
                      struct FTP_stat **file_data,
                      int *nfiles);
 
+/* Return 1 and the names in the directory (as NLST gives them, which may
+ * include the directory's path), 0 if it can't be listed. */
 extern int ftp_names(struct FTP *ctrl_con, const char *dir_path,
-              char ***names, int *n_names);
+                     char ***names, int *n_names);
+
+/* Return 1 and fill in the result if the server answers SIZE or XMD5 for
+ * the file, 0 if not. */
+extern int ftp_size(struct FTP *, const char *remote_path, size_t *size);
+extern int ftp_xmd5(struct FTP *, const char *remote_path, unsigned char md5[16]);
+
+/* Pipelined versions of those : set ok[i] for each path answered, return
+ * the number that were. */
+extern int ftp_size_batch(struct FTP *, int n, const char **remote_paths,
+                          size_t *sizes, int *ok);
+extern int ftp_xmd5_batch(struct FTP *, int n, const char **remote_paths,
+                          unsigned char (*md5s)[16], int *ok);
 
 extern int ftp_binary(struct FTP *ctrl_con);
 
+/* Return 1 if the connection is still alive, 0 if not */
+extern int ftp_noop(struct FTP *ctrl_con);
+
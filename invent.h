@@ -3,6 +3,7 @@
 #ifndef INVENT_H
 #define INVENT_H
 
+#include <stdio.h>
 #include <sys/types.h>
 #include <time.h>
 
@@ -17,14 +18,24 @@ struct fnode {/*{{{*/
   char *path; /* complete path from top of tree */
   int is_dir;
   int is_unique; /* 1 if only in this tree, 0 if in peer too. */
+  int is_clash;  /* 1 if the peer tree has a file where this is a directory,
+                    or vice versa */
   union {
     struct {
       size_t size;
       time_t mtime;
-      /* Eventually : perms? md5sum? */
+      unsigned char md5[16];
+      int has_md5;   /* 1 if md5 is known */
+      size_t block_size;     /* 0 if there are no per-block digests */
+      unsigned char *blocks; /* BLOCK_DIGEST_LEN bytes for each block */
+      dev_t dev;     /* identity of the local file (localinv only) */
+      ino_t ino;
+      /* Eventually : perms? */
       struct fnode *peer; /* Peer in other tree, if any */
       int is_stale;  /* 1 if different between trees, 0 if the same (don't care if
                         is_unique==1) */
+      int is_retouched; /* 1 if only the mtime differs, so the listing needs
+                           updating but nothing needs sending */
     } file;
     struct {
       /* Linked list of entries in the subdirectory. */
@@ -42,18 +53,160 @@ struct remote_params {
   char *remote_root;
 };
 
+struct upload_params {
+  int is_dummy_run;
+  int active_ftp;
+  int strict_scan;  /* 1 to ignore the local scan cache */
+  int watch;        /* 1 to keep running and upload changes as they happen */
+  int debounce_ms;  /* quiet period to wait for before acting on changes */
+  int pipeline;     /* 1 to start uploading while the local scan runs */
+  int n_connections; /* number of connections to send files over */
+  size_t mem_limit; /* if non-zero, compare the trees as sorted streams,
+                       keeping to about this much memory */
+  int delete_last;  /* 1 to send everything before removing old entries */
+  int shard_depth;  /* depth to split the listing at when preening, or -1
+                       to keep it as it is */
+  const char *only; /* if non-NULL, only upload this directory */
+};
+
+struct intent {
+  /* A remote operation that was started, from an 'I' record in the
+   * listing. */
+  char command[8]; /* DELE, RMD, MKD, STOR, RNFR or RNTO */
+  char *record;    /* the record for when it has worked */
+  char *path;      /* within record */
+};
+
+struct FTP;
+struct transfer;
+
+struct connect_info {
+  /* What's needed to open more connections to the server. */
+  const struct remote_params *rp;
+  const char *password;
+  int active_ftp;
+  int n_connections;
+};
+
+struct upload_totals {
+  int add_files;
+  size_t add_bytes;
+  int update_files;
+  size_t update_bytes;
+  int delete_entries;
+};
+
 void add_fnode_at_start(struct fnode *parent, struct fnode *new_fnode);
 void add_fnode_at_end(struct fnode *parent, struct fnode *new_fnode);
+struct fnode *lookup_dir_list(struct fnode *top, const char *path);
+void free_inventory(struct fnode *a);
+/* A separate copy of list a and everything under it. */
+struct fnode *copy_inventory(struct fnode *a);
 
-/* Assume already in the right directory at the point this is called. */
-struct fnode *make_localinv(const char *to_avoid);
+/* Assume already in the right directory at the point this is called.  The
+ * shards of the listing files in to_avoid (NULL-terminated) are left out;
+ * the other two take just the one listing file. */
+struct fnode *make_localinv(const char *const *to_avoid, const char *cache_file, int strict,
+                            void (*dir_done)(void *, const char *, struct fnode *),
+                            void *dir_done_arg);
+struct fnode *make_localinv_subtree(const char *to_avoid, const char *path);
+/* As make_localinv without the scan cache, but rather than building the
+ * tree, tell visit about each entry and let it go once its directory has
+ * been dealt with. */
+void walk_localinv(const char *to_avoid, void (*visit)(void *, const struct fnode *), void *visit_arg);
+int is_bookkeeping_file(const char *name);
 struct fnode *make_fileinv(const char *listing, struct remote_params *);
-struct fnode *make_remoteinv(const char *hostname, const int port_number, const char *username, const char *password, const char *remote_root, int active_ftp);
+/* As make_fileinv, but if the listing is split into shards, only read those
+ * with records for directory 'only' or the directories above it.  Entries
+ * elsewhere may or may not be there. */
+struct fnode *make_fileinv_within(const char *listing, struct remote_params *, const char *only);
+/* Pick apart single listing records.  record_path returns where the path
+ * starts in any F, M, B, D or Z line.  parse_file_record fills in f's size,
+ * mtime and digest from an F or M line, and parse_blocks_record its block
+ * digests from a B line; both return the path. */
+const char *record_path(const char *line);
+const char *parse_file_record(const char *line, struct fnode *f);
+const char *parse_blocks_record(const char *line, struct fnode *f);
+/* The intents in the listing that no later record settles, in the order
+ * they were written, filling in rp from the header. */
+struct intent *pending_intents(const char *listing, struct remote_params *rp, int *n_pending);
+/* Crawl the remote site, writing the listing as it goes.  If an earlier
+ * crawl into the same listing was interrupted, carry on from where it
+ * stopped. */
+void make_remoteinv(const char *listing_file, const char *hostname, const int port_number, const char *username, const char *password, const char *remote_root, int active_ftp);
 
 void print_inventory(struct fnode *a, const char *to_file, const char *hostname, const int port_number, const char *username, const char *remote_root);
+/* Write the records for everything in tree a (to stdout if out is NULL). */
+void write_inventory(struct fnode *a, FILE *out);
+
+/* Mark what's in each tree that isn't in the other one, and what differs. */
+void reconcile(struct fnode *fileinv, struct fnode *localinv);
+/* Rewrite the listing file without the records that later ones supersede. */
+void preen_listing(const char *listing_file);
+/* As preen_listing, splitting it into shards shard_depth directories deep
+ * (or into one file, if 0). */
+void rewrite_listing(const char *listing_file, int shard_depth);
+
+/* Listings split into shards, in shards.c.  The shard depth of the listing,
+ * 0 if it's one file. */
+int listing_shard_depth(const char *listing_file);
+/* 1 if name is a file belonging to the listing other than the listing
+ * itself; these are never uploaded. */
+int is_listing_shard(const char *listing_file, const char *name);
+/* Read the listing as if it were one file, or NULL if it can't be opened.
+ * Each shard read is introduced by an 'S <directory>' line.  If only is
+ * non-NULL, skip the shards for directories that are neither above nor
+ * below it. */
+FILE *open_listing(const char *listing_file, const char *only);
+/* As open_listing, for pending_intents. */
+FILE *open_listing_intents(const char *listing_file);
+/* Open the listing to append records to, or NULL if it can't be. */
+FILE *open_journal(const char *listing_file);
+/* Start a new listing, put in place of the old one when the stream is
+ * closed (fclose gives EOF if that fails). */
+FILE *create_listing(const char *listing_file, const struct remote_params *rp, int shard_depth);
 
 void init_remote_params(struct remote_params *rp);  
-int upload(const char *password, int is_dummy_run, const char *listing_file, int active_ftp);
+void init_upload_params(struct upload_params *up);
+int upload(const char *password, const char *listing_file, const struct upload_params *up);
+/* The upload for up->mem_limit, in streamup.c. */
+int upload_streaming(const char *password, const char *listing_file, const struct upload_params *up);
+/* As upload, bringing several mirrors (one listing file each) up to date
+ * at once from a single scan of the local tree.  A mirror that fails is
+ * given up on without stopping the others; return 1 if any did. */
+int upload_mirrors(const char *password, char **listing_files, int n, const struct upload_params *up);
+struct FTP *open_remote(const struct remote_params *rp, const char *password, int active_ftp);
+struct FTP *connect_remote(const struct remote_params *rp, const char *password, int active_ftp);
+void upload_subtree(struct FTP *ctrl_con, struct fnode *fileinv, struct fnode *localinv, FILE *journal);
+
+/* The pieces of an upload, for streamup.c.  Each remote operation is
+ * journalled once it has worked; failures are fatal. */
+void match_files(struct fnode *remote, struct fnode *local);
+void print_totals(const struct upload_totals *tot);
+void remove_file(struct FTP *ctrl_con, struct fnode *file, FILE *journal);
+void remove_directory(struct FTP *ctrl_con, struct fnode *dir, FILE *journal);
+void create_directory(struct FTP *ctrl_con, struct fnode *dir, FILE *journal);
+/* Send the n transfers over ctrl_con, and more connections if ci allows. */
+void send_batch(struct FTP *ctrl_con, struct transfer *t, int n, FILE *journal,
+                const struct connect_info *ci);
+/* Remove the n entries in v (DELE or RMD intents, files first and then
+ * directories deepest first), over more connections too if ci allows.  If
+ * resuming, a removal that fails is fine as long as the entry has gone. */
+void run_removals(struct FTP *ctrl_con, struct intent *v, int n, FILE *journal,
+                  const struct connect_info *ci, int resuming);
+
+/* Settle the intents an interrupted run left in the listing, in resume.c. */
+void resume_interrupted(const char *password, const char *listing_file, const struct upload_params *up);
+/* 1 if path is in the listing of its remote directory. */
+int remote_exists(struct FTP *ctrl_con, const char *path);
+
+int lint(const char *password, const char *listing_file, const struct upload_params *up, int fix);
+int audit(const char *password, const char *listing_file, const struct upload_params *up,
+          int n_draws, double threshold, int fix);
+
+struct FTP *watch_tree(struct FTP *ctrl_con, struct fnode *tree, FILE *journal,
+                       const struct remote_params *rp, const char *password,
+                       const char *listing_file, const struct upload_params *up);
 
 #endif /* INVENT_H */
 
@@ -0,0 +1,90 @@
+/*
+ * Append updates to the listing file.
+ * */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "digest.h"
+#include "invent.h"
+#include "journal.h"
+#include "md5.h"
+
+static void write_file_line(FILE *out, const struct fnode *contents, const char *path)/*{{{*/
+{
+  /* The 'F' or 'M' line on its own. */
+  unsigned long size = contents->x.file.size;
+  if (contents->x.file.has_md5) {
+    char hex[33];
+    md5_to_hex(contents->x.file.md5, hex);
+    fprintf(out, "M %8lu %08lx %s %s\n", size, contents->x.file.mtime, hex, path);
+  } else {
+    fprintf(out, "F %8lu %08lx %s\n", size, contents->x.file.mtime, path);
+  }
+}
+/*}}}*/
+void write_file_record(FILE *out, const struct fnode *contents, const char *path)/*{{{*/
+{
+  write_file_line(out, contents, path);
+  if (contents->x.file.has_md5 && contents->x.file.blocks) {
+    char block_hex[BLOCKS_HEX_LEN + 1];
+    blocks_to_hex(contents->x.file.blocks, contents->x.file.size, contents->x.file.block_size, block_hex);
+    fprintf(out, "B %lx %s %s\n", (unsigned long) contents->x.file.block_size, block_hex, path);
+  }
+}
+/*}}}*/
+void journal_file(FILE *journal, const struct fnode *contents, const char *path)/*{{{*/
+{
+  /* Files can be sent over several connections at once, so keep the 'M' and
+   * 'B' lines together. */
+  flockfile(journal);
+  write_file_record(journal, contents, path);
+  fflush(journal);
+  funlockfile(journal);
+}
+/*}}}*/
+void journal_dir(FILE *journal, const char *path)/*{{{*/
+{
+  fprintf(journal, "D                   %s\n", path);
+  fflush(journal);
+}
+/*}}}*/
+void journal_delete(FILE *journal, const char *path)/*{{{*/
+{
+  fprintf(journal, "Z %s\n", path);
+  fflush(journal);
+}
+/*}}}*/
+void journal_intent(FILE *journal, const char *command, const char *path)/*{{{*/
+{
+  /* What the command leaves is implied : nothing for DELE, RMD and RNFR, a
+   * directory for MKD. */
+  if (!strcmp(command, "MKD")) {
+    fprintf(journal, "I %s D                   %s\n", command, path);
+  } else {
+    fprintf(journal, "I %s Z %s\n", command, path);
+  }
+  fflush(journal);
+}
+/*}}}*/
+void journal_file_intent(FILE *journal, const char *command, const struct fnode *contents, const char *path)/*{{{*/
+{
+  flockfile(journal);
+  fprintf(journal, "I %s ", command);
+  write_file_line(journal, contents, path);
+  fflush(journal);
+  funlockfile(journal);
+}
+/*}}}*/
+void journal_record(FILE *journal, const char *record)/*{{{*/
+{
+  fprintf(journal, "%s\n", record);
+  fflush(journal);
+}
+/*}}}*/
+void journal_settled(FILE *journal, const char *path)/*{{{*/
+{
+  fprintf(journal, "X %s\n", path);
+  fflush(journal);
+}
+/*}}}*/
@@ -0,0 +1,30 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdio.h>
+
+struct fnode;
+
+/* Append records to the listing file as remote operations complete.  The
+ * record formats are described in fileinv.c. */
+
+/* Record that 'path' on the remote side now holds the contents described by
+ * the file node 'contents'. */
+extern void journal_file(FILE *journal, const struct fnode *contents, const char *path);
+/* As journal_file, without flushing; for writing a whole listing. */
+extern void write_file_record(FILE *out, const struct fnode *contents, const char *path);
+extern void journal_dir(FILE *journal, const char *path);
+extern void journal_delete(FILE *journal, const char *path);
+
+/* Before each remote operation, record the intent to send the FTP 'command'
+ * for 'path' : DELE, RMD, MKD or RNFR with journal_intent, and STOR, RNTO or
+ * CPTO (saying what contents 'path' will have) with journal_file_intent. */
+extern void journal_intent(FILE *journal, const char *command, const char *path);
+extern void journal_file_intent(FILE *journal, const char *command, const struct fnode *contents,
+                                const char *path);
+/* Append one record as it stands. */
+extern void journal_record(FILE *journal, const char *record);
+/* Record that the intent for 'path' left it as the listing already says. */
+extern void journal_settled(FILE *journal, const char *path);
+
+#endif /* JOURNAL_H */
@@ -0,0 +1,582 @@
+/*
+ * Check the listing file against what is really on the remote site.
+ * */
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ftp.h"
+#include "invent.h"
+#include "journal.h"
+#include "memory.h"
+
+/* The remote tree is listed a directory at a time over several connections,
+ * and each directory is compared with the listing as soon as it arrives, so
+ * nothing of the remote tree is kept beyond the directories still waiting to
+ * be listed. */
+
+struct lint_dir {/*{{{*/
+  struct lint_dir *next;
+  char *path;
+  struct fnode *listed; /* its entries in the listing, or NULL if it isn't there */
+};
+/*}}}*/
+struct lint_job {/*{{{*/
+  pthread_mutex_t lock; /* covers everything below, and stdout */
+  pthread_cond_t more;
+  struct lint_dir *pending;  /* directories still to be listed */
+  int n_busy;                /* workers part way through a directory */
+  FILE *journal;             /* where to write fix-up records, or NULL */
+  int n_dirs;
+  int n_missing;
+  int n_extra;
+  int n_size;
+  int n_type;
+};
+/*}}}*/
+struct lint_worker {/*{{{*/
+  struct lint_job *job;
+  struct FTP *con;
+};
+/*}}}*/
+static void push_dir(struct lint_job *job, const char *path, struct fnode *listed)/*{{{*/
+{
+  /* Call with the lock held. */
+  struct lint_dir *d;
+  d = new(struct lint_dir);
+  d->path = new_string(path);
+  d->listed = listed;
+  d->next = job->pending;
+  job->pending = d;
+  pthread_cond_signal(&job->more);
+}
+/*}}}*/
+static char *child_path(const char *dir, const char *name)/*{{{*/
+{
+  char *result;
+  if (!strcmp(dir, ".")) return new_string(name);
+  result = new_array(char, strlen(dir) + strlen(name) + 2);
+  strcpy(result, dir);
+  strcat(result, "/");
+  strcat(result, name);
+  return result;
+}
+/*}}}*/
+static void forget_listed(FILE *journal, struct fnode *e)/*{{{*/
+{
+  /* Remove e (and everything under it) from the listing, deepest first. */
+  struct fnode *top, *x;
+  if (e->is_dir) {
+    top = (struct fnode *) &e->x.dir.next;
+    for (x = top->next; x != top; x = x->next) {
+      forget_listed(journal, x);
+    }
+  }
+  journal_delete(journal, e->path);
+}
+/*}}}*/
+static void record_remote(FILE *journal, const char *path, const struct FTP_stat *st)/*{{{*/
+{
+  /* Add what's on the server to the listing.  The mtime isn't known, so 0 is
+   * recorded, as with -R. */
+  struct fnode contents;
+  if (st->is_dir) {
+    journal_dir(journal, path);
+  } else {
+    contents.x.file.size = st->size;
+    contents.x.file.mtime = 0;
+    contents.x.file.has_md5 = 0;
+    contents.x.file.block_size = 0;
+    contents.x.file.blocks = NULL;
+    journal_file(journal, &contents, path);
+  }
+}
+/*}}}*/
+static int compare_stats(const void *a, const void *b)/*{{{*/
+{
+  const struct FTP_stat *sa = a, *sb = b;
+  return strcmp(sa->name, sb->name);
+}
+/*}}}*/
+static int compare_fnodes(const void *a, const void *b)/*{{{*/
+{
+  const struct fnode *const *fa = a, *const *fb = b;
+  return strcmp((*fa)->name, (*fb)->name);
+}
+/*}}}*/
+static void lint_one_dir(struct FTP *con, struct lint_job *job, struct lint_dir *d)/*{{{*/
+{
+  struct FTP_stat *files;
+  int n_files;
+  struct fnode **listed = NULL;
+  int n_listed;
+  struct fnode *e;
+  int i, j, cmp;
+  char *path;
+
+  ftp_lsdir(con, d->path, &files, &n_files);
+  qsort(files, n_files, sizeof(struct FTP_stat), compare_stats);
+
+  n_listed = 0;
+  if (d->listed) {
+    for (e = d->listed->next; e != d->listed; e = e->next) n_listed++;
+    listed = new_array(struct fnode *, n_listed ? n_listed : 1);
+    for (i = 0, e = d->listed->next; e != d->listed; e = e->next) listed[i++] = e;
+    qsort(listed, n_listed, sizeof(struct fnode *), compare_fnodes);
+  }
+
+  pthread_mutex_lock(&job->lock);
+  job->n_dirs++;
+  for (i = j = 0; (i < n_listed) || (j < n_files); ) {
+    if (i == n_listed) cmp = 1;
+    else if (j == n_files) cmp = -1;
+    else cmp = strcmp(listed[i]->name, files[j].name);
+
+    if (cmp < 0) {
+      e = listed[i++];
+      printf("MISSING %c %s\n", e->is_dir ? 'D' : 'F', e->path);
+      job->n_missing++;
+      if (job->journal) forget_listed(job->journal, e);
+    } else if (cmp > 0) {
+      path = child_path(d->path, files[j].name);
+      printf("EXTRA   %c %s\n", files[j].is_dir ? 'D' : 'F', path);
+      job->n_extra++;
+      if (job->journal) record_remote(job->journal, path, &files[j]);
+      /* Its contents are all extra too. */
+      if (files[j].is_dir) push_dir(job, path, NULL);
+      free(path);
+      j++;
+    } else {
+      e = listed[i++];
+      if (e->is_dir != files[j].is_dir) {
+        printf("TYPE    %c %s (listed as a %s)\n", files[j].is_dir ? 'D' : 'F', e->path,
+               e->is_dir ? "directory" : "file");
+        job->n_type++;
+        if (job->journal) {
+          forget_listed(job->journal, e);
+          record_remote(job->journal, e->path, &files[j]);
+        }
+        if (files[j].is_dir) push_dir(job, e->path, NULL);
+      } else if (e->is_dir) {
+        push_dir(job, e->path, (struct fnode *) &e->x.dir.next);
+      } else if (e->x.file.size != files[j].size) {
+        printf("SIZE    F %s (listed %lu, server %lu)\n", e->path,
+               (unsigned long) e->x.file.size, (unsigned long) files[j].size);
+        job->n_size++;
+        if (job->journal) record_remote(job->journal, e->path, &files[j]);
+      }
+      j++;
+    }
+  }
+  fflush(stdout);
+  pthread_mutex_unlock(&job->lock);
+
+  for (j = 0; j < n_files; j++) free(files[j].name);
+  free(files);
+  if (listed) free(listed);
+}
+/*}}}*/
+static void *lint_worker(void *arg)/*{{{*/
+{
+  struct lint_worker *w = arg;
+  struct lint_job *job = w->job;
+  struct lint_dir *d;
+
+  pthread_mutex_lock(&job->lock);
+  while (1) {
+    /* Wait while the other workers may yet find more to do. */
+    while (!job->pending && job->n_busy) {
+      pthread_cond_wait(&job->more, &job->lock);
+    }
+    d = job->pending;
+    if (!d) break;
+    job->pending = d->next;
+    job->n_busy++;
+    pthread_mutex_unlock(&job->lock);
+
+    lint_one_dir(w->con, job, d);
+    free(d->path);
+    free(d);
+
+    pthread_mutex_lock(&job->lock);
+    job->n_busy--;
+    if (!job->pending && !job->n_busy) pthread_cond_broadcast(&job->more);
+  }
+  pthread_mutex_unlock(&job->lock);
+  return NULL;
+}
+/*}}}*/
+static int crawl(const struct remote_params *rp, const char *password, const struct upload_params *up,/*{{{*/
+                 struct fnode *fileinv, FILE *journal, char **roots, int n_roots)
+{
+  /* Compare the remote subtrees under each of roots with the listing, and
+   * return the number of differences. */
+  struct lint_job job;
+  struct lint_worker *workers;
+  pthread_t *threads;
+  int n_cons, n_started, i;
+
+  pthread_mutex_init(&job.lock, NULL);
+  pthread_cond_init(&job.more, NULL);
+  job.pending = NULL;
+  job.n_busy = 0;
+  job.journal = journal;
+  job.n_dirs = job.n_missing = job.n_extra = job.n_size = job.n_type = 0;
+  for (i = 0; i < n_roots; i++) {
+    push_dir(&job, roots[i], lookup_dir_list(fileinv, roots[i]));
+  }
+
+  /* Connect from this thread, since the resolver may not be thread-safe. */
+  n_cons = up->n_connections;
+  workers = new_array(struct lint_worker, n_cons);
+  threads = new_array(pthread_t, n_cons);
+  workers[0].job = &job;
+  workers[0].con = open_remote(rp, password, up->active_ftp);
+  for (i = 1; i < n_cons; i++) {
+    workers[i].job = &job;
+    workers[i].con = connect_remote(rp, password, up->active_ftp);
+    if (!workers[i].con) break;
+  }
+  n_cons = i;
+
+  for (n_started = 1; n_started < n_cons; n_started++) {
+    if (pthread_create(&threads[n_started], NULL, lint_worker, &workers[n_started]) != 0) break;
+  }
+  lint_worker(&workers[0]);
+  for (i = 1; i < n_started; i++) pthread_join(threads[i], NULL);
+  for (i = 0; i < n_cons; i++) ftp_close(workers[i].con);
+
+  printf("Checked %d directories over %d connection%s : %d missing, %d extra, %d size, %d type mismatches\n",
+         job.n_dirs, n_started, (n_started == 1) ? "" : "s",
+         job.n_missing, job.n_extra, job.n_size, job.n_type);
+  pthread_mutex_destroy(&job.lock);
+  pthread_cond_destroy(&job.more);
+  free(workers);
+  free(threads);
+  return job.n_missing + job.n_extra + job.n_size + job.n_type;
+}
+/*}}}*/
+static FILE *open_fixups(const char *listing_file, int fix)/*{{{*/
+{
+  FILE *journal;
+  if (!fix) return NULL;
+  journal = open_journal(listing_file);
+  if (!journal) {
+    fprintf(stderr, "Couldn't open %s to append updates\n", listing_file);
+    exit(1);
+  }
+  return journal;
+}
+/*}}}*/
+int lint(const char *password, const char *listing_file, const struct upload_params *up, int fix)/*{{{*/
+{
+  /* List the remote site and report where it differs from the listing file.
+   * If fix is set, append records to the listing so that it matches the
+   * site again (the next upload then puts the site right). */
+  struct fnode *fileinv;
+  struct remote_params rp;
+  FILE *journal;
+  char *root = ".";
+  int n_diffs;
+
+  init_remote_params(&rp);
+  fileinv = make_fileinv(listing_file, &rp);
+  journal = open_fixups(listing_file, fix);
+  n_diffs = crawl(&rp, password, up, fileinv, journal, &root, 1);
+  if (journal) fclose(journal);
+  free_inventory(fileinv);
+  free(fileinv);
+  return n_diffs ? 1 : 0;
+}
+/*}}}*/
+
+/* Auditing checks a random sample of the listed files rather than the whole
+ * site.  Files are drawn with probability in proportion to their size (plus
+ * AUDIT_BASE_WEIGHT, so that small files still get a look in), with
+ * replacement, so the fraction of draws that find a file changed estimates
+ * the fraction of the listed data that has drifted. */
+
+#define AUDIT_BASE_WEIGHT 4096
+#define AUDIT_BATCH 32
+
+struct sample {/*{{{*/
+  double target;        /* where the draw fell in the cumulative weight */
+  struct fnode *file;
+  int drifted;
+};
+/*}}}*/
+struct audit_job {/*{{{*/
+  struct sample *samples;  /* distinct files only, after draw_samples */
+  int n;
+  int next;                /* next sample to be claimed */
+  pthread_mutex_t lock;    /* for stdout */
+};
+/*}}}*/
+struct audit_worker {/*{{{*/
+  struct audit_job *job;
+  struct FTP *con;
+};
+/*}}}*/
+static double total_weight(struct fnode *a)/*{{{*/
+{
+  struct fnode *e;
+  double total = 0.0;
+  for (e = a->next; e != a; e = e->next) {
+    if (e->is_dir) total += total_weight((struct fnode *) &e->x.dir.next);
+    else total += (double) e->x.file.size + AUDIT_BASE_WEIGHT;
+  }
+  return total;
+}
+/*}}}*/
+static void pick_samples(struct fnode *a, struct sample *s, int n, int *k, double *sum)/*{{{*/
+{
+  /* s is sorted by target; walk the files accumulating weight and give each
+   * target to the file whose span it falls in. */
+  struct fnode *e;
+  for (e = a->next; (e != a) && (*k < n); e = e->next) {
+    if (e->is_dir) {
+      pick_samples((struct fnode *) &e->x.dir.next, s, n, k, sum);
+    } else {
+      *sum += (double) e->x.file.size + AUDIT_BASE_WEIGHT;
+      while ((*k < n) && (s[*k].target < *sum)) s[(*k)++].file = e;
+    }
+  }
+}
+/*}}}*/
+static int compare_targets(const void *a, const void *b)/*{{{*/
+{
+  const struct sample *sa = a, *sb = b;
+  if (sa->target != sb->target) return (sa->target < sb->target) ? -1 : 1;
+  return 0;
+}
+/*}}}*/
+static void check_batch(struct FTP *con, struct audit_job *job, struct sample *s, int n)/*{{{*/
+{
+  const char *paths[AUDIT_BATCH];
+  size_t sizes[AUDIT_BATCH];
+  unsigned char md5s[AUDIT_BATCH][16];
+  int got_size[AUDIT_BATCH], got_md5[AUDIT_BATCH];
+  const char *hash_paths[AUDIT_BATCH];
+  int hashed[AUDIT_BATCH];
+  int i, n_hash;
+  struct fnode *f;
+
+  for (i = 0; i < n; i++) paths[i] = s[i].file->path;
+  ftp_size_batch(con, n, paths, sizes, got_size);
+
+  /* Only files whose size still matches and whose digest is known are worth
+   * hashing; if the server can't, the size has to do. */
+  n_hash = 0;
+  for (i = 0; i < n; i++) {
+    f = s[i].file;
+    if (got_size[i] && (sizes[i] == f->x.file.size) && f->x.file.has_md5) {
+      hashed[n_hash] = i;
+      hash_paths[n_hash++] = paths[i];
+    }
+  }
+  if (n_hash) ftp_xmd5_batch(con, n_hash, hash_paths, md5s, got_md5);
+
+  pthread_mutex_lock(&job->lock);
+  for (i = 0; i < n; i++) {
+    f = s[i].file;
+    if (!got_size[i]) {
+      printf("MISSING F %s\n", f->path);
+      s[i].drifted = 1;
+    } else if (sizes[i] != f->x.file.size) {
+      printf("SIZE    F %s (listed %lu, server %lu)\n", f->path,
+             (unsigned long) f->x.file.size, (unsigned long) sizes[i]);
+      s[i].drifted = 1;
+    }
+  }
+  for (i = 0; i < n_hash; i++) {
+    f = s[hashed[i]].file;
+    if (got_md5[i] && memcmp(md5s[i], f->x.file.md5, 16)) {
+      printf("DIGEST  F %s\n", f->path);
+      s[hashed[i]].drifted = 1;
+    }
+  }
+  fflush(stdout);
+  pthread_mutex_unlock(&job->lock);
+}
+/*}}}*/
+static void *audit_worker(void *arg)/*{{{*/
+{
+  struct audit_worker *w = arg;
+  struct audit_job *job = w->job;
+  int i, n;
+  while ((i = __sync_fetch_and_add(&job->next, AUDIT_BATCH)) < job->n) {
+    n = job->n - i;
+    if (n > AUDIT_BATCH) n = AUDIT_BATCH;
+    check_batch(w->con, job, job->samples + i, n);
+  }
+  return NULL;
+}
+/*}}}*/
+static void wilson_interval(int k, int n, double *lo, double *hi)/*{{{*/
+{
+  /* 95% confidence interval for a proportion seen k times in n; unlike the
+   * plain normal approximation it behaves when k is 0 or small. */
+  const double z = 1.96;
+  double p, denom, centre, half;
+  p = (double) k / n;
+  denom = 1.0 + z * z / n;
+  centre = (p + z * z / (2.0 * n)) / denom;
+  half = z * sqrt(p * (1.0 - p) / n + z * z / (4.0 * n * n)) / denom;
+  *lo = centre - half;
+  *hi = centre + half;
+  if (*lo < 0.0) *lo = 0.0;
+  if (*hi > 1.0) *hi = 1.0;
+}
+/*}}}*/
+static int compare_paths(const void *a, const void *b)/*{{{*/
+{
+  return strcmp(*(char *const *) a, *(char *const *) b);
+}
+/*}}}*/
+static int affected_dirs(struct sample *s, int n, char ***dirs)/*{{{*/
+{
+  /* The directories holding the drifted files, leaving out any that lie
+   * under another in the list. */
+  char **d;
+  const char *slash;
+  int n_dirs, i, j, len;
+
+  d = new_array(char *, n ? n : 1);
+  n_dirs = 0;
+  for (i = 0; i < n; i++) {
+    if (!s[i].drifted) continue;
+    slash = strrchr(s[i].file->path, '/');
+    if (slash) {
+      len = slash - s[i].file->path;
+      d[n_dirs] = new_array(char, len + 1);
+      memcpy(d[n_dirs], s[i].file->path, len);
+      d[n_dirs][len] = 0;
+    } else {
+      d[n_dirs] = new_string(".");
+    }
+    n_dirs++;
+  }
+  qsort(d, n_dirs, sizeof(char *), compare_paths);
+  /* After sorting, a subdirectory follows its ancestor (or a duplicate). */
+  for (i = j = 0; i < n_dirs; i++) {
+    if (j > 0) {
+      len = strlen(d[j-1]);
+      if (!strcmp(d[j-1], ".") ||
+          (!strncmp(d[i], d[j-1], len) && ((d[i][len] == '/') || !d[i][len]))) {
+        free(d[i]);
+        continue;
+      }
+    }
+    d[j++] = d[i];
+  }
+  *dirs = d;
+  return j;
+}
+/*}}}*/
+int audit(const char *password, const char *listing_file, const struct upload_params *up,/*{{{*/
+          int n_draws, double threshold, int fix)
+{
+  /* Check n_draws size-weighted random draws from the listing against the
+   * server.  If the estimated fraction of data that has drifted is above
+   * threshold, crawl the directories where drift was found as -L would. */
+  struct fnode *fileinv;
+  struct remote_params rp;
+  struct sample *s;
+  struct audit_job job;
+  struct audit_worker *workers;
+  pthread_t *threads;
+  double total, sum, lo, hi;
+  int *draw_file;
+  int n, i, k, n_drifted, n_cons, n_started, n_dirs, n_diffs;
+  char **dirs;
+  FILE *journal;
+
+  init_remote_params(&rp);
+  fileinv = make_fileinv(listing_file, &rp);
+  total = total_weight(fileinv);
+  if ((n_draws <= 0) || (total <= 0.0)) {
+    printf("Nothing to audit\n");
+    return 0;
+  }
+
+  srand(time(NULL) ^ getpid());
+  s = new_array(struct sample, n_draws);
+  for (i = 0; i < n_draws; i++) {
+    s[i].target = total * ((double) rand() / ((double) RAND_MAX + 1.0));
+    s[i].file = NULL;
+    s[i].drifted = 0;
+  }
+  qsort(s, n_draws, sizeof(struct sample), compare_targets);
+  k = 0;
+  sum = 0.0;
+  pick_samples(fileinv, s, n_draws, &k, &sum);
+  /* Rounding might leave the last few past the end. */
+  for (; k < n_draws; k++) s[k].file = s[k-1].file;
+
+  /* A file drawn more than once need only be checked once; draw_file
+   * remembers which check each draw counts. */
+  draw_file = new_array(int, n_draws);
+  for (i = n = 0; i < n_draws; i++) {
+    if ((n == 0) || (s[n-1].file != s[i].file)) s[n++] = s[i];
+    draw_file[i] = n - 1;
+  }
+
+  job.samples = s;
+  job.n = n;
+  job.next = 0;
+  pthread_mutex_init(&job.lock, NULL);
+
+  n_cons = up->n_connections;
+  if (n_cons > (n + AUDIT_BATCH - 1) / AUDIT_BATCH) n_cons = (n + AUDIT_BATCH - 1) / AUDIT_BATCH;
+  workers = new_array(struct audit_worker, n_cons);
+  threads = new_array(pthread_t, n_cons);
+  workers[0].job = &job;
+  workers[0].con = open_remote(&rp, password, up->active_ftp);
+  for (i = 1; i < n_cons; i++) {
+    workers[i].job = &job;
+    workers[i].con = connect_remote(&rp, password, up->active_ftp);
+    if (!workers[i].con) break;
+  }
+  n_cons = i;
+  for (n_started = 1; n_started < n_cons; n_started++) {
+    if (pthread_create(&threads[n_started], NULL, audit_worker, &workers[n_started]) != 0) break;
+  }
+  audit_worker(&workers[0]);
+  for (i = 1; i < n_started; i++) pthread_join(threads[i], NULL);
+  for (i = 0; i < n_cons; i++) ftp_close(workers[i].con);
+  pthread_mutex_destroy(&job.lock);
+
+  n_drifted = 0;
+  for (i = 0; i < n_draws; i++) n_drifted += s[draw_file[i]].drifted;
+  wilson_interval(n_drifted, n_draws, &lo, &hi);
+  printf("Audited %d draws (%d files) over %d connection%s : %d drifted\n",
+         n_draws, n, n_started, (n_started == 1) ? "" : "s", n_drifted);
+  printf("Estimated drift : %.2f%% of listed data (95%% confidence %.2f%% to %.2f%%)\n",
+         100.0 * n_drifted / n_draws, 100.0 * lo, 100.0 * hi);
+  fflush(stdout);
+
+  n_diffs = 0;
+  if (n_drifted && ((double) n_drifted / n_draws > threshold)) {
+    n_dirs = affected_dirs(s, n, &dirs);
+    printf("Above the %.2f%% threshold, so checking %d director%s in full\n",
+           100.0 * threshold, n_dirs, (n_dirs == 1) ? "y" : "ies");
+    journal = open_fixups(listing_file, fix);
+    n_diffs = crawl(&rp, password, up, fileinv, journal, dirs, n_dirs);
+    if (journal) fclose(journal);
+    for (i = 0; i < n_dirs; i++) free(dirs[i]);
+    free(dirs);
+  }
+
+  free(draw_file);
+  free(s);
+  free(workers);
+  free(threads);
+  free_inventory(fileinv);
+  free(fileinv);
+  return (n_drifted || n_diffs) ? 1 : 0;
+}
+/*}}}*/
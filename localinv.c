@@ -5,14 +5,20 @@
 #include <string.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
+#include "digest.h"
 #include "ftp.h"
 #include "invent.h"
+#include "journal.h"
 #include "namecheck.h"
+#include "scancache.h"
 #include "memory.h"
 
+extern int verbose;
+
 void add_fnode_at_end(struct fnode *parent, struct fnode *new_fnode)/*{{{*/
 {
   new_fnode->prev = parent->prev;
@@ -30,20 +36,78 @@ void add_fnode_at_start(struct fnode *parent, struct fnode *new_fnode)/*{{{*/
 }
 /*}}}*/
 
-/* FIXME : this stuff needs to be user-configurable eventually. */
-static int reject_name(const char *name, struct namecheck *global_nc, struct namecheck *local_nc) {/*{{{*/
+struct fnode *lookup_dir_list(struct fnode *top, const char *path)/*{{{*/
+{
+  /* Return the entry list of directory 'path' within the tree 'top', or NULL
+   * if there's no such directory. */
+  const char *p, *slash;
+  struct fnode *e;
+  int len;
+
+  if (!strcmp(path, ".")) return top;
+  p = path;
+  while (1) {
+    slash = strchr(p, '/');
+    len = slash ? (slash - p) : strlen(p);
+    for (e = top->next; e != top; e = e->next) {
+      if (e->is_dir && !strncmp(e->name, p, len) && (e->name[len] == '\0')) break;
+    }
+    if (e == top) return NULL;
+    top = (struct fnode *) &e->x.dir.next;
+    if (!slash) return top;
+    p = slash + 1;
+  }
+}
+/*}}}*/
+
+int is_bookkeeping_file(const char *name)/*{{{*/
+{
+  /* 1 for the caches we keep at the top of the local tree (and the temporary
+   * files used when rewriting them), which are never uploaded. */
+  static const char *own_files[] = { "@@SCANCACHE@@", "@@HASHCACHE@@", NULL };
+  const char **f;
+  int len;
+  for (f = own_files; *f; f++) {
+    len = strlen(*f);
+    if (!strncmp(name, *f, len) && (!name[len] || !strcmp(name + len, ".new"))) return 1;
+  }
+  return 0;
+}
+/*}}}*/
+
+struct tree_rules {/*{{{*/
+  /* The @@TREE_UPLOAD@@ rules in force in a directory : those of the nearest
+   * directory at or above it with such a file, then those further up.  The
+   * rules are compiled once, and shared by every directory below. */
+  struct namecheck *nc;
+  int base_len;  /* length of the prefix to strip to make paths relative to
+                    the directory holding the file */
+  struct tree_rules *parent;
+};
+/*}}}*/
+static int reject_name(const char *name, const char *path, struct namecheck *global_nc,/*{{{*/
+                       struct namecheck *local_nc, const struct tree_rules *tr)
+{
+  /* The nearest rules take precedence : the directory's own @@UPLOAD@@, then
+   * the @@TREE_UPLOAD@@ files from here up to the top, then
+   * @@GLOBAL_UPLOAD@@. */
   enum nc_result ncr;
   if (local_nc) {
     ncr = lookup_namecheck(local_nc, name);
     if (ncr == NC_PASS)      return 0;
     else if (ncr == NC_FAIL) return 1;
   }
+  for (; tr; tr = tr->parent) {
+    ncr = lookup_namecheck_path(tr->nc, path + tr->base_len);
+    if (ncr == NC_PASS)      return 0;
+    else if (ncr == NC_FAIL) return 1;
+  }
   if (global_nc) {
-    ncr = lookup_namecheck(global_nc, name);
+    ncr = lookup_namecheck_path(global_nc, path);
     if (ncr == NC_PASS)      return 0;
     else if (ncr == NC_FAIL) return 1;
     else {
-      fprintf(stderr, "Filename <%s> not matched by [GLOBAL_]UPLOAD file rules\n", name);
+      fprintf(stderr, "Filename <%s> not matched by [GLOBAL_|TREE_]UPLOAD file rules\n", path);
       exit(1);
     }
   } else {
@@ -52,94 +116,408 @@ static int reject_name(const char *name, struct namecheck *global_nc, struct nam
   }
 }
 /*}}}*/
-static void scan_one_dir(const char *path, struct namecheck *global_nc, struct fnode *a)/*{{{*/
+static struct tree_rules *ancestor_rules(const char *path)/*{{{*/
+{
+  /* Load the tree rules that directory path inherits from the directories
+   * above it. */
+  struct tree_rules *result = NULL, *tr;
+  struct namecheck *nc;
+  const char *slash;
+  char *dir;
+  int len;
+
+  if (!strcmp(path, ".")) return NULL;
+  nc = make_namecheck("@@TREE_UPLOAD@@");
+  len = -1;
+  while (1) {
+    if (nc) {
+      tr = new(struct tree_rules);
+      tr->nc = nc;
+      tr->base_len = len + 1;
+      tr->parent = result;
+      result = tr;
+    }
+    slash = strchr(path + len + 1, '/');
+    if (!slash) break;
+    len = slash - path;
+    dir = new_array(char, len + 1);
+    memcpy(dir, path, len);
+    dir[len] = 0;
+    nc = make_namecheck_dir(dir, "@@TREE_UPLOAD@@");
+    free(dir);
+  }
+  return result;
+}
+/*}}}*/
+static void free_tree_rules(struct tree_rules *tr)/*{{{*/
 {
-  /* a is the list onto which the new entries are appended. */
-  DIR *d;
+  struct tree_rules *next;
+  for (; tr; tr = next) {
+    next = tr->parent;
+    free_namecheck(tr->nc);
+    free(tr);
+  }
+}
+/*}}}*/
+struct scan_context {/*{{{*/
+  struct namecheck *global_nc;
+  const struct scancache *old_cache; /* NULL for a full rescan */
+  struct scancache *new_cache;
+  int n_dirs;
+  int n_reused;
+  /* if non-NULL, told about each directory as soon as its entries are
+   * known */
+  void (*dir_done)(void *, const char *, struct fnode *);
+  void *dir_done_arg;
+  /* if non-NULL, told about each entry, and the tree isn't kept */
+  void (*visit)(void *, const struct fnode *);
+  void *visit_arg;
+  /* the listing files (NULL-terminated, or NULL for none), whose shards
+   * are left out */
+  const char *const *to_avoid;
+};
+/*}}}*/
+static int is_own_shard(const struct scan_context *ctx, const char *name)/*{{{*/
+{
+  const char *const *l;
+  for (l = ctx->to_avoid; l && *l; l++) {
+    if (is_listing_shard(*l, name)) return 1;
+  }
+  return 0;
+}
+/*}}}*/
+static void scan_one_dir(const char *path, struct scan_context *ctx, struct fnode *a,/*{{{*/
+                         struct tree_rules *inherited)
+{
+  /* a is the list onto which the new entries are appended.
+   *
+   * Names are checked against the rules before anything else is done with
+   * them, so an excluded subtree is never stat'ed or opened.
+   *
+   * Entries are stat'ed relative to the open directory (fstatat) rather than
+   * by full path, so the kernel doesn't re-walk every leading component for
+   * each file.  Where readdir already tells us an entry is a directory, no
+   * stat is needed at all.
+   *
+   * If the directory's inode and mtime match the scan cache, the names are
+   * taken from there instead of from readdir. */
+  DIR *d = NULL;
+  int dfd;
+  struct stat db;
   struct dirent *de;
   int pathlen;
   struct namecheck *local_nc;
+  struct tree_rules own_rules, *rules;
+  char **names;
+  unsigned char *types = NULL;
+  int n_names, max_names;
+  int i;
+  struct fnode *e;
 
   pathlen = strlen(path);
 
+  dfd = open(path, O_RDONLY | O_DIRECTORY);
+  if (dfd < 0) return; /* tough */
+  if (fstat(dfd, &db) < 0) {
+    close(dfd);
+    return;
+  }
+  ctx->n_dirs++;
+
+  names = NULL;
+  if (ctx->old_cache) {
+    names = lookup_scancache(ctx->old_cache, path, db.st_ino, db.st_mtime, &n_names);
+  }
+  if (names) {
+    ctx->n_reused++;
+  } else {
+    d = fdopendir(dfd);
+    if (!d) {
+      close(dfd);
+      return;
+    }
+    n_names = 0;
+    max_names = 16;
+    names = new_array(char *, max_names);
+    types = new_array(unsigned char, max_names);
+    while ((de = readdir(d))) {
+      if (!strcmp(de->d_name, ".")) continue;
+      if (!strcmp(de->d_name, "..")) continue;
+      if (n_names == max_names) {
+        max_names *= 2;
+        names = grow_array(char *, max_names, names);
+        types = grow_array(unsigned char, max_names, types);
+      }
+      names[n_names] = new_string(de->d_name);
+      types[n_names] = de->d_type;
+      n_names++;
+    }
+  }
+  if (ctx->new_cache) {
+    record_scancache(ctx->new_cache, path, db.st_ino, db.st_mtime, names, n_names);
+  }
+
   /* This returns null if the file isn't there. */
-  local_nc = make_namecheck_dir(path, "@@UPLOAD@@");
-  d = opendir(path);
-  if (!d) return; /* tough */
-  while ((de = readdir(d))) {
+  local_nc = make_namecheck_at(dfd, "@@UPLOAD@@");
+  own_rules.nc = make_namecheck_at(dfd, "@@TREE_UPLOAD@@");
+  if (own_rules.nc) {
+    own_rules.base_len = strcmp(".", path) ? pathlen + 1 : 0;
+    own_rules.parent = inherited;
+    rules = &own_rules;
+  } else {
+    rules = inherited;
+  }
+  for (i=0; i<n_names; i++) {
+    const char *name = names[i];
     char *full_path;
     struct stat sb;
     int namelen, totallen;
-    if (!strcmp(de->d_name, ".")) continue;
-    if (!strcmp(de->d_name, "..")) continue;
-    if (reject_name(de->d_name, global_nc, local_nc)) continue;
+    int is_dir, is_reg;
+    if (!strcmp(".", path) &&
+        (is_bookkeeping_file(name) || is_own_shard(ctx, name))) continue;
 
-    /* FIXME : Need some glob handling here to reject file patterns that the
-     * user doesn't want to push. */
-    
     if (strcmp(".", path)) {
-      namelen = strlen(de->d_name);
+      namelen = strlen(name);
       totallen = pathlen + 1 + namelen;
       full_path = new_array(char, totallen + 1);
       strcpy(full_path, path);
       strcat(full_path, "/");
-      strcat(full_path, de->d_name);
+      strcat(full_path, name);
     } else {
-      full_path = new_string(de->d_name);
+      full_path = new_string(name);
     }
-    if (stat(full_path, &sb) >= 0) {
-      if (S_ISREG(sb.st_mode)) {
-        struct fnode *nfn;
-        nfn = new(struct fnode);
-        nfn->name = new_string(de->d_name);
-        nfn->path = new_string(full_path);
-        nfn->is_dir = 0;
-        nfn->x.file.size = sb.st_size;
-        nfn->x.file.mtime = sb.st_mtime;
-        nfn->x.file.peer = NULL;
-        add_fnode_at_end(a, nfn);
-      } else if (S_ISDIR(sb.st_mode)) {
-        struct fnode *nfn;
-        nfn = new(struct fnode);
-        nfn->name = new_string(de->d_name);
-        nfn->path = new_string(full_path);
-        nfn->is_dir = 1;
-        nfn->x.dir.next = nfn->x.dir.prev = (struct fnode *) &nfn->x.dir;
-        add_fnode_at_start(a, nfn);
-        scan_one_dir(full_path, global_nc, (struct fnode *) &nfn->x.dir.next);
-      } else {
-        fprintf(stderr, "Can't handle %s, type not supported\n", full_path);
-      }
+    if (reject_name(name, full_path, ctx->global_nc, local_nc, rules)) {
+      free(full_path);
+      continue;
+    }
+
+    if (types && (types[i] == DT_DIR)) {
+      is_dir = 1, is_reg = 0;
+    } else if (fstatat(dfd, name, &sb, 0) >= 0) {
+      is_dir = S_ISDIR(sb.st_mode);
+      is_reg = S_ISREG(sb.st_mode);
+    } else {
+      free(full_path);
+      continue;
+    }
+
+    if (is_reg) {
+      struct fnode *nfn;
+      nfn = new(struct fnode);
+      nfn->name = new_string(name);
+      nfn->path = full_path;
+      nfn->is_dir = 0;
+      nfn->x.file.size = sb.st_size;
+      nfn->x.file.mtime = sb.st_mtime;
+      nfn->x.file.has_md5 = 0;
+      nfn->x.file.block_size = 0;
+      nfn->x.file.blocks = NULL;
+      nfn->x.file.dev = sb.st_dev;
+      nfn->x.file.ino = sb.st_ino;
+      nfn->x.file.peer = NULL;
+      nfn->x.file.is_retouched = 0;
+      add_fnode_at_end(a, nfn);
+    } else if (is_dir) {
+      struct fnode *nfn;
+      nfn = new(struct fnode);
+      nfn->name = new_string(name);
+      nfn->path = full_path;
+      nfn->is_dir = 1;
+      nfn->x.dir.next = nfn->x.dir.prev = (struct fnode *) &nfn->x.dir;
+      add_fnode_at_start(a, nfn);
+    } else {
+      fprintf(stderr, "Can't handle %s, type not supported\n", full_path);
+      free(full_path);
     }
-    free(full_path);
   }
-  closedir(d);
   if (local_nc) free_namecheck(local_nc);
+  if (d) {
+    closedir(d);
+    for (i=0; i<n_names; i++) free(names[i]);
+    free(names);
+    free(types);
+  } else {
+    close(dfd);
+  }
+
+  if (ctx->dir_done) (*ctx->dir_done)(ctx->dir_done_arg, path, a);
+  if (ctx->visit) {
+    for (e = a->next; e != a; e = e->next) (*ctx->visit)(ctx->visit_arg, e);
+  }
+
+  /* Descend only once this directory is finished with, so that we're not
+   * holding a descriptor open for every level of the tree. */
+  for (e = a->next; e != a; e = e->next) {
+    if (e->is_dir) {
+      scan_one_dir(e->path, ctx, (struct fnode *) &e->x.dir.next, rules);
+    }
+  }
+  if (own_rules.nc) free_namecheck(own_rules.nc);
+  if (ctx->visit) free_inventory(a);
 }
 /*}}}*/
-struct fnode *make_localinv(const char *to_avoid)/*{{{*/
+struct fnode *make_localinv(const char *const *to_avoid, const char *cache_file, int strict,/*{{{*/
+                            void (*dir_done)(void *, const char *, struct fnode *),
+                            void *dir_done_arg)
 {
+  /* If cache_file is non-null, directories that are unchanged since the
+   * last run are not re-read (unless strict is set), and the cache is
+   * rewritten for next time.
+   *
+   * If dir_done is non-null, it is called for each directory once its own
+   * entries are complete, parents before children.  The list passed to it
+   * won't change again, though the lists of its subdirectories will still
+   * be filled in afterwards. */
   struct fnode *result;
-  struct namecheck *global_nc;
+  struct scan_context ctx;
+  struct scancache *old_cache = NULL;
+
+  ctx.global_nc = make_namecheck("@@GLOBAL_UPLOAD@@");
+  ctx.n_dirs = ctx.n_reused = 0;
+  ctx.dir_done = dir_done;
+  ctx.dir_done_arg = dir_done_arg;
+  ctx.visit = NULL;
+  ctx.to_avoid = to_avoid;
+  if (cache_file && !strict) {
+    old_cache = load_scancache(cache_file);
+  }
+  ctx.old_cache = old_cache;
+  ctx.new_cache = cache_file ? new_scancache() : NULL;
 
-  global_nc = make_namecheck("@@GLOBAL_UPLOAD@@");
   result = new(struct fnode);
   result->next = result->prev = result;
-  scan_one_dir(".", global_nc, result);
+  scan_one_dir(".", &ctx, result, NULL);
+
+  if (verbose && old_cache) {
+    printf("Reused cached listings for %d of %d local directories\n", ctx.n_reused, ctx.n_dirs);
+  }
+  if (ctx.new_cache) {
+    if (!write_scancache(ctx.new_cache, cache_file)) {
+      fprintf(stderr, "Could not write scan cache %s\n", cache_file);
+    }
+    free_scancache(ctx.new_cache);
+  }
+  if (old_cache) free_scancache(old_cache);
+  if (ctx.global_nc) free_namecheck(ctx.global_nc);
   return result;
 };
 /*}}}*/
+struct fnode *make_localinv_subtree(const char *to_avoid, const char *path)/*{{{*/
+{
+  /* Rescan just the directory 'path' (and everything under it), returning
+   * its list of entries.  The scan cache isn't consulted. */
+  struct fnode *result;
+  struct scan_context ctx;
+  struct tree_rules *rules;
+  const char *avoid[2];
+
+  ctx.global_nc = make_namecheck("@@GLOBAL_UPLOAD@@");
+  ctx.n_dirs = ctx.n_reused = 0;
+  ctx.old_cache = NULL;
+  ctx.new_cache = NULL;
+  ctx.dir_done = NULL;
+  ctx.visit = NULL;
+  avoid[0] = to_avoid;
+  avoid[1] = NULL;
+  ctx.to_avoid = avoid;
+
+  result = new(struct fnode);
+  result->next = result->prev = result;
+  rules = ancestor_rules(path);
+  scan_one_dir(path, &ctx, result, rules);
+  free_tree_rules(rules);
+  if (ctx.global_nc) free_namecheck(ctx.global_nc);
+  return result;
+}
+/*}}}*/
+void walk_localinv(const char *to_avoid, void (*visit)(void *, const struct fnode *), void *visit_arg)/*{{{*/
+{
+  /* Only the directories on the way down to the current one are held at
+   * any time. */
+  struct fnode top;
+  struct scan_context ctx;
+  const char *avoid[2];
+
+  ctx.global_nc = make_namecheck("@@GLOBAL_UPLOAD@@");
+  ctx.n_dirs = ctx.n_reused = 0;
+  ctx.old_cache = NULL;
+  ctx.new_cache = NULL;
+  ctx.dir_done = NULL;
+  ctx.visit = visit;
+  ctx.visit_arg = visit_arg;
+  avoid[0] = to_avoid;
+  avoid[1] = NULL;
+  ctx.to_avoid = avoid;
+
+  top.next = top.prev = &top;
+  scan_one_dir(".", &ctx, &top, NULL);
+  if (ctx.global_nc) free_namecheck(ctx.global_nc);
+}
+/*}}}*/
+void free_inventory(struct fnode *a)/*{{{*/
+{
+  /* Free all the entries in list a, but not a itself. */
+  struct fnode *e, *ne;
+  for (e = a->next; e != a; e = ne) {
+    ne = e->next;
+    if (e->is_dir) {
+      free_inventory((struct fnode *) &e->x.dir.next);
+    } else if (e->x.file.blocks) {
+      free(e->x.file.blocks);
+    }
+    free(e->name);
+    free(e->path);
+    free(e);
+  }
+  a->next = a->prev = a;
+}
+/*}}}*/
+static void copy_entries(struct fnode *from, struct fnode *to)/*{{{*/
+{
+  struct fnode *e, *ne;
+  int len;
+
+  for (e = from->next; e != from; e = e->next) {
+    ne = new(struct fnode);
+    *ne = *e;
+    ne->name = new_string(e->name);
+    ne->path = new_string(e->path);
+    if (e->is_dir) {
+      ne->x.dir.next = ne->x.dir.prev = (struct fnode *) &ne->x.dir.next;
+      copy_entries((struct fnode *) &e->x.dir.next, (struct fnode *) &ne->x.dir.next);
+    } else {
+      ne->x.file.peer = NULL;
+      if (e->x.file.blocks) {
+        len = count_blocks(e->x.file.size, e->x.file.block_size) * BLOCK_DIGEST_LEN;
+        ne->x.file.blocks = new_array(unsigned char, len);
+        memcpy(ne->x.file.blocks, e->x.file.blocks, len);
+      }
+    }
+    add_fnode_at_end(to, ne);
+  }
+}
+/*}}}*/
+struct fnode *copy_inventory(struct fnode *a)/*{{{*/
+{
+  /* Return a new list holding a copy of everything in list a. */
+  struct fnode *result;
+  result = new(struct fnode);
+  result->next = result->prev = result;
+  copy_entries(a, result);
+  return result;
+}
+/*}}}*/
 
-static void inner_print_inventory(struct fnode *a, FILE *out)/*{{{*/
+void write_inventory(struct fnode *a, FILE *out)/*{{{*/
 {
   struct fnode *b;
 
   for (b = a->next; b != a; b = b->next) {
     if (b->is_dir) {
       fprintf(out ? out : stdout, "D                   %s\n", b->path);
-      inner_print_inventory((struct fnode *) &b->x.dir.next, out);
+      write_inventory((struct fnode *) &b->x.dir.next, out);
     } else {
-      fprintf(out ? out : stdout, "F %8d %08lx %s\n", (int)b->x.file.size, b->x.file.mtime, b->path);
+      write_file_record(out ? out : stdout, b, b->path);
     }
   }
 }
@@ -161,7 +539,7 @@ void print_inventory(struct fnode *a, const char *to_file, const char *hostname,
     fprintf(out, "R %s\n", remote_root);
   }
 
-  inner_print_inventory(a, out);
+  write_inventory(a, out);
   if (out) fclose(out);
 }
 /*}}}*/
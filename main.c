@@ -8,29 +8,82 @@
 
 int verbose = 0;
 
+static size_t parse_size(const char *arg)/*{{{*/
+{
+  /* A number of bytes, with an optional k, M or G suffix; 0 if it won't
+   * parse. */
+  char *end;
+  double size = strtod(arg, &end);
+  switch (*end) {
+    case 'k': case 'K': size *= 1024.0; end++; break;
+    case 'm': case 'M': size *= 1024.0 * 1024.0; end++; break;
+    case 'g': case 'G': size *= 1024.0 * 1024.0 * 1024.0; end++; break;
+  }
+  if ((end == arg) || *end || (size < 1.0)) return 0;
+  return (size_t) size;
+}
+/*}}}*/
+static char *tidy_path(const char *arg)/*{{{*/
+{
+  /* A local directory as the listing has it : without any leading "./" or
+   * trailing slashes.  NULL for the top, which is the same as the whole
+   * tree. */
+  char *path, *p;
+  while ((arg[0] == '.') && (arg[1] == '/')) arg += 2;
+  path = new_string(arg);
+  for (p = path + strlen(path); (p > path) && (p[-1] == '/'); p--) ;
+  *p = '\0';
+  if (!path[0] || !strcmp(path, ".")) {
+    free(path);
+    return NULL;
+  }
+  return path;
+}
+/*}}}*/
 static void usage(void)
 {
   fprintf(stderr, "First time usage:\n"
       "  ftpup -R -u <username> [-P <port_number>] [-r <remote_root>] <hostname>\n"
+      "  (if it is interrupted, running it again carries on from where it stopped)\n"
       "Subsequent use:\n"
       "  ftpup -U        <- do upload\n"
       "  ftpup -U [-a]   <- do upload using active FTP\n"
+      "  ftpup -U -W     <- do upload, then keep uploading changes as they happen\n"
       "  ftpup -N        <- dry_run : see what would be uploaded\n"
+      "  ftpup -L        <- lint : check the listing file against the remote site\n"
+      "  ftpup --audit <n> <- check n random draws from the listing against the remote site\n"
       "Special options:\n"
       "  -l <listing_file> : file containing the remote inventory (default: @@LISTING@@)\n"
+      "                      with -U or -N, give it more than once to update several mirrors at once\n"
       "  -p <password>     : supply FTP password                  (default: prompt for it)\n"
+      "  -S                : rescan every local directory, ignoring @@SCANCACHE@@\n"
+      "  -j <n>            : with -U or -L, use this many connections at once (default: 1, or 4 for -L)\n"
+      "  --fix             : with -L or --audit, update the listing file to match the remote site\n"
+      "  --audit-threshold <pct> : with --audit, check the affected directories in full\n"
+      "                      if the estimated drift is above this (default: 0)\n"
+      "  --pipeline        : with -U, start uploading while the local tree is still being scanned\n"
+      "  --delete-last     : with -U, send everything new before removing anything, then\n"
+      "                      remove the old entries over all the connections at once\n"
+      "  --debounce <ms>   : with -W, wait for this long a pause in changes (default: 500)\n"
+      "  --mem-limit <size> : with -U or -N, compare the trees as sorted streams in about\n"
+      "                      this much memory (k, M or G suffix), spilling to temporary files\n"
+      "  --shard <depth>   : with -U, split the listing into a file for each directory this\n"
+      "                      many levels down, listed in the listing file (0 to go back to one file)\n"
+      "  --only <dir>      : with -U or -N, only bring this directory up to date; with a\n"
+      "                      split listing, only the parts covering it are read\n"
       );
 }
 
 int main (int argc, char **argv) {
 
-  struct fnode *reminv;
   char *hostname = NULL;
   int port_number = 21;
   char *username = NULL;
   char *password = NULL;
   char *remote_root = NULL;
   char *listing_file = NULL;
+  char **listing_files = NULL;
+  int n_listing_files = 0;
 
   /* Download the remote tree to create an initial inventory listing. */
   int do_remote_inv = 0;
@@ -44,7 +97,18 @@ int main (int argc, char **argv) {
   /* Work out what would get uploaded/removed and show to user */
   int do_dummy_upload = 0;
 
-  int active_ftp = 0;
+  /* Check this many random draws from the listing against the remote site. */
+  int audit_draws = 0;
+  double audit_threshold = 0.0;
+
+  /* With lint, append records to the listing to bring it back into step. */
+  int fix_listing = 0;
+
+  int n_connections = 0;
+
+  struct upload_params up;
+
+  init_upload_params(&up);
 
   while (++argv, --argc) {
     if ((*argv)[0] == '-') {
@@ -62,7 +126,8 @@ int main (int argc, char **argv) {
         remote_root = *argv;
       } else if (!strcmp(*argv, "-l")) {
         --argc, ++argv;
-        listing_file = *argv;
+        listing_files = grow_array(char *, n_listing_files + 1, listing_files);
+        listing_files[n_listing_files++] = *argv;
       } else if (!strcmp(*argv, "-h") || !strcmp(*argv, "--help")) {
         usage();
         exit(0);
@@ -70,12 +135,74 @@ int main (int argc, char **argv) {
         do_upload = 1;
       } else if (!strcmp(*argv, "-N") || !strcmp(*argv, "--dummy")) {
         do_dummy_upload = 1;
+      } else if (!strcmp(*argv, "-L") || !strcmp(*argv, "--lint")) {
+        do_lint = 1;
+      } else if (!strcmp(*argv, "--audit")) {
+        --argc, ++argv;
+        audit_draws = *argv ? atoi(*argv) : 0;
+        if (audit_draws < 1) {
+          fprintf(stderr, "--audit needs a number of draws\n");
+          exit(1);
+        }
+      } else if (!strcmp(*argv, "--audit-threshold")) {
+        --argc, ++argv;
+        if (!*argv) {
+          fprintf(stderr, "--audit-threshold needs a percentage\n");
+          exit(1);
+        }
+        audit_threshold = atof(*argv) / 100.0;
+      } else if (!strcmp(*argv, "--fix")) {
+        fix_listing = 1;
       } else if (!strcmp(*argv, "-R") || !strcmp(*argv, "--remote-inventory")) {
         do_remote_inv = 1;
       } else if (!strcmp(*argv, "-v") || !strcmp(*argv, "--verbose")) {
         verbose = 1;
       } else if (!strcmp(*argv, "-a") || !strcmp(*argv, "--active-ftp")) {
-        active_ftp = 1;
+        up.active_ftp = 1;
+      } else if (!strcmp(*argv, "-S") || !strcmp(*argv, "--strict-scan")) {
+        up.strict_scan = 1;
+      } else if (!strcmp(*argv, "-W") || !strcmp(*argv, "--watch")) {
+        up.watch = 1;
+      } else if (!strcmp(*argv, "-j") || !strcmp(*argv, "--jobs")) {
+        --argc, ++argv;
+        if (!*argv) {
+          fprintf(stderr, "-j needs a number of connections\n");
+          exit(1);
+        }
+        n_connections = atoi(*argv);
+        if (n_connections < 1) n_connections = 1;
+      } else if (!strcmp(*argv, "--pipeline")) {
+        up.pipeline = 1;
+      } else if (!strcmp(*argv, "--delete-last")) {
+        up.delete_last = 1;
+      } else if (!strcmp(*argv, "--debounce")) {
+        --argc, ++argv;
+        up.debounce_ms = *argv ? atoi(*argv) : 0;
+        if (up.debounce_ms < 1) {
+          fprintf(stderr, "--debounce needs a time in milliseconds\n");
+          exit(1);
+        }
+      } else if (!strcmp(*argv, "--shard")) {
+        --argc, ++argv;
+        up.shard_depth = *argv ? atoi(*argv) : -1;
+        if (up.shard_depth < 0) {
+          fprintf(stderr, "--shard needs a depth\n");
+          exit(1);
+        }
+      } else if (!strcmp(*argv, "--only")) {
+        --argc, ++argv;
+        if (!*argv) {
+          fprintf(stderr, "--only needs a directory\n");
+          exit(1);
+        }
+        up.only = tidy_path(*argv);
+      } else if (!strcmp(*argv, "--mem-limit")) {
+        --argc, ++argv;
+        up.mem_limit = *argv ? parse_size(*argv) : 0;
+        if (!up.mem_limit) {
+          fprintf(stderr, "--mem-limit needs a size, e.g. 256M\n");
+          exit(1);
+        }
       } else {
         fprintf(stderr, "Unrecognized option %s\n", *argv);
         exit(2);
@@ -85,21 +212,57 @@ int main (int argc, char **argv) {
     }
   }
 
-  if (!do_remote_inv && !do_lint && !do_upload && !do_dummy_upload) {
-    fprintf(stderr, "One of the options -R, -L, -U or -N is required\n");
+  if (!do_remote_inv && !do_lint && !audit_draws && !do_upload && !do_dummy_upload) {
+    fprintf(stderr, "One of the options -R, -L, --audit, -U or -N is required\n");
     exit(1);
   }
 
-  if (do_remote_inv || do_upload) {
+  if (up.watch && !do_upload) {
+    fprintf(stderr, "-W only makes sense with -U\n");
+    exit(1);
+  }
+
+  if (up.mem_limit && (up.watch || up.pipeline || up.delete_last)) {
+    fprintf(stderr, "--mem-limit can't be used with -W, --pipeline or --delete-last\n");
+    exit(1);
+  }
+
+  if ((up.shard_depth >= 0) && !do_upload) {
+    fprintf(stderr, "--shard only makes sense with -U\n");
+    exit(1);
+  }
+
+  if (up.only && (up.watch || up.pipeline || up.mem_limit || (n_listing_files > 1) ||
+                  (up.shard_depth >= 0))) {
+    fprintf(stderr, "--only can't be used with -W, --pipeline, --mem-limit, --shard or more than one -l\n");
+    exit(1);
+  }
+
+  if (fix_listing && !do_lint && !audit_draws) {
+    fprintf(stderr, "--fix only makes sense with -L or --audit\n");
+    exit(1);
+  }
+
+  /* Listing directories is mostly waiting for the server, so lint gains from
+   * more connections by default. */
+  up.n_connections = n_connections ? n_connections : ((do_lint || audit_draws) ? 4 : 1);
+
+  if (do_remote_inv || do_lint || audit_draws || do_upload) {
     if (!password) {
       password = getpass("PASSWORD: ");
       password = new_string(password);
     }
   }
 
-  if (!listing_file) {
-    listing_file = "@@LISTING@@";
+  if (n_listing_files > 1) {
+    if (do_remote_inv || do_lint || audit_draws || up.watch || up.pipeline || up.mem_limit) {
+      fprintf(stderr, "More than one -l only works with -U or -N, without -W, --pipeline or --mem-limit\n");
+      exit(1);
+    }
+    up.is_dummy_run = !do_upload;
+    return upload_mirrors(password, listing_files, n_listing_files, &up);
   }
+  listing_file = n_listing_files ? listing_files[0] : "@@LISTING@@";
 
   if (do_remote_inv) {
     if (!hostname) {
@@ -110,13 +273,16 @@ int main (int argc, char **argv) {
       fprintf(stderr, "-R requires username\n");
       exit(1);
     }
-    reminv = make_remoteinv(hostname, port_number, username, password, remote_root, active_ftp);
-    print_inventory(reminv, listing_file, hostname, port_number, username, remote_root);
+    make_remoteinv(listing_file, hostname, port_number, username, password, remote_root, up.active_ftp);
   } else if (do_lint) {
+    return lint(password, listing_file, &up, fix_listing);
+  } else if (audit_draws) {
+    return audit(password, listing_file, &up, audit_draws, audit_threshold, fix_listing);
   } else if (do_upload) {
-    upload(password, 0, listing_file, active_ftp);
+    upload(password, listing_file, &up);
   } else if (do_dummy_upload) {
-    upload(password, 1, listing_file, active_ftp);
+    up.is_dummy_run = 1;
+    upload(password, listing_file, &up);
   }
 
   return 0;
@@ -0,0 +1,194 @@
+/*
+ * MD5 message digest (RFC 1321).
+ *
+ * MD5 is chosen over anything faster because it's the digest FTP servers
+ * will compute for us (XMD5, HASH), so the same value can be checked at
+ * both ends.
+ * */
+
+#include <ctype.h>
+#include <string.h>
+
+#include "md5.h"
+
+#define F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define G(x, y, z) ((y) ^ ((z) & ((x) ^ (y))))
+#define H(x, y, z) ((x) ^ (y) ^ (z))
+#define I(x, y, z) ((y) ^ ((x) | ~(z)))
+
+#define STEP(f, a, b, c, d, x, t, s) \
+  (a) += f((b), (c), (d)) + (x) + (t); \
+  (a) = ((a) << (s)) | ((a) >> (32 - (s))); \
+  (a) += (b);
+
+static void md5_block(uint32_t *state, const unsigned char *p)/*{{{*/
+{
+  uint32_t a, b, c, d;
+  uint32_t x[16];
+  int i;
+
+  for (i=0; i<16; i++) {
+    x[i] = ((uint32_t) p[4*i]) |
+           ((uint32_t) p[4*i+1] << 8) |
+           ((uint32_t) p[4*i+2] << 16) |
+           ((uint32_t) p[4*i+3] << 24);
+  }
+
+  a = state[0]; b = state[1]; c = state[2]; d = state[3];
+
+  STEP(F, a, b, c, d, x[ 0], 0xd76aa478,  7)
+  STEP(F, d, a, b, c, x[ 1], 0xe8c7b756, 12)
+  STEP(F, c, d, a, b, x[ 2], 0x242070db, 17)
+  STEP(F, b, c, d, a, x[ 3], 0xc1bdceee, 22)
+  STEP(F, a, b, c, d, x[ 4], 0xf57c0faf,  7)
+  STEP(F, d, a, b, c, x[ 5], 0x4787c62a, 12)
+  STEP(F, c, d, a, b, x[ 6], 0xa8304613, 17)
+  STEP(F, b, c, d, a, x[ 7], 0xfd469501, 22)
+  STEP(F, a, b, c, d, x[ 8], 0x698098d8,  7)
+  STEP(F, d, a, b, c, x[ 9], 0x8b44f7af, 12)
+  STEP(F, c, d, a, b, x[10], 0xffff5bb1, 17)
+  STEP(F, b, c, d, a, x[11], 0x895cd7be, 22)
+  STEP(F, a, b, c, d, x[12], 0x6b901122,  7)
+  STEP(F, d, a, b, c, x[13], 0xfd987193, 12)
+  STEP(F, c, d, a, b, x[14], 0xa679438e, 17)
+  STEP(F, b, c, d, a, x[15], 0x49b40821, 22)
+
+  STEP(G, a, b, c, d, x[ 1], 0xf61e2562,  5)
+  STEP(G, d, a, b, c, x[ 6], 0xc040b340,  9)
+  STEP(G, c, d, a, b, x[11], 0x265e5a51, 14)
+  STEP(G, b, c, d, a, x[ 0], 0xe9b6c7aa, 20)
+  STEP(G, a, b, c, d, x[ 5], 0xd62f105d,  5)
+  STEP(G, d, a, b, c, x[10], 0x02441453,  9)
+  STEP(G, c, d, a, b, x[15], 0xd8a1e681, 14)
+  STEP(G, b, c, d, a, x[ 4], 0xe7d3fbc8, 20)
+  STEP(G, a, b, c, d, x[ 9], 0x21e1cde6,  5)
+  STEP(G, d, a, b, c, x[14], 0xc33707d6,  9)
+  STEP(G, c, d, a, b, x[ 3], 0xf4d50d87, 14)
+  STEP(G, b, c, d, a, x[ 8], 0x455a14ed, 20)
+  STEP(G, a, b, c, d, x[13], 0xa9e3e905,  5)
+  STEP(G, d, a, b, c, x[ 2], 0xfcefa3f8,  9)
+  STEP(G, c, d, a, b, x[ 7], 0x676f02d9, 14)
+  STEP(G, b, c, d, a, x[12], 0x8d2a4c8a, 20)
+
+  STEP(H, a, b, c, d, x[ 5], 0xfffa3942,  4)
+  STEP(H, d, a, b, c, x[ 8], 0x8771f681, 11)
+  STEP(H, c, d, a, b, x[11], 0x6d9d6122, 16)
+  STEP(H, b, c, d, a, x[14], 0xfde5380c, 23)
+  STEP(H, a, b, c, d, x[ 1], 0xa4beea44,  4)
+  STEP(H, d, a, b, c, x[ 4], 0x4bdecfa9, 11)
+  STEP(H, c, d, a, b, x[ 7], 0xf6bb4b60, 16)
+  STEP(H, b, c, d, a, x[10], 0xbebfbc70, 23)
+  STEP(H, a, b, c, d, x[13], 0x289b7ec6,  4)
+  STEP(H, d, a, b, c, x[ 0], 0xeaa127fa, 11)
+  STEP(H, c, d, a, b, x[ 3], 0xd4ef3085, 16)
+  STEP(H, b, c, d, a, x[ 6], 0x04881d05, 23)
+  STEP(H, a, b, c, d, x[ 9], 0xd9d4d039,  4)
+  STEP(H, d, a, b, c, x[12], 0xe6db99e5, 11)
+  STEP(H, c, d, a, b, x[15], 0x1fa27cf8, 16)
+  STEP(H, b, c, d, a, x[ 2], 0xc4ac5665, 23)
+
+  STEP(I, a, b, c, d, x[ 0], 0xf4292244,  6)
+  STEP(I, d, a, b, c, x[ 7], 0x432aff97, 10)
+  STEP(I, c, d, a, b, x[14], 0xab9423a7, 15)
+  STEP(I, b, c, d, a, x[ 5], 0xfc93a039, 21)
+  STEP(I, a, b, c, d, x[12], 0x655b59c3,  6)
+  STEP(I, d, a, b, c, x[ 3], 0x8f0ccc92, 10)
+  STEP(I, c, d, a, b, x[10], 0xffeff47d, 15)
+  STEP(I, b, c, d, a, x[ 1], 0x85845dd1, 21)
+  STEP(I, a, b, c, d, x[ 8], 0x6fa87e4f,  6)
+  STEP(I, d, a, b, c, x[15], 0xfe2ce6e0, 10)
+  STEP(I, c, d, a, b, x[ 6], 0xa3014314, 15)
+  STEP(I, b, c, d, a, x[13], 0x4e0811a1, 21)
+  STEP(I, a, b, c, d, x[ 4], 0xf7537e82,  6)
+  STEP(I, d, a, b, c, x[11], 0xbd3af235, 10)
+  STEP(I, c, d, a, b, x[ 2], 0x2ad7d2bb, 15)
+  STEP(I, b, c, d, a, x[ 9], 0xeb86d391, 21)
+
+  state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+}
+/*}}}*/
+void md5_init(struct md5_ctx *ctx)/*{{{*/
+{
+  ctx->state[0] = 0x67452301;
+  ctx->state[1] = 0xefcdab89;
+  ctx->state[2] = 0x98badcfe;
+  ctx->state[3] = 0x10325476;
+  ctx->count = 0;
+}
+/*}}}*/
+void md5_update(struct md5_ctx *ctx, const void *data, size_t len)/*{{{*/
+{
+  const unsigned char *p = data;
+  size_t used = ctx->count & 63;
+
+  ctx->count += len;
+  if (used) {
+    size_t room = 64 - used;
+    if (len < room) {
+      memcpy(ctx->buffer + used, p, len);
+      return;
+    }
+    memcpy(ctx->buffer + used, p, room);
+    md5_block(ctx->state, ctx->buffer);
+    p += room;
+    len -= room;
+  }
+  while (len >= 64) {
+    md5_block(ctx->state, p);
+    p += 64;
+    len -= 64;
+  }
+  memcpy(ctx->buffer, p, len);
+}
+/*}}}*/
+void md5_final(struct md5_ctx *ctx, unsigned char digest[16])/*{{{*/
+{
+  static const unsigned char padding[64] = { 0x80 };
+  unsigned char bits[8];
+  uint64_t nbits = ctx->count << 3;
+  size_t used = ctx->count & 63;
+  int i;
+
+  for (i=0; i<8; i++) bits[i] = (nbits >> (8*i)) & 0xff;
+  md5_update(ctx, padding, (used < 56) ? (56 - used) : (120 - used));
+  md5_update(ctx, bits, 8);
+  for (i=0; i<4; i++) {
+    digest[4*i]   = (ctx->state[i]      ) & 0xff;
+    digest[4*i+1] = (ctx->state[i] >>  8) & 0xff;
+    digest[4*i+2] = (ctx->state[i] >> 16) & 0xff;
+    digest[4*i+3] = (ctx->state[i] >> 24) & 0xff;
+  }
+}
+/*}}}*/
+void md5_to_hex(const unsigned char digest[16], char *out)/*{{{*/
+{
+  static const char hex[] = "0123456789abcdef";
+  int i;
+  for (i=0; i<16; i++) {
+    out[2*i]   = hex[digest[i] >> 4];
+    out[2*i+1] = hex[digest[i] & 15];
+  }
+  out[32] = '\0';
+}
+/*}}}*/
+static int hex_value(int c)/*{{{*/
+{
+  if ((c >= '0') && (c <= '9')) return c - '0';
+  c = tolower(c);
+  if ((c >= 'a') && (c <= 'f')) return c - 'a' + 10;
+  return -1;
+}
+/*}}}*/
+int md5_from_hex(const char *hex, unsigned char digest[16])/*{{{*/
+{
+  int i, hi, lo;
+  for (i=0; i<16; i++) {
+    hi = hex_value(hex[2*i]);
+    if (hi < 0) return 0;
+    lo = hex_value(hex[2*i+1]);
+    if (lo < 0) return 0;
+    digest[i] = (hi << 4) | lo;
+  }
+  return 1;
+}
+/*}}}*/
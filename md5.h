@@ -0,0 +1,22 @@
+#ifndef MD5_H
+#define MD5_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct md5_ctx {
+  uint32_t state[4];
+  uint64_t count;  /* bytes processed so far */
+  unsigned char buffer[64];
+};
+
+extern void md5_init(struct md5_ctx *);
+extern void md5_update(struct md5_ctx *, const void *data, size_t len);
+extern void md5_final(struct md5_ctx *, unsigned char digest[16]);
+
+/* Write 32 hex digits plus a terminating null into out. */
+extern void md5_to_hex(const unsigned char digest[16], char *out);
+/* Return 1 if hex starts with 32 hex digits (which are parsed), else 0. */
+extern int md5_from_hex(const char *hex, unsigned char digest[16]);
+
+#endif /* MD5_H */
@@ -2,39 +2,259 @@
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "memory.h"
 #include "namecheck.h"
 
-enum pattern_type {/*{{{*/
-  PT_EXACT,
-  PT_STARTS_WITH,
-  PT_ENDS_WITH
+/* Each line of an @@UPLOAD@@ file is a glob, optionally preceded by '!' to
+ * reject what it matches.  The usual wildcards are understood : '?' for any
+ * one character, '[...]' for a set ('[!...]' or '[^...]' for its complement,
+ * with ranges like a-z), '*' for any run of characters not including '/',
+ * '**' for any run at all ('**' then '/' standing for any number of leading
+ * directories, including none), and '\' to take the next character literally.
+ *
+ * A pattern with no '/' in it is matched against the name alone.  One with a
+ * '/' is matched against the whole path (for @@TREE_UPLOAD@@ and
+ * @@GLOBAL_UPLOAD@@, relative to the directory holding the file); a leading
+ * '/' just anchors a pattern like '/build' there.
+ *
+ * To avoid trying every rule on every name, the rules are indexed by the
+ * literal text they start with in a trie, or failing that by the literal
+ * text they end with in a second trie over the reversed names, or failing
+ * that by the longest literal text they contain in a third.  Walking the name
+ * down the tries gives the only rules that could match, and those are tried
+ * in file order. */
+
+#define MAX_TOKENS 1024
+#define BITS_PER_WORD (8 * sizeof(unsigned long))
+#define STATE_WORDS ((MAX_TOKENS + BITS_PER_WORD) / BITS_PER_WORD)
+
+enum token_type {/*{{{*/
+  TK_CHAR,     /* one literal character */
+  TK_ANY,      /* '?' */
+  TK_CLASS,    /* '[...]' */
+  TK_STAR,     /* '*' */
+  TK_STARSTAR, /* '**' */
+  TK_ANYDIRS   /* '**' then '/' */
+};
+/*}}}*/
+struct token {/*{{{*/
+  enum token_type type;
+  unsigned char c;      /* for TK_CHAR */
+  unsigned char *class; /* for TK_CLASS : 256-bit map of the characters in the set */
+};
+/*}}}*/
+struct rule {/*{{{*/
+  int pass; /* 1 for a positive pattern, 0 for a negative one */
+  struct token *tokens;
+  int n_tokens;
+  /* The literal characters at each end; the tokens between them are what's
+   * left to match once the trie walk has found the rule. */
+  char *prefix;
+  int prefix_len;
+  char *suffix;
+  int suffix_len;
 };
 /*}}}*/
-struct pattern {/*{{{*/
-  struct pattern *next;
-  int pass; /* 1 for a positve pattern, 0 for a negative one */
-  enum pattern_type type;
-  char *pattern;
+struct trie_node {/*{{{*/
+  struct trie_node *child;
+  struct trie_node *sibling;
+  unsigned char c;
+  int exact;     /* first rule with no wildcards that is exactly this string, or -1 */
+  int *rules;    /* rules indexed here, in file order */
+  int n_rules;
+  int max_rules;
+};
+/*}}}*/
+struct rule_index {/*{{{*/
+  struct trie_node *prefixes; /* by literal prefix */
+  struct trie_node *suffixes; /* by literal suffix (read backwards), for rules with no prefix */
+  struct trie_node *infixes;  /* by longest literal run, for rules with neither */
 };
 /*}}}*/
 struct namecheck {/*{{{*/
-  struct pattern *head;
-  struct pattern *tail;
+  struct rule *rules;
+  int n_rules;
+  int max_rules;
+  struct rule_index names; /* rules matched against the last component */
+  struct rule_index paths; /* rules matched against the whole path */
 };
 /*}}}*/
+static struct trie_node *new_trie_node(unsigned char c)/*{{{*/
+{
+  struct trie_node *n;
+  n = new(struct trie_node);
+  n->child = n->sibling = NULL;
+  n->c = c;
+  n->exact = -1;
+  n->rules = NULL;
+  n->n_rules = n->max_rules = 0;
+  return n;
+}
+/*}}}*/
+static struct trie_node *find_child(const struct trie_node *n, unsigned char c)/*{{{*/
+{
+  struct trie_node *x;
+  for (x = n->child; x; x = x->sibling) {
+    if (x->c == c) return x;
+  }
+  return NULL;
+}
+/*}}}*/
+static struct trie_node *trie_insert(struct trie_node *n, const char *text, int len, int step)/*{{{*/
+{
+  /* Return the node for the len characters at text, read with the given step
+   * (+1 forwards, -1 backwards), creating it if needed. */
+  struct trie_node *x;
+  while (len--) {
+    x = find_child(n, (unsigned char) *text);
+    if (!x) {
+      x = new_trie_node((unsigned char) *text);
+      x->sibling = n->child;
+      n->child = x;
+    }
+    n = x;
+    text += step;
+  }
+  return n;
+}
+/*}}}*/
+static void trie_add_rule(struct trie_node *n, int index)/*{{{*/
+{
+  if (n->n_rules == n->max_rules) {
+    n->max_rules = n->max_rules ? 2 * n->max_rules : 4;
+    n->rules = grow_array(int, n->max_rules, n->rules);
+  }
+  n->rules[n->n_rules++] = index;
+}
+/*}}}*/
+static void free_trie(struct trie_node *n)/*{{{*/
+{
+  struct trie_node *next;
+  while (n) {
+    next = n->sibling;
+    free_trie(n->child);
+    if (n->rules) free(n->rules);
+    free(n);
+    n = next;
+  }
+}
+/*}}}*/
+static const char *parse_class(const char *p, unsigned char **class)/*{{{*/
+{
+  /* p points just after the '['.  Return the position after the closing ']',
+   * or NULL if there isn't one (in which case the '[' is taken literally). */
+  unsigned char map[32];
+  int negate = 0;
+  int first = 1;
+  int lo, hi, i;
+
+  memset(map, 0, sizeof(map));
+  if ((*p == '!') || (*p == '^')) {
+    negate = 1;
+    p++;
+  }
+  while (*p && ((*p != ']') || first)) {
+    first = 0;
+    if ((*p == '\\') && p[1]) p++;
+    lo = hi = (unsigned char) *p++;
+    if ((p[0] == '-') && p[1] && (p[1] != ']')) {
+      p++;
+      if ((*p == '\\') && p[1]) p++;
+      hi = (unsigned char) *p++;
+    }
+    for (i = lo; i <= hi; i++) map[i >> 3] |= 1 << (i & 7);
+  }
+  if (!*p) return NULL;
+  if (negate) {
+    for (i = 0; i < 32; i++) map[i] = ~map[i];
+  }
+  /* As with '?', a set never matches '/'. */
+  map['/' >> 3] &= ~(1 << ('/' & 7));
+  *class = new_array(unsigned char, 32);
+  memcpy(*class, map, 32);
+  return p + 1;
+}
+/*}}}*/
+static void compile_rule(const char *pattern, struct rule *r)/*{{{*/
+{
+  struct token *t;
+  const char *p, *q;
+  int n, i;
+
+  p = pattern;
+  t = new_array(struct token, strlen(p) + 1);
+  n = 0;
+  while (*p) {
+    t[n].class = NULL;
+    if (*p == '*') {
+      t[n].type = TK_STAR;
+      p++;
+      if (*p == '*') {
+        t[n].type = TK_STARSTAR;
+        while (*p == '*') p++;
+        if (*p == '/') {
+          t[n++].type = TK_ANYDIRS;
+          p++;
+          continue;
+        }
+      }
+      /* Runs like '*' '*' add nothing; keep just one. */
+      if ((n > 0) && (t[n-1].type == TK_STARSTAR || t[n-1].type == TK_STAR)) {
+        if (t[n].type == TK_STARSTAR) t[n-1].type = TK_STARSTAR;
+        continue;
+      }
+    } else if (*p == '?') {
+      t[n].type = TK_ANY;
+      p++;
+    } else if ((*p == '[') && (q = parse_class(p + 1, &t[n].class))) {
+      t[n].type = TK_CLASS;
+      p = q;
+    } else {
+      if ((*p == '\\') && p[1]) p++;
+      t[n].type = TK_CHAR;
+      t[n].c = (unsigned char) *p++;
+    }
+    n++;
+  }
+  if (n >= MAX_TOKENS) {
+    fprintf(stderr, "Pattern too long : [%s]\n", pattern);
+    exit(1);
+  }
+  r->tokens = t;
+  r->n_tokens = n;
+
+  for (i = 0; (i < n) && (t[i].type == TK_CHAR); i++) ;
+  r->prefix_len = i;
+  if (i < n) {
+    for (i = n; (i > r->prefix_len) && (t[i-1].type == TK_CHAR); i--) ;
+    r->suffix_len = n - i;
+  } else {
+    r->suffix_len = 0;
+  }
+  r->prefix = new_array(char, r->prefix_len + 1);
+  for (i = 0; i < r->prefix_len; i++) r->prefix[i] = t[i].c;
+  r->prefix[i] = 0;
+  r->suffix = new_array(char, r->suffix_len + 1);
+  for (i = 0; i < r->suffix_len; i++) r->suffix[i] = t[n - r->suffix_len + i].c;
+  r->suffix[i] = 0;
+}
+/*}}}*/
 static void map_line(char *line, struct namecheck *nc)/*{{{*/
 {
-  char *p, *q;
+  char *p;
   int len;
   int negate = 0;
-  int wild_at_start = 0;
-  int wild_at_end = 0;
-  struct pattern *np;
+  int index;
+  int i, start, run, best_start, best_run;
+  struct rule *r;
+  struct rule_index *ix;
+  struct trie_node *node;
   
   p = line;
   len = strlen(line);
-  if (line[len-1] == '\n') line[len-1] = 0;
+  if (len && (line[len-1] == '\n')) line[len-1] = 0;
   
   /* Allow comments */
   if (*p == '#') return;
@@ -45,48 +265,49 @@ static void map_line(char *line, struct namecheck *nc)/*{{{*/
   }
 
   while (*p && isspace(*p)) p++;
+  if (!*p) return;
 
-  if (*p == '*') {
-    wild_at_start = 1;
-    p++;
-  }
-
-  if (*p) {
-    q = p;
-    while (*q) {
-      if ((q[0] == '*') && !q[1]) {
-        wild_at_end = 1;
-        q[0] = 0;
-        break;
-      }
-      q++;
-    }
-  }
-
-  if (wild_at_start && wild_at_end) {
-    fprintf(stderr, "Cannot have pattern that is wild at both start and end : [%s]\n", line);
-    exit(1);
-  }
+  ix = strchr(p, '/') ? &nc->paths : &nc->names;
+  if (*p == '/') p++;
 
   /* Now build the record. */ 
-  np = new(struct pattern);
-  if (wild_at_start) np->type = PT_ENDS_WITH;
-  else if (wild_at_end) np->type = PT_STARTS_WITH;
-  else np->type = PT_EXACT;
-
-  if (p) {
-    np->pattern = new_string(p);
-  } else {
-    np->pattern = NULL; /* total wildcard */
+  if (nc->n_rules == nc->max_rules) {
+    nc->max_rules = nc->max_rules ? 2 * nc->max_rules : 16;
+    nc->rules = grow_array(struct rule, nc->max_rules, nc->rules);
   }
-  np->pass = negate ? 0 : 1;
-  
-  np->next = NULL;
-  if (!nc->head) {
-    nc->head = nc->tail = np;
+  index = nc->n_rules++;
+  r = &nc->rules[index];
+  r->pass = negate ? 0 : 1;
+  compile_rule(p, r);
+
+  if (r->prefix_len == r->n_tokens) {
+    /* No wildcards */
+    node = trie_insert(ix->prefixes, r->prefix, r->prefix_len, 1);
+    if (node->exact < 0) node->exact = index;
+  } else if (r->prefix_len) {
+    trie_add_rule(trie_insert(ix->prefixes, r->prefix, r->prefix_len, 1), index);
+  } else if (r->suffix_len) {
+    trie_add_rule(trie_insert(ix->suffixes, r->suffix + r->suffix_len - 1, r->suffix_len, -1), index);
   } else {
-    nc->tail->next = np;
-    nc->tail = np;
+    best_start = best_run = 0;
+    for (i = 0; i < r->n_tokens; i = start + run + 1) {
+      for (start = i; (start < r->n_tokens) && (r->tokens[start].type != TK_CHAR); start++) ;
+      for (run = 0; (start + run < r->n_tokens) && (r->tokens[start + run].type == TK_CHAR); run++) ;
+      if (run > best_run) {
+        best_start = start;
+        best_run = run;
+      }
+    }
+    if (best_run) {
+      node = ix->infixes;
+      for (i = best_start; i < best_start + best_run; i++) {
+        node = trie_insert(node, (const char *) &r->tokens[i].c, 1, 1);
+      }
+      trie_add_rule(node, index);
+    } else {
+      /* Nothing literal at all (e.g. '*'), so it has to be tried every time. */
+      trie_add_rule(ix->prefixes, index);
+    }
   }
   return;
 }
@@ -94,27 +315,59 @@ static void map_line(char *line, struct namecheck *nc)/*{{{*/
 /* Functions for comparing a filename against a list of patterns
  * and returning a boolean. */
 
-struct namecheck *make_namecheck(char *filename)/*{{{*/
+static void init_index(struct rule_index *ix)/*{{{*/
+{
+  ix->prefixes = new_trie_node(0);
+  ix->suffixes = new_trie_node(0);
+  ix->infixes = new_trie_node(0);
+}
+/*}}}*/
+static struct namecheck *read_namecheck(FILE *in)/*{{{*/
 {
   struct namecheck *result;
-  FILE *in;
   char line[1024];
 
+  result = new(struct namecheck);
+  result->rules = NULL;
+  result->n_rules = result->max_rules = 0;
+  init_index(&result->names);
+  init_index(&result->paths);
+  while (fgets(line, sizeof(line), in)) {
+    map_line(line, result);
+  }
+  fclose(in);
+  return result;
+}
+/*}}}*/
+struct namecheck *make_namecheck(char *filename)/*{{{*/
+{
+  FILE *in;
+
   in = fopen(filename, "r");
   if (in) {
-    result = new(struct namecheck);
-    result->head = result->tail = NULL;
-    while (fgets(line, sizeof(line), in)) {
-      map_line(line, result);
-    }
-    fclose(in);
+    return read_namecheck(in);
   } else {
-    result = NULL;
+    return NULL;
   }
 
-  return result;
-
 }/*}}}*/
+struct namecheck *make_namecheck_at(int dirfd, const char *filename)/*{{{*/
+{
+  /* As make_namecheck_dir, but relative to an open directory so that the
+   * probe doesn't have to resolve the full path again. */
+  int fd;
+  FILE *in;
+
+  fd = openat(dirfd, filename, O_RDONLY);
+  if (fd < 0) return NULL;
+  in = fdopen(fd, "r");
+  if (!in) {
+    close(fd);
+    return NULL;
+  }
+  return read_namecheck(in);
+}
+/*}}}*/
 struct namecheck *make_namecheck_dir(const char *dir, const char *filename)/*{{{*/
 {
   int l1, l2;
@@ -134,73 +387,339 @@ struct namecheck *make_namecheck_dir(const char *dir, const char *filename)/*{{{
 /*}}}*/
 void free_namecheck(struct namecheck *nc)/*{{{*/
 {
-  struct pattern *p, *np;
-  for (p=nc->head; p; p=np) {
-    np = p->next;
-    free(p->pattern);
-    free(p);
+  int i, j;
+  for (i=0; i<nc->n_rules; i++) {
+    for (j=0; j<nc->rules[i].n_tokens; j++) {
+      if (nc->rules[i].tokens[j].class) free(nc->rules[i].tokens[j].class);
+    }
+    free(nc->rules[i].tokens);
+    free(nc->rules[i].prefix);
+    free(nc->rules[i].suffix);
   }
+  if (nc->rules) free(nc->rules);
+  free_trie(nc->names.prefixes);
+  free_trie(nc->names.suffixes);
+  free_trie(nc->names.infixes);
+  free_trie(nc->paths.prefixes);
+  free_trie(nc->paths.suffixes);
+  free_trie(nc->paths.infixes);
   free(nc);
 }
 /*}}}*/
 
-static int ends_with(const char *name, const char *pattern) {/*{{{*/
-  int len, patlen;
-  len = strlen(name);
-  patlen = strlen(pattern);
-  if (len > patlen) {
-    if (!strcmp(name+len-patlen, pattern)) {
-      return 1;
-    } else {
-      return 0;
+static int match_tokens(const struct token *t, int n, const unsigned char *s, int len,/*{{{*/
+                        int at_start)
+{
+  /* Run the tokens as a non-deterministic automaton over s : state i means
+   * the first i tokens have been matched.  This avoids the exponential
+   * backtracking that patterns like '*a*a*a*b' can otherwise cause.  '**' '/'
+   * can match no directories at all, but only where a path component
+   * starts : at the start of s if at_start is set, or just after a '/'. */
+  unsigned long states[2][STATE_WORDS];
+  unsigned long *cur = states[0], *next = states[1], *tmp;
+  int words = n / BITS_PER_WORD + 1;
+  int i, k, any;
+
+#define SET(x, i) ((x)[(i) / BITS_PER_WORD] |= 1UL << ((i) % BITS_PER_WORD))
+#define IS_SET(x, i) (((x)[(i) / BITS_PER_WORD] >> ((i) % BITS_PER_WORD)) & 1)
+
+  /* The commonest cases, after the literal ends have been matched. */
+  if (n == 0) return (len == 0);
+  if (n == 1) {
+    switch (t[0].type) {
+      case TK_STAR:     return !memchr(s, '/', len);
+      case TK_STARSTAR: return 1;
+      default: break;
     }
-  } else {
-    return 0;
   }
+
+  memset(cur, 0, words * sizeof(unsigned long));
+  SET(cur, 0);
+  for (i = 0; i < n; i++) {
+    if (IS_SET(cur, i) && ((t[i].type == TK_STAR) || (t[i].type == TK_STARSTAR) ||
+                           ((t[i].type == TK_ANYDIRS) && at_start))) {
+      SET(cur, i+1);
+    }
+  }
+  for (k = 0; k < len; k++) {
+    memset(next, 0, words * sizeof(unsigned long));
+    any = 0;
+    for (i = 0; i < n; i++) {
+      if (!IS_SET(cur, i)) continue;
+      switch (t[i].type) {
+        case TK_CHAR:
+          if (t[i].c == s[k]) { SET(next, i+1); any = 1; }
+          break;
+        case TK_ANY:
+          if (s[k] != '/') { SET(next, i+1); any = 1; }
+          break;
+        case TK_CLASS:
+          if ((t[i].class[s[k] >> 3] >> (s[k] & 7)) & 1) { SET(next, i+1); any = 1; }
+          break;
+        case TK_STAR:
+          if (s[k] != '/') { SET(next, i); any = 1; }
+          break;
+        case TK_STARSTAR:
+          SET(next, i);
+          any = 1;
+          break;
+        case TK_ANYDIRS:
+          SET(next, i);
+          if (s[k] == '/') SET(next, i+1);
+          any = 1;
+          break;
+      }
+    }
+    if (!any) return 0;
+    for (i = 0; i < n; i++) {
+      if (IS_SET(next, i) && ((t[i].type == TK_STAR) || (t[i].type == TK_STARSTAR) ||
+                              ((t[i].type == TK_ANYDIRS) && (s[k] == '/')))) {
+        SET(next, i+1);
+      }
+    }
+    tmp = cur; cur = next; next = tmp;
+  }
+  return IS_SET(cur, n);
+
+#undef SET
+#undef IS_SET
 }
 /*}}}*/
-static int starts_with(const char *name, const char *pattern)/*{{{*/
+static int rule_matches(const struct rule *r, const char *name, int len)/*{{{*/
 {
-  if (pattern) {
-    int patlen = strlen(pattern);
-    if (!strncmp(name, pattern, patlen)) {
-      return 1;
-    } else {
-      return 0;
+  int middle;
+  middle = len - r->prefix_len - r->suffix_len;
+  if (middle < 0) return 0;
+  if (memcmp(name, r->prefix, r->prefix_len)) return 0;
+  if (memcmp(name + len - r->suffix_len, r->suffix, r->suffix_len)) return 0;
+  return match_tokens(r->tokens + r->prefix_len, r->n_tokens - r->prefix_len - r->suffix_len,
+                      (const unsigned char *) name + r->prefix_len, middle,
+                      (r->prefix_len == 0) || (r->prefix[r->prefix_len - 1] == '/'));
+}
+/*}}}*/
+static int first_match(const struct namecheck *nc, const struct trie_node *node,/*{{{*/
+                       const char *name, int len, int best)
+{
+  /* Return the first of the rules at node that matches, if it comes before
+   * best. */
+  int i;
+  for (i = 0; (i < node->n_rules) && (node->rules[i] < best); i++) {
+    if (rule_matches(&nc->rules[node->rules[i]], name, len)) return node->rules[i];
+  }
+  return best;
+}
+/*}}}*/
+static int index_lookup(const struct namecheck *nc, const struct rule_index *ix,/*{{{*/
+                        const char *name, int best)
+{
+  /* Return the first rule in ix that matches name, if it comes before best. */
+  const struct trie_node *node;
+  int len, i, j;
+
+  len = strlen(name);
+
+  node = ix->prefixes;
+  for (i = 0; ; i++) {
+    best = first_match(nc, node, name, len, best);
+    if (i == len) {
+      if ((node->exact >= 0) && (node->exact < best)) best = node->exact;
+      break;
     }
-  } else {
-    /* Full wildcard, i.e. '*' or '!*' */
-    return 1;
+    node = find_child(node, (unsigned char) name[i]);
+    if (!node) break;
+  }
+
+  node = ix->suffixes;
+  for (i = len - 1; i >= 0; i--) {
+    node = find_child(node, (unsigned char) name[i]);
+    if (!node) break;
+    best = first_match(nc, node, name, len, best);
   }
+
+  for (i = 0; i < len; i++) {
+    node = ix->infixes;
+    for (j = i; j < len; j++) {
+      node = find_child(node, (unsigned char) name[j]);
+      if (!node) break;
+      best = first_match(nc, node, name, len, best);
+    }
+  }
+  return best;
 }
 /*}}}*/
-enum nc_result lookup_namecheck(const struct namecheck *nc, const char *filename)/*{{{*/
+enum nc_result lookup_namecheck_path(const struct namecheck *nc, const char *path)/*{{{*/
 {
   /* It's always the FIRST match that prevails - this is quicker than searching
    * for the last match! */
-  struct pattern *p;
-  for (p=nc->head; p; p=p->next) {
-    switch (p->type) {
-      case PT_EXACT:
-        if (!strcmp(filename, p->pattern)) {
-          if (p->pass) return NC_PASS;
-          else         return NC_FAIL;
-        }
-        break;
-      case PT_STARTS_WITH:
-        if (starts_with(filename, p->pattern)) {
-          if (p->pass) return NC_PASS;
-          else         return NC_FAIL;
-        }
-        break;
-      case PT_ENDS_WITH:
-        if (ends_with(filename, p->pattern)) {
-          if (p->pass) return NC_PASS;
-          else         return NC_FAIL;
-        }
-        break;
+  const char *name;
+  int best;
+
+  name = strrchr(path, '/');
+  name = name ? name + 1 : path;
+  best = index_lookup(nc, &nc->names, name, nc->n_rules);
+  best = index_lookup(nc, &nc->paths, path, best);
+
+  if (best == nc->n_rules) return NC_UNMATCHED;
+  return nc->rules[best].pass ? NC_PASS : NC_FAIL;
+}
+/*}}}*/
+enum nc_result lookup_namecheck(const struct namecheck *nc, const char *filename)/*{{{*/
+{
+  return lookup_namecheck_path(nc, filename);
+}
+/*}}}*/
+
+#ifdef TEST
+/* Microbenchmark : gcc -O2 -DTEST -o namecheck-bench namecheck.c
+ * Matches a million names against 10000 rules, checking a sample of the
+ * results against fnmatch() tried on each rule in turn, and '**' patterns
+ * against known answers. */
+#include <fnmatch.h>
+#include <sys/time.h>
+
+#define N_RULES 10000
+#define N_NAMES 1000000
+#define N_CHECKED 2000
+
+static double now(void)/*{{{*/
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + 1.0e-6 * tv.tv_usec;
+}
+/*}}}*/
+static void random_word(char *out, int len)/*{{{*/
+{
+  int i;
+  for (i = 0; i < len; i++) out[i] = 'a' + rand() % 26;
+  out[len] = 0;
+}
+/*}}}*/
+static void make_rule(char *out)/*{{{*/
+{
+  char w1[16], w2[16];
+  random_word(w1, 3 + rand() % 6);
+  random_word(w2, 2 + rand() % 3);
+  switch (rand() % 8) {
+    case 0: case 1: sprintf(out, "%s%s.%s", (rand() & 1) ? "!" : "", w1, w2); break;
+    case 2: case 3: sprintf(out, "%s%s*", (rand() & 1) ? "!" : "", w1); break;
+    case 4: case 5: sprintf(out, "%s*.%s", (rand() & 1) ? "!" : "", w2); break;
+    case 6:         sprintf(out, "%s?%s[0-9]*", (rand() & 1) ? "!" : "", w2); break;
+    default:        sprintf(out, "%s*%s*", (rand() & 1) ? "!" : "", w1); break;
+  }
+}
+/*}}}*/
+static void make_name(char *out, char rules[][32])/*{{{*/
+{
+  /* Mostly names that some rule is aimed at, with some that nothing is. */
+  char w[16];
+  const char *r = rules[rand() % N_RULES];
+  const char *star;
+  if (*r == '!') r++;
+  random_word(w, 1 + rand() % 8);
+  if (rand() % 4 == 0) {
+    sprintf(out, "%s.%s", w, "zz");
+  } else if (!strchr(r, '*')) {
+    strcpy(out, r);
+  } else if ((star = strchr(r, '*')) && (star == r) && (strlen(r) > 1) && (r[1] != '.')) {
+    sprintf(out, "%s%.*s%s", w, (int) strlen(r) - 2, r + 1, w);
+  } else if (star == r) {
+    sprintf(out, "%s%s", w, r + 1);
+  } else if (r[0] == '?') {
+    sprintf(out, "x%.*s%d%s", (int) (strchr(r, '[') - r - 1), r + 1, rand() % 10, w);
+  } else {
+    sprintf(out, "%.*s%s", (int) (star - r), r, w);
+  }
+}
+/*}}}*/
+static enum nc_result linear_lookup(char rules[][32], const char *name)/*{{{*/
+{
+  int i;
+  const char *r;
+  for (i = 0; i < N_RULES; i++) {
+    r = rules[i];
+    if (*r == '!') {
+      if (!fnmatch(r + 1, name, FNM_PATHNAME)) return NC_FAIL;
+    } else {
+      if (!fnmatch(r, name, FNM_PATHNAME)) return NC_PASS;
     }
   }
   return NC_UNMATCHED;
 }
 /*}}}*/
+static int check_anydirs(void)/*{{{*/
+{
+  /* fnmatch() has no '**', so check those patterns against known answers. */
+  static const struct { const char *pattern, *name; int matches; } cases[] = {
+    { "**/build", "build", 1 },       { "**/build", "a/b/build", 1 },
+    { "**/build", "mybuild", 0 },     { "**/build", "a/rebuild", 0 },
+    { "x/**/y", "x/y", 1 },           { "x/**/y", "x/a/b/y", 1 },
+    { "x/**/y", "x/ay", 0 },          { "x/**/y", "xy", 0 },
+    { "*/**/b", "x/b", 1 },           { "*/**/b", "x/c/b", 1 },
+    { "*/**/b", "x/cb", 0 },          { "*/**/b", "xb", 0 },
+    { "**/*.o", "a.o", 1 },           { "**/*.o", "d/e/a.o", 1 },
+    { "**/*.o", "d/a/o", 0 },         { "**/node_modules", "a/node_modules", 1 },
+    { "**/node_modules", "my_node_modules", 0 },
+    { NULL, NULL, 0 }
+  };
+  struct namecheck *nc;
+  FILE *f;
+  int i, got, errors = 0;
+  for (i = 0; cases[i].pattern; i++) {
+    f = tmpfile();
+    fprintf(f, "%s\n", cases[i].pattern);
+    rewind(f);
+    nc = read_namecheck(f);
+    got = (lookup_namecheck(nc, cases[i].name) == NC_PASS);
+    if (got != cases[i].matches) {
+      printf("Mismatch for %s against %s\n", cases[i].name, cases[i].pattern);
+      errors++;
+    }
+    free_namecheck(nc);
+  }
+  return errors;
+}
+/*}}}*/
+int main (int argc, char **argv) {
+  static char rules[N_RULES][32];
+  static char names[N_NAMES][32];
+  struct namecheck *nc;
+  FILE *f;
+  int i, counts[3], errors;
+  double t0, t1, t2;
+
+  srand(1);
+  f = tmpfile();
+  for (i = 0; i < N_RULES; i++) {
+    make_rule(rules[i]);
+    fprintf(f, "%s\n", rules[i]);
+  }
+  rewind(f);
+  for (i = 0; i < N_NAMES; i++) make_name(names[i], rules);
+
+  t0 = now();
+  nc = read_namecheck(f);
+  t1 = now();
+  counts[0] = counts[1] = counts[2] = 0;
+  for (i = 0; i < N_NAMES; i++) counts[lookup_namecheck(nc, names[i])]++;
+  t2 = now();
+  printf("%d rules compiled in %.3fs\n", N_RULES, t1 - t0);
+  printf("%d names in %.3fs (%.2fus each) : %d pass, %d fail, %d unmatched\n",
+         N_NAMES, t2 - t1, 1.0e6 * (t2 - t1) / N_NAMES,
+         counts[NC_PASS], counts[NC_FAIL], counts[NC_UNMATCHED]);
+
+  errors = 0;
+  t0 = now();
+  for (i = 0; i < N_CHECKED; i++) {
+    if (linear_lookup(rules, names[i]) != lookup_namecheck(nc, names[i])) {
+      if (errors++ < 10) printf("Mismatch for %s\n", names[i]);
+    }
+  }
+  t1 = now();
+  printf("fnmatch on each rule in turn : %.2fus each, %d mismatches in %d names\n",
+         1.0e6 * (t1 - t0) / N_CHECKED, errors, N_CHECKED);
+  free_namecheck(nc);
+  errors += check_anydirs();
+  return errors ? 1 : 0;
+}
+#endif
@@ -11,9 +11,13 @@ struct namecheck;
 
 extern struct namecheck *make_namecheck_dir(const char *dir, const char *filename);
 extern struct namecheck *make_namecheck(char *filename);
+extern struct namecheck *make_namecheck_at(int dirfd, const char *filename);
 extern void free_namecheck(struct namecheck *);
 
 extern enum nc_result lookup_namecheck(const struct namecheck *, const char *filename);
+/* As lookup_namecheck, but patterns containing '/' are tried against the
+ * whole of path (the rest just against its last component). */
+extern enum nc_result lookup_namecheck_path(const struct namecheck *, const char *path);
 
 #endif /* NAMECHECK_H */
 
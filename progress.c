@@ -0,0 +1,251 @@
+/*
+ * Show how far through sending the files we are.
+ * */
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "progress.h"
+
+#define TTY_INTERVAL 1   /* seconds between redraws of the status line */
+#define LOG_INTERVAL 10  /* seconds between lines when stdout isn't a terminal */
+#define RATE_WINDOW 10   /* seconds over which the rate is averaged */
+
+struct progress_state {/*{{{*/
+  int running;
+  int is_tty;
+  int drawn;            /* 1 if the status line is on the screen */
+  int total_files;
+  size_t total_bytes;
+  /* Updated without the lock, atomically */
+  int files_done;
+  size_t bytes_done;    /* sent, or found not to need sending */
+  size_t bytes_sent;    /* actually sent, for the rate */
+  /* bytes_sent as it was at each of the last few ticks, for the rate */
+  double sample_time[RATE_WINDOW + 1];
+  size_t sample_sent[RATE_WINDOW + 1];
+  int n_samples;
+  pthread_mutex_t lock; /* covers stdout too */
+  pthread_cond_t wake;
+  pthread_t thread;
+};
+/*}}}*/
+static struct progress_state state = { 0 };
+static pthread_mutex_t nesting_lock = PTHREAD_MUTEX_INITIALIZER;
+static int nesting = 0;
+static __thread int own_nesting = 0; /* begun by this thread and not ended */
+static __thread const char *label = NULL;
+
+static double now(void)/*{{{*/
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + 1.0e-6 * tv.tv_usec;
+}
+/*}}}*/
+char *format_bytes(double n, char buf[16])/*{{{*/
+{
+  static const char *units[] = { "bytes", "kB", "MB", "GB", "TB" };
+  int u = 0;
+  while ((n >= 1000.0) && (u < 4)) {
+    n /= 1024.0;
+    u++;
+  }
+  if (u == 0) sprintf(buf, "%.0f %s", n, units[u]);
+  else sprintf(buf, "%.1f %s", n, units[u]);
+  return buf;
+}
+/*}}}*/
+static double current_rate(void)/*{{{*/
+{
+  /* Bytes per second over the sampling window. */
+  int oldest = 0, newest = state.n_samples - 1;
+  double dt;
+  if (state.n_samples < 2) return 0.0;
+  dt = state.sample_time[newest] - state.sample_time[oldest];
+  if (dt <= 0.0) return 0.0;
+  return (state.sample_sent[newest] - state.sample_sent[oldest]) / dt;
+}
+/*}}}*/
+static void take_sample(void)/*{{{*/
+{
+  int i;
+  if (state.n_samples == RATE_WINDOW + 1) {
+    for (i = 1; i < state.n_samples; i++) {
+      state.sample_time[i-1] = state.sample_time[i];
+      state.sample_sent[i-1] = state.sample_sent[i];
+    }
+    state.n_samples--;
+  }
+  state.sample_time[state.n_samples] = now();
+  state.sample_sent[state.n_samples] = state.bytes_sent;
+  state.n_samples++;
+}
+/*}}}*/
+static void draw(void)/*{{{*/
+{
+  /* Call with the lock held. */
+  char done[16], total[16], rate_text[16], eta[32];
+  double rate, fraction;
+  size_t bytes_done = state.bytes_done;
+  long secs;
+
+  if (state.total_bytes) fraction = (double) bytes_done / state.total_bytes;
+  else if (state.total_files) fraction = (double) state.files_done / state.total_files;
+  else fraction = 1.0;
+  if (fraction > 1.0) fraction = 1.0;
+
+  rate = current_rate();
+  if ((rate > 0.0) && (bytes_done < state.total_bytes)) {
+    secs = (long) ((state.total_bytes - bytes_done) / rate + 0.5);
+    if (secs >= 3600) sprintf(eta, "%ld:%02ld:%02ld", secs / 3600, (secs / 60) % 60, secs % 60);
+    else sprintf(eta, "%ld:%02ld", secs / 60, secs % 60);
+  } else if (bytes_done >= state.total_bytes) {
+    sprintf(eta, "0:00");
+  } else {
+    sprintf(eta, "--:--");
+  }
+
+  printf("%s[%3d%%] %d of %d files, %s of %s, %s/s, ETA %s%s",
+         state.is_tty ? "\r\033[K" : "Progress : ",
+         (int) (100.0 * fraction), state.files_done, state.total_files,
+         format_bytes(bytes_done, done), format_bytes(state.total_bytes, total),
+         format_bytes(rate, rate_text), eta,
+         state.is_tty ? "" : "\n");
+  fflush(stdout);
+  state.drawn = state.is_tty;
+}
+/*}}}*/
+static void clear(void)/*{{{*/
+{
+  /* Call with the lock held. */
+  if (state.drawn) {
+    printf("\r\033[K");
+    state.drawn = 0;
+  }
+}
+/*}}}*/
+static void *renderer(void *arg)/*{{{*/
+{
+  /* Redraw at a fixed rate, whatever size of chunks the data goes in. */
+  struct timespec until;
+  int interval, ticks = 0;
+
+  interval = state.is_tty ? TTY_INTERVAL : LOG_INTERVAL;
+  pthread_mutex_lock(&state.lock);
+  clock_gettime(CLOCK_REALTIME, &until);
+  while (state.running) {
+    until.tv_sec += 1;
+    pthread_cond_timedwait(&state.wake, &state.lock, &until);
+    if (!state.running) break;
+    take_sample();
+    if (++ticks % interval == 0) draw();
+  }
+  pthread_mutex_unlock(&state.lock);
+  return NULL;
+}
+/*}}}*/
+void progress_begin(int n_files, size_t n_bytes)/*{{{*/
+{
+  own_nesting++;
+  pthread_mutex_lock(&nesting_lock);
+  if (nesting++ > 0) {
+    __sync_fetch_and_add(&state.total_files, n_files);
+    __sync_fetch_and_add(&state.total_bytes, n_bytes);
+    pthread_mutex_unlock(&nesting_lock);
+    return;
+  }
+  state.is_tty = isatty(fileno(stdout));
+  state.drawn = 0;
+  state.total_files = n_files;
+  state.total_bytes = n_bytes;
+  state.files_done = 0;
+  state.bytes_done = 0;
+  state.bytes_sent = 0;
+  state.n_samples = 0;
+  pthread_mutex_init(&state.lock, NULL);
+  pthread_cond_init(&state.wake, NULL);
+  take_sample();
+  state.running = 1;
+  if (pthread_create(&state.thread, NULL, renderer, NULL) != 0) {
+    /* Just do without */
+    state.running = 0;
+  }
+  pthread_mutex_unlock(&nesting_lock);
+}
+/*}}}*/
+void progress_sent(size_t n)/*{{{*/
+{
+  __sync_fetch_and_add(&state.bytes_sent, n);
+  __sync_fetch_and_add(&state.bytes_done, n);
+}
+/*}}}*/
+void progress_file_done(size_t planned, size_t sent)/*{{{*/
+{
+  /* Wraps round correctly if more was sent than planned. */
+  __sync_fetch_and_add(&state.bytes_done, planned - sent);
+  __sync_fetch_and_add(&state.files_done, 1);
+}
+/*}}}*/
+void progress_message(const char *fmt, ...)/*{{{*/
+{
+  va_list ap;
+  int running = state.running;
+  if (running) {
+    pthread_mutex_lock(&state.lock);
+    clear();
+  }
+  if (label) printf("[%s] ", label);
+  va_start(ap, fmt);
+  vprintf(fmt, ap);
+  va_end(ap);
+  fflush(stdout);
+  if (running) {
+    if (state.is_tty) draw();
+    pthread_mutex_unlock(&state.lock);
+  }
+}
+/*}}}*/
+void progress_end(void)/*{{{*/
+{
+  if (own_nesting > 0) own_nesting--;
+  pthread_mutex_lock(&nesting_lock);
+  if ((nesting == 0) || (--nesting > 0)) {
+    pthread_mutex_unlock(&nesting_lock);
+    return;
+  }
+  if (!state.running) {
+    pthread_mutex_unlock(&nesting_lock);
+    return;
+  }
+  pthread_mutex_lock(&state.lock);
+  state.running = 0;
+  pthread_cond_signal(&state.wake);
+  pthread_mutex_unlock(&state.lock);
+  pthread_join(state.thread, NULL);
+  clear();
+  fflush(stdout);
+  pthread_mutex_destroy(&state.lock);
+  pthread_cond_destroy(&state.wake);
+  pthread_mutex_unlock(&nesting_lock);
+}
+/*}}}*/
+void progress_end_own(void)/*{{{*/
+{
+  while (own_nesting > 0) progress_end();
+}
+/*}}}*/
+void progress_set_label(const char *new_label)/*{{{*/
+{
+  label = new_label;
+}
+/*}}}*/
+const char *progress_get_label(void)/*{{{*/
+{
+  return label;
+}
+/*}}}*/
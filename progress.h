@@ -0,0 +1,39 @@
+#ifndef PROGRESS_H
+#define PROGRESS_H
+
+#include <sys/types.h>
+
+/* Overall progress while files are being sent, shown as a status line that
+ * is redrawn once a second on a terminal, or as a log line every so often
+ * otherwise.  All the functions may be called from any thread. */
+
+/* Start showing progress towards sending n_files files, n_bytes in all.
+ * Calls may nest, as when uploading to several mirrors at once : the totals
+ * add up, and the status line stays until the last progress_end. */
+extern void progress_begin(int n_files, size_t n_bytes);
+
+/* Note n more bytes sent. */
+extern void progress_sent(size_t n);
+
+/* Note a file finished : 'planned' is what it was counted as in the total,
+ * 'sent' what actually went (less if only part of it needed sending). */
+extern void progress_file_done(size_t planned, size_t sent);
+
+/* printf, keeping the status line out of the way. */
+extern void progress_message(const char *fmt, ...);
+
+/* Start each message from this thread with "[label] ", to tell apart work
+ * going on side by side; NULL for none.  The label isn't copied. */
+extern void progress_set_label(const char *label);
+extern const char *progress_get_label(void);
+
+/* Stop showing progress. */
+extern void progress_end(void);
+/* Match any progress_begin made by this thread that hasn't been ended, as
+ * when it gives up part way (see fail.h). */
+extern void progress_end_own(void);
+
+/* Write n as e.g. "1.5 MB" into buf. */
+extern char *format_bytes(double n, char buf[16]);
+
+#endif /* PROGRESS_H */
@@ -3,25 +3,171 @@
  * */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <sys/types.h>
 
 #include "ftp.h"
 #include "invent.h"
+#include "journal.h"
 #include "memory.h"
 
-static void scan_one_dir(struct FTP *ctrl_con, const char *path, struct fnode *x)/*{{{*/
+/* The records for each directory are appended to the listing as soon as it
+ * has been listed, so only the directories still to be listed are held in
+ * memory.  They are also kept in a checkpoint file next to the listing,
+ * rewritten after each directory :
+
+   O <offset>
+   S <path>
+
+   <offset> (in hex) is the length of the listing at that point, and there is
+   one 'S' line for each directory still to be listed, the next one last.  If
+   the crawl is interrupted, running it again picks up from the checkpoint,
+   first cutting the listing back to <offset> in case the directory after
+   it was partly written.  The checkpoint is removed once the crawl is
+   complete. */
+
+struct frontier {/*{{{*/
+  /* Directories still to be listed, as a stack so that the crawl goes depth
+   * first and the stack stays small. */
+  char **paths;
+  int n;
+  int max;
+};
+/*}}}*/
+static void push_dir(struct frontier *fr, char *path)/*{{{*/
 {
+  /* fr takes ownership of path. */
+  if (fr->n == fr->max) {
+    fr->max = fr->max ? 2 * fr->max : 64;
+    fr->paths = grow_array(char *, fr->max, fr->paths);
+  }
+  fr->paths[fr->n++] = path;
+}
+/*}}}*/
+static char *checkpoint_name(const char *listing_file)/*{{{*/
+{
+  char *name = new_array(char, strlen(listing_file) + 7);
+  strcpy(name, listing_file);
+  strcat(name, ".crawl");
+  return name;
+}
+/*}}}*/
+static void write_checkpoint(const char *checkpoint, long offset, const struct frontier *fr)/*{{{*/
+{
+  char *nf;
+  FILE *out;
+  int i;
+
+  nf = new_array(char, strlen(checkpoint) + 5);
+  strcpy(nf, checkpoint);
+  strcat(nf, ".new");
+  out = fopen(nf, "w");
+  if (!out) {
+    fprintf(stderr, "Could not write crawl checkpoint %s\n", nf);
+    exit(1);
+  }
+  fprintf(out, "O %lx\n", (unsigned long) offset);
+  for (i=0; i<fr->n; i++) {
+    fprintf(out, "S %s\n", fr->paths[i]);
+  }
+  if ((fclose(out) != 0) || (rename(nf, checkpoint) < 0)) {
+    fprintf(stderr, "Could not write crawl checkpoint %s\n", checkpoint);
+    exit(1);
+  }
+  free(nf);
+}
+/*}}}*/
+static int read_checkpoint(const char *checkpoint, long *offset, struct frontier *fr)/*{{{*/
+{
+  /* Return 0 if there's no checkpoint. */
+  FILE *in;
+  char *line = NULL;
+  size_t linesize = 0;
+  unsigned long o;
+  int has_offset = 0;
+
+  in = fopen(checkpoint, "r");
+  if (!in) return 0;
+  while (getline(&line, &linesize, in) > 0) {
+    line[strcspn(line, "\n")] = '\0';
+    if ((line[0] == 'O') && (sscanf(line + 2, "%lx", &o) == 1)) {
+      *offset = o;
+      has_offset = 1;
+    } else if (line[0] == 'S') {
+      push_dir(fr, new_string(line + 2));
+    } else {
+      fprintf(stderr, "Crawl checkpoint %s corrupted\n", checkpoint);
+      exit(1);
+    }
+  }
+  if (line) free(line);
+  fclose(in);
+  if (!has_offset) {
+    fprintf(stderr, "Crawl checkpoint %s corrupted\n", checkpoint);
+    exit(1);
+  }
+  return 1;
+}
+/*}}}*/
+static void check_header(const char *listing_file, const char *checkpoint,/*{{{*/
+                         const char *hostname, const int port_number,
+                         const char *username, const char *remote_root)
+{
+  /* Only resume a crawl of the same site. */
+  struct remote_params rp;
+  FILE *in;
+  char line[8192];
+
+  init_remote_params(&rp);
+  rp.port_number = 0;
+  in = fopen(listing_file, "r");
+  if (!in) {
+    fprintf(stderr, "Couldn't open listing file %s to resume the crawl\n", listing_file);
+    exit(1);
+  }
+  while (fgets(line, sizeof(line), in) && strchr("HUPR", line[0])) {
+    line[strcspn(line, "\n")] = '\0';
+    switch (line[0]) {
+      case 'H': rp.hostname = new_string(line + 2); break;
+      case 'U': rp.username = new_string(line + 2); break;
+      case 'P': rp.port_number = atoi(line + 2); break;
+      case 'R': rp.remote_root = new_string(line + 2); break;
+    }
+  }
+  fclose(in);
+  if (!rp.hostname || strcmp(rp.hostname, hostname) ||
+      !rp.username || strcmp(rp.username, username) ||
+      (rp.port_number != port_number) ||
+      (!rp.remote_root != !remote_root) ||
+      (remote_root && strcmp(rp.remote_root, remote_root))) {
+    fprintf(stderr, "%s is from a crawl of a different site; remove %s to start again\n",
+            listing_file, checkpoint);
+    exit(1);
+  }
+  if (rp.hostname) free(rp.hostname);
+  if (rp.username) free(rp.username);
+  if (rp.remote_root) free(rp.remote_root);
+}
+/*}}}*/
+static void scan_one_dir(struct FTP *ctrl_con, const char *path, FILE *out, struct frontier *fr)/*{{{*/
+{
+  /* Write out the entries of one directory, and add its subdirectories to
+   * the frontier in the order they were listed. */
   struct FTP_stat *files;
   int n_files;
-  int i;
+  int i, first_dir;
   int dirlen, namelen, totallen;
   char *full_path;
+  struct fnode nfn;
 
   dirlen = strlen(path);
 
   printf("Scanning directory %s\n", path);
   fflush(stdout);
   ftp_lsdir(ctrl_con, path, &files, &n_files);
+  first_dir = fr->n;
   for (i=0; i<n_files; i++) {
     if (!strcmp(files[i].name, ".")) continue;
     if (!strcmp(files[i].name, "..")) continue;
@@ -37,25 +183,17 @@ static void scan_one_dir(struct FTP *ctrl_con, const char *path, struct fnode *x
     }
 
     if (files[i].is_dir) {
-      struct fnode *nfn;
-      nfn = new(struct fnode);
-      nfn->name = files[i].name;
-      nfn->path = full_path;
-      nfn->is_dir = 1;
-      nfn->x.dir.next = nfn->x.dir.prev = (struct fnode *) &nfn->x.dir;
-      add_fnode_at_start(x, nfn);
-      scan_one_dir(ctrl_con, full_path, (struct fnode *) &nfn->x.dir.next);
+      fprintf(out, "D                   %s\n", full_path);
+      push_dir(fr, full_path);
     } else {
       /* regular file */
-      struct fnode *nfn;
-      nfn = new(struct fnode);
-      nfn->name = files[i].name;
-      nfn->path = full_path;
-      nfn->is_dir = 0;
-      nfn->x.file.size = files[i].size;
-      nfn->x.file.mtime = 0;
-      nfn->x.file.peer = NULL;
-      add_fnode_at_end(x, nfn);
+      nfn.is_dir = 0;
+      nfn.x.file.size = files[i].size;
+      nfn.x.file.mtime = 0;
+      nfn.x.file.has_md5 = 0;
+      nfn.x.file.block_size = 0;
+      nfn.x.file.blocks = NULL;
+      write_file_record(out, &nfn, full_path);
 
       /* If file is not writable, update the perms */
 #if 0
@@ -63,26 +201,82 @@ static void scan_one_dir(struct FTP *ctrl_con, const char *path, struct fnode *x
         ftp_chmod(ctrl_con, full_path, 0644);
       }
 #endif
+      free(full_path);
     }
+    free(files[i].name);
   }
   free(files);
+
+  /* Reverse the new entries, so the first one listed is taken next. */
+  for (i=0; i<(fr->n - first_dir)/2; i++) {
+    char *t = fr->paths[first_dir + i];
+    fr->paths[first_dir + i] = fr->paths[fr->n - 1 - i];
+    fr->paths[fr->n - 1 - i] = t;
+  }
 }
 /*}}}*/
 
-struct fnode *make_remoteinv(const char *hostname, const int port_number, const char *username, const char *password, const char *remote_root, int active_ftp)/*{{{*/
+void make_remoteinv(const char *listing_file, const char *hostname, const int port_number, const char *username, const char *password, const char *remote_root, int active_ftp)/*{{{*/
 {
   struct FTP *ftp_con;
-  struct fnode *result;
+  struct frontier fr;
+  char *checkpoint, *path;
+  long offset = 0;
+  FILE *out;
+
+  fr.paths = NULL;
+  fr.n = fr.max = 0;
+  checkpoint = checkpoint_name(listing_file);
+  if (read_checkpoint(checkpoint, &offset, &fr)) {
+    check_header(listing_file, checkpoint, hostname, port_number, username, remote_root);
+    if (truncate(listing_file, offset) < 0) {
+      fprintf(stderr, "Couldn't cut listing file %s back to the checkpoint\n", listing_file);
+      exit(1);
+    }
+    out = fopen(listing_file, "a");
+    if (out) fseek(out, 0, SEEK_END);
+    printf("Resuming crawl with %d director%s left to scan\n", fr.n, (fr.n == 1) ? "y" : "ies");
+  } else {
+    out = fopen(listing_file, "w");
+    if (out) {
+      fprintf(out, "H %s\n", hostname);
+      fprintf(out, "U %s\n", username);
+      fprintf(out, "P %d\n", port_number);
+      if (remote_root) {
+        fprintf(out, "R %s\n", remote_root);
+      }
+    }
+    push_dir(&fr, new_string("."));
+  }
+  if (!out) {
+    fprintf(stderr, "Couldn't open listing file %s to write\n", listing_file);
+    exit(1);
+  }
+  fflush(out);
+  write_checkpoint(checkpoint, ftell(out), &fr);
 
   ftp_con = ftp_open(hostname, port_number, username, password, active_ftp);
   if (remote_root) {
     ftp_cwd(ftp_con, remote_root);
   }
-  result = new(struct fnode);
-  result->next = result->prev = result;
-  scan_one_dir(ftp_con, ".", result);
+  while (fr.n > 0) {
+    path = fr.paths[--fr.n];
+    scan_one_dir(ftp_con, path, out, &fr);
+    free(path);
+    if (fflush(out) == EOF) {
+      fprintf(stderr, "Couldn't write to listing file %s\n", listing_file);
+      exit(1);
+    }
+    write_checkpoint(checkpoint, ftell(out), &fr);
+  }
   ftp_close(ftp_con);
-  return result;
+
+  if (fclose(out) != 0) {
+    fprintf(stderr, "Couldn't write to listing file %s\n", listing_file);
+    exit(1);
+  }
+  unlink(checkpoint);
+  free(checkpoint);
+  if (fr.paths) free(fr.paths);
 }
 /*}}}*/
-
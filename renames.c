@@ -0,0 +1,420 @@
+/*
+ * Rename detection : turn 'delete A, upload B' into 'rename A to B' when the
+ * listing shows that A already holds B's contents.
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "digest.h"
+#include "fail.h"
+#include "ftp.h"
+#include "invent.h"
+#include "journal.h"
+#include "memory.h"
+#include "progress.h"
+#include "renames.h"
+
+/* Number of RNFR/RNTO pairs to send before waiting for replies. */
+#define BATCH 32
+
+/* Candidates are paired up by size and digest, and only when a digest
+ * occurs exactly once on each side; anything ambiguous is left to the normal
+ * delete and upload.
+
+   Sources are remote files that are about to be deleted, or whose contents
+   are about to be replaced.  Targets are local files that are new, or
+   stale.  A stale target can only be renamed onto if its old contents are
+   themselves being renamed away, which produces chains (C->D, B->C, A->B)
+   and rings (A->B, B->A).  Chains are done from the far end; a ring is
+   broken by first renaming one member to a temporary name. */
+
+struct candidate {/*{{{*/
+  struct candidate *next; /* hash chain */
+  struct fnode *node;
+  int count;  /* how many nodes have this size and digest */
+};
+/*}}}*/
+struct rename {/*{{{*/
+  struct fnode *src;  /* from fileinv */
+  struct fnode *dst;  /* from localinv */
+  char *from;         /* where src's contents are now */
+  int pred;           /* rename that must clear dst's path first, or -1 */
+  int active;
+  int state;          /* for scheduling : 0 not yet, 1 pending, 2 done */
+};
+/*}}}*/
+struct rename_step {/*{{{*/
+  int r;        /* index into renames */
+  char *from;
+  char *to;
+  int is_temp;  /* 1 if just moving src out of the way */
+};
+/*}}}*/
+struct rename_plan {/*{{{*/
+  struct rename *renames;
+  int n;
+  struct rename_step *steps;
+  int n_steps;
+};
+/*}}}*/
+
+#define N_BUCKETS 4096
+
+static unsigned int key_hash(const struct fnode *f)/*{{{*/
+{
+  unsigned int h;
+  memcpy(&h, f->x.file.md5, sizeof(h));
+  return (h ^ (unsigned int) f->x.file.size) % N_BUCKETS;
+}
+/*}}}*/
+static int same_key(const struct fnode *a, const struct fnode *b)/*{{{*/
+{
+  return (a->x.file.size == b->x.file.size) && !memcmp(a->x.file.md5, b->x.file.md5, 16);
+}
+/*}}}*/
+static struct candidate *find_candidate(struct candidate **table, const struct fnode *f)/*{{{*/
+{
+  struct candidate *c;
+  for (c = table[key_hash(f)]; c; c = c->next) {
+    if (same_key(c->node, f)) return c;
+  }
+  return NULL;
+}
+/*}}}*/
+static void add_candidate(struct candidate **table, struct fnode *f)/*{{{*/
+{
+  struct candidate *c;
+  c = find_candidate(table, f);
+  if (c) {
+    c->count++;
+  } else {
+    unsigned int b = key_hash(f);
+    c = new(struct candidate);
+    c->node = f;
+    c->count = 1;
+    c->next = table[b];
+    table[b] = c;
+  }
+}
+/*}}}*/
+static void free_candidates(struct candidate **table)/*{{{*/
+{
+  int i;
+  struct candidate *c, *nc;
+  for (i=0; i<N_BUCKETS; i++) {
+    for (c = table[i]; c; c = nc) {
+      nc = c->next;
+      free(c);
+    }
+  }
+  free(table);
+}
+/*}}}*/
+static struct candidate **new_table(void)/*{{{*/
+{
+  struct candidate **table;
+  table = new_array(struct candidate *, N_BUCKETS);
+  memset(table, 0, N_BUCKETS * sizeof(struct candidate *));
+  return table;
+}
+/*}}}*/
+
+static void find_sources(struct fnode *x, struct candidate **table, int *n)/*{{{*/
+{
+  /* x is from 'fileinv' */
+  struct fnode *e;
+  for (e = x->next; e != x; e = e->next) {
+    if (e->is_dir) {
+      find_sources((struct fnode *) &e->x.dir.next, table, n);
+    } else if (e->x.file.has_md5 && (e->x.file.size > 0) &&
+               (e->is_unique || e->x.file.is_stale)) {
+      add_candidate(table, e);
+      ++*n;
+    }
+  }
+}
+/*}}}*/
+static int compare_sizes(const void *a, const void *b)/*{{{*/
+{
+  size_t sa = *(const size_t *) a, sb = *(const size_t *) b;
+  return (sa < sb) ? -1 : (sa > sb) ? 1 : 0;
+}
+/*}}}*/
+static size_t *source_sizes(struct candidate **sources, int max, int *n_sizes)/*{{{*/
+{
+  /* Sorted, so local files that can't possibly match are never hashed. */
+  size_t *sizes;
+  struct candidate *c;
+  int i, n = 0;
+  sizes = new_array(size_t, max);
+  for (i=0; i<N_BUCKETS; i++) {
+    for (c = sources[i]; c; c = c->next) {
+      sizes[n++] = c->node->x.file.size;
+    }
+  }
+  qsort(sizes, n, sizeof(size_t), compare_sizes);
+  *n_sizes = n;
+  return sizes;
+}
+/*}}}*/
+static void find_targets(struct fnode *x, int under_clash, const size_t *sizes, int n_sizes,/*{{{*/
+                         struct fnode ***targets, int *n, int *max)
+{
+  /* x is from 'localinv'.  A new file can only be renamed into place if its
+   * directory will exist by the time the renames are done, i.e. isn't
+   * waiting for a remote file of the same name to be removed. */
+  struct fnode *e;
+  for (e = x->next; e != x; e = e->next) {
+    if (e->is_dir) {
+      find_targets((struct fnode *) &e->x.dir.next, under_clash || e->is_clash,
+                   sizes, n_sizes, targets, n, max);
+    } else if ((e->x.file.size > 0) &&
+               ((e->is_unique && !e->is_clash && !under_clash) ||
+                (!e->is_unique && e->x.file.is_stale)) &&
+               bsearch(&e->x.file.size, sizes, n_sizes, sizeof(size_t), compare_sizes)) {
+      if (*n == *max) {
+        *max = *max ? 2 * *max : 64;
+        *targets = grow_array(struct fnode *, *max, *targets);
+      }
+      (*targets)[(*n)++] = e;
+    }
+  }
+}
+/*}}}*/
+static int find_rename_by_src(const struct rename_plan *plan, const struct fnode *src)/*{{{*/
+{
+  int i;
+  for (i=0; i<plan->n; i++) {
+    if (plan->renames[i].src == src) return i;
+  }
+  return -1;
+}
+/*}}}*/
+static void add_step(struct rename_plan *plan, int r, const char *from, const char *to, int is_temp)/*{{{*/
+{
+  struct rename_step *st = &plan->steps[plan->n_steps++];
+  st->r = r;
+  st->from = new_string(from);
+  st->to = new_string(to);
+  st->is_temp = is_temp;
+}
+/*}}}*/
+static void schedule(struct rename_plan *plan)/*{{{*/
+{
+  /* Each rename has at most one predecessor, and is the predecessor of at
+   * most one other, so following predecessors from any rename ends either at
+   * a rename with none (a chain) or back where it started (a ring). */
+  int i, cur, n_stack;
+  int *stack;
+  int n_temp = 0;
+
+  stack = new_array(int, plan->n ? plan->n : 1);
+  /* Worst case is one extra step per ring, and a ring has at least 2
+   * members. */
+  plan->steps = new_array(struct rename_step, plan->n + plan->n/2 + 1);
+  plan->n_steps = 0;
+
+  for (i=0; i<plan->n; i++) {
+    if (!plan->renames[i].active || (plan->renames[i].state == 2)) continue;
+    n_stack = 0;
+    cur = i;
+    while ((cur >= 0) && (plan->renames[cur].state == 0)) {
+      plan->renames[cur].state = 1;
+      stack[n_stack++] = cur;
+      cur = plan->renames[cur].pred;
+    }
+    if ((cur >= 0) && (plan->renames[cur].state == 1)) {
+      /* A ring : move cur's contents aside, which frees up the path its
+       * predecessor in the ring is waiting for. */
+      struct rename *r = &plan->renames[cur];
+      char *temp = new_array(char, strlen(r->from) + 32);
+      sprintf(temp, "%s.ftpup-%d", r->from, ++n_temp);
+      add_step(plan, cur, r->from, temp, 1);
+      free(r->from);
+      r->from = temp;
+    }
+    while (n_stack > 0) {
+      struct rename *r = &plan->renames[stack[--n_stack]];
+      add_step(plan, stack[n_stack], r->from, r->dst->path, 0);
+      r->state = 2;
+    }
+  }
+  free(stack);
+}
+/*}}}*/
+struct rename_plan *plan_renames(struct fnode *fileinv, struct fnode *localinv)/*{{{*/
+{
+  struct candidate **sources, **dests;
+  struct fnode **targets = NULL;
+  size_t *sizes;
+  int n_sources = 0, n_sizes, n_targets = 0, max_targets = 0;
+  struct rename_plan *plan;
+  int i, changed;
+
+  sources = new_table();
+  find_sources(fileinv, sources, &n_sources);
+  if (!n_sources) {
+    free_candidates(sources);
+    return NULL;
+  }
+
+  sizes = source_sizes(sources, n_sources, &n_sizes);
+  find_targets(localinv, 0, sizes, n_sizes, &targets, &n_targets, &max_targets);
+  free(sizes);
+  digest_files(targets, n_targets);
+  dests = new_table();
+  for (i=0; i<n_targets; i++) {
+    if (targets[i]->x.file.has_md5) add_candidate(dests, targets[i]);
+  }
+
+  plan = new(struct rename_plan);
+  plan->renames = new_array(struct rename, n_targets ? n_targets : 1);
+  plan->n = 0;
+  plan->steps = NULL;
+  plan->n_steps = 0;
+  for (i=0; i<n_targets; i++) {
+    struct candidate *s, *d;
+    struct fnode *t = targets[i];
+    if (!t->x.file.has_md5) continue;
+    d = find_candidate(dests, t);
+    s = find_candidate(sources, t);
+    if (d && s && (d->count == 1) && (s->count == 1) && strcmp(s->node->path, t->path)) {
+      struct rename *r = &plan->renames[plan->n++];
+      r->src = s->node;
+      r->dst = t;
+      r->from = new_string(s->node->path);
+      r->pred = -1;
+      r->active = 1;
+      r->state = 0;
+    }
+  }
+  free(targets);
+  free_candidates(sources);
+  free_candidates(dests);
+
+  /* A stale target is still occupied by its old contents; only keep it if
+   * they are being renamed away.  Dropping one rename can invalidate
+   * another, so repeat until nothing changes. */
+  for (i=0; i<plan->n; i++) {
+    struct rename *r = &plan->renames[i];
+    if (!r->dst->is_unique) {
+      r->pred = find_rename_by_src(plan, r->dst->x.file.peer);
+    }
+  }
+  do {
+    changed = 0;
+    for (i=0; i<plan->n; i++) {
+      struct rename *r = &plan->renames[i];
+      if (r->active && !r->dst->is_unique &&
+          ((r->pred < 0) || !plan->renames[r->pred].active)) {
+        r->active = 0;
+        changed = 1;
+      }
+    }
+  } while (changed);
+
+  schedule(plan);
+  if (!plan->n_steps) {
+    free_rename_plan(plan);
+    return NULL;
+  }
+  return plan;
+}
+/*}}}*/
+static void assume_rename(struct rename *r)/*{{{*/
+{
+  /* The source's old path is now empty.  If it was going to be deleted,
+   * there's nothing left to do for it; if it was stale, it still needs its
+   * new contents, unless another rename supplies them. */
+  if (r->src->is_unique) {
+    r->src->is_unique = 0;
+    r->src->x.file.is_stale = 0;
+    r->src->x.file.is_retouched = 0;
+  }
+  if (r->dst->is_unique) {
+    r->dst->is_unique = 0;
+  } else {
+    struct fnode *old = r->dst->x.file.peer;
+    old->x.file.is_stale = r->dst->x.file.is_stale = 0;
+    old->x.file.is_retouched = 0;
+  }
+}
+/*}}}*/
+void assume_renames(struct rename_plan *plan)/*{{{*/
+{
+  int i;
+  for (i=0; i<plan->n_steps; i++) {
+    if (!plan->steps[i].is_temp) {
+      assume_rename(&plan->renames[plan->steps[i].r]);
+    }
+  }
+}
+/*}}}*/
+void print_renames(const struct rename_plan *plan)/*{{{*/
+{
+  int i;
+  for (i=0; i<plan->n_steps; i++) {
+    printf("R %s -> %s\n", plan->steps[i].from, plan->steps[i].to);
+  }
+}
+/*}}}*/
+void perform_renames(struct FTP *ctrl_con, struct rename_plan *plan, FILE *journal)/*{{{*/
+{
+  const char *from[BATCH], *to[BATCH];
+  int ok[BATCH];
+  int i, j, n, failed;
+
+  for (i=0; i<plan->n_steps; i += n) {
+    n = plan->n_steps - i;
+    if (n > BATCH) n = BATCH;
+    for (j=0; j<n; j++) {
+      struct rename_step *st = &plan->steps[i+j];
+      struct rename *r = &plan->renames[st->r];
+      from[j] = st->from;
+      to[j] = st->to;
+      journal_intent(journal, "RNFR", st->from);
+      journal_file_intent(journal, "RNTO", st->is_temp ? r->src : r->dst, st->to);
+    }
+    ftp_rename_batch(ctrl_con, n, from, to, ok);
+
+    /* Whatever happened to the others, each rename that worked did move
+     * whatever was at its old path, so journal them all before giving up. */
+    failed = 0;
+    for (j=0; j<n; j++) {
+      struct rename_step *st = &plan->steps[i+j];
+      struct rename *r = &plan->renames[st->r];
+      if (ok[j]) {
+        journal_file(journal, st->is_temp ? r->src : r->dst, st->to);
+        journal_delete(journal, st->from);
+        if (!st->is_temp) assume_rename(r);
+        progress_message("Renamed remote file %s to %s\n", st->from, st->to);
+      } else {
+        fprintf(stderr, "FAILED TO RENAME %s TO %s ON REMOTE SIDE\n", st->from, st->to);
+        journal_settled(journal, st->from);
+        journal_settled(journal, st->to);
+        failed = 1;
+      }
+    }
+    fflush(stdout);
+    if (failed) {
+      fprintf(stderr, "ABORTING\n");
+      give_up();
+    }
+  }
+}
+/*}}}*/
+void free_rename_plan(struct rename_plan *plan)/*{{{*/
+{
+  int i;
+  for (i=0; i<plan->n; i++) free(plan->renames[i].from);
+  for (i=0; i<plan->n_steps; i++) {
+    free(plan->steps[i].from);
+    free(plan->steps[i].to);
+  }
+  free(plan->renames);
+  free(plan->steps);
+  free(plan);
+}
+/*}}}*/
@@ -0,0 +1,26 @@
+#ifndef RENAMES_H
+#define RENAMES_H
+
+#include <stdio.h>
+
+struct fnode;
+struct FTP;
+struct rename_plan;
+
+/* Work out which new or changed local files already exist on the remote
+ * side under another name.  Must be called after reconcile.  Return NULL if
+ * there is nothing to rename. */
+extern struct rename_plan *plan_renames(struct fnode *fileinv, struct fnode *localinv);
+
+/* Adjust the reconcile flags as though every rename in the plan had been
+ * done, without doing them (for a dummy run). */
+extern void assume_renames(struct rename_plan *);
+extern void print_renames(const struct rename_plan *);
+
+/* Carry out the renames, journalling each one.  Any new directories they
+ * need must already exist on the remote side. */
+extern void perform_renames(struct FTP *ctrl_con, struct rename_plan *, FILE *journal);
+
+extern void free_rename_plan(struct rename_plan *);
+
+#endif /* RENAMES_H */
@@ -0,0 +1,191 @@
+/*
+ * Pick up after an interrupted run.
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ftp.h"
+#include "invent.h"
+#include "journal.h"
+#include "memory.h"
+
+/* Each remote operation is preceded in the journal by an intent record (see
+ * fileinv.c) and followed by the record for what it did.  So after an
+ * interruption, only the operations whose intents are still unsettled can
+ * have left the server out of step with the listing, and only those need
+ * looking at, however big the site is :
+
+   DELE, RMD : done again; if that fails, the entry must have gone from its
+               directory already.
+   MKD       : done if the directory is there.
+   STOR/CPTO : done if the file is there with the size, and the digest if
+               the server will give one, that was being sent.  Otherwise
+               the listing gets what is there, with an mtime no local file
+               has, so that it is sent again (or just its tail, if what got
+               there is the start of it).
+   RNFR/RNTO : the renames went over one connection in order, so the ones
+               done are those up to the last one whose source has gone.
+
+   Whatever didn't happen is settled with an 'X' record. */
+
+int remote_exists(struct FTP *ctrl_con, const char *path)/*{{{*/
+{
+  char *parent, **names;
+  const char *slash, *base, *name;
+  int n, i, found;
+
+  slash = strrchr(path, '/');
+  if (slash) {
+    parent = new_array(char, slash - path + 1);
+    memcpy(parent, path, slash - path);
+    parent[slash - path] = '\0';
+    base = slash + 1;
+  } else {
+    parent = new_string(".");
+    base = path;
+  }
+  found = 0;
+  ftp_names(ctrl_con, parent, &names, &n);
+  for (i=0; i<n; i++) {
+    /* Some servers give the directory's path too. */
+    name = strrchr(names[i], '/');
+    name = name ? name + 1 : names[i];
+    if (!strcmp(name, base)) found = 1;
+    free(names[i]);
+  }
+  if (names) free(names);
+  free(parent);
+  return found;
+}
+/*}}}*/
+static void resume_mkdir(struct FTP *ctrl_con, const struct intent *in, FILE *journal)/*{{{*/
+{
+  if (remote_exists(ctrl_con, in->path)) {
+    journal_record(journal, in->record);
+    printf("Created remote directory %s before the interruption\n", in->path);
+  } else {
+    journal_settled(journal, in->path);
+  }
+}
+/*}}}*/
+static void resume_send(struct FTP *ctrl_con, const struct intent *in, FILE *journal)/*{{{*/
+{
+  struct fnode f;
+  size_t size;
+  unsigned char md5[16];
+
+  f.x.file.blocks = NULL;
+  f.x.file.block_size = 0;
+  parse_file_record(in->record, &f);
+  if (ftp_size(ctrl_con, in->path, &size)) {
+    /* The old contents may well have had the same size, so only a digest
+     * shows that the new ones got there.  Otherwise the file is recorded
+     * with a stale mtime, so that the next run sends it again. */
+    if ((size == f.x.file.size) && f.x.file.has_md5 && ftp_xmd5(ctrl_con, in->path, md5) &&
+        !memcmp(md5, f.x.file.md5, 16)) {
+      journal_record(journal, in->record);
+      printf("Sent %s before the interruption\n", in->path);
+      return;
+    }
+  } else if (!remote_exists(ctrl_con, in->path)) {
+    journal_settled(journal, in->path);
+    return;
+  } else {
+    size = 0;
+  }
+  f.x.file.size = size;
+  f.x.file.mtime = 1;
+  f.x.file.has_md5 = 0;
+  journal_file(journal, &f, in->path);
+  printf("Couldn't tell that all of %s was sent before the interruption\n", in->path);
+}
+/*}}}*/
+static void resume_renames(struct FTP *ctrl_con, struct intent **v, int n, FILE *journal)/*{{{*/
+{
+  /* v holds the RNFR and RNTO intents in order.  They come in pairs, except
+   * that an RNFR on its own is one whose RNTO got journalled, so was done. */
+  int i, last_done;
+
+  last_done = -1;
+  for (i = n - 1; i >= 0; i--) {
+    if (!strcmp(v[i]->command, "RNFR") && ((i + 1 == n) || !strcmp(v[i+1]->command, "RNFR"))) {
+      continue;
+    }
+    if (!strcmp(v[i]->command, "RNFR") && !remote_exists(ctrl_con, v[i]->path)) {
+      last_done = i + 1;
+      break;
+    }
+  }
+  for (i=0; i<n; i++) {
+    int lone = !strcmp(v[i]->command, "RNFR") && ((i + 1 == n) || !strcmp(v[i+1]->command, "RNFR"));
+    if (lone || (i <= last_done)) {
+      journal_record(journal, v[i]->record);
+      if (!strcmp(v[i]->command, "RNTO")) {
+        printf("Renamed remote file to %s before the interruption\n", v[i]->path);
+      }
+    } else {
+      journal_settled(journal, v[i]->path);
+    }
+  }
+}
+/*}}}*/
+void resume_interrupted(const char *password, const char *listing_file, const struct upload_params *up)/*{{{*/
+{
+  struct remote_params rp;
+  struct intent *pending, *removals, **renames;
+  struct connect_info ci;
+  struct FTP *ctrl_con;
+  FILE *journal;
+  int n, n_removals, n_renames, i;
+
+  init_remote_params(&rp);
+  pending = pending_intents(listing_file, &rp, &n);
+  if (n) {
+    printf("Checking %d remote operation%s left unfinished by an interrupted run\n", n, (n == 1) ? "" : "s");
+    journal = open_journal(listing_file);
+    if (!journal) {
+      fprintf(stderr, "Couldn't open %s to append updates\n", listing_file);
+      exit(1);
+    }
+    ci.rp = &rp;
+    ci.password = password;
+    ci.active_ftp = up->active_ftp;
+    ci.n_connections = up->n_connections;
+    ctrl_con = open_remote(&rp, password, up->active_ftp);
+
+    removals = new_array(struct intent, n);
+    renames = new_array(struct intent *, n);
+    n_removals = n_renames = 0;
+    for (i=0; i<n; i++) {
+      struct intent *in = &pending[i];
+      if (!strcmp(in->command, "DELE") || !strcmp(in->command, "RMD")) {
+        /* Already in the order run_removals wants. */
+        removals[n_removals++] = *in;
+      } else if (!strcmp(in->command, "RNFR") || !strcmp(in->command, "RNTO")) {
+        renames[n_renames++] = in;
+      } else if (!strcmp(in->command, "MKD")) {
+        resume_mkdir(ctrl_con, in, journal);
+      } else if (!strcmp(in->command, "STOR") || !strcmp(in->command, "CPTO")) {
+        resume_send(ctrl_con, in, journal);
+      } else {
+        fprintf(stderr, "Unknown intent %s for %s in listing file %s\n", in->command, in->path, listing_file);
+        exit(1);
+      }
+    }
+    if (n_renames) resume_renames(ctrl_con, renames, n_renames, journal);
+    run_removals(ctrl_con, removals, n_removals, journal, &ci, 1);
+
+    ftp_close(ctrl_con);
+    fclose(journal);
+    free(removals);
+    free(renames);
+  }
+  for (i=0; i<n; i++) free(pending[i].record);
+  free(pending);
+  if (rp.hostname) free(rp.hostname);
+  if (rp.username) free(rp.username);
+  if (rp.remote_root) free(rp.remote_root);
+}
+/*}}}*/
@@ -0,0 +1,249 @@
+/*
+ * Cache of local directory contents, used to avoid re-reading directories
+ * that haven't changed since the last run.
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "scancache.h"
+#include "memory.h"
+
+/* Notes on cache file format.
+
+   T <time>
+   C <inode> <mtime> <n_names> <path>
+
+   followed by <n_names> lines, each holding one entry name.  The numbers are
+   in hex.  <time> is when the scan that wrote the file started.
+
+   A directory's mtime only changes when entries are added, removed or
+   renamed, so a matching (inode, mtime) pair means its list of names can be
+   reused without a readdir.  It says nothing about the contents of the files
+   in it, so those still need a stat each time.
+
+   mtime has 1 second resolution; a directory that changed in the same second
+   as (or after) the scan started could change again without its mtime
+   moving, so such directories are written with mtime 0, which never
+   matches. */
+
+struct dir_record {/*{{{*/
+  struct dir_record *next; /* hash chain */
+  char *path;
+  ino_t ino;
+  time_t mtime;
+  char **names;
+  int n_names;
+};
+/*}}}*/
+struct scancache {/*{{{*/
+  struct dir_record **table;
+  int n_buckets;
+  int n_records;
+  time_t started;
+};
+/*}}}*/
+
+static unsigned int hash_path(const char *path)/*{{{*/
+{
+  unsigned int h = 2166136261U;
+  while (*path) {
+    h ^= (unsigned char) *path++;
+    h *= 16777619U;
+  }
+  return h;
+}
+/*}}}*/
+static void insert_record(struct scancache *sc, struct dir_record *dr)/*{{{*/
+{
+  unsigned int b;
+  if (sc->n_records >= 2 * sc->n_buckets) {
+    /* Grow the table */
+    int i, nb;
+    struct dir_record **nt, *x, *nx;
+    nb = 2 * sc->n_buckets;
+    nt = new_array(struct dir_record *, nb);
+    memset(nt, 0, nb * sizeof(struct dir_record *));
+    for (i=0; i<sc->n_buckets; i++) {
+      for (x = sc->table[i]; x; x = nx) {
+        nx = x->next;
+        b = hash_path(x->path) % nb;
+        x->next = nt[b];
+        nt[b] = x;
+      }
+    }
+    free(sc->table);
+    sc->table = nt;
+    sc->n_buckets = nb;
+  }
+  b = hash_path(dr->path) % sc->n_buckets;
+  dr->next = sc->table[b];
+  sc->table[b] = dr;
+  sc->n_records++;
+}
+/*}}}*/
+struct scancache *new_scancache(void)/*{{{*/
+{
+  struct scancache *sc;
+  sc = new(struct scancache);
+  sc->n_buckets = 1024;
+  sc->n_records = 0;
+  sc->table = new_array(struct dir_record *, sc->n_buckets);
+  memset(sc->table, 0, sc->n_buckets * sizeof(struct dir_record *));
+  sc->started = time(NULL);
+  return sc;
+}
+/*}}}*/
+void free_scancache(struct scancache *sc)/*{{{*/
+{
+  int i, j;
+  struct dir_record *x, *nx;
+  for (i=0; i<sc->n_buckets; i++) {
+    for (x = sc->table[i]; x; x = nx) {
+      nx = x->next;
+      for (j=0; j<x->n_names; j++) free(x->names[j]);
+      free(x->names);
+      free(x->path);
+      free(x);
+    }
+  }
+  free(sc->table);
+  free(sc);
+}
+/*}}}*/
+static char *read_cache_line(FILE *in, char **buf, size_t *bufsize)/*{{{*/
+{
+  ssize_t len;
+  len = getline(buf, bufsize, in);
+  if (len <= 0) return NULL;
+  if ((*buf)[len-1] == '\n') (*buf)[len-1] = '\0';
+  return *buf;
+}
+/*}}}*/
+struct scancache *load_scancache(const char *filename)/*{{{*/
+{
+  /* A missing or damaged cache just means a full scan, so never fail here. */
+  struct scancache *sc;
+  FILE *in;
+  char *line = NULL;
+  size_t linesize = 0;
+
+  sc = new_scancache();
+  in = fopen(filename, "r");
+  if (!in) return sc;
+
+  while (read_cache_line(in, &line, &linesize)) {
+    struct dir_record *dr;
+    unsigned long ino, mtime;
+    int n, pos, i;
+
+    if (line[0] == 'T') continue;
+    if ((line[0] != 'C') ||
+        (sscanf(line+1, "%lx %lx %x %n", &ino, &mtime, &n, &pos) < 3) ||
+        (n < 0)) {
+      goto corrupt;
+    }
+    dr = new(struct dir_record);
+    dr->path = new_string(line + 1 + pos);
+    dr->ino = ino;
+    dr->mtime = mtime;
+    dr->n_names = n;
+    dr->names = new_array(char *, n ? n : 1);
+    for (i=0; i<n; i++) {
+      if (!read_cache_line(in, &line, &linesize)) {
+        dr->n_names = i;
+        dr->mtime = 0;
+        insert_record(sc, dr);
+        goto corrupt;
+      }
+      dr->names[i] = new_string(line);
+    }
+    insert_record(sc, dr);
+  }
+  free(line);
+  fclose(in);
+  return sc;
+
+corrupt:
+  fprintf(stderr, "Scan cache %s corrupted, rescanning everything\n", filename);
+  free(line);
+  fclose(in);
+  free_scancache(sc);
+  return new_scancache();
+}
+/*}}}*/
+char **lookup_scancache(const struct scancache *sc, const char *path, ino_t ino, time_t mtime, int *n_names)/*{{{*/
+{
+  struct dir_record *dr;
+  for (dr = sc->table[hash_path(path) % sc->n_buckets]; dr; dr = dr->next) {
+    if (!strcmp(dr->path, path)) {
+      if (dr->mtime && (dr->mtime == mtime) && (dr->ino == ino)) {
+        *n_names = dr->n_names;
+        return dr->names;
+      } else {
+        return NULL;
+      }
+    }
+  }
+  return NULL;
+}
+/*}}}*/
+void record_scancache(struct scancache *sc, const char *path, ino_t ino, time_t mtime, char **names, int n_names)/*{{{*/
+{
+  struct dir_record *dr;
+  int i;
+
+  dr = new(struct dir_record);
+  dr->path = new_string(path);
+  dr->ino = ino;
+  dr->mtime = (mtime < sc->started) ? mtime : 0;
+  dr->n_names = n_names;
+  dr->names = new_array(char *, n_names ? n_names : 1);
+  for (i=0; i<n_names; i++) {
+    if (strchr(names[i], '\n')) {
+      /* Can't be represented in the file, so never trust this entry. */
+      dr->mtime = 0;
+    }
+    dr->names[i] = new_string(names[i]);
+  }
+  insert_record(sc, dr);
+}
+/*}}}*/
+int write_scancache(const struct scancache *sc, const char *filename)/*{{{*/
+{
+  /* Return 1 for success, 0 for failure */
+  char *nf;
+  FILE *out;
+  int i, j;
+  struct dir_record *dr;
+
+  nf = new_array(char, strlen(filename) + 5);
+  strcpy(nf, filename);
+  strcat(nf, ".new");
+  out = fopen(nf, "w");
+  if (!out) {
+    free(nf);
+    return 0;
+  }
+  fprintf(out, "T %lx\n", (unsigned long) sc->started);
+  for (i=0; i<sc->n_buckets; i++) {
+    for (dr = sc->table[i]; dr; dr = dr->next) {
+      if (!dr->mtime) continue; /* would never match anyway */
+      fprintf(out, "C %lx %lx %x %s\n", (unsigned long) dr->ino, (unsigned long) dr->mtime, dr->n_names, dr->path);
+      for (j=0; j<dr->n_names; j++) {
+        fprintf(out, "%s\n", dr->names[j]);
+      }
+    }
+  }
+  if ((fclose(out) != 0) || (rename(nf, filename) < 0)) {
+    unlink(nf);
+    free(nf);
+    return 0;
+  }
+  free(nf);
+  return 1;
+}
+/*}}}*/
@@ -0,0 +1,25 @@
+#ifndef SCANCACHE_H
+#define SCANCACHE_H
+
+#include <sys/types.h>
+#include <time.h>
+
+struct scancache;
+
+extern struct scancache *new_scancache(void);
+extern struct scancache *load_scancache(const char *filename);
+extern void free_scancache(struct scancache *);
+
+/* Return the cached entry names of directory 'path', or NULL if the directory
+ * isn't in the cache or its inode / mtime no longer match. */
+extern char **lookup_scancache(const struct scancache *, const char *path,
+                               ino_t ino, time_t mtime, int *n_names);
+
+/* Take a copy of the names read from 'path' for the next run. */
+extern void record_scancache(struct scancache *, const char *path,
+                             ino_t ino, time_t mtime,
+                             char **names, int n_names);
+
+extern int write_scancache(const struct scancache *, const char *filename);
+
+#endif /* SCANCACHE_H */
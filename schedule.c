@@ -0,0 +1,242 @@
+/*
+ * Ordering of file transfers across several connections.
+ * */
+
+#include <fnmatch.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "fail.h"
+#include "invent.h"
+#include "memory.h"
+#include "progress.h"
+#include "schedule.h"
+
+static char **read_priorities(const char *filename, int *n)/*{{{*/
+{
+  FILE *in;
+  char line[1024];
+  char **patterns = NULL;
+  int max = 0;
+  char *p;
+
+  *n = 0;
+  in = fopen(filename, "r");
+  if (!in) return NULL;
+  while (fgets(line, sizeof(line), in)) {
+    for (p = line + strlen(line); (p > line) && ((p[-1] == '\n') || (p[-1] == ' ')); p--) ;
+    *p = '\0';
+    if (!line[0] || (line[0] == '#')) continue;
+    if (*n == max) {
+      max = max ? 2 * max : 8;
+      patterns = grow_array(char *, max, patterns);
+    }
+    patterns[(*n)++] = new_string(line);
+  }
+  fclose(in);
+  return patterns;
+}
+/*}}}*/
+/* Below this size, a file takes little longer to send than the commands
+ * around it, so it's worth keeping it next to the others in its directory
+ * (see in_dir in ftp.c). */
+#define AFFINE_SIZE (256*1024)
+/* The most of those one connection takes at once. */
+#define AFFINE_RUN 16
+
+static int compare_dirs(const char *a, const char *b)/*{{{*/
+{
+  /* Order paths by the directory they're in, ignoring the name. */
+  const char *sa = strrchr(a, '/'), *sb = strrchr(b, '/');
+  int la = sa ? sa - a : 0, lb = sb ? sb - b : 0;
+  int c = strncmp(a, b, (la < lb) ? la : lb);
+  if (c) return c;
+  return la - lb;
+}
+/*}}}*/
+static int compare_groups(const void *a, const void *b)/*{{{*/
+{
+  const struct transfer *ta = a, *tb = b;
+  if (ta->priority != tb->priority) return (ta->priority < tb->priority) ? -1 : 1;
+  return compare_dirs(ta->node->path, tb->node->path);
+}
+/*}}}*/
+static int compare_transfers(const void *a, const void *b)/*{{{*/
+{
+  const struct transfer *ta = a, *tb = b;
+  int c;
+  if (ta->priority != tb->priority) return (ta->priority < tb->priority) ? -1 : 1;
+  if (ta->group_size != tb->group_size) return (ta->group_size > tb->group_size) ? -1 : 1;
+  if ((c = compare_dirs(ta->node->path, tb->node->path))) return c;
+  if (ta->size != tb->size) return (ta->size > tb->size) ? -1 : 1;
+  return strcmp(ta->node->path, tb->node->path);
+}
+/*}}}*/
+void order_transfers(struct transfer *t, int n, const char *priority_file)/*{{{*/
+{
+  /* Taking the largest remaining file whenever a connection comes free is
+   * the longest-processing-time rule; it leaves the small files to fill in
+   * round the big ones at the end.  The small files in each directory are
+   * kept together, placed as if they were all the size of the largest, so
+   * that each connection changes directory once per group rather than once
+   * per file. */
+  char **patterns;
+  int n_patterns, i, j, k;
+  size_t largest;
+
+  patterns = read_priorities(priority_file, &n_patterns);
+  for (i=0; i<n; i++) {
+    t[i].priority = n_patterns;
+    for (j=0; j<n_patterns; j++) {
+      if (!fnmatch(patterns[j], t[i].node->path, 0)) {
+        t[i].priority = j;
+        break;
+      }
+    }
+  }
+  qsort(t, n, sizeof(struct transfer), compare_groups);
+  for (i=0; i<n; i=j) {
+    largest = 0;
+    for (j=i; (j<n) && !compare_groups(&t[i], &t[j]); j++) {
+      if ((t[j].size < AFFINE_SIZE) && (t[j].size > largest)) largest = t[j].size;
+    }
+    for (k=i; k<j; k++) {
+      t[k].group_size = (t[k].size < AFFINE_SIZE) ? largest : t[k].size;
+    }
+  }
+  qsort(t, n, sizeof(struct transfer), compare_transfers);
+  for (j=0; j<n_patterns; j++) free(patterns[j]);
+  free(patterns);
+}
+/*}}}*/
+
+struct transfer_job {/*{{{*/
+  struct transfer *t;
+  int n;
+  int *ends;    /* the transfers are claimed in runs; ends[k] is where run
+                   k stops */
+  int n_runs;
+  int next;     /* next run to be claimed */
+  void (*send)(struct FTP *, struct transfer *, void *);
+  void *arg;
+  const char *label; /* progress label of the thread that started it */
+  struct fail_scope *scope; /* and its failure scope */
+};
+/*}}}*/
+struct transfer_worker {/*{{{*/
+  struct transfer_job *job;
+  struct FTP *con;
+};
+/*}}}*/
+static double now(void)/*{{{*/
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + 1.0e-6 * tv.tv_usec;
+}
+/*}}}*/
+static void *transfer_worker(void *arg)/*{{{*/
+{
+  struct transfer_worker *w = arg;
+  struct transfer_job *job = w->job;
+  int i, k;
+  double start;
+  progress_set_label(job->label);
+  fail_set_scope(job->scope);
+  while (!fail_pending() && ((k = __sync_fetch_and_add(&job->next, 1)) < job->n_runs)) {
+    for (i = k ? job->ends[k-1] : 0; i < job->ends[k]; i++) {
+      start = now();
+      (*job->send)(w->con, &job->t[i], job->arg);
+      job->t[i].seconds = now() - start;
+    }
+  }
+  return NULL;
+}
+/*}}}*/
+static int split_runs(const struct transfer *t, int n, int *ends)/*{{{*/
+{
+  /* A run is a single file, or up to AFFINE_RUN small ones that were kept
+   * together by order_transfers, so that each connection does a directory's
+   * worth from there.  Return the number of runs. */
+  int i, start, n_runs;
+  n_runs = 0;
+  for (start = 0, i = 1; i <= n; i++) {
+    if ((i < n) && (i - start < AFFINE_RUN) &&
+        (t[i].size < AFFINE_SIZE) && (t[start].size < AFFINE_SIZE) &&
+        (t[i].priority == t[start].priority) &&
+        !compare_dirs(t[i].node->path, t[start].node->path)) {
+      continue;
+    }
+    ends[n_runs++] = i;
+    start = i;
+  }
+  return n_runs;
+}
+/*}}}*/
+static void report(const struct transfer *t, int n, int n_cons, double elapsed)/*{{{*/
+{
+  /* No split of the work can beat the longest single transfer, nor the
+   * total shared out evenly. */
+  double total = 0.0, longest = 0.0, ideal;
+  int i;
+  for (i=0; i<n; i++) {
+    total += t[i].seconds;
+    if (t[i].seconds > longest) longest = t[i].seconds;
+  }
+  ideal = total / n_cons;
+  if (longest > ideal) ideal = longest;
+  progress_message("Sent %d file%s over %d connection%s in %.1fs (ideal %.1fs, %.0f%%)\n",
+                   n, (n == 1) ? "" : "s", n_cons, (n_cons == 1) ? "" : "s", elapsed, ideal,
+                   (elapsed > 0.0) ? 100.0 * ideal / elapsed : 100.0);
+}
+/*}}}*/
+void run_transfers(struct transfer *t, int n, struct FTP **cons, int n_cons,/*{{{*/
+                   void (*send)(struct FTP *, struct transfer *, void *),
+                   void *arg)
+{
+  struct transfer_job job;
+  struct transfer_worker *workers;
+  pthread_t *threads;
+  int i, n_started, own;
+  double start;
+
+  if (!n) return;
+  job.t = t;
+  job.n = n;
+  job.ends = new_array(int, n);
+  job.n_runs = split_runs(t, n, job.ends);
+  job.next = 0;
+  job.send = send;
+  job.arg = arg;
+  job.label = progress_get_label();
+  job.scope = fail_get_scope();
+  workers = new_array(struct transfer_worker, n_cons);
+  threads = new_array(pthread_t, n_cons);
+  for (i=0; i<n_cons; i++) {
+    workers[i].job = &job;
+    workers[i].con = cons[i];
+  }
+
+  start = now();
+  /* The first connection is worked from this thread, unless a failure
+   * there has to be kept from the others (see fail.h). */
+  own = !job.scope;
+  for (n_started = own; n_started < n_cons; n_started++) {
+    if (pthread_create(&threads[n_started], NULL, transfer_worker, &workers[n_started]) != 0) break;
+  }
+  if (own || !n_started) {
+    transfer_worker(&workers[0]);
+  }
+  for (i=own; i<n_started; i++) pthread_join(threads[i], NULL);
+  if (!n_started) n_started = 1;
+  fail_check();
+
+  report(t, n, n_started, now() - start);
+  free(job.ends);
+  free(workers);
+  free(threads);
+}
+/*}}}*/
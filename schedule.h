@@ -0,0 +1,32 @@
+#ifndef SCHEDULE_H
+#define SCHEDULE_H
+
+#include <sys/types.h>
+
+struct fnode;
+struct FTP;
+
+struct transfer {
+  struct fnode *node;
+  size_t size;      /* bytes to send */
+  int priority;     /* lower goes first */
+  size_t group_size; /* size to place it by (see order_transfers) */
+  double seconds;   /* how long it took */
+};
+
+/* Put the transfers in the order they should be started : by the user's
+ * priority rules (one glob per line in priority_file, matched against the
+ * path, earlier lines first and unmatched files last), then largest first
+ * so that the big files don't end up running on their own at the end, with
+ * the small files in each directory kept together. */
+extern void order_transfers(struct transfer *t, int n, const char *priority_file);
+
+/* Send the transfers over the n_cons connections, each connection taking the
+ * next one in order as soon as it is free (or the next few, if they're small
+ * files in the same directory), then report how the elapsed time
+ * compares with an ideal split of the work. */
+extern void run_transfers(struct transfer *t, int n, struct FTP **cons, int n_cons,
+                          void (*send)(struct FTP *, struct transfer *, void *),
+                          void *arg);
+
+#endif /* SCHEDULE_H */
@@ -0,0 +1,592 @@
+/*
+ * Listings split into shards by directory.
+ * */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "invent.h"
+#include "memory.h"
+
+/* A listing is normally one file.  For a big site it can instead be split
+ * by directory, so that a run that only deals with part of the site (see
+ * --only) only reads the records for that part, and the records for
+ * different parts are appended to different files.  The listing file itself
+ * then becomes a manifest :
+
+   H, U, P, R as in a plain listing
+   T <depth>
+   S <name> <key>
+   I <name> <offset> <command> <record>
+   X <path>
+
+   'T' says how far down the split goes.  Each 'S' line gives a shard : the
+   records for the entries inside the directory <key> ('.' for the top),
+   kept in the file <listing>.<name>.  An entry deeper than <depth> levels
+   goes in the shard of its ancestor <depth> levels down; a directory's own
+   'D' and 'Z' records go in the shard of its parent, like any other entry.
+   The shards hold the F, M, B, D and Z records, in the format of a plain
+   listing (see fileinv.c).
+
+   Intents and 'X' records go in the manifest, so that they stay in the order
+   they were written.  Each intent also says where the shard that gets the
+   records for its path had got to when it was written : the records there
+   from <offset> on came after it.
+
+   Shard names are <generation>.<number>.  Rewriting the listing starts a new
+   generation, so the shards of the old manifest are left alone until the new
+   one is in place. */
+
+/* Beyond this, the least recently opened shard is closed to make room. */
+#define MAX_OPEN_SHARDS 32
+
+struct shard {/*{{{*/
+  char *key;
+  char *name;
+  FILE *file;
+  int written;   /* 1 once it's been opened for writing */
+  long opened;   /* when it was last opened, to find the oldest */
+};
+/*}}}*/
+struct manifest {/*{{{*/
+  int depth;     /* 0 for a plain listing */
+  int gen;       /* the latest generation of the shards */
+  struct shard *shards;
+  int n;
+  int max;
+  char *header;  /* the H, U, P and R lines */
+};
+/*}}}*/
+
+static char *shard_file_name(const char *listing_file, const char *name)/*{{{*/
+{
+  char *result = new_array(char, strlen(listing_file) + strlen(name) + 2);
+  sprintf(result, "%s.%s", listing_file, name);
+  return result;
+}
+/*}}}*/
+static struct shard *add_shard(struct manifest *m, const char *name, const char *key)/*{{{*/
+{
+  struct shard *s;
+  if (m->n == m->max) {
+    m->max = m->max ? 2 * m->max : 16;
+    m->shards = grow_array(struct shard, m->max, m->shards);
+  }
+  s = &m->shards[m->n++];
+  s->key = new_string(key);
+  s->name = new_string(name);
+  s->file = NULL;
+  s->written = 0;
+  s->opened = 0;
+  if (atoi(name) > m->gen) m->gen = atoi(name);
+  return s;
+}
+/*}}}*/
+static void free_manifest(struct manifest *m)/*{{{*/
+{
+  int i;
+  for (i=0; i<m->n; i++) {
+    free(m->shards[i].key);
+    free(m->shards[i].name);
+  }
+  if (m->shards) free(m->shards);
+  free(m->header);
+}
+/*}}}*/
+static int read_manifest(const char *listing_file, struct manifest *m)/*{{{*/
+{
+  /* Return 0 if the listing can't be read.  Only the header of a plain
+   * listing is read. */
+  FILE *in;
+  char *line = NULL;
+  size_t linesize = 0;
+  char *p;
+  size_t len;
+
+  m->depth = 0;
+  m->gen = 0;
+  m->shards = NULL;
+  m->n = m->max = 0;
+  m->header = new_string("");
+  in = fopen(listing_file, "r");
+  if (!in) return 0;
+  while (getline(&line, &linesize, in) > 0) {
+    if (strchr("HUPR", line[0])) {
+      len = strlen(m->header);
+      m->header = grow_array(char, len + strlen(line) + 1, m->header);
+      strcpy(m->header + len, line);
+    } else if (line[0] == 'T') {
+      m->depth = atoi(line + 2);
+    } else if (!m->depth) {
+      break;
+    } else if (line[0] == 'S') {
+      line[strcspn(line, "\n")] = '\0';
+      p = strchr(line + 2, ' ');
+      if (!p) {
+        fprintf(stderr, "Listing manifest %s corrupted\n", listing_file);
+        exit(1);
+      }
+      *p = '\0';
+      add_shard(m, line + 2, p + 1);
+    }
+  }
+  if (line) free(line);
+  fclose(in);
+  return 1;
+}
+/*}}}*/
+static struct shard *find_shard(struct manifest *m, const char *key)/*{{{*/
+{
+  int i;
+  for (i=0; i<m->n; i++) {
+    if (!strcmp(m->shards[i].key, key)) return &m->shards[i];
+  }
+  return NULL;
+}
+/*}}}*/
+static char *shard_key(const char *path, int depth)/*{{{*/
+{
+  /* The first depth components of the directory path is in. */
+  const char *slash, *p;
+  char *key;
+  int n;
+
+  slash = strrchr(path, '/');
+  if (!slash) return new_string(".");
+  for (p = path, n = 0; p < slash; p++) {
+    if ((*p == '/') && (++n == depth)) break;
+  }
+  key = new_array(char, p - path + 1);
+  memcpy(key, path, p - path);
+  key[p - path] = '\0';
+  return key;
+}
+/*}}}*/
+static int key_depth(const char *key)/*{{{*/
+{
+  int n;
+  if (!strcmp(key, ".")) return 0;
+  for (n = 1; (key = strchr(key, '/')); key++) n++;
+  return n;
+}
+/*}}}*/
+static int is_below(const char *path, const char *dir)/*{{{*/
+{
+  int len = strlen(dir);
+  return !strcmp(dir, ".") || (!strncmp(path, dir, len) && (!path[len] || (path[len] == '/')));
+}
+/*}}}*/
+int is_listing_shard(const char *listing_file, const char *name)/*{{{*/
+{
+  /* 1 if name is one of the listing's shards, or the manifest of a new
+   * listing being written. */
+  int len;
+  if (!listing_file) return 0;
+  len = strlen(listing_file);
+  if (strncmp(name, listing_file, len) || (name[len] != '.')) return 0;
+  name += len + 1;
+  if (!strcmp(name, "new")) return 1;
+  len = strspn(name, "0123456789");
+  if (!len || (name[len] != '.')) return 0;
+  name += len + 1;
+  len = strspn(name, "0123456789");
+  return len && !name[len];
+}
+/*}}}*/
+int listing_shard_depth(const char *listing_file)/*{{{*/
+{
+  struct manifest m;
+  int depth;
+  read_manifest(listing_file, &m);
+  depth = m.depth;
+  free_manifest(&m);
+  return depth;
+}
+/*}}}*/
+
+/*{{{ Reading */
+struct listing_reader {/*{{{*/
+  char *listing_file;
+  struct manifest m;
+  int *order;    /* the shards to read, in order */
+  int n;
+  int next;
+  char *text;    /* to hand out before the next file */
+  size_t text_len;
+  size_t text_pos;
+  FILE *in;
+};
+/*}}}*/
+static ssize_t read_shards(void *cookie, char *buf, size_t size)/*{{{*/
+{
+  /* The header, then each shard with an 'S <key>' line before it. */
+  struct listing_reader *r = cookie;
+  struct shard *s;
+  char *name;
+  size_t n;
+
+  while (1) {
+    if (r->text_pos < r->text_len) {
+      n = r->text_len - r->text_pos;
+      if (n > size) n = size;
+      memcpy(buf, r->text + r->text_pos, n);
+      r->text_pos += n;
+      return n;
+    }
+    if (r->in) {
+      n = fread(buf, 1, size, r->in);
+      if (n > 0) return n;
+      fclose(r->in);
+      r->in = NULL;
+    }
+    if (r->next == r->n) return 0;
+    s = &r->m.shards[r->order[r->next++]];
+    free(r->text);
+    r->text = new_array(char, strlen(s->key) + 4);
+    sprintf(r->text, "S %s\n", s->key);
+    r->text_len = strlen(r->text);
+    r->text_pos = 0;
+    name = shard_file_name(r->listing_file, s->name);
+    r->in = fopen(name, "r");
+    if (!r->in) {
+      fprintf(stderr, "Couldn't open listing shard %s\n", name);
+      exit(1);
+    }
+    free(name);
+  }
+}
+/*}}}*/
+static int close_reader(void *cookie)/*{{{*/
+{
+  struct listing_reader *r = cookie;
+  if (r->in) fclose(r->in);
+  free_manifest(&r->m);
+  free(r->listing_file);
+  free(r->order);
+  free(r->text);
+  free(r);
+  return 0;
+}
+/*}}}*/
+FILE *open_listing(const char *listing_file, const char *only)/*{{{*/
+{
+  struct listing_reader *r;
+  cookie_io_functions_t io = { read_shards, NULL, NULL, close_reader };
+  int i, j, k;
+
+  r = new(struct listing_reader);
+  if (!read_manifest(listing_file, &r->m) || !r->m.depth) {
+    free_manifest(&r->m);
+    free(r);
+    return fopen(listing_file, "r");
+  }
+  r->listing_file = new_string(listing_file);
+  /* Parents before children, so that each directory is there before the
+   * records for what's in it. */
+  r->order = new_array(int, r->m.n ? r->m.n : 1);
+  r->n = 0;
+  for (i=0; i<r->m.n; i++) {
+    const char *key = r->m.shards[i].key;
+    if (only && !is_below(only, key) && !is_below(key, only)) continue;
+    for (j = r->n; (j > 0) && (key_depth(r->m.shards[r->order[j-1]].key) > key_depth(key)); j--) ;
+    for (k = r->n; k > j; k--) r->order[k] = r->order[k-1];
+    r->order[j] = i;
+    r->n++;
+  }
+  r->next = 0;
+  r->text = new_string(r->m.header);
+  r->text_len = strlen(r->text);
+  r->text_pos = 0;
+  r->in = NULL;
+  return fopencookie(r, "r", io);
+}
+/*}}}*/
+static void copy_shard_until(struct listing_reader *r, struct shard *s, long offset, FILE *out)/*{{{*/
+{
+  /* Copy the shard's records up to offset (or the end, if -1), starting at
+   * offset the first time. */
+  char *line = NULL;
+  size_t linesize = 0;
+  char *name;
+
+  if (!s->written) {
+    name = shard_file_name(r->listing_file, s->name);
+    s->file = fopen(name, "r");
+    if (!s->file) {
+      fprintf(stderr, "Couldn't open listing shard %s\n", name);
+      exit(1);
+    }
+    free(name);
+    fseek(s->file, offset, SEEK_SET);
+    s->written = 1;
+  }
+  while (((offset < 0) || (ftell(s->file) < offset)) && (getline(&line, &linesize, s->file) > 0)) {
+    fputs(line, out);
+  }
+  if (line) free(line);
+}
+/*}}}*/
+FILE *open_listing_intents(const char *listing_file)/*{{{*/
+{
+  /* For pending_intents : the intents, with the records that could settle
+   * them put back in order round them, as if it were a plain listing.  Only
+   * the shards that intents refer to are read, and only from the first
+   * intent on. */
+  struct listing_reader r;
+  struct shard *s;
+  FILE *in, *out;
+  char *line = NULL;
+  size_t linesize = 0;
+  char name[64], command[8];
+  long offset;
+  int used, i;
+
+  if (!read_manifest(listing_file, &r.m) || !r.m.depth) {
+    free_manifest(&r.m);
+    return fopen(listing_file, "r");
+  }
+  r.listing_file = (char *) listing_file;
+  in = fopen(listing_file, "r");
+  out = tmpfile();
+  if (!in || !out) {
+    fprintf(stderr, "Couldn't read listing manifest %s\n", listing_file);
+    exit(1);
+  }
+  fputs(r.m.header, out);
+  while (getline(&line, &linesize, in) > 0) {
+    if (line[0] == 'X') {
+      fputs(line, out);
+    } else if ((line[0] == 'I') &&
+               (sscanf(line + 2, "%63s %ld %7s %n", name, &offset, command, &used) == 3)) {
+      for (i=0; (i<r.m.n) && strcmp(r.m.shards[i].name, name); i++) ;
+      if (i < r.m.n) copy_shard_until(&r, &r.m.shards[i], offset, out);
+      fprintf(out, "I %s %s", command, line + 2 + used);
+    }
+  }
+  if (line) free(line);
+  fclose(in);
+  for (i=0; i<r.m.n; i++) {
+    s = &r.m.shards[i];
+    if (s->written) {
+      copy_shard_until(&r, s, -1, out);
+      fclose(s->file);
+    }
+  }
+  free_manifest(&r.m);
+  rewind(out);
+  return out;
+}
+/*}}}*/
+/*}}}*/
+/*{{{ Writing */
+struct listing_writer {/*{{{*/
+  char *listing_file;
+  struct manifest m;
+  FILE *manifest;
+  int creating;      /* 1 when writing a new listing, 0 when appending */
+  char *new_file;    /* where a new manifest goes until it's complete */
+  struct manifest old; /* shards to remove once it is */
+  int n_open;
+  long clock;
+  char *line;        /* a record not yet complete */
+  size_t len;
+  size_t max;
+  int failed;
+};
+/*}}}*/
+static void close_shard(struct listing_writer *w, struct shard *s)/*{{{*/
+{
+  if (fclose(s->file) != 0) w->failed = 1;
+  s->file = NULL;
+  w->n_open--;
+}
+/*}}}*/
+static struct shard *shard_for(struct listing_writer *w, const char *path)/*{{{*/
+{
+  struct shard *s, *oldest;
+  char *key, *file_name;
+  char name[32];
+  int i;
+
+  key = shard_key(path, w->m.depth);
+  s = find_shard(&w->m, key);
+  if (!s) {
+    /* Record the shard in the manifest before anything goes in it. */
+    sprintf(name, "%d.%d", w->m.gen ? w->m.gen : 1, w->m.n + 1);
+    s = add_shard(&w->m, name, key);
+    fprintf(w->manifest, "S %s %s\n", name, key);
+    if (!w->creating) fflush(w->manifest);
+  }
+  free(key);
+  if (!s->file) {
+    if (w->n_open == MAX_OPEN_SHARDS) {
+      oldest = NULL;
+      for (i=0; i<w->m.n; i++) {
+        if (w->m.shards[i].file && (!oldest || (w->m.shards[i].opened < oldest->opened))) {
+          oldest = &w->m.shards[i];
+        }
+      }
+      close_shard(w, oldest);
+    }
+    file_name = shard_file_name(w->listing_file, s->name);
+    s->file = fopen(file_name, (w->creating && !s->written) ? "w" : "a");
+    if (!s->file) {
+      fprintf(stderr, "Couldn't open listing shard %s to write\n", file_name);
+      exit(1);
+    }
+    free(file_name);
+    fseek(s->file, 0, SEEK_END);
+    s->written = 1;
+    s->opened = ++w->clock;
+    w->n_open++;
+  }
+  return s;
+}
+/*}}}*/
+static void write_line(struct listing_writer *w, char *line)/*{{{*/
+{
+  /* line is one record, without its newline. */
+  struct shard *s;
+
+  if (!w->m.depth) {
+    fprintf(w->manifest, "%s\n", line);
+    return;
+  }
+  switch (line[0]) {
+    case 'I':
+      s = shard_for(w, record_path(line));
+      fprintf(w->manifest, "I %s %ld %s\n", s->name, ftell(s->file), line + 2);
+      break;
+    case 'X':
+      fprintf(w->manifest, "%s\n", line);
+      break;
+    default:
+      s = shard_for(w, record_path(line));
+      fprintf(s->file, "%s\n", line);
+      if (!w->creating) fflush(s->file);
+      break;
+  }
+  if (!w->creating) fflush(w->manifest);
+}
+/*}}}*/
+static ssize_t write_records(void *cookie, const char *buf, size_t size)/*{{{*/
+{
+  struct listing_writer *w = cookie;
+  char *start, *nl;
+
+  if (w->len + size + 1 > w->max) {
+    w->max = 2 * (w->len + size + 1);
+    w->line = grow_array(char, w->max, w->line);
+  }
+  memcpy(w->line + w->len, buf, size);
+  w->len += size;
+  w->line[w->len] = '\0';
+  for (start = w->line; (nl = strchr(start, '\n')); start = nl + 1) {
+    *nl = '\0';
+    write_line(w, start);
+  }
+  w->len -= start - w->line;
+  memmove(w->line, start, w->len);
+  return w->failed ? -1 : size;
+}
+/*}}}*/
+static int close_writer(void *cookie)/*{{{*/
+{
+  struct listing_writer *w = cookie;
+  char *name;
+  int i, result;
+
+  for (i=0; i<w->m.n; i++) {
+    if (w->m.shards[i].file) close_shard(w, &w->m.shards[i]);
+  }
+  if (fclose(w->manifest) != 0) w->failed = 1;
+  result = w->failed ? -1 : 0;
+  if (w->creating) {
+    if (!w->failed && (rename(w->new_file, w->listing_file) < 0)) result = -1;
+    if (result == 0) {
+      for (i=0; i<w->old.n; i++) {
+        name = shard_file_name(w->listing_file, w->old.shards[i].name);
+        unlink(name);
+        free(name);
+      }
+    }
+    free(w->new_file);
+    free_manifest(&w->old);
+  }
+  free_manifest(&w->m);
+  free(w->listing_file);
+  if (w->line) free(w->line);
+  free(w);
+  return result;
+}
+/*}}}*/
+static FILE *open_writer(struct listing_writer *w)/*{{{*/
+{
+  cookie_io_functions_t io = { NULL, write_records, NULL, close_writer };
+  w->n_open = 0;
+  w->clock = 0;
+  w->line = NULL;
+  w->len = w->max = 0;
+  w->failed = 0;
+  return fopencookie(w, "w", io);
+}
+/*}}}*/
+FILE *open_journal(const char *listing_file)/*{{{*/
+{
+  struct listing_writer *w;
+
+  w = new(struct listing_writer);
+  if (!read_manifest(listing_file, &w->m) || !w->m.depth) {
+    free_manifest(&w->m);
+    free(w);
+    return fopen(listing_file, "a");
+  }
+  w->listing_file = new_string(listing_file);
+  w->creating = 0;
+  w->manifest = fopen(listing_file, "a");
+  if (!w->manifest) {
+    free_manifest(&w->m);
+    free(w->listing_file);
+    free(w);
+    return NULL;
+  }
+  return open_writer(w);
+}
+/*}}}*/
+FILE *create_listing(const char *listing_file, const struct remote_params *rp, int shard_depth)/*{{{*/
+{
+  struct listing_writer *w;
+
+  w = new(struct listing_writer);
+  w->listing_file = new_string(listing_file);
+  w->creating = 1;
+  read_manifest(listing_file, &w->old);
+  w->m.depth = shard_depth;
+  w->m.gen = w->old.gen + 1;
+  w->m.shards = NULL;
+  w->m.n = w->m.max = 0;
+  w->m.header = new_string("");
+  w->new_file = new_array(char, strlen(listing_file) + 5);
+  strcpy(w->new_file, listing_file);
+  strcat(w->new_file, ".new");
+  w->manifest = fopen(w->new_file, "w");
+  if (!w->manifest) {
+    fprintf(stderr, "Could not write new listing file %s\n", w->new_file);
+    exit(1);
+  }
+  fprintf(w->manifest, "H %s\n", rp->hostname);
+  fprintf(w->manifest, "U %s\n", rp->username);
+  fprintf(w->manifest, "P %d\n", rp->port_number);
+  if (rp->remote_root) {
+    fprintf(w->manifest, "R %s\n", rp->remote_root);
+  }
+  if (shard_depth) {
+    fprintf(w->manifest, "T %d\n", shard_depth);
+  }
+  return open_writer(w);
+}
+/*}}}*/
+/*}}}*/
@@ -0,0 +1,698 @@
+/*
+ * Upload by merging sorted streams of the listing and the local tree.
+ * */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "digest.h"
+#include "extsort.h"
+#include "ftp.h"
+#include "invent.h"
+#include "journal.h"
+#include "memory.h"
+#include "progress.h"
+#include "schedule.h"
+
+/* For trees too big to hold in memory.  The listing and the local tree are
+ * each turned into a stream of entries sorted by path, spilling sorted runs
+ * to temporary files once their share of the memory limit is used up (see
+ * extsort.c).  A directory sorts before everything in it, so one pass down
+ * both streams side by side finds what is new, changed or gone, as
+ * reconcile does for the trees.  What has to be done is spilled too, and
+ * done afterwards : removals deepest first, then new directories shallowest
+ * first, then the files to send, a batch at a time.
+ *
+ * The remote stream, with the superseded records dropped, is the preened
+ * listing, so that is written out on the same pass.
+ *
+ * Renames aren't looked for, and the scan and hash caches aren't used, since
+ * each of them needs the whole tree at once. */
+
+/* The memory limit is shared between the two streams, the list of removals
+ * and the batch of files being digested or sent. */
+#define STREAM_SHARES 4
+#define MIN_SHARE (64UL << 10)
+/* Allowance for each file in a batch, on top of its path and block
+ * digests. */
+#define BATCH_OVERHEAD (2 * sizeof(struct fnode) + sizeof(struct transfer) + 64)
+
+struct listed {/*{{{*/
+  /* One path's entry in either stream. */
+  char *path;
+  int is_dir;
+  struct fnode f; /* size, mtime and digests of a file */
+};
+/*}}}*/
+struct stream_job {/*{{{*/
+  size_t share;
+  struct sorter *remote;
+  const char *remote_ahead; /* next record from remote, not yet used */
+  struct sorter *local;
+  struct sorter *deletes;   /* deepest first */
+  FILE *mkdirs;             /* paths of new directories, shallowest first */
+  FILE *sends;              /* see write_send */
+  FILE *retouched;          /* listing records for files with just a new mtime */
+  struct upload_totals tot;
+
+  /* Files that look stale but may only have been touched, waiting to be
+   * digested : listing entries, each with its local peer. */
+  struct fnode **touched;
+  int n_touched;
+  int max_touched;
+  size_t touched_bytes;
+};
+/*}}}*/
+static int compare_paths_reversed(const char *a, const char *b)/*{{{*/
+{
+  return compare_paths(b, a);
+}
+/*}}}*/
+static void add_keyed(struct sorter *s, const char *path, const char *rest)/*{{{*/
+{
+  /* Records are the path, a newline and the rest. */
+  char *record;
+  int len = strlen(path);
+  record = new_array(char, len + strlen(rest) + 2);
+  strcpy(record, path);
+  record[len] = '\n';
+  strcpy(record + len + 1, rest);
+  sorter_add(s, record);
+  free(record);
+}
+/*}}}*/
+static FILE *spill_file(void)/*{{{*/
+{
+  FILE *f = tmpfile();
+  if (!f) {
+    fprintf(stderr, "Could not create a temporary file\n");
+    exit(1);
+  }
+  return f;
+}
+/*}}}*/
+static void clear_listed(struct listed *e)/*{{{*/
+{
+  e->path = NULL;
+  e->f.path = e->f.name = NULL;
+  e->f.is_dir = 0;
+  e->f.x.file.has_md5 = 0;
+  e->f.x.file.block_size = 0;
+  e->f.x.file.blocks = NULL;
+  e->f.x.file.dev = 0;
+  e->f.x.file.ino = 0;
+  e->f.x.file.peer = NULL;
+  e->f.x.file.is_stale = 0;
+  e->f.x.file.is_retouched = 0;
+}
+/*}}}*/
+static void free_listed(struct listed *e)/*{{{*/
+{
+  if (e->f.x.file.blocks) free(e->f.x.file.blocks);
+  if (e->path) free(e->path);
+  clear_listed(e);
+}
+/*}}}*/
+static struct fnode *new_file_node(const char *path, const struct fnode *from)/*{{{*/
+{
+  /* A copy of the file details in from, taking over its block digests. */
+  struct fnode *f;
+  f = new(struct fnode);
+  *f = *from;
+  f->path = f->name = new_string(path);
+  f->is_dir = 0;
+  f->is_unique = f->is_clash = 0;
+  f->x.file.peer = NULL;
+  return f;
+}
+/*}}}*/
+static void free_file_node(struct fnode *f)/*{{{*/
+{
+  /* name and path are the same string here. */
+  if (f->x.file.blocks) free(f->x.file.blocks);
+  free(f->path);
+  free(f);
+}
+/*}}}*/
+static void read_listing(const char *listing, struct remote_params *rp, struct sorter *s)/*{{{*/
+{
+  /* As make_fileinv, but into the sorter rather than a tree. */
+  FILE *in;
+  char *line = NULL;
+  size_t linesize = 0;
+  int number;
+
+  in = open_listing(listing, NULL);
+  if (!in) {
+    fprintf(stderr, "Couldn't open listing file %s\n", listing);
+    exit(1);
+  }
+  number = 1;
+  while (getline(&line, &linesize, in) > 0) {
+    char *p;
+    for (p=line; *p; p++) ;
+    while ((p > line) && isspace(*--p)) {
+      *p = '\0';
+    }
+    switch (line[0]) {
+      case 'H': rp->hostname = new_string(line + 2); break;
+      case 'U': rp->username = new_string(line + 2); break;
+      case 'P': rp->port_number = atoi(line + 2); break;
+      case 'R': rp->remote_root = new_string(line + 2); break;
+      case 'F':
+      case 'M':
+      case 'B':
+      case 'D':
+      case 'Z':
+        add_keyed(s, record_path(line), line);
+        break;
+      case 'I':
+      case 'X':
+        /* Already seen to by upload */
+        break;
+      case 'S':
+        /* A shard's records are taken as they come : the leftovers of a
+         * directory that has gone are all 'Z' in the end. */
+        break;
+      default:
+        fprintf(stderr, "Line %d in listing file %s corrupted\n", number, listing);
+        break;
+    }
+    number++;
+  }
+  if (line) free(line);
+  fclose(in);
+}
+/*}}}*/
+static int next_listed(struct stream_job *job, struct listed *e)/*{{{*/
+{
+  /* Take the records for the next path that is still on the server and
+   * work out what they leave there, as make_fileinv would : the last F, M,
+   * D or Z record wins, with any B record that follows the last M.  Return
+   * 0 at the end. */
+  const char *line;
+  int len, state; /* 0 : gone, 1 : file, 2 : directory */
+
+  while (job->remote_ahead) {
+    clear_listed(e);
+    len = strchr(job->remote_ahead, '\n') - job->remote_ahead;
+    e->path = new_array(char, len + 1);
+    memcpy(e->path, job->remote_ahead, len);
+    e->path[len] = '\0';
+    state = 0;
+    while (job->remote_ahead && !compare_paths(job->remote_ahead, e->path)) {
+      line = job->remote_ahead + len + 1;
+      switch (line[0]) {
+        case 'F':
+        case 'M':
+          state = 1;
+          if (e->f.x.file.blocks) free(e->f.x.file.blocks);
+          e->f.x.file.blocks = NULL;
+          e->f.x.file.block_size = 0;
+          parse_file_record(line, &e->f);
+          break;
+        case 'B':
+          if (state == 1) parse_blocks_record(line, &e->f);
+          break;
+        case 'D':
+          state = 2;
+          break;
+        case 'Z':
+          state = 0;
+          break;
+      }
+      job->remote_ahead = sorter_next(job->remote);
+    }
+    if (state) {
+      e->is_dir = (state == 2);
+      return 1;
+    }
+    free_listed(e);
+  }
+  return 0;
+}
+/*}}}*/
+static void visit_local(void *arg, const struct fnode *e)/*{{{*/
+{
+  char rest[128];
+  if (e->is_dir) {
+    strcpy(rest, "D");
+  } else {
+    sprintf(rest, "F %lx %lx %llx %llx", (unsigned long) e->x.file.size, (unsigned long) e->x.file.mtime,
+            (unsigned long long) e->x.file.dev, (unsigned long long) e->x.file.ino);
+  }
+  add_keyed((struct sorter *) arg, e->path, rest);
+}
+/*}}}*/
+static int next_local(struct stream_job *job, struct listed *e)/*{{{*/
+{
+  const char *record, *rest;
+  unsigned long size, mtime;
+  unsigned long long dev, ino;
+  int len;
+
+  record = sorter_next(job->local);
+  if (!record) return 0;
+  clear_listed(e);
+  rest = strchr(record, '\n');
+  len = rest - record;
+  rest++;
+  e->path = new_array(char, len + 1);
+  memcpy(e->path, record, len);
+  e->path[len] = '\0';
+  e->is_dir = (rest[0] == 'D');
+  if (!e->is_dir) {
+    sscanf(rest, "F %lx %lx %llx %llx", &size, &mtime, &dev, &ino);
+    e->f.x.file.size = size;
+    e->f.x.file.mtime = mtime;
+    e->f.x.file.dev = dev;
+    e->f.x.file.ino = ino;
+  }
+  return 1;
+}
+/*}}}*/
+static void write_send(FILE *out, const char *path, const struct fnode *remote, const struct fnode *local)/*{{{*/
+{
+  /* A new file is
+   *   N <size> <mtime> <device> <inode> <path>
+   * from the local file, and one to update is the same with U, followed by
+   * the listing's record(s) for the remote file. */
+  fprintf(out, "%c %lx %lx %llx %llx %s\n", remote ? 'U' : 'N',
+          (unsigned long) local->x.file.size, (unsigned long) local->x.file.mtime,
+          (unsigned long long) local->x.file.dev, (unsigned long long) local->x.file.ino, path);
+  if (remote) write_file_record(out, remote, path);
+}
+/*}}}*/
+static void check_touched(struct stream_job *job)/*{{{*/
+{
+  /* As check_digests, for the files queued so far. */
+  struct fnode **local;
+  struct fnode *e1, *e2;
+  int i;
+
+  if (!job->n_touched) return;
+  local = new_array(struct fnode *, job->n_touched);
+  for (i=0; i<job->n_touched; i++) local[i] = job->touched[i]->x.file.peer;
+  digest_files(local, job->n_touched);
+  for (i=0; i<job->n_touched; i++) {
+    e1 = job->touched[i];
+    e2 = e1->x.file.peer;
+    if (e2->x.file.has_md5 && !memcmp(e1->x.file.md5, e2->x.file.md5, 16)) {
+      write_file_record(job->retouched, e2, e1->path);
+    } else {
+      write_send(job->sends, e1->path, e1, e2);
+      job->tot.update_files++;
+      job->tot.update_bytes += e2->x.file.size;
+    }
+    free_file_node(e1);
+    free_file_node(e2);
+  }
+  free(local);
+  forget_hashcache();
+  job->n_touched = 0;
+  job->touched_bytes = 0;
+}
+/*}}}*/
+static void gone(struct stream_job *job, const struct listed *r)/*{{{*/
+{
+  add_keyed(job->deletes, r->path, r->is_dir ? "D" : "F");
+  job->tot.delete_entries++;
+}
+/*}}}*/
+static void arrived(struct stream_job *job, const struct listed *l)/*{{{*/
+{
+  if (l->is_dir) {
+    fprintf(job->mkdirs, "%s\n", l->path);
+  } else {
+    write_send(job->sends, l->path, NULL, &l->f);
+    job->tot.add_files++;
+    job->tot.add_bytes += l->f.x.file.size;
+  }
+}
+/*}}}*/
+static void compare_listed(struct stream_job *job, struct listed *r, struct listed *l)/*{{{*/
+{
+  /* r from the listing and l from the local tree have the same path. */
+  struct fnode *e1, *e2;
+
+  if (r->is_dir != l->is_dir) {
+    gone(job, r);
+    arrived(job, l);
+    return;
+  }
+  if (r->is_dir) return;
+  match_files(&r->f, &l->f);
+  if (!r->f.x.file.is_stale) return;
+  if (!r->f.x.file.has_md5 || (r->f.x.file.size != l->f.x.file.size)) {
+    write_send(job->sends, r->path, &r->f, &l->f);
+    job->tot.update_files++;
+    job->tot.update_bytes += l->f.x.file.size;
+    return;
+  }
+
+  /* Maybe only touched : find out a batch at a time. */
+  e1 = new_file_node(r->path, &r->f);
+  e2 = new_file_node(l->path, &l->f);
+  r->f.x.file.blocks = NULL;
+  e1->x.file.peer = e2;
+  e2->x.file.peer = e1;
+  if (job->n_touched == job->max_touched) {
+    job->max_touched = job->max_touched ? 2 * job->max_touched : 64;
+    job->touched = grow_array(struct fnode *, job->max_touched, job->touched);
+  }
+  job->touched[job->n_touched++] = e1;
+  job->touched_bytes += BATCH_OVERHEAD + 2 * strlen(r->path) +
+    (e1->x.file.blocks ? count_blocks(e1->x.file.size, e1->x.file.block_size) * BLOCK_DIGEST_LEN : 0);
+  if (job->touched_bytes >= job->share) check_touched(job);
+}
+/*}}}*/
+static void write_listed(FILE *out, const struct listed *r)/*{{{*/
+{
+  if (r->is_dir) {
+    fprintf(out, "D                   %s\n", r->path);
+  } else {
+    write_file_record(out, &r->f, r->path);
+  }
+}
+/*}}}*/
+static void merge_streams(struct stream_job *job, FILE *preened)/*{{{*/
+{
+  /* If preened is non-NULL, the listing's entries are written to it as they
+   * go past. */
+  struct listed r, l;
+  int have_r, have_l, c;
+
+  job->remote_ahead = sorter_next(job->remote);
+  have_r = next_listed(job, &r);
+  have_l = next_local(job, &l);
+  while (have_r || have_l) {
+    c = !have_r ? 1 : !have_l ? -1 : strcmp(r.path, l.path);
+    if ((c <= 0) && preened) write_listed(preened, &r);
+    if (c < 0) {
+      gone(job, &r);
+    } else if (c > 0) {
+      arrived(job, &l);
+    } else {
+      compare_listed(job, &r, &l);
+    }
+    if (c <= 0) {
+      free_listed(&r);
+      have_r = next_listed(job, &r);
+    }
+    if (c >= 0) {
+      free_listed(&l);
+      have_l = next_local(job, &l);
+    }
+  }
+  check_touched(job);
+}
+/*}}}*/
+static struct fnode *read_send(FILE *in, char **buf, size_t *bufsize)/*{{{*/
+{
+  /* Read back one file from the sends spill, returning the node to put in
+   * the transfer : the local file if it is new, the remote one (with its
+   * local peer) if not.  Return NULL at the end.  The lines are read into
+   * *buf, which the caller frees. */
+  char *line;
+  unsigned long size, mtime;
+  unsigned long long dev, ino;
+  struct fnode *l, *r;
+  int used, c;
+
+  if (getline(buf, bufsize, in) <= 0) return NULL;
+  line = *buf;
+  line[strcspn(line, "\n")] = '\0';
+  if (sscanf(line + 1, " %lx %lx %llx %llx %n", &size, &mtime, &dev, &ino, &used) != 4) {
+    fprintf(stderr, "Temporary file corrupted\n");
+    exit(1);
+  }
+  l = new(struct fnode);
+  l->path = l->name = new_string(line + 1 + used);
+  l->is_dir = 0;
+  l->is_unique = 1;
+  l->is_clash = 0;
+  l->x.file.size = size;
+  l->x.file.mtime = mtime;
+  l->x.file.has_md5 = 0;
+  l->x.file.block_size = 0;
+  l->x.file.blocks = NULL;
+  l->x.file.dev = dev;
+  l->x.file.ino = ino;
+  l->x.file.peer = NULL;
+  l->x.file.is_stale = 0;
+  l->x.file.is_retouched = 0;
+  if (line[0] == 'N') return l;
+
+  r = new(struct fnode);
+  *r = *l;
+  r->path = r->name = new_string(l->path);
+  r->is_unique = 0;
+  r->x.file.is_stale = 1;
+  if (getline(buf, bufsize, in) <= 0) {
+    fprintf(stderr, "Temporary file corrupted\n");
+    exit(1);
+  }
+  parse_file_record(*buf, r);
+  c = getc(in);
+  ungetc(c, in);
+  if (c == 'B') {
+    if (getline(buf, bufsize, in) <= 0) {
+      fprintf(stderr, "Temporary file corrupted\n");
+      exit(1);
+    }
+    parse_blocks_record(*buf, r);
+    /* Block digests are only comparable at the same block size. */
+    if (r->x.file.blocks && (count_blocks(l->x.file.size, r->x.file.block_size) <= MAX_BLOCKS)) {
+      l->x.file.block_size = r->x.file.block_size;
+    }
+  }
+  r->x.file.peer = l;
+  l->x.file.peer = r;
+  l->is_unique = 0;
+  return r;
+}
+/*}}}*/
+static void send_streamed(struct FTP *ctrl_con, struct stream_job *job, FILE *journal,/*{{{*/
+                          const struct connect_info *ci)
+{
+  struct transfer *t = NULL;
+  struct fnode **local = NULL;
+  struct fnode *node;
+  char *line = NULL;
+  size_t linesize = 0;
+  int n, max = 0, i;
+  size_t batch_bytes;
+
+  if (!job->tot.add_files && !job->tot.update_files) return;
+  rewind(job->sends);
+  progress_begin(job->tot.add_files + job->tot.update_files,
+                 job->tot.add_bytes + job->tot.update_bytes);
+  do {
+    n = 0;
+    batch_bytes = 0;
+    while ((batch_bytes < job->share) && (node = read_send(job->sends, &line, &linesize))) {
+      if (n == max) {
+        max = max ? 2 * max : 64;
+        t = grow_array(struct transfer, max, t);
+        local = grow_array(struct fnode *, max, local);
+      }
+      local[n] = node->is_unique ? node : node->x.file.peer;
+      t[n].node = node;
+      t[n].size = local[n]->x.file.size;
+      batch_bytes += BATCH_OVERHEAD + 2 * strlen(node->path) +
+        (node->x.file.blocks ? count_blocks(node->x.file.size, node->x.file.block_size) * BLOCK_DIGEST_LEN : 0);
+      n++;
+    }
+    if (!n) break;
+    digest_files(local, n);
+    send_batch(ctrl_con, t, n, journal, ci);
+    for (i=0; i<n; i++) {
+      if (!t[i].node->is_unique) free_file_node(t[i].node->x.file.peer);
+      free_file_node(t[i].node);
+    }
+    forget_hashcache();
+  } while (batch_bytes >= job->share);
+  progress_end();
+  if (line) free(line);
+  if (t) free(t);
+  if (local) free(local);
+}
+/*}}}*/
+static char *record_key(const char *record)/*{{{*/
+{
+  int len = strcspn(record, "\n");
+  char *path = new_array(char, len + 1);
+  memcpy(path, record, len);
+  path[len] = '\0';
+  return path;
+}
+/*}}}*/
+static const char *send_path(const char *line)/*{{{*/
+{
+  /* Skip the type and the four numbers at the start of a sends record. */
+  int i;
+  for (i=0; i<5; i++) {
+    line += strcspn(line, " ");
+    line += strspn(line, " ");
+  }
+  return line;
+}
+/*}}}*/
+static void print_streamed(struct stream_job *job)/*{{{*/
+{
+  /* As upload_dummy, from the spill files. */
+  char *line = NULL;
+  size_t linesize = 0;
+  const char *record;
+  char *path;
+
+  printf("UNIQUE IN LOCAL FILESYSTEM\n");
+  rewind(job->mkdirs);
+  while (getline(&line, &linesize, job->mkdirs) > 0) {
+    printf("D %s", line);
+  }
+  rewind(job->sends);
+  while (getline(&line, &linesize, job->sends) > 0) {
+    if (line[0] == 'N') printf("F %s", send_path(line));
+  }
+  printf("TOTAL OF %ld bytes to upload\n", (unsigned long) job->tot.add_bytes);
+  printf("\n\nUNIQUE IN REMOTE FILESYSTEM (FROM listing file)\n");
+  while ((record = sorter_next(job->deletes))) {
+    path = record_key(record);
+    printf("%c %s\n", record[strlen(path) + 1], path);
+    free(path);
+  }
+  printf("\n\nOUT OF DATE IN REMOTE FILESYSTEM (FROM listing file)\n");
+  rewind(job->sends);
+  while (getline(&line, &linesize, job->sends) > 0) {
+    if (line[0] == 'U') printf("F %s", send_path(line));
+  }
+  if (line) free(line);
+  printf("TOTAL OF %ld bytes to upload\n", (unsigned long) job->tot.update_bytes);
+}
+/*}}}*/
+static void remove_streamed(struct FTP *ctrl_con, struct stream_job *job, FILE *journal)/*{{{*/
+{
+  const char *record;
+  struct fnode e;
+
+  while ((record = sorter_next(job->deletes))) {
+    e.path = record_key(record);
+    if (record[strlen(e.path) + 1] == 'D') {
+      remove_directory(ctrl_con, &e, journal);
+    } else {
+      remove_file(ctrl_con, &e, journal);
+    }
+    free(e.path);
+  }
+}
+/*}}}*/
+static void create_streamed(struct FTP *ctrl_con, struct stream_job *job, FILE *journal)/*{{{*/
+{
+  char *line = NULL;
+  size_t linesize = 0;
+  struct fnode e;
+
+  rewind(job->mkdirs);
+  while (getline(&line, &linesize, job->mkdirs) > 0) {
+    line[strcspn(line, "\n")] = '\0';
+    e.path = line;
+    create_directory(ctrl_con, &e, journal);
+  }
+  if (line) free(line);
+}
+/*}}}*/
+static void copy_file(FILE *from, FILE *to)/*{{{*/
+{
+  char buffer[8192];
+  size_t n;
+  rewind(from);
+  while ((n = fread(buffer, 1, sizeof(buffer), from)) > 0) {
+    fwrite(buffer, 1, n, to);
+  }
+}
+/*}}}*/
+int upload_streaming(const char *password, const char *listing_file,/*{{{*/
+                     const struct upload_params *up)
+{
+  struct stream_job job;
+  struct remote_params rp;
+  struct connect_info ci;
+  FILE *preened = NULL;
+
+  job.share = up->mem_limit / STREAM_SHARES;
+  if (job.share < MIN_SHARE) job.share = MIN_SHARE;
+  job.tot.add_files = job.tot.update_files = job.tot.delete_entries = 0;
+  job.tot.add_bytes = job.tot.update_bytes = 0;
+  job.touched = NULL;
+  job.n_touched = job.max_touched = 0;
+  job.touched_bytes = 0;
+  job.mkdirs = spill_file();
+  job.sends = spill_file();
+  job.retouched = spill_file();
+
+  init_remote_params(&rp);
+  job.remote = new_sorter(job.share, compare_paths);
+  read_listing(listing_file, &rp, job.remote);
+  sorter_finish(job.remote);
+  job.local = new_sorter(job.share, compare_paths);
+  walk_localinv(listing_file, visit_local, job.local);
+  sorter_finish(job.local);
+  job.deletes = new_sorter(job.share, compare_paths_reversed);
+
+  if (!up->is_dummy_run) {
+    printf("Preening listing file... "); fflush(stdout);
+    preened = create_listing(listing_file, &rp,
+                             (up->shard_depth >= 0) ? up->shard_depth : listing_shard_depth(listing_file));
+  }
+  merge_streams(&job, preened);
+  free_sorter(job.remote);
+  free_sorter(job.local);
+  sorter_finish(job.deletes);
+
+  if (up->is_dummy_run) {
+    print_streamed(&job);
+  } else {
+    struct FTP *ctrl_con;
+    FILE *journal;
+
+    /* Files that were only touched go after everything else, so that they
+     * take precedence. */
+    copy_file(job.retouched, preened);
+    if (fclose(preened) != 0) {
+      fprintf(stderr, "Could not put new listing file in place of %s\n", listing_file);
+      exit(1);
+    }
+    printf("done\n"); fflush(stdout);
+
+    journal = open_journal(listing_file);
+    if (!journal) {
+      fprintf(stderr, "Couldn't open %s to append updates\n", listing_file);
+      exit(1);
+    }
+    ci.rp = &rp;
+    ci.password = password;
+    ci.active_ftp = up->active_ftp;
+    ci.n_connections = up->n_connections;
+    print_totals(&job.tot);
+    ctrl_con = open_remote(&rp, password, up->active_ftp);
+    remove_streamed(ctrl_con, &job, journal);
+    create_streamed(ctrl_con, &job, journal);
+    send_streamed(ctrl_con, &job, journal, &ci);
+    ftp_close(ctrl_con);
+    fclose(journal);
+  }
+
+  free_sorter(job.deletes);
+  fclose(job.mkdirs);
+  fclose(job.sends);
+  fclose(job.retouched);
+  if (job.touched) free(job.touched);
+  free(rp.hostname);
+  free(rp.username);
+  if (rp.remote_root) free(rp.remote_root);
+  return 0;
+}
+/*}}}*/
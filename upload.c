@@ -1,13 +1,21 @@
 /* Do site upload */
 
+#include <pthread.h>
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <time.h>
 
+#include "copies.h"
+#include "digest.h"
+#include "fail.h"
 #include "ftp.h"
 #include "invent.h"
+#include "journal.h"
 #include "memory.h"
+#include "progress.h"
+#include "renames.h"
+#include "schedule.h"
 
 static void set_subdir_unique(struct fnode *x, int to_what)/*{{{*/
 {
@@ -15,6 +23,7 @@ static void set_subdir_unique(struct fnode *x, int to_what)/*{{{*/
   struct fnode *e;
   for (e = x->next; e != x; e = e->next) {
     e->is_unique = to_what;
+    e->is_clash = 0;
     if (e->is_dir) {
       set_subdir_unique((struct fnode *) &e->x.dir.next, to_what);
     }
@@ -28,6 +37,35 @@ static void set_file_unique(struct fnode *x, int to_what)/*{{{*/
   if (x->is_dir) set_subdir_unique((struct fnode *) &x->x.dir.next, to_what);
 }
 /*}}}*/
+void match_files(struct fnode *e1, struct fnode *e2)/*{{{*/
+{
+  /* e1 is from 'fileinv', e2 is from 'localinv', with the same name. */
+
+  /* Mark uniques == 0, so that the new file is uploaded 'in place'
+   * rather than being deleted in the 1st pass and then uploaded anew in
+   * the 2nd pass. */
+  e1->is_unique = e2->is_unique = 0;
+  e1->x.file.peer = e2;
+  e2->x.file.peer = e1;
+  e1->x.file.is_retouched = 0;
+  if (e1->x.file.size == e2->x.file.size) {
+    /* Further check based on mtime.  Treat zero mtime as a wildcard
+     * (e.g. when the remote index has been built for the first time.)
+     * Allow a grace window of 2 seconds, because strange things seem to
+     * happen to mtimes on VFAT filesystems...
+     * */
+    if (!e1->x.file.mtime || !e2->x.file.mtime ||
+        ((int)(e2->x.file.mtime - e1->x.file.mtime) < 2)) {
+      e1->x.file.is_stale = e2->x.file.is_stale = 0;
+    } else {
+      e1->x.file.is_stale = e2->x.file.is_stale = 1;
+    }
+  } else {
+    /* Certainly differing */
+    e1->x.file.is_stale = e2->x.file.is_stale = 1;
+  }
+}
+/*}}}*/
 static void inner_reconcile(struct fnode *f1, struct fnode *f2)/*{{{*/
 {
   struct fnode *e1;
@@ -58,6 +96,7 @@ matched:
 /*{{{ dir/file */
         e2->is_unique = 1;
         set_file_unique(e1, 1);
+        e1->is_clash = e2->is_clash = 1;
 /*}}}*/
       }
     } else {
@@ -65,43 +104,81 @@ matched:
 /*{{{ file/dir */
         e1->is_unique = 1;
         set_file_unique(e2, 1);
+        e1->is_clash = e2->is_clash = 1;
 /*}}}*/
       } else {
         /*{{{ file/file */
-        /* Mark uniques == 0, so that the new file is uploaded 'in place'
-         * rather than being deleted in the 1st pass and then uploaded anew in
-         * the 2nd pass. */
-        e1->is_unique = e2->is_unique = 0;
-        e1->x.file.peer = e2;
-        e2->x.file.peer = e1;
-        if (e1->x.file.size == e2->x.file.size) {
-          /* Further check based on mtime.  Treat zero mtime as a wildcard
-           * (e.g. when the remote index has been built for the first time.)
-           * Allow a grace window of 2 seconds, because strange things seem to
-           * happen to mtimes on VFAT filesystems...
-           * */
-          if (!e1->x.file.mtime || !e2->x.file.mtime ||
-              ((int)(e2->x.file.mtime - e1->x.file.mtime) < 2)) {
-            e1->x.file.is_stale = e2->x.file.is_stale = 0;
-          } else {
-            e1->x.file.is_stale = e2->x.file.is_stale = 1;
-          }
-        } else {
-          /* Certainly differing */
-          e1->x.file.is_stale = e2->x.file.is_stale = 1;
-        }
+        match_files(e1, e2);
 /*}}}*/
       }
     }
   }
 }
 /*}}}*/
-static void reconcile(struct fnode *f1, struct fnode *f2)/*{{{*/
+struct file_set {/*{{{*/
+  struct fnode **files;
+  int n;
+  int max;
+};
+/*}}}*/
+static void add_to_set(struct file_set *fs, struct fnode *f)/*{{{*/
+{
+  if (fs->n == fs->max) {
+    fs->max = fs->max ? 2 * fs->max : 64;
+    fs->files = grow_array(struct fnode *, fs->max, fs->files);
+  }
+  fs->files[fs->n++] = f;
+}
+/*}}}*/
+static void find_touched(struct fnode *x, struct file_set *fs)/*{{{*/
+{
+  /* x is from 'fileinv'.  Collect files that look stale only because of
+   * their mtime, where we know what the remote contents are. */
+  struct fnode *e;
+  for (e = x->next; e != x; e = e->next) {
+    if (e->is_dir) {
+      find_touched((struct fnode *) &e->x.dir.next, fs);
+    } else if (!e->is_unique && e->x.file.is_stale && e->x.file.has_md5 &&
+               (e->x.file.size == e->x.file.peer->x.file.size)) {
+      add_to_set(fs, e);
+    }
+  }
+}
+/*}}}*/
+static void check_digests(struct fnode *fileinv)/*{{{*/
+{
+  /* A file that has been touched, checked out again or rebuilt identically
+   * has a new mtime but the same contents.  Compare digests to avoid sending
+   * it again; the listing just needs to learn the new mtime. */
+  struct file_set remote, local;
+  int i;
+
+  remote.files = local.files = NULL;
+  remote.n = remote.max = local.n = local.max = 0;
+  find_touched(fileinv, &remote);
+  for (i=0; i<remote.n; i++) {
+    add_to_set(&local, remote.files[i]->x.file.peer);
+  }
+  digest_files(local.files, local.n);
+  for (i=0; i<remote.n; i++) {
+    struct fnode *e1 = remote.files[i];
+    struct fnode *e2 = e1->x.file.peer;
+    if (e2->x.file.has_md5 && !memcmp(e1->x.file.md5, e2->x.file.md5, 16)) {
+      e1->x.file.is_stale = e2->x.file.is_stale = 0;
+      e1->x.file.is_retouched = 1;
+    }
+  }
+  free(remote.files);
+  free(local.files);
+}
+/*}}}*/
+void reconcile(struct fnode *f1, struct fnode *f2)/*{{{*/
 {
   /* Work out what's in each tree that's not in the other one. */
   set_subdir_unique(f1, 0);
   set_subdir_unique(f2, 1);
   inner_reconcile(f1, f2);
+  check_digests(f1);
 }
 /*}}}*/
 
@@ -153,37 +230,32 @@ static void upload_dummy(struct fnode *localinv, struct fnode *fileinv)/*{{{*/
 }
 /*}}}*/
 
-static void remove_directory(struct FTP *ctrl_con, struct fnode *dir, FILE *journal)/*{{{*/
+void remove_directory(struct FTP *ctrl_con, struct fnode *dir, FILE *journal)/*{{{*/
 {
   int status;
 
-  /* FIXME : create magic symlink to track aborted FTP ops */
-
+  journal_intent(journal, "RMD", dir->path);
   status = ftp_rmdir(ctrl_con, dir->path);
   if (status) {
-    fprintf(journal, "Z %s\n", dir->path);
-    fflush(journal);
-    printf("Removed remote directory %s\n", dir->path);
-    fflush(stdout);
+    journal_delete(journal, dir->path);
+    progress_message("Removed remote directory %s\n", dir->path);
   } else {
     fprintf(stderr, "FAILED TO REMOVE DIRECTORY %s FROM REMOTE SIZE, ABORTING\n", dir->path);
-    exit(1);
+    give_up();
   }
 }
 /*}}}*/
-static void remove_file(struct FTP *ctrl_con, struct fnode *file, FILE *journal)/*{{{*/
+void remove_file(struct FTP *ctrl_con, struct fnode *file, FILE *journal)/*{{{*/
 {
   int status;
-  /* FIXME : create magic symlink to track aborted FTP ops */
+  journal_intent(journal, "DELE", file->path);
   status = ftp_delete(ctrl_con, file->path);
   if (status) {
-    fprintf(journal, "Z %s\n", file->path);
-    fflush(journal);
-    printf("Removed remote file %s\n", file->path);
-    fflush(stdout);
+    journal_delete(journal, file->path);
+    progress_message("Removed remote file %s\n", file->path);
   } else {
     fprintf(stderr, "FAILED TO REMOVE FILE %s FROM REMOTE SIZE, ABORTING\n", file->path);
-    exit(1);
+    give_up();
   }
 }
 /*}}}*/
@@ -210,10 +282,10 @@ static void remove_dead_files(struct FTP *ctrl_con, struct fnode *fileinv, FILE
 }
 /*}}}*/
 
-static char *truncate_name(const char *name)/*{{{*/
+static char *truncate_name(const char *name, char *output)/*{{{*/
 {
+  /* output needs room for 64 characters. */
   int len;
-  static char output[64];
   len = strlen(name);
   if (len > 60) {
     strcpy(output, "...");
@@ -224,157 +296,763 @@ static char *truncate_name(const char *name)/*{{{*/
   return output;
 }
 /*}}}*/
+static void check_unchanged(struct fnode *local, const struct stat *sb)/*{{{*/
+{
+  /* After sending a file, forget its digest if it was modified between
+   * being hashed and being sent, since the digest may not describe what
+   * went over the wire. */
+  if ((sb->st_mtime != local->x.file.mtime) || (sb->st_size != local->x.file.size)) {
+    local->x.file.has_md5 = 0;
+  }
+  local->x.file.mtime = sb->st_mtime;
+}
+/*}}}*/
 struct callback_info {/*{{{*/
-  time_t last_time;
+  size_t stream_sent; /* bytes sent in the current STOR/APPE */
+  size_t file_sent;   /* bytes sent for the file altogether */
 };
 /*}}}*/
-static void write_callback(void *arg_info, int percent)/*{{{*/
+static void start_stream(struct callback_info *info)/*{{{*/
+{
+  info->file_sent += info->stream_sent;
+  info->stream_sent = 0;
+}
+/*}}}*/
+static void write_callback(void *arg_info, size_t bytes_sent)/*{{{*/
 {
-  time_t now;
   struct callback_info *info = arg_info;
-  now = time(NULL);
-  /* Only update the output once per second at most. */
-  if (now > info->last_time) {
-    info->last_time = now;
-    printf("\b\b\b\b%2d%%)", percent);
-    fflush(stdout);
-  }
+  progress_sent(bytes_sent - info->stream_sent);
+  info->stream_sent = bytes_sent;
 }
 /*}}}*/
-static void create_directory(struct FTP *ctrl_con, struct fnode *dir, FILE *journal)/*{{{*/
+void create_directory(struct FTP *ctrl_con, struct fnode *dir, FILE *journal)/*{{{*/
 {
   int status;
-  /* FIXME : magic symlink */
+  journal_intent(journal, "MKD", dir->path);
   status = ftp_mkdir(ctrl_con, dir->path);
   if (status) {
-    fprintf(journal, "D                   %s\n", dir->path);
-    fflush(journal);
-    printf("Created new remote directory %s\n", dir->path);
-    fflush(stdout);
+    journal_dir(journal, dir->path);
+    progress_message("Created new remote directory %s\n", dir->path);
   } else {
     fprintf(stderr, "FAILED TO CREATE DIRECTORY %s ON REMOTE SIZE, ABORTING\n", dir->path);
-    exit(1);
+    give_up();
   }
 }
 /*}}}*/
 static void create_file(struct FTP *ctrl_con, struct fnode *file, FILE *journal)/*{{{*/
 {
   int status;
-  char *short_name = truncate_name(file->path);
+  char short_name[64];
   struct callback_info info;
+  size_t planned = file->x.file.size;
   
-  /* FIXME : magic symlink */
-  printf("Creating remote file %s (%d bytes) ( 0%%)", short_name, (int)file->x.file.size);
-  fflush(stdout);
-  info.last_time = time(NULL);
+  progress_message("Creating remote file %s (%d bytes)\n", truncate_name(file->path, short_name),
+                   (int)file->x.file.size);
+  journal_file_intent(journal, "STOR", file, file->path);
+  info.stream_sent = info.file_sent = 0;
   status = ftp_write(ctrl_con, file->path, file->path, write_callback, &info);
-  /* FIXME : md5sum */
   if (status) {
     struct stat sb;
     if (stat(file->path, &sb) < 0) {
       fprintf(stderr, "Could not stat the file I just uploaded\n");
-      exit(1);
+      give_up();
     }
-    file->x.file.mtime = sb.st_mtime;
-    fprintf(journal, "F %8d %08lx %s\n", (int)file->x.file.size, file->x.file.mtime, file->path);
-    fflush(journal);
-    printf("\rDone creating new remote file %s (%d bytes)\n", file->path, (int)file->x.file.size);
-    fflush(stdout);
+    check_unchanged(file, &sb);
+    journal_file(journal, file, file->path);
+    start_stream(&info);
+    progress_file_done(planned, info.file_sent);
+    progress_message("Done creating new remote file %s (%d bytes)\n", file->path, (int)file->x.file.size);
   } else {
     fprintf(stderr, "FAILED TO CREATE FILE %s ON REMOTE SIZE, ABORTING\n", file->path);
-    exit(1);
+    give_up();
   }
 }
 /*}}}*/
-static void add_new_files(struct FTP *ctrl_con, struct fnode *localinv, FILE *journal)/*{{{*/
+static int prefix_unchanged(struct FTP *ctrl_con, struct fnode *file)/*{{{*/
 {
-  struct fnode *a;
-  for (a = localinv->next; a != localinv; a = a->next) {
-    /* Start with shallowest stuff */
-    if (a->is_unique) {
-      if (a->is_dir) {
-        create_directory(ctrl_con, a, journal);
-      } else {
-        create_file(ctrl_con, a, journal);
-      }
+  /* file is from 'fileinv'.  Check that the remote file is exactly the
+   * start of its local peer, using the digest in the listing if there is
+   * one and otherwise asking the server for it.  The local prefix is only
+   * read once there is something to compare it with. */
+  unsigned char local_md5[16], remote_md5[16];
+
+  if (file->x.file.has_md5) {
+    memcpy(remote_md5, file->x.file.md5, 16);
+  } else if (!ftp_xmd5(ctrl_con, file->path, remote_md5)) {
+    return 0;
+  }
+  if (!digest_prefix(file->path, file->x.file.size, local_md5)) return 0;
+  return !memcmp(local_md5, remote_md5, 16);
+}
+/*}}}*/
+static int append_tail(struct FTP *ctrl_con, struct fnode *file, struct stat *sb,/*{{{*/
+                       struct callback_info *info)
+{
+  /* If the local file has only grown since it was sent, send just the new
+   * part.  Return 1 if that worked, 0 if the whole file has to be sent
+   * after all. */
+  struct fnode *local_peer = file->x.file.peer;
+  size_t remote_size;
+  char short_name[64];
+
+  if ((file->x.file.size == 0) || (local_peer->x.file.size <= file->x.file.size)) return 0;
+  if (!prefix_unchanged(ctrl_con, file)) return 0;
+
+  progress_message("Appending to %s (%d new bytes)\n", truncate_name(file->path, short_name),
+                   (int)(local_peer->x.file.size - file->x.file.size));
+  start_stream(info);
+  if (!ftp_append(ctrl_con, file->path, file->path, file->x.file.size, write_callback, info)) {
+    progress_message("Could not append to remote file %s, sending all of it\n", file->path);
+    return 0;
+  }
+  if (stat(file->path, sb) < 0) {
+    fprintf(stderr, "Could not stat the file I just uploaded\n");
+    give_up();
+  }
+  /* A server that can't say how big the file is now gets the benefit of the
+   * doubt. */
+  if (ftp_size(ctrl_con, file->path, &remote_size) && (remote_size != sb->st_size)) {
+    progress_message("Remote file %s has the wrong size after appending, sending all of it\n", file->path);
+    return 0;
+  }
+  progress_message("Done appending to remote file %s (%d bytes)\n", file->path, (int)local_peer->x.file.size);
+  return 1;
+}
+/*}}}*/
+static int patch_blocks(struct FTP *ctrl_con, struct fnode *file, struct stat *sb,/*{{{*/
+                        struct callback_info *info)
+{
+  /* If the listing has block digests for the remote file, resend just the
+   * blocks whose digests have changed, overwriting them in place.  Return 1
+   * if that worked and the server's digest of the result matches the local
+   * file, 0 if the whole file has to be sent after all. */
+  struct fnode *local_peer = file->x.file.peer;
+  size_t block_size = file->x.file.block_size;
+  size_t offset, length, to_send;
+  unsigned char remote_md5[16];
+  int n_remote, n_local, n_changed, i, j;
+  char short_name[64];
+
+  if (!block_size || !file->x.file.has_md5 || !local_peer->x.file.has_md5 ||
+      !local_peer->x.file.blocks || (local_peer->x.file.block_size != block_size) ||
+      (local_peer->x.file.size < file->x.file.size)) {
+    return 0;
+  }
+  n_remote = count_blocks(file->x.file.size, block_size);
+  n_local = count_blocks(local_peer->x.file.size, block_size);
+  n_changed = 0;
+  for (i=0; i<n_local; i++) {
+    if ((i >= n_remote) ||
+        memcmp(file->x.file.blocks + i * BLOCK_DIGEST_LEN,
+               local_peer->x.file.blocks + i * BLOCK_DIGEST_LEN, BLOCK_DIGEST_LEN)) {
+      n_changed++;
     }
-    if (a->is_dir) {
-      add_new_files(ctrl_con, (struct fnode *) &a->x.dir.next, journal);
+  }
+  /* Not worth the extra round trips if most of it has changed. */
+  if (4 * n_changed > 3 * n_local) return 0;
+
+  /* Only patch what the listing says is there. */
+  if (!ftp_rest_overwrites(ctrl_con) ||
+      !ftp_xmd5(ctrl_con, file->path, remote_md5) ||
+      memcmp(remote_md5, file->x.file.md5, 16)) {
+    return 0;
+  }
+
+  progress_message("Patching %s (%d of %d blocks)\n", truncate_name(file->path, short_name), n_changed, n_local);
+  for (i=0; i<n_local; i=j) {
+    for (j=i; (j < n_local) &&
+              ((j >= n_remote) ||
+               memcmp(file->x.file.blocks + j * BLOCK_DIGEST_LEN,
+                      local_peer->x.file.blocks + j * BLOCK_DIGEST_LEN, BLOCK_DIGEST_LEN)); j++) ;
+    if (j == i) {
+      j++;
+      continue;
     }
+    /* Blocks i to j-1 have changed; the last one runs to the end of the
+     * file, whatever its length now. */
+    offset = i * block_size;
+    length = (j < n_local) ? (j - i) * block_size : 0;
+    to_send = length ? length : local_peer->x.file.size - offset;
+    start_stream(info);
+    if (!ftp_patch(ctrl_con, file->path, file->path, offset, length, write_callback, info)) {
+      progress_message("Could not patch remote file %s, sending all of it\n", file->path);
+      return 0;
+    }
+    progress_message("  bytes %lu to %lu of %s done\n", (unsigned long) offset, (unsigned long) (offset + to_send),
+                     short_name);
+  }
+
+  if (stat(file->path, sb) < 0) {
+    fprintf(stderr, "Could not stat the file I just uploaded\n");
+    give_up();
   }
+  if (!ftp_xmd5(ctrl_con, file->path, remote_md5) ||
+      memcmp(remote_md5, local_peer->x.file.md5, 16)) {
+    progress_message("Remote file %s doesn't match after patching, sending all of it\n", file->path);
+    return 0;
+  }
+  progress_message("Done patching remote file %s (%lu bytes)\n", file->path, (unsigned long) local_peer->x.file.size);
+  return 1;
 }
 /*}}}*/
-
 static void update_file(struct FTP *ctrl_con, struct fnode *file, FILE *journal)/*{{{*/
 {
   int status;
-  char *short_name;
+  char short_name[64];
   struct fnode *local_peer = file->x.file.peer;
   struct callback_info info;
+  struct stat sb;
+  size_t planned = local_peer->x.file.size;
   
-  /* FIXME : magic symlink */
+  /* Appending and patching count as STOR too : either way, the file ends up
+   * with the local contents if it works. */
+  journal_file_intent(journal, "STOR", local_peer, file->path);
+  info.stream_sent = info.file_sent = 0;
+  if (append_tail(ctrl_con, file, &sb, &info) || patch_blocks(ctrl_con, file, &sb, &info)) {
+    check_unchanged(local_peer, &sb);
+    journal_file(journal, local_peer, file->path);
+    start_stream(&info);
+    progress_file_done(planned, info.file_sent);
+    return;
+  }
+
   /* ? do we need to delete the file first for safety (according to STOR in
    * RFC959, no.) */
-  short_name = truncate_name(file->path);
-
-  printf("Updating %s (%d bytes) ( 0%%)", short_name, (int)local_peer->x.file.size);
-  fflush(stdout);
-  info.last_time = time(NULL);
+  progress_message("Updating %s (%d bytes)\n", truncate_name(file->path, short_name),
+                   (int)local_peer->x.file.size);
+  start_stream(&info);
   status = ftp_write(ctrl_con, file->path, file->path, write_callback, &info);
-  /* FIXME : md5sum */
   if (status) {
-    struct stat sb;
     if (stat(file->path, &sb) < 0) {
       fprintf(stderr, "Could not stat the file I just uploaded\n");
-      exit(1);
+      give_up();
     }
-    local_peer->x.file.mtime = sb.st_mtime;
-    fprintf(journal, "F %8d %08lx %s\n", (int)local_peer->x.file.size, local_peer->x.file.mtime, file->path);
-    fflush(journal);
-    printf("\rDone updating remote file %s (%d bytes)\n", file->path, (int)local_peer->x.file.size);
-    fflush(stdout);
+    check_unchanged(local_peer, &sb);
+    journal_file(journal, local_peer, file->path);
+    start_stream(&info);
+    progress_file_done(planned, info.file_sent);
+    progress_message("Done updating remote file %s (%d bytes)\n", file->path, (int)local_peer->x.file.size);
   } else {
     fprintf(stderr, "FAILED TO UPDATE FILE %s ON REMOTE SIZE, ABORTING\n", file->path);
-    exit(1);
+    give_up();
+  }
+}
+/*}}}*/
+static void find_new_files(struct fnode *x, struct file_set *fs)/*{{{*/
+{
+  /* x is from 'localinv' */
+  struct fnode *e;
+  for (e = x->next; e != x; e = e->next) {
+    if (e->is_dir) {
+      find_new_files((struct fnode *) &e->x.dir.next, fs);
+    } else if (e->is_unique) {
+      add_to_set(fs, e);
+    }
+  }
+}
+/*}}}*/
+static void find_stale_files(struct fnode *x, struct file_set *fs)/*{{{*/
+{
+  /* x is from 'fileinv'; collect the local peers */
+  struct fnode *e;
+  for (e = x->next; e != x; e = e->next) {
+    if (e->is_dir) {
+      find_stale_files((struct fnode *) &e->x.dir.next, fs);
+    } else if (!e->is_unique && e->x.file.is_stale) {
+      struct fnode *local = e->x.file.peer;
+      /* Block digests are only comparable at the same block size. */
+      if (e->x.file.blocks && (local->x.file.block_size != e->x.file.block_size) &&
+          (count_blocks(local->x.file.size, e->x.file.block_size) <= MAX_BLOCKS)) {
+        if (local->x.file.blocks) free(local->x.file.blocks);
+        local->x.file.blocks = NULL;
+        local->x.file.block_size = e->x.file.block_size;
+      }
+      add_to_set(fs, local);
+    }
   }
 }
 /*}}}*/
-static void update_stale_files(struct FTP *ctrl_con, struct fnode *fileinv, FILE *journal)/*{{{*/
+static void digest_outgoing(struct fnode *localinv, struct fnode *fileinv)/*{{{*/
 {
+  /* Work out the digests of everything that's about to be sent, so they can
+   * go into the listing. */
+  struct file_set fs;
+  fs.files = NULL;
+  fs.n = fs.max = 0;
+  find_new_files(localinv, &fs);
+  find_stale_files(fileinv, &fs);
+  digest_files(fs.files, fs.n);
+  free(fs.files);
+}
+/*}}}*/
+static void create_new_directories(struct FTP *ctrl_con, struct fnode *localinv, FILE *journal,/*{{{*/
+                                   int skip_clashes)
+{
+  /* Shallowest first, and all of a directory's new subdirectories before
+   * going down into any of them, so they're made from one place.  Before
+   * removals, leave alone any directories that clash with a remote file,
+   * since that has to be removed first. */
   struct fnode *a;
-  for (a = fileinv->next; a != fileinv; a = a->next) {
-    /* deepest directories first */
-
-    if (a->is_dir) {
-      update_stale_files(ctrl_con, (struct fnode *) &a->x.dir.next, journal);
-    } else {
-      /* it's a file */
-      if (!a->is_unique && a->x.file.is_stale) {
-        update_file(ctrl_con, a, journal);
-      } else {
-        /* nothing to do. */
+  for (a = localinv->next; a != localinv; a = a->next) {
+    if (a->is_dir && !(skip_clashes && a->is_clash) && a->is_unique) {
+      create_directory(ctrl_con, a, journal);
+      a->is_unique = 0;
+    }
+  }
+  for (a = localinv->next; a != localinv; a = a->next) {
+    if (a->is_dir && !(skip_clashes && a->is_clash)) {
+      create_new_directories(ctrl_con, (struct fnode *) &a->x.dir.next, journal, skip_clashes);
+    }
+  }
+}
+/*}}}*/
+static void find_transfers(struct fnode *localinv, struct fnode *fileinv, FILE *journal,/*{{{*/
+                           struct transfer **t, int *n, int *max)
+{
+  /* Collect the new local files (from localinv) and the stale remote ones
+   * (from fileinv).  Files whose contents haven't changed only need the
+   * listing updating, which is done straight away. */
+  struct fnode *e;
+  if (localinv) {
+    for (e = localinv->next; e != localinv; e = e->next) {
+      if (e->is_dir) {
+        find_transfers((struct fnode *) &e->x.dir.next, NULL, journal, t, n, max);
+      } else if (e->is_unique) {
+        if (*n == *max) {
+          *max = *max ? 2 * *max : 64;
+          *t = grow_array(struct transfer, *max, *t);
+        }
+        (*t)[*n].node = e;
+        (*t)[(*n)++].size = e->x.file.size;
+      }
+    }
+  }
+  if (fileinv) {
+    for (e = fileinv->next; e != fileinv; e = e->next) {
+      if (e->is_dir) {
+        find_transfers(NULL, (struct fnode *) &e->x.dir.next, journal, t, n, max);
+      } else if (!e->is_unique && e->x.file.is_stale) {
+        if (*n == *max) {
+          *max = *max ? 2 * *max : 64;
+          *t = grow_array(struct transfer, *max, *t);
+        }
+        (*t)[*n].node = e;
+        (*t)[(*n)++].size = e->x.file.peer->x.file.size;
+      } else if (!e->is_unique && e->x.file.is_retouched) {
+        /* Same contents, new mtime : no need to send it again. */
+        journal_file(journal, e->x.file.peer, e->path);
+        e->x.file.is_retouched = 0;
       }
     }
   }
 }
 /*}}}*/
+struct FTP *connect_remote(const struct remote_params *rp, const char *password, int active_ftp)/*{{{*/
+{
+  /* As open_remote, but return NULL if the connection can't be made. */
+  struct FTP *ctrl_con;
+  ctrl_con = ftp_open(rp->hostname, rp->port_number, rp->username, password, active_ftp);
+  if (!ctrl_con) return NULL;
+  if (rp->remote_root) {
+    ftp_cwd(ctrl_con, rp->remote_root);
+  }
+  ftp_binary(ctrl_con);
+  ftp_relative_paths(ctrl_con);
+  return ctrl_con;
+}
+/*}}}*/
+struct FTP *open_remote(const struct remote_params *rp, const char *password, int active_ftp)/*{{{*/
+{
+  struct FTP *ctrl_con;
+  ctrl_con = connect_remote(rp, password, active_ftp);
+  if (!ctrl_con) {
+    fprintf(stderr, "Could not connect to %s\n", rp->hostname);
+    give_up();
+  }
+  return ctrl_con;
+}
+/*}}}*/
+static void send_one(struct FTP *ctrl_con, struct transfer *t, void *arg)/*{{{*/
+{
+  FILE *journal = arg;
+  if (t->node->is_unique) {
+    create_file(ctrl_con, t->node, journal);
+  } else {
+    update_file(ctrl_con, t->node, journal);
+  }
+}
+/*}}}*/
+static void count_new(struct fnode *localinv, struct upload_totals *tot)/*{{{*/
+{
+  struct fnode *e;
+  for (e = localinv->next; e != localinv; e = e->next) {
+    if (e->is_dir) {
+      count_new((struct fnode *) &e->x.dir.next, tot);
+    } else if (e->is_unique) {
+      tot->add_files++;
+      tot->add_bytes += e->x.file.size;
+    }
+  }
+}
+/*}}}*/
+static void count_listed(struct fnode *fileinv, int all_dead, struct upload_totals *tot)/*{{{*/
+{
+  /* all_dead is set inside a directory that is going. */
+  struct fnode *e;
+  for (e = fileinv->next; e != fileinv; e = e->next) {
+    if (all_dead || e->is_unique) tot->delete_entries++;
+    if (e->is_dir) {
+      count_listed((struct fnode *) &e->x.dir.next, all_dead || e->is_unique, tot);
+    } else if (!all_dead && !e->is_unique && e->x.file.is_stale) {
+      tot->update_files++;
+      tot->update_bytes += e->x.file.peer->x.file.size;
+    }
+  }
+}
+/*}}}*/
+void print_totals(const struct upload_totals *tot)/*{{{*/
+{
+  char add[16], update[16];
+  progress_message("To do : add %d file%s (%s), update %d file%s (%s), delete %d entr%s\n",
+                   tot->add_files, (tot->add_files == 1) ? "" : "s", format_bytes(tot->add_bytes, add),
+                   tot->update_files, (tot->update_files == 1) ? "" : "s", format_bytes(tot->update_bytes, update),
+                   tot->delete_entries, (tot->delete_entries == 1) ? "y" : "ies");
+}
+/*}}}*/
+static void print_plan(struct fnode *localinv, struct fnode *fileinv)/*{{{*/
+{
+  struct upload_totals tot;
+  tot.add_files = tot.update_files = tot.delete_entries = 0;
+  tot.add_bytes = tot.update_bytes = 0;
+  count_new(localinv, &tot);
+  count_listed(fileinv, 0, &tot);
+  print_totals(&tot);
+}
+/*}}}*/
+void send_batch(struct FTP *ctrl_con, struct transfer *t, int n, FILE *journal,/*{{{*/
+                       const struct connect_info *ci)
+{
+  /* Send the n transfers in t, over extra connections too if ci allows. */
+  struct FTP **cons;
+  int n_cons, i;
 
-static void upload_for_real(struct FTP *ctrl_con, struct fnode *localinv, struct fnode *fileinv, const char *listing_file)/*{{{*/
+  order_transfers(t, n, "@@PRIORITY@@");
+  n_cons = ci ? ci->n_connections : 1;
+  if (n_cons > n) n_cons = n;
+  cons = new_array(struct FTP *, n_cons);
+  cons[0] = ctrl_con;
+  for (i=1; i<n_cons; i++) {
+    /* Carry on with fewer if the server won't take any more. */
+    cons[i] = connect_remote(ci->rp, ci->password, ci->active_ftp);
+    if (!cons[i]) break;
+  }
+  n_cons = i;
+
+  run_transfers(t, n, cons, n_cons, send_one, journal);
+
+  for (i=1; i<n_cons; i++) ftp_close(cons[i]);
+  free(cons);
+}
+/*}}}*/
+static void send_files(struct FTP *ctrl_con, struct fnode *localinv, struct fnode *fileinv,/*{{{*/
+                       FILE *journal, const struct connect_info *ci)
 {
+  struct transfer *t = NULL;
+  int n = 0, max = 0;
+  int i;
+  size_t total;
+
+  find_transfers(localinv, fileinv, journal, &t, &n, &max);
+  if (!n) return;
+  for (i=0, total=0; i<n; i++) total += t[i].size;
+
+  progress_begin(n, total);
+  send_batch(ctrl_con, t, n, journal, ci);
+  progress_end();
+  free(t);
+}
+/*}}}*/
+/*{{{ Removing last */
+/* With up->delete_last, nothing is removed from the server until everything
+ * new has been sent, so that pages don't go missing from the live site while
+ * their replacements are on the way.  Only remote entries in the way of a new
+ * directory or file go first.  The rest are then removed over all the
+ * connections at once, in pipelined batches : files first, then directories
+ * deepest first, each stage finishing before the next starts so that a
+ * directory is empty by the time it's removed.  Within a stage, entries are
+ * sorted by the directory they're in, so that a batch needs few CWDs.  Before any of it starts, the
+ * intents for all the removals go into the journal, so that if the run is
+ * interrupted the next one finishes them off (see resume.c) without
+ * comparing the trees. */
+
+#define REMOVAL_BATCH 32
+
+struct intent_list {/*{{{*/
+  struct intent *v;
+  int n;
+  int max;
+};
+/*}}}*/
+struct removal_job {/*{{{*/
+  struct intent *v;
+  int n;
+  int next;      /* next entry to be claimed */
+  int resuming;  /* 1 if a failure may mean it had gone already */
   FILE *journal;
+  const char *label;
+  struct fail_scope *scope;
+};
+/*}}}*/
+struct removal_worker {/*{{{*/
+  struct removal_job *job;
+  struct FTP *con;
+};
+/*}}}*/
+static void add_intent(struct intent_list *l, const char *command, char *path)/*{{{*/
+{
+  /* The path isn't copied. */
+  if (l->n == l->max) {
+    l->max = l->max ? 2 * l->max : 64;
+    l->v = grow_array(struct intent, l->max, l->v);
+  }
+  strcpy(l->v[l->n].command, command);
+  l->v[l->n++].path = path;
+}
+/*}}}*/
+static void find_removals(struct fnode *x, struct intent_list *files, struct intent_list *dirs)/*{{{*/
+{
+  struct fnode *e;
+  for (e = x->next; e != x; e = e->next) {
+    if (e->is_dir) {
+      find_removals((struct fnode *) &e->x.dir.next, files, dirs);
+    }
+    if (e->is_unique) {
+      add_intent(e->is_dir ? dirs : files, e->is_dir ? "RMD" : "DELE", e->path);
+    }
+  }
+}
+/*}}}*/
+static int depth(const char *path)/*{{{*/
+{
+  int n = 0;
+  while ((path = strchr(path, '/'))) n++, path++;
+  return n;
+}
+/*}}}*/
+static int compare_parents(const void *a, const void *b)/*{{{*/
+{
+  /* Entries in the same directory together, for ftp_remove_batch to do from
+   * inside it. */
+  const char *pa = ((const struct intent *) a)->path, *pb = ((const struct intent *) b)->path;
+  const char *sa = strrchr(pa, '/'), *sb = strrchr(pb, '/');
+  int la = sa ? sa - pa : 0, lb = sb ? sb - pb : 0;
+  int c = strncmp(pa, pb, (la < lb) ? la : lb);
+  if (c) return c;
+  if (la != lb) return la - lb;
+  return strcmp(pa, pb);
+}
+/*}}}*/
+static int compare_depths(const void *a, const void *b)/*{{{*/
+{
+  /* Deepest first */
+  int c = depth(((const struct intent *) b)->path) - depth(((const struct intent *) a)->path);
+  return c ? c : compare_parents(a, b);
+}
+/*}}}*/
+static int stage_end(const struct intent *v, int n, int start)/*{{{*/
+{
+  /* Files can all go together, but a directory only alongside others just
+   * as deep. */
+  int i, is_dir;
+  is_dir = !strcmp(v[start].command, "RMD");
+  for (i = start + 1; i < n; i++) {
+    if (strcmp(v[i].command, v[start].command)) break;
+    if (is_dir && (depth(v[i].path) != depth(v[start].path))) break;
+  }
+  return i;
+}
+/*}}}*/
+static void *removal_worker(void *arg)/*{{{*/
+{
+  struct removal_worker *w = arg;
+  struct removal_job *job = w->job;
+  const char *paths[REMOVAL_BATCH];
+  int is_dir[REMOVAL_BATCH], ok[REMOVAL_BATCH];
+  int i, j, n;
 
-  journal = fopen(listing_file, "a");
-  if (!journal) {
-    fprintf(stderr, "Couldn't open %s to append updates\n", listing_file);
-    exit(1);
+  progress_set_label(job->label);
+  fail_set_scope(job->scope);
+  while (!fail_pending() && ((i = __sync_fetch_and_add(&job->next, REMOVAL_BATCH)) < job->n)) {
+    n = job->n - i;
+    if (n > REMOVAL_BATCH) n = REMOVAL_BATCH;
+    for (j=0; j<n; j++) {
+      paths[j] = job->v[i+j].path;
+      is_dir[j] = !strcmp(job->v[i+j].command, "RMD");
+    }
+    ftp_remove_batch(w->con, n, paths, is_dir, ok);
+    for (j=0; j<n; j++) {
+      if (ok[j] || (job->resuming && !remote_exists(w->con, paths[j]))) {
+        journal_delete(job->journal, paths[j]);
+        progress_message("Removed remote %s %s%s\n", is_dir[j] ? "directory" : "file", paths[j],
+                         ok[j] ? "" : " (it had gone already)");
+      } else {
+        fprintf(stderr, "FAILED TO REMOVE %s %s FROM REMOTE SIDE, ABORTING\n",
+                is_dir[j] ? "DIRECTORY" : "FILE", paths[j]);
+        give_up();
+      }
+    }
   }
+  return NULL;
+}
+/*}}}*/
+void run_removals(struct FTP *ctrl_con, struct intent *v, int n, FILE *journal,/*{{{*/
+                  const struct connect_info *ci, int resuming)
+{
+  /* Carry out the removals in v, which are in the order described above. */
+  struct removal_job job;
+  struct removal_worker *workers;
+  pthread_t *threads;
+  struct FTP **cons;
+  int n_cons, n_started, i, own;
 
-  remove_dead_files(ctrl_con, fileinv, journal);
-  add_new_files(ctrl_con, localinv, journal);
-  update_stale_files(ctrl_con, fileinv, journal);
+  if (!n) return;
+  n_cons = ci ? ci->n_connections : 1;
+  if (n_cons > (n + REMOVAL_BATCH - 1) / REMOVAL_BATCH) {
+    n_cons = (n + REMOVAL_BATCH - 1) / REMOVAL_BATCH;
+  }
+  cons = new_array(struct FTP *, n_cons);
+  cons[0] = ctrl_con;
+  for (i=1; i<n_cons; i++) {
+    cons[i] = connect_remote(ci->rp, ci->password, ci->active_ftp);
+    if (!cons[i]) break;
+  }
+  n_cons = i;
+  workers = new_array(struct removal_worker, n_cons);
+  threads = new_array(pthread_t, n_cons);
+  for (i=0; i<n_cons; i++) {
+    workers[i].job = &job;
+    workers[i].con = cons[i];
+  }
 
-  return;
+  job.v = v;
+  job.resuming = resuming;
+  job.journal = journal;
+  job.label = progress_get_label();
+  job.scope = fail_get_scope();
+  own = !job.scope;
+  for (job.n = 0; job.n < n; ) {
+    job.next = job.n;
+    job.n = stage_end(v, n, job.next);
+    /* The first connection is worked from this thread, unless a failure
+     * there has to be kept from the others (see fail.h). */
+    for (n_started = own; n_started < n_cons; n_started++) {
+      if (pthread_create(&threads[n_started], NULL, removal_worker, &workers[n_started]) != 0) break;
+    }
+    if (own || !n_started) {
+      removal_worker(&workers[0]);
+    }
+    for (i=own; i<n_started; i++) pthread_join(threads[i], NULL);
+    fail_check();
+  }
 
+  for (i=1; i<n_cons; i++) ftp_close(cons[i]);
+  free(cons);
+  free(workers);
+  free(threads);
+}
+/*}}}*/
+static void drop_entry(struct fnode *e)/*{{{*/
+{
+  e->next->prev = e->prev;
+  e->prev->next = e->next;
+  if (e->is_dir) {
+    free_inventory((struct fnode *) &e->x.dir.next);
+  } else if (e->x.file.blocks) {
+    free(e->x.file.blocks);
+  }
+  free(e->name);
+  free(e->path);
+  free(e);
+}
+/*}}}*/
+static void remove_clashes(struct FTP *ctrl_con, struct fnode *fileinv, FILE *journal)/*{{{*/
+{
+  /* Remove just the remote entries where a new directory has to go in place
+   * of a file, or the other way round, and drop them from fileinv. */
+  struct fnode *a, *next_a;
+  for (a = fileinv->next; a != fileinv; a = next_a) {
+    next_a = a->next;
+    if (a->is_clash && a->is_unique) {
+      if (a->is_dir) {
+        remove_dead_files(ctrl_con, (struct fnode *) &a->x.dir.next, journal);
+        remove_directory(ctrl_con, a, journal);
+      } else {
+        remove_file(ctrl_con, a, journal);
+      }
+      drop_entry(a);
+    } else if (a->is_dir && !a->is_unique) {
+      remove_clashes(ctrl_con, (struct fnode *) &a->x.dir.next, journal);
+    }
+  }
+}
+/*}}}*/
+static void remove_dead_files_last(struct FTP *ctrl_con, struct fnode *fileinv, FILE *journal,/*{{{*/
+                                   const struct connect_info *ci)
+{
+  struct intent_list files, dirs;
+  int i;
+
+  files.v = dirs.v = NULL;
+  files.n = files.max = dirs.n = dirs.max = 0;
+  find_removals(fileinv, &files, &dirs);
+  qsort(files.v, files.n, sizeof(struct intent), compare_parents);
+  qsort(dirs.v, dirs.n, sizeof(struct intent), compare_depths);
+  for (i=0; i<dirs.n; i++) add_intent(&files, dirs.v[i].command, dirs.v[i].path);
+  for (i=0; i<files.n; i++) journal_intent(journal, files.v[i].command, files.v[i].path);
+  run_removals(ctrl_con, files.v, files.n, journal, ci, 0);
+  if (files.v) free(files.v);
+  if (dirs.v) free(dirs.v);
+}
+/*}}}*/
+/*}}}*/
+static void upload_for_real(struct FTP *ctrl_con, struct fnode *localinv, struct fnode *fileinv,/*{{{*/
+                            struct rename_plan *renames, FILE *journal,
+                            const struct connect_info *ci, int delete_last)
+{
+  struct copy_plan *copies = NULL;
+
+  digest_outgoing(localinv, fileinv);
+  if (renames) {
+    create_new_directories(ctrl_con, localinv, journal, 1);
+    perform_renames(ctrl_con, renames, journal);
+  }
+  if (ftp_can_copy(ctrl_con)) copies = plan_copies(fileinv, localinv);
+  print_plan(localinv, fileinv);
+  if (delete_last) {
+    remove_clashes(ctrl_con, fileinv, journal);
+  } else {
+    remove_dead_files(ctrl_con, fileinv, journal);
+  }
+  create_new_directories(ctrl_con, localinv, journal, 0);
+  send_files(ctrl_con, localinv, fileinv, journal, ci);
+  if (copies) {
+    perform_copies(ctrl_con, copies, journal, ci);
+    free_copy_plan(copies);
+  }
+  if (delete_last) {
+    remove_dead_files_last(ctrl_con, fileinv, journal, ci);
+  }
+}
+/*}}}*/
+void upload_subtree(struct FTP *ctrl_con, struct fnode *fileinv, struct fnode *localinv, FILE *journal)/*{{{*/
+{
+  /* As a full upload, but for the lists of one directory's entries in each
+   * tree. */
+  struct rename_plan *renames;
+  reconcile(fileinv, localinv);
+  renames = plan_renames(fileinv, localinv);
+  upload_for_real(ctrl_con, localinv, fileinv, renames, journal, NULL, 0);
+  if (renames) free_rename_plan(renames);
 }
 /*}}}*/
 
@@ -385,70 +1063,611 @@ void init_remote_params(struct remote_params *rp)/*{{{*/
   rp->remote_root = NULL;
 }
 /*}}}*/
+void init_upload_params(struct upload_params *up)/*{{{*/
+{
+  up->is_dummy_run = 0;
+  up->active_ftp   = 0;
+  up->strict_scan  = 0;
+  up->watch        = 0;
+  up->debounce_ms  = 500;
+  up->pipeline     = 0;
+  up->n_connections = 1;
+  up->mem_limit    = 0;
+  up->delete_last  = 0;
+  up->shard_depth  = -1;
+  up->only         = NULL;
+}
+/*}}}*/
 
-static void preen_listing(const char *listing_file)/*{{{*/
+void rewrite_listing(const char *listing_file, int shard_depth)/*{{{*/
 {
-  char *nlf;
-  int len;
   struct remote_params rp;
   struct fnode *fileinv;
-
-  len = strlen(listing_file);
-  nlf = new_array(char, len + 5);
-  strcpy(nlf, listing_file);
-  strcat(nlf, ".new");
+  FILE *out;
 
   init_remote_params(&rp);
   fileinv = make_fileinv(listing_file, &rp);
-  print_inventory(fileinv, nlf, rp.hostname, rp.port_number, rp.username, rp.remote_root);
-  if (rename(nlf, listing_file) < 0) {
-    fprintf(stderr, "Could not rename new listing file %s to %s\n", nlf, listing_file);
+  out = create_listing(listing_file, &rp, shard_depth);
+  write_inventory(fileinv, out);
+  if (fclose(out) != 0) {
+    fprintf(stderr, "Could not put new listing file in place of %s\n", listing_file);
     exit(1);
   }
 
   free(rp.hostname);
   free(rp.username);
   if (rp.remote_root) free(rp.remote_root);
-  free(nlf);
   /* FIXME : fileinv is leaked */
 
 }
 /*}}}*/
+void preen_listing(const char *listing_file)/*{{{*/
+{
+  rewrite_listing(listing_file, listing_shard_depth(listing_file));
+}
+/*}}}*/
+static void preen_as_asked(const char *listing_file, const struct upload_params *up)/*{{{*/
+{
+  /* With up->shard_depth, change the listing's layout while at it. */
+  rewrite_listing(listing_file, (up->shard_depth >= 0) ? up->shard_depth : listing_shard_depth(listing_file));
+}
+/*}}}*/
+
+/*{{{ Pipelined upload */
+/* The local scan runs on its own thread and hands over each directory as
+ * soon as its entries are known.  Meanwhile this thread connects and works
+ * through the directories in the order they arrive, sending whatever is new
+ * or changed at that level.  Removing remote files has to wait until the
+ * scan has finished (a file may only have moved further down the tree), as
+ * does anything where a file has become a directory or vice versa; a normal
+ * pass against the updated listing picks these up at the end. */
+
+struct queued_dir {/*{{{*/
+  struct queued_dir *next;
+  char *path;
+  struct fnode *list;
+};
+/*}}}*/
+struct scan_job {/*{{{*/
+  pthread_mutex_t lock;
+  pthread_cond_t more;
+  struct queued_dir *head;
+  struct queued_dir *tail;
+  int finished;
+  const char *listing_file;
+  int strict;
+  struct fnode *localinv;
+};
+/*}}}*/
+static void queue_dir(void *arg, const char *path, struct fnode *list)/*{{{*/
+{
+  struct scan_job *job = arg;
+  struct queued_dir *qd;
+  qd = new(struct queued_dir);
+  qd->next = NULL;
+  qd->path = new_string(path);
+  qd->list = list;
+  pthread_mutex_lock(&job->lock);
+  if (job->tail) {
+    job->tail->next = qd;
+  } else {
+    job->head = qd;
+  }
+  job->tail = qd;
+  pthread_cond_signal(&job->more);
+  pthread_mutex_unlock(&job->lock);
+}
+/*}}}*/
+static void *scan_worker(void *arg)/*{{{*/
+{
+  struct scan_job *job = arg;
+  const char *avoid[2];
+  avoid[0] = job->listing_file;
+  avoid[1] = NULL;
+  job->localinv = make_localinv(avoid, "@@SCANCACHE@@", job->strict, queue_dir, job);
+  pthread_mutex_lock(&job->lock);
+  job->finished = 1;
+  pthread_cond_signal(&job->more);
+  pthread_mutex_unlock(&job->lock);
+  return NULL;
+}
+/*}}}*/
+static struct queued_dir *next_dir(struct scan_job *job)/*{{{*/
+{
+  /* Return NULL once the scan has finished and everything has been taken. */
+  struct queued_dir *qd;
+  pthread_mutex_lock(&job->lock);
+  while (!job->head && !job->finished) {
+    pthread_cond_wait(&job->more, &job->lock);
+  }
+  qd = job->head;
+  if (qd) {
+    job->head = qd->next;
+    if (!job->head) job->tail = NULL;
+  }
+  pthread_mutex_unlock(&job->lock);
+  return qd;
+}
+/*}}}*/
+static struct fnode *remote_level(struct fnode *fileinv, const char *path, int *is_clash)/*{{{*/
+{
+  /* Return the listing's entries for directory 'path', or NULL if it has
+   * none (i.e. the directory has only just been created).  Set *is_clash if
+   * the listing has a file where the path has a directory. */
+  const char *p, *slash;
+  struct fnode *e;
+  int len;
+
+  *is_clash = 0;
+  if (!strcmp(path, ".")) return fileinv;
+  p = path;
+  while (1) {
+    slash = strchr(p, '/');
+    len = slash ? (slash - p) : strlen(p);
+    for (e = fileinv->next; e != fileinv; e = e->next) {
+      if (!strncmp(e->name, p, len) && (e->name[len] == '\0')) break;
+    }
+    if (e == fileinv) return NULL;
+    if (!e->is_dir) {
+      *is_clash = 1;
+      return NULL;
+    }
+    fileinv = (struct fnode *) &e->x.dir.next;
+    if (!slash) return fileinv;
+    p = slash + 1;
+  }
+}
+/*}}}*/
+static void upload_level(struct FTP *ctrl_con, struct fnode *remote, struct fnode *local, FILE *journal)/*{{{*/
+{
+  /* Bring the remote side of one directory's entries up to date, without
+   * looking into subdirectories or removing anything.  remote is NULL for a
+   * directory that has just been created. */
+  struct fnode *e1, *e2;
+  struct file_set fs;
+
+  fs.files = NULL;
+  fs.n = fs.max = 0;
+  for (e2 = local->next; e2 != local; e2 = e2->next) {
+    e2->is_unique = 1;
+    e2->is_clash = 0;
+    e1 = NULL;
+    if (remote) {
+      for (e1 = remote->next; e1 != remote; e1 = e1->next) {
+        if (!strcmp(e1->name, e2->name)) break;
+      }
+      if (e1 == remote) e1 = NULL;
+    }
+    if (!e1) {
+      if (!e2->is_dir) add_to_set(&fs, e2);
+    } else if (e1->is_dir != e2->is_dir) {
+      e2->is_clash = 1;
+    } else if (e1->is_dir) {
+      e2->is_unique = 0;
+    } else {
+      match_files(e1, e2);
+      if (e2->x.file.is_stale) add_to_set(&fs, e2);
+    }
+  }
+  digest_files(fs.files, fs.n);
+  free(fs.files);
+
+  for (e2 = local->next; e2 != local; e2 = e2->next) {
+    if (e2->is_clash) continue;
+    if (e2->is_unique) {
+      if (e2->is_dir) {
+        create_directory(ctrl_con, e2, journal);
+      } else {
+        create_file(ctrl_con, e2, journal);
+      }
+    } else if (!e2->is_dir && e2->x.file.is_stale) {
+      e1 = e2->x.file.peer;
+      if (e1->x.file.has_md5 && e2->x.file.has_md5 &&
+          (e1->x.file.size == e2->x.file.size) &&
+          !memcmp(e1->x.file.md5, e2->x.file.md5, 16)) {
+        /* Same contents, new mtime : no need to send it again. */
+        journal_file(journal, e2, e2->path);
+      } else {
+        update_file(ctrl_con, e1, journal);
+      }
+    }
+  }
+}
+/*}}}*/
+static struct fnode *upload_pipelined(struct FTP **ctrl_con, const struct remote_params *rp,/*{{{*/
+                                      const char *password, struct fnode *fileinv,
+                                      const char *listing_file, const struct upload_params *up,
+                                      FILE *journal, const struct connect_info *ci)
+{
+  /* Return the local inventory, and the connection through ctrl_con.  Only
+   * the final pass spreads its transfers over several connections. */
+  struct scan_job job;
+  pthread_t scanner;
+  struct queued_dir *qd;
+  struct fnode *remote;
+  struct remote_params new_rp;
+  int is_clash, threaded;
+
+  pthread_mutex_init(&job.lock, NULL);
+  pthread_cond_init(&job.more, NULL);
+  job.head = job.tail = NULL;
+  job.finished = 0;
+  job.listing_file = listing_file;
+  job.strict = up->strict_scan;
+  job.localinv = NULL;
+
+  threaded = (pthread_create(&scanner, NULL, scan_worker, &job) == 0);
+  if (!threaded) {
+    /* No overlap, but still correct. */
+    scan_worker(&job);
+  }
+  *ctrl_con = open_remote(rp, password, up->active_ftp);
+
+  while ((qd = next_dir(&job))) {
+    remote = remote_level(fileinv, qd->path, &is_clash);
+    if (!is_clash) {
+      upload_level(*ctrl_con, remote, qd->list, journal);
+    }
+    free(qd->path);
+    free(qd);
+  }
+  if (threaded) pthread_join(scanner, NULL);
+  pthread_mutex_destroy(&job.lock);
+  pthread_cond_destroy(&job.more);
+
+  /* The journal now describes what's on the server, so start again from
+   * there for the removals and the rest. */
+  free_inventory(fileinv);
+  init_remote_params(&new_rp);
+  fileinv = make_fileinv(listing_file, &new_rp);
+  free(new_rp.hostname);
+  free(new_rp.username);
+  if (new_rp.remote_root) free(new_rp.remote_root);
+  reconcile(fileinv, job.localinv);
+  upload_for_real(*ctrl_con, job.localinv, fileinv, NULL, journal, ci, up->delete_last);
+  free_inventory(fileinv);
+  free(fileinv);
+
+  return job.localinv;
+}
+/*}}}*/
+/*}}}*/
+
+static int upload_only(const char *password, const char *listing_file, const struct upload_params *up)/*{{{*/
+{
+  /* Bring just the directory up->only up to date, reading only the shards
+   * of the listing that cover it.  The listing isn't preened, since that
+   * needs all of it, nor is the hash cache saved, since that would lose the
+   * entries for the rest of the tree. */
+  struct fnode *fileinv, *remote_list, *local_list;
+  struct remote_params rp;
+  struct rename_plan *renames;
+  struct connect_info ci;
+  struct stat sb;
+
+  if ((stat(up->only, &sb) < 0) || !S_ISDIR(sb.st_mode)) {
+    fprintf(stderr, "%s is not a local directory\n", up->only);
+    exit(1);
+  }
+  init_remote_params(&rp);
+  fileinv = make_fileinv_within(listing_file, &rp, up->only);
+  remote_list = lookup_dir_list(fileinv, up->only);
+  if (!remote_list) {
+    fprintf(stderr, "%s isn't on the remote side yet; upload the directory it's in\n", up->only);
+    exit(1);
+  }
+  load_hashcache("@@HASHCACHE@@");
+  local_list = make_localinv_subtree(listing_file, up->only);
+  reconcile(remote_list, local_list);
+  renames = plan_renames(remote_list, local_list);
+
+  if (up->is_dummy_run) {
+    if (renames) {
+      printf("RENAMES ON REMOTE SIDE\n");
+      print_renames(renames);
+      printf("\n\n");
+      assume_renames(renames);
+    }
+    upload_dummy(local_list, remote_list);
+  } else {
+    struct FTP *ctrl_con;
+    FILE *journal;
+
+    journal = open_journal(listing_file);
+    if (!journal) {
+      fprintf(stderr, "Couldn't open %s to append updates\n", listing_file);
+      exit(1);
+    }
+    ci.rp = &rp;
+    ci.password = password;
+    ci.active_ftp = up->active_ftp;
+    ci.n_connections = up->n_connections;
+    ctrl_con = open_remote(&rp, password, up->active_ftp);
+    upload_for_real(ctrl_con, local_list, remote_list, renames, journal, &ci, up->delete_last);
+    ftp_close(ctrl_con);
+    fclose(journal);
+  }
+  if (renames) free_rename_plan(renames);
+  /* (fileinv and local_list are leaked.) */
+  return 0;
+}
+/*}}}*/
 
 /* Assume already in correct local directory. */
-int upload(const char *password, int is_dummy_run, const char *listing_file, int active_ftp)/*{{{*/
+int upload(const char *password, const char *listing_file, const struct upload_params *up)/*{{{*/
 {
   struct fnode *localinv;
   struct fnode *fileinv;
   struct remote_params rp;
+  struct rename_plan *renames;
+  struct connect_info ci;
+  const char *avoid[2];
+
+  if (!up->is_dummy_run) resume_interrupted(password, listing_file, up);
+  if (up->mem_limit) return upload_streaming(password, listing_file, up);
+  if (up->only) return upload_only(password, listing_file, up);
 
-  if (!is_dummy_run) {
+  if (!up->is_dummy_run) {
     printf("Preening listing file... "); fflush(stdout);
-    preen_listing(listing_file);
+    preen_as_asked(listing_file, up);
     printf("done\n"); fflush(stdout);
   }
 
   init_remote_params(&rp);
+  avoid[0] = listing_file;
+  avoid[1] = NULL;
 
   fileinv = make_fileinv(listing_file, &rp);
-  localinv = make_localinv(listing_file);
-  
-  reconcile(fileinv, localinv);
+  load_hashcache("@@HASHCACHE@@");
+  ci.rp = &rp;
+  ci.password = password;
+  ci.active_ftp = up->active_ftp;
+  ci.n_connections = up->n_connections;
+  renames = NULL;
 
-  if (is_dummy_run) {
+  if (up->is_dummy_run) {
+    localinv = make_localinv(avoid, "@@SCANCACHE@@", up->strict_scan, NULL, NULL);
+    reconcile(fileinv, localinv);
+    renames = plan_renames(fileinv, localinv);
+    if (renames) {
+      printf("RENAMES ON REMOTE SIDE\n");
+      print_renames(renames);
+      printf("\n\n");
+      assume_renames(renames);
+    }
     upload_dummy(localinv, fileinv);
+    save_hashcache("@@HASHCACHE@@", localinv);
   } else {
     struct FTP *ctrl_con;
-    ctrl_con = ftp_open(rp.hostname, rp.port_number, rp.username, password, active_ftp);
-    if (rp.remote_root) {
-      ftp_cwd(ctrl_con, rp.remote_root);
+    FILE *journal;
+
+    journal = open_journal(listing_file);
+    if (!journal) {
+      fprintf(stderr, "Couldn't open %s to append updates\n", listing_file);
+      exit(1);
+    }
+    if (up->pipeline) {
+      /* No renames : new files will have been sent before it's known which
+       * remote files are going. */
+      localinv = upload_pipelined(&ctrl_con, &rp, password, fileinv, listing_file, up, journal, &ci);
+    } else {
+      localinv = make_localinv(avoid, "@@SCANCACHE@@", up->strict_scan, NULL, NULL);
+      reconcile(fileinv, localinv);
+      renames = plan_renames(fileinv, localinv);
+      ctrl_con = open_remote(&rp, password, up->active_ftp);
+      upload_for_real(ctrl_con, localinv, fileinv, renames, journal, &ci, up->delete_last);
+    }
+    save_hashcache("@@HASHCACHE@@", localinv);
+    if (up->watch) {
+      /* The remote site now matches the local tree, so that becomes the
+       * picture of the remote site to work from.  (fileinv is leaked.) */
+      ctrl_con = watch_tree(ctrl_con, localinv, journal, &rp, password, listing_file, up);
     }
-    ftp_binary(ctrl_con);
-    upload_for_real(ctrl_con, localinv, fileinv, listing_file);
     ftp_close(ctrl_con);
+    fclose(journal);
   }
+  if (renames) free_rename_plan(renames);
 
   return 0;
 }
 /*}}}*/
+/*{{{ Several mirrors */
+
+/* Each mirror has its own listing and journal, and is brought up to date
+ * over its own connections, in a thread of its own so that a slow one
+ * doesn't hold up the rest, and within a failure scope (see fail.h) so that
+ * one that fails doesn't stop them.  The local tree is only scanned once, and the
+ * digests are all worked out before any sending starts, so every file is
+ * read for them just once however many mirrors want it.  The mirrors send
+ * the same files in the same order at about the same time, so the reads
+ * for sending mostly come out of the page cache too. */
+
+struct mirror {/*{{{*/
+  const char *listing_file;
+  struct remote_params rp;
+  struct fnode *fileinv;
+  struct fnode *localinv;
+  struct rename_plan *renames;
+  const char *password;
+  const struct upload_params *up;
+  char *label;
+  int failed;
+};
+/*}}}*/
+static char *mirror_label(const struct remote_params *rp)/*{{{*/
+{
+  /* host, with :port unless it's the usual one, and /root if there is one. */
+  char *label;
+  label = new_array(char, strlen(rp->hostname) + (rp->remote_root ? strlen(rp->remote_root) : 0) + 16);
+  strcpy(label, rp->hostname);
+  if (rp->port_number != 21) {
+    sprintf(label + strlen(label), ":%d", rp->port_number);
+  }
+  if (rp->remote_root) {
+    strcat(label, "/");
+    strcat(label, rp->remote_root);
+  }
+  return label;
+}
+/*}}}*/
+static void *mirror_worker(void *arg)/*{{{*/
+{
+  /* A failure only stops this mirror.  Its connections are left for the
+   * process exit to close. */
+  struct mirror *m = arg;
+  struct connect_info ci;
+  struct FTP *ctrl_con;
+  FILE * volatile journal = NULL;
+  struct fail_scope scope;
+
+  progress_set_label(m->label);
+  fail_begin_scope(&scope);
+  if (setjmp(scope.jump)) {
+    progress_end_own();
+    if (journal) fclose(journal);
+    progress_message("Gave up on this mirror\n");
+    m->failed = 1;
+    return NULL;
+  }
+  journal = open_journal(m->listing_file);
+  if (!journal) {
+    fprintf(stderr, "Couldn't open %s to append updates\n", m->listing_file);
+    give_up();
+  }
+  ci.rp = &m->rp;
+  ci.password = m->password;
+  ci.active_ftp = m->up->active_ftp;
+  ci.n_connections = m->up->n_connections;
+  ctrl_con = open_remote(&m->rp, m->password, m->up->active_ftp);
+  upload_for_real(ctrl_con, m->localinv, m->fileinv, m->renames, journal, &ci, m->up->delete_last);
+  ftp_close(ctrl_con);
+  fclose(journal);
+  fail_set_scope(NULL);
+  progress_message("Mirror is up to date\n");
+  return NULL;
+}
+/*}}}*/
+static int resume_mirror(const char *password, const char *listing_file,/*{{{*/
+                         const struct upload_params *up)
+{
+  /* As resume_interrupted, but return 0 instead of giving up. */
+  struct fail_scope scope;
+  fail_begin_scope(&scope);
+  if (setjmp(scope.jump)) {
+    fail_set_scope(NULL);
+    return 0;
+  }
+  resume_interrupted(password, listing_file, up);
+  fail_set_scope(NULL);
+  return 1;
+}
+/*}}}*/
+int upload_mirrors(const char *password, char **listing_files, int n, const struct upload_params *up)/*{{{*/
+{
+  /* Return 1 if any of the mirrors couldn't be brought up to date. */
+  struct mirror *mirrors;
+  struct fnode *localinv;
+  pthread_t *threads;
+  const char **ready;
+  int i, n_failed;
+
+  /* Leave out any mirror whose interrupted run can't be finished off. */
+  ready = new_array(const char *, n + 1);
+  n_failed = 0;
+  if (!up->is_dummy_run) {
+    for (i=0; i<n; i++) {
+      if (resume_mirror(password, listing_files[i], up)) {
+        ready[i - n_failed] = listing_files[i];
+      } else {
+        fprintf(stderr, "Leaving out the mirror for %s\n", listing_files[i]);
+        n_failed++;
+      }
+    }
+    n -= n_failed;
+    printf("Preening listing files... "); fflush(stdout);
+    for (i=0; i<n; i++) preen_as_asked(ready[i], up);
+    printf("done\n"); fflush(stdout);
+  } else {
+    for (i=0; i<n; i++) ready[i] = listing_files[i];
+  }
+  if (n < 1) {
+    free(ready);
+    return 1;
+  }
+  /* None of the listings' shards are to be sent to any of the mirrors. */
+  ready[n] = NULL;
 
+  localinv = make_localinv(ready, "@@SCANCACHE@@", up->strict_scan, NULL, NULL);
+  load_hashcache("@@HASHCACHE@@");
+
+  /* reconcile marks up the local tree too, so each mirror needs its own. */
+  mirrors = new_array(struct mirror, n);
+  for (i=0; i<n; i++) {
+    struct mirror *m = &mirrors[i];
+    m->listing_file = ready[i];
+    init_remote_params(&m->rp);
+    m->fileinv = make_fileinv(ready[i], &m->rp);
+    m->localinv = i ? copy_inventory(localinv) : localinv;
+    reconcile(m->fileinv, m->localinv);
+    m->renames = plan_renames(m->fileinv, m->localinv);
+    m->password = password;
+    m->up = up;
+    m->label = mirror_label(&m->rp);
+    m->failed = 0;
+  }
+
+  if (up->is_dummy_run) {
+    for (i=0; i<n; i++) {
+      struct mirror *m = &mirrors[i];
+      printf("MIRROR %s (%s)\n\n", m->label, m->listing_file);
+      if (m->renames) {
+        printf("RENAMES ON REMOTE SIDE\n");
+        print_renames(m->renames);
+        printf("\n\n");
+        assume_renames(m->renames);
+      }
+      upload_dummy(m->localinv, m->fileinv);
+      printf("\n");
+    }
+  } else {
+    /* One mirror after another, so no file is read by two at once; after
+     * the first, most of what the others want is in the cache. */
+    for (i=0; i<n; i++) {
+      digest_outgoing(mirrors[i].localinv, mirrors[i].fileinv);
+    }
+
+    /* Hold the progress display open across all the mirrors, each adding
+     * its own files to the totals as it starts sending. */
+    progress_begin(0, 0);
+    threads = new_array(pthread_t, n);
+    for (i=0; i<n; i++) {
+      if (pthread_create(&threads[i], NULL, mirror_worker, &mirrors[i]) != 0) {
+        fprintf(stderr, "Could not start the upload to %s\n", mirrors[i].label);
+        exit(1);
+      }
+    }
+    for (i=0; i<n; i++) pthread_join(threads[i], NULL);
+    progress_end();
+    free(threads);
+  }
+  save_hashcache("@@HASHCACHE@@", localinv);
+
+  for (i=0; i<n; i++) {
+    struct mirror *m = &mirrors[i];
+    if (m->failed) {
+      fprintf(stderr, "Could not bring %s (%s) up to date\n", m->label, m->listing_file);
+      n_failed++;
+    }
+    if (m->renames) free_rename_plan(m->renames);
+    if (i) {
+      free_inventory(m->localinv);
+      free(m->localinv);
+    }
+    free(m->label);
+  }
+  free(mirrors);
+  free(ready);
+  return n_failed ? 1 : 0;
+}
+/*}}}*/
+/*}}}*/
@@ -0,0 +1,299 @@
+/*
+ * Watch the local tree with inotify and upload changes as they happen.
+ * */
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#include "ftp.h"
+#include "invent.h"
+#include "memory.h"
+
+extern int verbose;
+
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE | \
+                    IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+/* Send a NOOP after this long without any activity, so the server doesn't
+ * time the control connection out. */
+#define KEEPALIVE_MS 60000
+
+/* However busy the tree is, don't put off uploading for longer than this
+ * many debounce periods. */
+#define MAX_DEFER 20
+
+struct watcher {/*{{{*/
+  int fd;
+  char **wd_paths;  /* directory path for each watch descriptor */
+  int n_wd;
+  char **dirty;     /* directories whose entries have changed */
+  int n_dirty, max_dirty;
+  int overflowed;
+  const char *listing_file;
+};
+/*}}}*/
+
+static void add_watch(struct watcher *w, const char *path)/*{{{*/
+{
+  int wd;
+  wd = inotify_add_watch(w->fd, path, WATCH_MASK | IN_ONLYDIR);
+  if (wd < 0) {
+    fprintf(stderr, "Could not watch %s : %s\n", path, strerror(errno));
+    return;
+  }
+  if (wd >= w->n_wd) {
+    int i, n = 2 * wd + 16;
+    w->wd_paths = grow_array(char *, n, w->wd_paths);
+    for (i = w->n_wd; i < n; i++) w->wd_paths[i] = NULL;
+    w->n_wd = n;
+  }
+  /* A directory that has been renamed keeps its watch descriptor. */
+  free(w->wd_paths[wd]);
+  w->wd_paths[wd] = new_string(path);
+}
+/*}}}*/
+static void add_watches(struct watcher *w, struct fnode *x)/*{{{*/
+{
+  /* x is the entry list of a directory that is already watched. */
+  struct fnode *e;
+  for (e = x->next; e != x; e = e->next) {
+    if (e->is_dir) {
+      add_watch(w, e->path);
+      add_watches(w, (struct fnode *) &e->x.dir.next);
+    }
+  }
+}
+/*}}}*/
+static void mark_dirty(struct watcher *w, const char *path)/*{{{*/
+{
+  int i;
+  for (i=0; i<w->n_dirty; i++) {
+    if (!strcmp(w->dirty[i], path)) return;
+  }
+  if (w->n_dirty == w->max_dirty) {
+    w->max_dirty = w->max_dirty ? 2 * w->max_dirty : 16;
+    w->dirty = grow_array(char *, w->max_dirty, w->dirty);
+  }
+  w->dirty[w->n_dirty++] = new_string(path);
+}
+/*}}}*/
+static void read_events(struct watcher *w)/*{{{*/
+{
+  char buf[16384] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  ssize_t n;
+  char *p;
+
+  while ((n = read(w->fd, buf, sizeof(buf))) > 0) {
+    for (p = buf; p < buf + n; p += sizeof(struct inotify_event) + ((struct inotify_event *) p)->len) {
+      struct inotify_event *ev = (struct inotify_event *) p;
+      const char *dir;
+      if (ev->mask & IN_Q_OVERFLOW) {
+        w->overflowed = 1;
+        continue;
+      }
+      if ((ev->wd < 0) || (ev->wd >= w->n_wd) || !w->wd_paths[ev->wd]) continue;
+      dir = w->wd_paths[ev->wd];
+      if (ev->mask & IN_IGNORED) {
+        /* Directory has gone; its parent will have seen that. */
+        free(w->wd_paths[ev->wd]);
+        w->wd_paths[ev->wd] = NULL;
+        continue;
+      }
+      if (ev->len && !strcmp(dir, ".") &&
+          (!strcmp(ev->name, w->listing_file) || is_listing_shard(w->listing_file, ev->name) ||
+           is_bookkeeping_file(ev->name))) {
+        /* Our own bookkeeping */
+        continue;
+      }
+      mark_dirty(w, dir);
+    }
+  }
+}
+/*}}}*/
+static long elapsed_ms(const struct timespec *since)/*{{{*/
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+/*}}}*/
+static int is_below(const char *path, const char *dir)/*{{{*/
+{
+  /* 1 if path is dir or somewhere underneath it. */
+  int len;
+  if (!strcmp(dir, ".")) return 1;
+  len = strlen(dir);
+  return !strncmp(path, dir, len) && ((path[len] == '\0') || (path[len] == '/'));
+}
+/*}}}*/
+static char *existing_ancestor(struct fnode *tree, const char *path)/*{{{*/
+{
+  /* The deepest directory at or above path that we know about. */
+  char *p, *slash;
+  p = new_string(path);
+  while (strcmp(p, ".") && !lookup_dir_list(tree, p)) {
+    slash = strrchr(p, '/');
+    if (slash) {
+      *slash = '\0';
+    } else {
+      strcpy(p, ".");
+    }
+  }
+  return p;
+}
+/*}}}*/
+static void sync_dir(struct FTP *ctrl_con, struct watcher *w, struct fnode *tree, const char *path, FILE *journal)/*{{{*/
+{
+  /* Bring the remote copy of directory 'path' back into line with the local
+   * one, then take the fresh local scan as the new picture of what's
+   * remote. */
+  struct fnode *remote_list, *local_list;
+
+  remote_list = lookup_dir_list(tree, path);
+  local_list = make_localinv_subtree(w->listing_file, path);
+  upload_subtree(ctrl_con, remote_list, local_list, journal);
+
+  free_inventory(remote_list);
+  if (local_list->next != local_list) {
+    remote_list->next = local_list->next;
+    remote_list->prev = local_list->prev;
+    local_list->next->prev = remote_list;
+    local_list->prev->next = remote_list;
+  }
+  free(local_list);
+  add_watches(w, remote_list);
+}
+/*}}}*/
+static void process_dirty(struct FTP *ctrl_con, struct watcher *w, struct fnode *tree, FILE *journal)/*{{{*/
+{
+  int i, j;
+
+  if (w->overflowed) {
+    /* Events were lost, so there's no telling which directories changed. */
+    printf("Change notifications overflowed, rescanning whole tree\n");
+    for (i=0; i<w->n_dirty; i++) free(w->dirty[i]);
+    w->n_dirty = 0;
+    mark_dirty(w, ".");
+    w->overflowed = 0;
+  }
+
+  /* A directory that has vanished is handled by resyncing the nearest
+   * ancestor that still exists in our picture of the tree. */
+  for (i=0; i<w->n_dirty; i++) {
+    char *a = existing_ancestor(tree, w->dirty[i]);
+    free(w->dirty[i]);
+    w->dirty[i] = a;
+  }
+
+  /* Resyncing a directory covers everything under it, so drop any entries
+   * below another one. */
+  for (i=0; i<w->n_dirty; i++) {
+    int covered = 0;
+    for (j=0; j<w->n_dirty; j++) {
+      if ((i != j) && is_below(w->dirty[i], w->dirty[j]) &&
+          (strcmp(w->dirty[i], w->dirty[j]) || (j < i))) {
+        covered = 1;
+        break;
+      }
+    }
+    if (!covered) {
+      if (verbose) {
+        printf("Resyncing %s\n", w->dirty[i]);
+        fflush(stdout);
+      }
+      sync_dir(ctrl_con, w, tree, w->dirty[i], journal);
+    }
+  }
+  for (i=0; i<w->n_dirty; i++) free(w->dirty[i]);
+  w->n_dirty = 0;
+}
+/*}}}*/
+struct FTP *watch_tree(struct FTP *ctrl_con, struct fnode *tree, FILE *journal,/*{{{*/
+                       const struct remote_params *rp, const char *password,
+                       const char *listing_file, const struct upload_params *up)
+{
+  /* tree is the picture of the remote site, which must match the local tree
+   * at the point this is called.  Never returns unless inotify fails, in
+   * which case the control connection (which may have been re-opened along
+   * the way) is returned. */
+  struct watcher w;
+  struct pollfd pfd;
+  struct timespec first_event, last_event, last_activity;
+
+  w.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (w.fd < 0) {
+    perror("inotify_init1");
+    return ctrl_con;
+  }
+  w.wd_paths = NULL;
+  w.n_wd = 0;
+  w.dirty = NULL;
+  w.n_dirty = w.max_dirty = 0;
+  w.overflowed = 0;
+  w.listing_file = listing_file;
+
+  /* A dropped control connection shows up as a failed NOOP, not a signal. */
+  signal(SIGPIPE, SIG_IGN);
+
+  add_watch(&w, ".");
+  add_watches(&w, tree);
+  printf("Watching for changes...\n");
+  fflush(stdout);
+
+  pfd.fd = w.fd;
+  pfd.events = POLLIN;
+  clock_gettime(CLOCK_MONOTONIC, &last_activity);
+  while (1) {
+    int timeout, status;
+
+    if (w.n_dirty || w.overflowed) {
+      /* Wait for a quiet spell, but not indefinitely. */
+      long quiet = elapsed_ms(&last_event);
+      long waited = elapsed_ms(&first_event);
+      if ((quiet >= up->debounce_ms) || (waited >= MAX_DEFER * up->debounce_ms)) {
+        if (!ftp_noop(ctrl_con)) {
+          ftp_close(ctrl_con);
+          ctrl_con = open_remote(rp, password, up->active_ftp);
+        }
+        process_dirty(ctrl_con, &w, tree, journal);
+        clock_gettime(CLOCK_MONOTONIC, &last_activity);
+        continue;
+      }
+      timeout = up->debounce_ms - quiet;
+    } else {
+      timeout = KEEPALIVE_MS - elapsed_ms(&last_activity);
+      if (timeout <= 0) {
+        if (!ftp_noop(ctrl_con)) {
+          if (verbose) printf("Control connection lost, reconnecting\n");
+          ftp_close(ctrl_con);
+          ctrl_con = open_remote(rp, password, up->active_ftp);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &last_activity);
+        continue;
+      }
+    }
+
+    status = poll(&pfd, 1, timeout);
+    if (status < 0) {
+      if (errno == EINTR) continue;
+      perror("poll");
+      return ctrl_con;
+    }
+    if (status > 0) {
+      int was_idle = !w.n_dirty && !w.overflowed;
+      read_events(&w);
+      if (w.n_dirty || w.overflowed) {
+        clock_gettime(CLOCK_MONOTONIC, &last_event);
+        if (was_idle) first_event = last_event;
+      }
+    }
+  }
+}
+/*}}}*/